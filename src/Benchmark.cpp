@@ -0,0 +1,215 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "Benchmark.h"
+#include "Curve.h"
+#include "Noise.h"
+#include "OpenGLUtils.h"
+#include "Resource.h"
+#include "SharedBlocks.h"
+#include "StaticNoise.h"
+
+// The directional light counts the shader variants are timed with,
+// how many times each covers the screen, and the ocean's shininess.
+const unsigned int SHADER_BENCH_LIGHT_COUNTS[] = { 1, 4, LightListData::MAX_LIGHTS };
+const int SHADER_BENCH_DRAWS = 100;
+const float SHADER_BENCH_SPECULAR_POW = 20.0f;
+const std::size_t SHADER_BENCH_RING_BYTES = 4096;
+
+struct SamplePoints {
+    std::vector<double> xs, ys, zs;
+};
+
+SamplePoints randomSpherePoints(std::size_t count, double radius) {
+    std::default_random_engine engine{12345};
+    std::normal_distribution<double> normal{0.0, 1.0};
+    SamplePoints rv;
+    rv.xs.resize(count);
+    rv.ys.resize(count);
+    rv.zs.resize(count);
+
+    for (std::size_t i = 0; i < count; ++i) {
+        double x = normal(engine), y = normal(engine), z = normal(engine);
+        double scale = radius / std::sqrt(x*x + y*y + z*z);
+        rv.xs[i] = x * scale;
+        rv.ys[i] = y * scale;
+        rv.zs[i] = z * scale;
+    }
+
+    return rv;
+}
+
+template <typename Fn>
+double timePerSample(const char *name, std::size_t samples, Fn fn) {
+    // Once untimed, so that each variant starts with the same warm
+    // caches, whichever runs first.
+    fn();
+
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / samples;
+    std::cout << "  " << std::left << std::setw(28) << name
+              << std::right << std::fixed << std::setprecision(1) << std::setw(8) << ns
+              << " ns/sample" << std::endl;
+    return ns;
+}
+
+std::size_t countMismatches(const std::vector<double> &a, const std::vector<double> &b) {
+    std::size_t rv = 0;
+    for (std::size_t i = 0; i < a.size(); ++i) {
+        if (std::memcmp(&a[i], &b[i], sizeof(double)) != 0) {
+            ++rv;
+        }
+    }
+    return rv;
+}
+
+void benchmarkNoise(const CubicSpline &spline, int octaves, double persistence, std::size_t samples) {
+    const Perlin base_noise{};
+    const Octave octave_noise{base_noise, octaves, persistence};
+    const Curve curved_noise{octave_noise, spline};
+    const NoiseFunction &virtual_graph = curved_noise;
+
+    auto static_graph = staticCurve(staticOctave(StaticPerlin{base_noise}, octaves, persistence), spline);
+    auto adapter = noiseAdapter(static_graph);
+    const NoiseFunction &adapted_graph = adapter;
+
+    SamplePoints points = randomSpherePoints(samples, 2.0);
+    const double *xs = points.xs.data(), *ys = points.ys.data(), *zs = points.zs.data();
+    std::vector<double> virtual_out(samples), static_out(samples), adapted_out(samples), batch_out(samples);
+
+    std::cout << "Noise benchmark: " << samples << " samples, "
+              << octaves << " octaves, persistence " << persistence
+              << ", batch kernel " << Perlin::batchKernelName() << std::endl;
+
+    double virtual_ns = timePerSample("virtual graph", samples, [&]() {
+        for (std::size_t i = 0; i < samples; ++i) {
+            virtual_out[i] = virtual_graph(xs[i], ys[i], zs[i]);
+        }
+    });
+
+    double static_ns = timePerSample("static graph", samples, [&]() {
+        for (std::size_t i = 0; i < samples; ++i) {
+            static_out[i] = static_graph(xs[i], ys[i], zs[i]);
+        }
+    });
+
+    timePerSample("static graph via adapter", samples, [&]() {
+        adapted_graph.evaluate(samples, xs, ys, zs, adapted_out.data());
+    });
+
+    timePerSample("virtual graph, batched", samples, [&]() {
+        virtual_graph.evaluate(samples, xs, ys, zs, batch_out.data());
+    });
+
+    std::cout << "  static speedup: " << std::setprecision(2) << virtual_ns / static_ns << "x" << std::endl;
+    std::cout << "  mismatches vs. virtual graph: static " << countMismatches(virtual_out, static_out)
+              << ", adapter " << countMismatches(virtual_out, adapted_out)
+              << ", batched " << countMismatches(virtual_out, batch_out) << std::endl;
+}
+
+// Draw ocean.frag, lit by lights and specialised on features, over
+// each of fragments SHADER_BENCH_DRAWS times, and print how long a
+// fragment took on the GPU.
+double timePerFragment(const char *name, GLuint vertex_shader, const ShaderFeatures &features, LightListBlock &lights, UniformRing &ring, std::size_t fragments) {
+    const std::vector<char> &frag_code = LOAD_RESOURCE(ocean_frag);
+    const std::vector<char> &lighting_code = LOAD_RESOURCE(lighting_glsl);
+    GLuint fragment_shader = ShaderCache::current().shader(GL_FRAGMENT_SHADER, {frag_code.data(), lighting_code.data()}, features);
+    GLuint program = createProgramFromShaders(vertex_shader, fragment_shader);
+    GLuint light_block_idx = glGetUniformBlockIndex(program, "LightListBlock");
+    glUniformBlockBinding(program, light_block_idx, LightListBlock::BINDING_INDEX);
+
+    GLState::current().useProgram(program);
+    glUniform1f(glGetUniformLocation(program, "specular_pow"), SHADER_BENCH_SPECULAR_POW);
+    ring.beginFrame();
+    lights.writeToBuffer(ring);
+
+    // Once untimed, so that the driver has finished with the program.
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    GLuint query;
+    glGenQueries(1, &query);
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    for (int i = 0; i < SHADER_BENCH_DRAWS; ++i) {
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+    ring.endFrame();
+
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+    glDeleteQueries(1, &query);
+
+    // The ShaderCache owns the fragment shader.
+    glDetachShader(program, fragment_shader);
+    glDetachShader(program, vertex_shader);
+    GLState::current().forgetProgram(program);
+    glDeleteProgram(program);
+
+    double ns = static_cast<double>(elapsed) / (static_cast<double>(fragments) * SHADER_BENCH_DRAWS);
+    std::cout << "    " << std::left << std::setw(26) << name
+              << std::right << std::fixed << std::setprecision(3) << std::setw(8) << ns
+              << " ns/fragment" << std::endl;
+    return ns;
+}
+
+void benchmarkShaderVariants(int width, int height) {
+    std::size_t fragments = static_cast<std::size_t>(width) * height;
+    std::cout << "Shader benchmark: ocean.frag over " << width << "x" << height
+              << " pixels, " << SHADER_BENCH_DRAWS << " draws each" << std::endl;
+
+    const std::vector<char> &vert_code = LOAD_RESOURCE(shader_bench_vert);
+    GLuint vertex_shader = createAndCompileShader(GL_VERTEX_SHADER, vert_code.data());
+
+    // Drawn off screen, so that the window's size and visibility don't
+    // matter. The triangle needs no vertex data, but core profiles
+    // still want an array object bound to draw it.
+    GLuint renderbuffer, framebuffer, array_object;
+    glGenRenderbuffers(1, &renderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffer);
+    glGenVertexArrays(1, &array_object);
+    GLState::current().bindVertexArray(array_object);
+    GLState::current().disable(GL_DEPTH_TEST);
+    glViewport(0, 0, width, height);
+
+    UniformRing ring{SHADER_BENCH_RING_BYTES, 2};
+    for (unsigned int count : SHADER_BENCH_LIGHT_COUNTS) {
+        LightListBlock lights{};
+        for (unsigned int i = 0; i < count; ++i) {
+            float angle = 6.2831853f * i / count;
+            lights.enableLight(i, glm::normalize(glm::vec3{std::cos(angle), std::sin(angle), -2.0f}));
+        }
+
+        std::cout << "  " << count << (count == 1 ? " light" : " lights") << std::endl;
+        double generic_ns = timePerFragment("generic", vertex_shader, ShaderFeatures{}, lights, ring, fragments);
+        double specialised_ns = timePerFragment("specialised", vertex_shader, lights.shaderFeatures(false), lights, ring, fragments);
+        std::cout << "    specialised speedup: " << std::setprecision(2) << generic_ns / specialised_ns << "x" << std::endl;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &renderbuffer);
+    GLState::current().forgetVertexArray(array_object);
+    glDeleteVertexArrays(1, &array_object);
+    glDeleteShader(vertex_shader);
+}
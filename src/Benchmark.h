@@ -0,0 +1,21 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_BENCHMARK_H_
+#define _PLANET_BENCHMARK_H_
+
+#include <cstddef>
+
+class CubicSpline;
+
+// Time the per-sample cost of the terrain noise stack (Perlin ->
+// Octave -> Curve) built from virtual NoiseFunctions and as a static
+// graph, and check that they agree. Prints the results to stdout.
+void benchmarkNoise(const CubicSpline &spline, int octaves, double persistence, std::size_t samples);
+
+// Time what a fragment of ocean.frag costs on the GPU, drawn off
+// screen at width x height, built generic and specialised on the
+// number of directional lights, for a few numbers of them. Needs a
+// current context. Prints the results to stdout.
+void benchmarkShaderVariants(int width, int height);
+
+#endif
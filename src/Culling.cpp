@@ -0,0 +1,260 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/matrix.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#include "opengl.h"
+
+#include "Culling.h"
+#include "Models.h"
+
+std::vector<MeshCluster> clusterMesh(PositionsAndElements &pne, unsigned int target_triangles) {
+    // Sort the triangles into the cells of a cube map, each side split
+    // into cells x cells squares, by the direction of their centroids.
+    std::size_t triangles = pne.elements.size() / 3;
+    unsigned int cells = static_cast<unsigned int>(std::max(1.0, std::round(std::sqrt(triangles / (6.0 * target_triangles)))));
+    std::size_t cell_count = 6 * cells * cells;
+
+    std::vector<unsigned int> cell_of(triangles);
+    std::vector<unsigned int> starts(cell_count + 1, 0);
+    for (std::size_t t = 0; t < triangles; ++t) {
+        glm::vec3 c = pne.positions[pne.elements[3*t+0]]
+            + pne.positions[pne.elements[3*t+1]]
+            + pne.positions[pne.elements[3*t+2]];
+        glm::vec3 a = glm::abs(c);
+        int axis = (a.x >= a.y && a.x >= a.z) ? 0 : (a.y >= a.z ? 1 : 2);
+        unsigned int side = 2 * axis + (c[axis] < 0.0f ? 1 : 0);
+        float u = c[(axis + 1) % 3] / a[axis];
+        float v = c[(axis + 2) % 3] / a[axis];
+        unsigned int cu = std::min(cells - 1, static_cast<unsigned int>(std::max(0.0f, 0.5f * (u + 1.0f) * cells)));
+        unsigned int cv = std::min(cells - 1, static_cast<unsigned int>(std::max(0.0f, 0.5f * (v + 1.0f) * cells)));
+
+        cell_of[t] = (side * cells + cv) * cells + cu;
+        ++starts[cell_of[t] + 1];
+    }
+
+    for (std::size_t c = 0; c < cell_count; ++c) {
+        starts[c + 1] += starts[c];
+    }
+
+    std::vector<MeshCluster> clusters;
+    for (std::size_t c = 0; c < cell_count; ++c) {
+        if (starts[c + 1] > starts[c]) {
+            clusters.push_back(MeshCluster{3 * starts[c], 3 * (starts[c + 1] - starts[c]), CullBounds{}});
+        }
+    }
+
+    // A stable counting sort, so each cluster keeps the vertex cache
+    // order its triangles had.
+    std::vector<unsigned int> elements(pne.elements.size());
+    for (std::size_t t = 0; t < triangles; ++t) {
+        unsigned int dest = starts[cell_of[t]]++;
+        elements[3*dest+0] = pne.elements[3*t+0];
+        elements[3*dest+1] = pne.elements[3*t+1];
+        elements[3*dest+2] = pne.elements[3*t+2];
+    }
+    pne.elements.swap(elements);
+
+    optimizeVertexFetch(pne);
+    return clusters;
+}
+
+CullBounds boundTriangles(const glm::vec3 *positions, const unsigned int *elements, std::size_t count) {
+    CullBounds rv;
+    if (count == 0) {
+        rv.center = glm::vec3{0.0f, 0.0f, 0.0f};
+        rv.radius = 0.0f;
+        rv.cone_axis = glm::vec3{0.0f, 0.0f, 1.0f};
+        rv.cone_cutoff = 1.0f;
+        return rv;
+    }
+
+    glm::vec3 lo = positions[elements[0]], hi = lo;
+    for (std::size_t i = 1; i < count; ++i) {
+        lo = glm::min(lo, positions[elements[i]]);
+        hi = glm::max(hi, positions[elements[i]]);
+    }
+
+    rv.center = 0.5f * (lo + hi);
+    rv.radius = 0.0f;
+    for (std::size_t i = 0; i < count; ++i) {
+        rv.radius = std::max(rv.radius, glm::distance(rv.center, positions[elements[i]]));
+    }
+
+    // The cone is around the average facet normal, and wide enough to
+    // take in the one furthest from it.
+    std::vector<glm::vec3> normals;
+    normals.reserve(count / 3);
+    glm::vec3 sum{0.0f, 0.0f, 0.0f};
+    for (std::size_t i = 0; i + 2 < count; i += 3) {
+        const glm::vec3 &v1 = positions[elements[i+0]];
+        const glm::vec3 &v2 = positions[elements[i+1]];
+        const glm::vec3 &v3 = positions[elements[i+2]];
+        glm::vec3 cross = glm::cross(v2 - v1, v3 - v1);
+        float length = glm::length(cross);
+        if (length > 0.0f) {
+            normals.push_back(cross / length);
+            sum += normals.back();
+        }
+    }
+
+    float sum_length = glm::length(sum);
+    rv.cone_axis = sum_length > 0.0f ? sum / sum_length : glm::vec3{0.0f, 0.0f, 1.0f};
+    float min_dot = sum_length > 0.0f ? 1.0f : -1.0f;
+    for (const glm::vec3 &normal : normals) {
+        min_dot = std::min(min_dot, glm::dot(normal, rv.cone_axis));
+    }
+
+    // The sine of the cone's half angle; no cone that reaches a right
+    // angle can be back-facing as a whole.
+    rv.cone_cutoff = min_dot > 0.0f ? std::sqrt(1.0f - min_dot * min_dot) : 1.0f;
+    return rv;
+}
+
+float boundClusters(std::vector<MeshCluster> &clusters, const std::vector<unsigned int> &elements, const std::vector<glm::vec3> &positions) {
+    for (MeshCluster &cluster : clusters) {
+        cluster.bounds = boundTriangles(positions.data(), &elements[cluster.first], cluster.count);
+    }
+
+    return elements.empty() ? 0.0f : enclosedRadius(positions.data(), elements.data(), elements.size());
+}
+
+float enclosedRadius(const glm::vec3 *positions, const unsigned int *elements, std::size_t count) {
+    // Every point of a triangle is at least as far from the origin as
+    // its plane.
+    float rv = std::numeric_limits<float>::max();
+    for (std::size_t i = 0; i + 2 < count; i += 3) {
+        const glm::vec3 &v1 = positions[elements[i+0]];
+        const glm::vec3 &v2 = positions[elements[i+1]];
+        const glm::vec3 &v3 = positions[elements[i+2]];
+        glm::vec3 cross = glm::cross(v2 - v1, v3 - v1);
+        float length = glm::length(cross);
+        if (length > 0.0f) {
+            rv = std::min(rv, std::abs(glm::dot(cross, v1)) / length);
+        }
+    }
+    return rv;
+}
+
+CullStats::CullStats()
+    : drawn{0},
+      frustum{0},
+      horizon{0},
+      backface{0}
+{}
+
+void CullStats::count(CullResult result) {
+    switch (result) {
+    case CULL_VISIBLE:
+        ++drawn;
+        break;
+    case CULL_FRUSTUM:
+        ++frustum;
+        break;
+    case CULL_HORIZON:
+        ++horizon;
+        break;
+    case CULL_BACKFACE:
+        ++backface;
+        break;
+    }
+}
+
+std::size_t CullStats::culled() const {
+    return frustum + horizon + backface;
+}
+
+Culler::Culler(const glm::mat4x4 &mvp, const glm::vec3 &camera, float occluder_radius)
+    : m_planes{},
+      m_camera{camera},
+      m_occluder_radius{occluder_radius}
+{
+    // The frustum planes, in model coordinates, from the rows of the
+    // model-view-projection matrix: left, right, bottom, top, near and
+    // far. Points inside have a positive distance from each.
+    glm::vec4 rows[4];
+    for (int r = 0; r < 4; ++r) {
+        rows[r] = glm::vec4{mvp[0][r], mvp[1][r], mvp[2][r], mvp[3][r]};
+    }
+
+    for (int p = 0; p < 6; ++p) {
+        glm::vec4 plane = (p % 2 == 0) ? rows[3] + rows[p / 2] : rows[3] - rows[p / 2];
+        m_planes[p] = plane / glm::length(glm::vec3{plane});
+    }
+}
+
+Culler::~Culler() {}
+
+CullResult Culler::classify(const CullBounds &bounds) const {
+    for (const glm::vec4 &plane : m_planes) {
+        if (glm::dot(glm::vec3{plane}, bounds.center) + plane.w < -bounds.radius) {
+            return CULL_FRUSTUM;
+        }
+    }
+
+    glm::vec3 to_center = bounds.center - m_camera;
+    float distance = glm::length(to_center);
+    if (distance <= bounds.radius) {
+        return CULL_VISIBLE;
+    }
+
+    // The occluder hides what is both inside the cone of sight lines
+    // that graze it and behind the plane of the circle they touch it
+    // on.
+    float camera_distance = glm::length(m_camera);
+    if (m_occluder_radius > 0.0f && camera_distance > m_occluder_radius) {
+        float angle = std::acos(glm::clamp(glm::dot(to_center, -m_camera) / (distance * camera_distance), -1.0f, 1.0f));
+        float spread = std::asin(bounds.radius / distance);
+        float horizon_angle = std::asin(m_occluder_radius / camera_distance);
+        float horizon_plane = m_occluder_radius * m_occluder_radius / camera_distance;
+        if (angle + spread < horizon_angle
+            && glm::dot(bounds.center, m_camera) / camera_distance + bounds.radius < horizon_plane) {
+            return CULL_HORIZON;
+        }
+    }
+
+    if (glm::dot(to_center, bounds.cone_axis) >= bounds.cone_cutoff * distance + bounds.radius) {
+        return CULL_BACKFACE;
+    }
+
+    return CULL_VISIBLE;
+}
+
+void cullClusters(const std::vector<MeshCluster> &clusters, const Culler &culler, CullStats &stats, std::vector<GLsizei> &counts, std::vector<const void*> &offsets) {
+    stats = CullStats{};
+    counts.clear();
+    offsets.clear();
+
+    unsigned int run_end = 0;
+    for (const MeshCluster &cluster : clusters) {
+        CullResult result = culler.classify(cluster.bounds);
+        stats.count(result);
+        if (result != CULL_VISIBLE) {
+            continue;
+        }
+
+        if (!counts.empty() && cluster.first == run_end) {
+            counts.back() += static_cast<GLsizei>(cluster.count);
+        } else {
+            counts.push_back(static_cast<GLsizei>(cluster.count));
+            offsets.push_back((const void *)(cluster.first * sizeof(GLuint)));
+        }
+        run_end = cluster.first + cluster.count;
+    }
+}
+
+glm::vec3 modelCamera(const glm::mat4x4 &view, const glm::mat4x4 &model) {
+    glm::vec4 camera = glm::inverse(view * model) * glm::vec4{0.0f, 0.0f, 0.0f, 1.0f};
+    return glm::vec3{camera} / camera.w;
+}
@@ -0,0 +1,103 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_CULLING_H_
+#define _PLANET_CULLING_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#include "opengl.h"
+
+struct PositionsAndElements;
+
+// Where a piece of a mesh sits, for culling: a bounding sphere, and a
+// cone around axis that its facet normals all lie in. A cone_cutoff of
+// 1 or more means the normals are too spread out to ever be entirely
+// back-facing.
+struct CullBounds {
+    glm::vec3 center;
+    float radius;
+    glm::vec3 cone_axis;
+    float cone_cutoff;
+};
+
+// A run of count elements, from first, in an element buffer.
+struct MeshCluster {
+    unsigned int first;
+    unsigned int count;
+    CullBounds bounds;
+};
+
+// Reorder the triangles of a sphere-like mesh around the origin so
+// that they fall into runs of roughly target_triangles triangles that
+// are near each other, and renumber the vertices to match (as
+// optimizeVertexFetch does). Each run keeps the order its triangles
+// were in.
+std::vector<MeshCluster> clusterMesh(PositionsAndElements &pne, unsigned int target_triangles);
+
+// Work out the bounds of each cluster from its triangles. Returns the
+// radius of the largest sphere about the origin that the mesh
+// encloses, which hides whatever is behind it.
+float boundClusters(std::vector<MeshCluster> &clusters, const std::vector<unsigned int> &elements, const std::vector<glm::vec3> &positions);
+
+// The radius of the largest sphere about the origin that the triangles
+// given as the count elements starting at elements, indexing
+// positions, stay outside of.
+float enclosedRadius(const glm::vec3 *positions, const unsigned int *elements, std::size_t count);
+
+// Bounds from a set of triangles, given as the count elements
+// starting at elements, indexing positions. Adds the triangles' facet
+// normals into the cone as well as their vertices into the sphere.
+CullBounds boundTriangles(const glm::vec3 *positions, const unsigned int *elements, std::size_t count);
+
+enum CullResult {
+    CULL_VISIBLE,
+    CULL_FRUSTUM,
+    CULL_HORIZON,
+    CULL_BACKFACE
+};
+
+// How many pieces of a mesh were drawn or culled, and why.
+struct CullStats {
+    CullStats();
+
+    void count(CullResult result);
+    std::size_t culled() const;
+
+    std::size_t drawn;
+    std::size_t frustum;
+    std::size_t horizon;
+    std::size_t backface;
+};
+
+// Tests bounds, in the model's coordinates, against the view frustum,
+// the horizon of a sphere about the origin, and the camera.
+class Culler {
+public:
+    // camera is the camera position in model coordinates. An
+    // occluder_radius of 0 turns off horizon culling.
+    Culler(const glm::mat4x4 &model_view_projection, const glm::vec3 &camera, float occluder_radius);
+    ~Culler();
+
+    CullResult classify(const CullBounds &bounds) const;
+
+private:
+    glm::vec4 m_planes[6];
+    glm::vec3 m_camera;
+    float m_occluder_radius;
+};
+
+// Add up the clusters that pass the culler, as the counts and byte
+// offsets into a GLuint element buffer that glMultiDrawElements takes.
+// Clusters that follow on from each other are merged into one run.
+void cullClusters(const std::vector<MeshCluster> &clusters, const Culler &culler, CullStats &stats, std::vector<GLsizei> &counts, std::vector<const void*> &offsets);
+
+// The camera position in the coordinates of model.
+glm::vec3 modelCamera(const glm::mat4x4 &view, const glm::mat4x4 &model);
+
+#endif
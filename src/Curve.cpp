@@ -1,16 +1,20 @@
 // -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <limits>
 #include <vector>
 
 #include "glm_defines.h"
 #include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
 
 #include "opengl.h"
 
 #include "Curve.h"
 #include "OpenGLUtils.h"
+#include "RenderQueue.h"
 #include "Resource.h"
 
 CubicSpline::CubicSpline()
@@ -49,6 +53,15 @@ CubicSpline& CubicSpline::addControlPoint(double x, double y) {
     return *this;
 }
 
+CubicSpline& CubicSpline::setControlPoint(std::size_t index, double y) {
+    m_cps[index].second = y;
+    if (m_cps.size() >= 2) {
+        generateCoeffs();
+    }
+
+    return *this;
+}
+
 double CubicSpline::operator()(double x) const {
     if (x < m_cps.front().first) {
         return m_cps.front().second;
@@ -72,6 +85,75 @@ double CubicSpline::operator()(double x) const {
     return m_cps[i].second + alpha*rv;
 }
 
+double CubicSpline::derivative(double x) const {
+    if (x < m_cps.front().first || x > m_cps.back().first) {
+        return 0.0;
+    }
+
+    int i, n = static_cast<int>(m_cps.size()) - 1;
+    for (i = n - 1; i >= 0; --i) {
+        if (x - m_cps[i].first >= 0) {
+            break;
+        }
+    }
+
+    // d/dx of the polynomial in operator().
+    double alpha = x - m_cps[i].first;
+    double h = m_cps[i+1].first - m_cps[i].first;
+    double rv = m_coeffs[i] + alpha*(m_coeffs[i+1] - m_coeffs[i])/(2*h);
+    rv = -1*(h/6.0)*(m_coeffs[i+1] + 2*m_coeffs[i]) + (m_cps[i+1].second - m_cps[i].second)/h + alpha*rv;
+    return rv;
+}
+
+std::pair<double, double> CubicSpline::range() const {
+    double lo = m_cps.front().second, hi = lo;
+    for (auto cp : m_cps) {
+        lo = std::min(lo, cp.second);
+        hi = std::max(hi, cp.second);
+    }
+
+    // Between control points, the curve can also turn where its
+    // derivative, a quadratic in alpha, is zero.
+    for (std::size_t i = 0; i + 1 < m_cps.size(); ++i) {
+        double h = m_cps[i+1].first - m_cps[i].first;
+        double a = (m_coeffs[i+1] - m_coeffs[i])/(2*h);
+        double b = m_coeffs[i];
+        double c = -1*(h/6.0)*(m_coeffs[i+1] + 2*m_coeffs[i]) + (m_cps[i+1].second - m_cps[i].second)/h;
+
+        double roots[2];
+        int num_roots = 0;
+        if (std::abs(a) < std::numeric_limits<double>::epsilon()) {
+            if (std::abs(b) >= std::numeric_limits<double>::epsilon()) {
+                roots[num_roots++] = -c/b;
+            }
+        } else {
+            double disc = b*b - 4*a*c;
+            if (disc >= 0) {
+                roots[num_roots++] = (-b - std::sqrt(disc))/(2*a);
+                roots[num_roots++] = (-b + std::sqrt(disc))/(2*a);
+            }
+        }
+
+        for (int r = 0; r < num_roots; ++r) {
+            if (roots[r] > 0 && roots[r] < h) {
+                double y = (*this)(m_cps[i].first + roots[r]);
+                lo = std::min(lo, y);
+                hi = std::max(hi, y);
+            }
+        }
+    }
+
+    return std::pair<double, double>{lo, hi};
+}
+
+const std::vector<std::pair<double, double> >& CubicSpline::controlPoints() const {
+    return m_cps;
+}
+
+const std::vector<double>& CubicSpline::coefficients() const {
+    return m_coeffs;
+}
+
 void CubicSpline::generateCoeffs() {
     int n = static_cast<int>(m_cps.size()) - 1;
     m_coeffs.clear();
@@ -105,7 +187,11 @@ void CubicSpline::generateCoeffs() {
 }
 
 CurveDisplay::CurveDisplay()
-    : m_vertices{},
+    : m_min_x{0.0},
+      m_max_x{0.0},
+      m_min_y{0.0},
+      m_max_y{0.0},
+      m_vertices{},
       m_array_buffer{0},
       m_vertex_shader{0},
       m_fragment_shader{0},
@@ -115,7 +201,12 @@ CurveDisplay::CurveDisplay()
 {}
 
 CurveDisplay::CurveDisplay(const CubicSpline &curve, double min_x, double max_x, double min_y, double max_y, int num_points): CurveDisplay() {
-    initGeometry(curve, min_x, max_x, min_y, max_y, num_points);
+    m_min_x = min_x;
+    m_max_x = max_x;
+    m_min_y = min_y;
+    m_max_y = max_y;
+    m_vertices.resize(num_points);
+    initGeometry(curve);
     initBuffer();
     initProgram();
     initVAO();
@@ -141,40 +232,52 @@ CurveDisplay::~CurveDisplay() {
         }
         m_fragment_shader = 0;
         
+        GLState::current().forgetProgram(m_program);
         glDeleteProgram(m_program);
     }
 
     m_program = 0;
 
     if (glIsVertexArray(m_array_object)) {
+        GLState::current().forgetVertexArray(m_array_object);
         glDeleteVertexArrays(1, &m_array_object);
     }
 
     m_array_object = 0;
 }
 
-void CurveDisplay::render() const {
-    glUseProgram(m_program);
+void CurveDisplay::submit(RenderQueue &queue) const {
+    GLsizei count = static_cast<GLsizei>(m_vertices.size());
+    queue.submit(DrawPacket{
+        OVERLAY_LAYER, m_program, m_array_object, false,
+        glm::vec3{0.0f}, 0.0f,
+        [count]() {
+            glDrawArrays(GL_LINE_STRIP, 0, count);
+        }});
+}
 
-    glDisable(GL_DEPTH_TEST);
-    glBindVertexArray(m_array_object);
-    glDrawArrays(GL_LINE_STRIP, 0, static_cast<GLsizei>(m_vertices.size()));
+void CurveDisplay::update(const CubicSpline &curve) {
+    initGeometry(curve);
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
+    glBufferSubData(
+        GL_ARRAY_BUFFER, 0,
+        m_vertices.size()*sizeof(glm::vec2),
+        m_vertices.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void CurveDisplay::initGeometry(const CubicSpline &curve, double min_x, double max_x, double min_y, double max_y, int num_points) {
-    m_vertices.resize(num_points);
-    double domain = max_x - min_x;
-    double range = max_y - min_y;
+void CurveDisplay::initGeometry(const CubicSpline &curve) {
+    std::size_t num_points = m_vertices.size();
+    double domain = m_max_x - m_min_x;
+    double range = m_max_y - m_min_y;
     double h = domain / (num_points - 1);
-    for (int i = 0; i < num_points; ++i) {
-        double x = min_x + i*h;
+    for (std::size_t i = 0; i < num_points; ++i) {
+        double x = m_min_x + i*h;
         double y = curve(x);
 
-        double clip_x = 1.8*(x - min_x)/domain - 0.9;
-        double clip_y = 0.9*(y - min_y)/range - 0.9;
+        double clip_x = 1.8*(x - m_min_x)/domain - 0.9;
+        double clip_y = 0.9*(y - m_min_y)/range - 0.9;
 
         // std::cout << "(" << x << ", " << y << ") -> (" << clip_x << ", " << clip_y << ")" << std::endl;
 
@@ -207,8 +310,8 @@ void CurveDisplay::initProgram() {
 
 void CurveDisplay::initVAO() {
     glGenVertexArrays(1, &m_array_object);
-    glUseProgram(m_program);
-    glBindVertexArray(m_array_object);
+    GLState::current().useProgram(m_program);
+    GLState::current().bindVertexArray(m_array_object);
     glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
 
     glEnableVertexAttribArray(m_position_loc);
@@ -219,7 +322,7 @@ void CurveDisplay::initVAO() {
         (const void *)(0)
     );
 
-    glBindVertexArray(0);
+    GLState::current().bindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glUseProgram(0);
+    GLState::current().useProgram(0);
 }
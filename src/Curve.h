@@ -3,6 +3,8 @@
 #ifndef _PLANET_CURVE_H_
 #define _PLANET_CURVE_H_
 
+#include <cstddef>
+#include <utility>
 #include <vector>
 
 #include "glm_defines.h"
@@ -10,6 +12,8 @@
 
 #include "opengl.h"
 
+class RenderQueue;
+
 class CubicSpline {
 public:
     CubicSpline();
@@ -17,8 +21,22 @@ public:
 
     CubicSpline& addControlPoint(double x, double y);
 
+    // Move the index'th control point, in order of x, to height y.
+    CubicSpline& setControlPoint(std::size_t index, double y);
+
     double operator()(double x) const;
 
+    // The slope of the curve at x. Flat outside the control points.
+    double derivative(double x) const;
+
+    // The lowest and highest values the curve takes anywhere.
+    std::pair<double, double> range() const;
+
+    // The control points, sorted by x, and the second derivative of the
+    // curve at each of them.
+    const std::vector<std::pair<double, double> >& controlPoints() const;
+    const std::vector<double>& coefficients() const;
+
 private:
     void generateCoeffs();
 
@@ -36,16 +54,21 @@ public:
     CurveDisplay& operator=(const CurveDisplay &other) = delete;
     CurveDisplay& operator=(CurveDisplay &&other) = delete;
 
-    void render() const;
+    // Queue the curve to be drawn over the scene.
+    void submit(RenderQueue &queue) const;
+
+    // Redraw the curve after it has changed.
+    void update(const CubicSpline &curve);
 
 private:
     CurveDisplay();
 
-    void initGeometry(const CubicSpline &curve, double min_x, double max_x, double min_y, double max_y, int num_points);
+    void initGeometry(const CubicSpline &curve);
     void initBuffer();
     void initProgram();
     void initVAO();
 
+    double m_min_x, m_max_x, m_min_y, m_max_y;
     std::vector<glm::vec2> m_vertices;
     
     GLuint m_array_buffer;
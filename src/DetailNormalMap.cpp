@@ -0,0 +1,144 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "DetailNormalMap.h"
+#include "Models.h"
+#include "OpenGLUtils.h"
+#include "PackedVertex.h"
+#include "Streaming.h"
+#include "TaskPool.h"
+#include "Terrain.h"
+
+// Texels per bake task.
+const std::size_t DETAIL_GRAIN = 4096;
+
+DetailNormalMap::DetailNormalMap(float radius, const NoiseFunction &noise, const NoiseFunction &geometry_noise, unsigned int texels)
+    : m_radius{radius},
+      m_noise{noise},
+      m_geometry_noise{geometry_noise},
+      m_texels{texels},
+      m_normals{},
+      m_bake_ms{0.0},
+      m_texture{0},
+      m_baker{[this]() { bake(); }}
+{
+    // Mipmapped, since it's sampled per pixel at every distance, and
+    // filtered across the edges between faces.
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    GLsizei levels = 1;
+    for (unsigned int size = texels; size > 1; size /= 2) {
+        ++levels;
+    }
+
+    glGenTextures(1, &m_texture);
+    GLState::current().bindTexture(0, GL_TEXTURE_CUBE_MAP, m_texture);
+    glTexStorage2D(GL_TEXTURE_CUBE_MAP, levels, GL_RGBA8_SNORM, m_texels, m_texels);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    rebake();
+}
+
+DetailNormalMap::~DetailNormalMap() {
+    if (glIsTexture(m_texture)) {
+        GLState::current().forgetTexture(m_texture);
+        glDeleteTextures(1, &m_texture);
+    }
+
+    m_texture = 0;
+}
+
+void DetailNormalMap::rebake() {
+    m_baker.start();
+}
+
+void DetailNormalMap::update() {
+    if (!m_baker.takeFinished()) {
+        return;
+    }
+
+    std::size_t face_texels = static_cast<std::size_t>(m_texels) * m_texels;
+    GLState::current().bindTexture(0, GL_TEXTURE_CUBE_MAP, m_texture);
+    for (int face = 0; face < 6; ++face) {
+        glTexSubImage2D(
+            GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, 0, 0, m_texels, m_texels,
+            GL_RGBA, GL_BYTE, &m_normals[4 * face * face_texels]);
+    }
+    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+
+    std::cout << "Detail normal map: 6 x " << m_texels << "^2 texels baked in "
+              << m_bake_ms << " ms on " << TaskPool::shared().threadCount() << " threads; "
+              << textureBytes() / 1024 << " KiB of textures" << std::endl;
+}
+
+bool DetailNormalMap::isReady() const {
+    return m_baker.isReady();
+}
+
+bool DetailNormalMap::isBaking() const {
+    return m_baker.isBaking();
+}
+
+void DetailNormalMap::bind(GLuint unit) const {
+    GLState::current().bindTexture(unit, GL_TEXTURE_CUBE_MAP, m_texture);
+}
+
+std::size_t DetailNormalMap::textureBytes() const {
+    // Each level is a quarter of the one before, so the mipmaps add a
+    // third.
+    return 6 * static_cast<std::size_t>(m_texels) * m_texels * 4 * sizeof(int8_t) * 4 / 3;
+}
+
+void DetailNormalMap::bake() {
+    auto start = std::chrono::steady_clock::now();
+
+    std::size_t face_texels = static_cast<std::size_t>(m_texels) * m_texels;
+    std::size_t count = 6 * face_texels;
+    m_normals.resize(4 * count);
+    TaskPool::shared().parallelFor(count, DETAIL_GRAIN, [&](std::size_t begin, std::size_t end) {
+        std::vector<glm::vec3> positions(end - begin);
+        for (std::size_t i = begin; i < end; ++i) {
+            int face = static_cast<int>(i / face_texels);
+            unsigned int texel = static_cast<unsigned int>(i % face_texels);
+            positions[i - begin] = cubeTexelDirection(face, texel % m_texels, texel / m_texels, m_texels) * m_radius;
+        }
+
+        std::vector<TerrainVertex> full(positions.size()), geometry(positions.size());
+        displaceVertices(positions.data(), positions.size(), m_radius, m_noise, full.data());
+        displaceVertices(positions.data(), positions.size(), m_radius, m_geometry_noise, geometry.data());
+
+        // Each normal, scaled to meet the plane touching the sphere a
+        // unit out, is the direction plus the surface's slope. The
+        // detail is the difference in slope.
+        for (std::size_t i = 0; i < positions.size(); ++i) {
+            glm::vec3 dir = positions[i] / m_radius;
+            glm::vec3 slope = full[i].normal / std::max(glm::dot(full[i].normal, dir), 1e-3f)
+                - geometry[i].normal / std::max(glm::dot(geometry[i].normal, dir), 1e-3f);
+            glm::vec3 normal = glm::normalize(dir + slope);
+            int8_t *texel = &m_normals[4 * (begin + i)];
+            for (int c = 0; c < 3; ++c) {
+                texel[c] = static_cast<int8_t>(std::round(glm::clamp(normal[c], -1.0f, 1.0f) * 127.0f));
+            }
+            texel[3] = 0;
+        }
+    });
+
+    auto end = std::chrono::steady_clock::now();
+    m_bake_ms = std::chrono::duration<double, std::milli>(end - start).count();
+}
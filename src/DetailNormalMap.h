@@ -0,0 +1,74 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_DETAIL_NORMAL_MAP_H_
+#define _PLANET_DETAIL_NORMAL_MAP_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "opengl.h"
+
+#include "Streaming.h"
+
+class NoiseFunction;
+
+// The detail that the octaves left out of the terrain's geometry would
+// add, baked into a cube map of normals for terrain.frag to apply per
+// pixel. Each texel holds the normal of the plain sphere tilted by the
+// difference between the slope of the full noise and the slope of the
+// noise the geometry was displaced by, so that adding the same tilt
+// to the geometry's normal gives the full noise's normal there. The
+// normals are kept as snorm8 vectors rather than octahedrally encoded,
+// so that they filter and mipmap properly.
+class DetailNormalMap {
+public:
+    // Bake the difference between noise and geometry_noise, over a
+    // sphere of radius, into texels^2 on each face. Baking happens on
+    // a background thread; the noises must outlive the map, and stay
+    // unchanged while isBaking().
+    DetailNormalMap(float radius, const NoiseFunction &noise, const NoiseFunction &geometry_noise, unsigned int texels);
+    DetailNormalMap(const DetailNormalMap &other) = delete;
+    DetailNormalMap(DetailNormalMap &&other) = delete;
+    ~DetailNormalMap();
+
+    DetailNormalMap& operator=(const DetailNormalMap &other) = delete;
+    DetailNormalMap& operator=(DetailNormalMap &&other) = delete;
+
+    // Bake again, after the noises have changed. The last bake stays
+    // in use until this one is uploaded.
+    void rebake();
+
+    // Upload the bake once it's finished.
+    void update();
+
+    // Whether a bake has been uploaded, and whether one is underway.
+    bool isReady() const;
+    bool isBaking() const;
+
+    // Bind the map to texture unit unit.
+    void bind(GLuint unit) const;
+
+    // Bytes of texture memory the map takes, mipmaps and all.
+    std::size_t textureBytes() const;
+
+private:
+    void bake();
+
+    float m_radius;
+    const NoiseFunction &m_noise;
+    const NoiseFunction &m_geometry_noise;
+    unsigned int m_texels;
+
+    // Filled in by m_baker's thread, and handed over by it.
+    std::vector<int8_t> m_normals;
+    double m_bake_ms;
+
+    GLuint m_texture;
+
+    // Last, so that it's stopped before anything it uses goes away.
+    BackgroundBake m_baker;
+};
+
+#endif
@@ -0,0 +1,188 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+
+#include "opengl.h"
+
+#include "LightClusters.h"
+#include "OpenGLUtils.h"
+#include "Resource.h"
+#include "SharedBlocks.h"
+
+// Where light_clusters.comp and lighting.glsl take the lights and the
+// clusters' counts and lists.
+const GLuint LIGHT_BUFFER_BINDING = 4;
+const GLuint CLUSTER_COUNT_BINDING = 5;
+const GLuint CLUSTER_INDEX_BINDING = 6;
+
+// Matches light_clusters.comp.
+const GLuint CLUSTER_GROUP_SIZE = 64;
+
+// Tiles across and down the screen, square on a 4:3 window, and
+// slices in depth. Lights past the first MAX_LIGHTS_PER_CLUSTER to
+// reach a cluster are left out of it.
+const GLuint CLUSTERS_X = 16, CLUSTERS_Y = 12, CLUSTERS_Z = 24;
+const GLuint MAX_LIGHTS_PER_CLUSTER = 128;
+
+// The first slice takes in everything nearer than this, however close
+// the near plane comes, so that the rest aren't spent on thin slices
+// right in front of the camera.
+const float MIN_CLUSTER_DEPTH = 0.05f;
+
+LightClusters::LightClusters()
+    : m_compute_shader{0},
+      m_program{0},
+      m_cluster_grid_loc{-1},
+      m_cluster_depth_loc{-1},
+      m_light_count_loc{-1},
+      m_light_buffer{0},
+      m_count_buffer{0},
+      m_index_buffer{0},
+      m_light_count{0},
+      m_light_generation{0}
+{
+    if (!GLAD_GL_VERSION_4_3) {
+        return;
+    }
+
+    initProgram();
+    initBuffers();
+
+    std::cout << "Light clusters: " << CLUSTERS_X << "x" << CLUSTERS_Y << "x" << CLUSTERS_Z
+              << ", up to " << MAX_LIGHTS_PER_CLUSTER << " lights each, "
+              << bufferBytes() / 1024 << " KiB of buffers" << std::endl;
+}
+
+LightClusters::~LightClusters() {
+    std::vector<GLuint> bufs{};
+    GLuint *buffers[] = { &m_light_buffer, &m_count_buffer, &m_index_buffer };
+    for (GLuint *buffer : buffers) {
+        if (glIsBuffer(*buffer)) {
+            bufs.push_back(*buffer);
+        }
+        *buffer = 0;
+    }
+
+    if (bufs.size() > 0) {
+        glDeleteBuffers(static_cast<GLsizei>(bufs.size()), bufs.data());
+    }
+
+    if (glIsProgram(m_program)) {
+        if (glIsShader(m_compute_shader)) {
+            glDetachShader(m_program, m_compute_shader);
+            glDeleteShader(m_compute_shader);
+        }
+        m_compute_shader = 0;
+
+        GLState::current().forgetProgram(m_program);
+        glDeleteProgram(m_program);
+    }
+
+    m_program = 0;
+}
+
+bool LightClusters::isAvailable() const {
+    return isProgramLinked(m_program);
+}
+
+void LightClusters::update(LightListBlock &lights, const ViewAndProjectionBlock &vp_block, int viewport_width, int viewport_height) {
+    if (!isAvailable()) {
+        return;
+    }
+
+    if (lights.localLightGeneration() != m_light_generation) {
+        const std::vector<LocalLight> &local_lights = lights.localLights();
+        m_light_count = local_lights.size();
+        m_light_generation = lights.localLightGeneration();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_light_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<std::size_t>(1, m_light_count)*sizeof(LocalLight), m_light_count > 0 ? local_lights.data() : nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    // The near and far planes, from a perspective projection.
+    const glm::mat4x4 &projection = vp_block.projection();
+    float near_plane = projection[3][2] / (projection[2][2] - 1.0f);
+    float far_plane = projection[3][2] / (projection[2][2] + 1.0f);
+    float first_depth = std::min(std::max(near_plane, MIN_CLUSTER_DEPTH), 0.5f * far_plane);
+
+    // Slices after the first each go deeper by the same factor, so a
+    // view depth's slice is 1 + log(depth / first_depth) / log(factor).
+    float slice_scale = (CLUSTERS_Z - 1) / std::log(far_plane / first_depth);
+    glm::uvec4 grid{CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z, MAX_LIGHTS_PER_CLUSTER};
+    lights.setClusters(
+        static_cast<unsigned int>(m_light_count), grid,
+        glm::vec4{
+            static_cast<float>(CLUSTERS_X) / viewport_width,
+            static_cast<float>(CLUSTERS_Y) / viewport_height,
+            slice_scale, 1.0f - std::log(first_depth) * slice_scale},
+        glm::vec4{near_plane, far_plane, 0.0f, 0.0f});
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_BUFFER_BINDING, m_light_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_COUNT_BINDING, m_count_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDEX_BINDING, m_index_buffer);
+    if (m_light_count == 0) {
+        return;
+    }
+
+    GLState::current().useProgram(m_program);
+    glUniform4ui(m_cluster_grid_loc, grid.x, grid.y, grid.z, grid.w);
+    glUniform2f(m_cluster_depth_loc, first_depth, far_plane);
+    glUniform1ui(m_light_count_loc, static_cast<GLuint>(m_light_count));
+    glDispatchCompute(static_cast<GLuint>((clusterCount() + CLUSTER_GROUP_SIZE - 1) / CLUSTER_GROUP_SIZE), 1, 1);
+
+    // The fragment shaders read the lists next. The buffers stay bound
+    // for them.
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+std::size_t LightClusters::clusterCount() const {
+    return static_cast<std::size_t>(CLUSTERS_X) * CLUSTERS_Y * CLUSTERS_Z;
+}
+
+std::size_t LightClusters::bufferBytes() const {
+    return m_light_count*sizeof(LocalLight) + clusterCount()*(1 + MAX_LIGHTS_PER_CLUSTER)*sizeof(GLuint);
+}
+
+void LightClusters::initProgram() {
+    const std::vector<char> &comp_code = LOAD_RESOURCE(light_clusters_comp);
+
+    m_compute_shader = createAndCompileShader(GL_COMPUTE_SHADER, comp_code.data());
+    m_program = createComputeProgram(m_compute_shader);
+    ViewAndProjectionBlock::checkLayout(m_program, "ViewAndProjectionBlock");
+
+    m_cluster_grid_loc = glGetUniformLocation(m_program, "cluster_grid");
+    m_cluster_depth_loc = glGetUniformLocation(m_program, "cluster_depth");
+    m_light_count_loc = glGetUniformLocation(m_program, "light_count");
+
+    GLuint vp_block_idx = glGetUniformBlockIndex(m_program, "ViewAndProjectionBlock");
+    glUniformBlockBinding(m_program, vp_block_idx, ViewAndProjectionBlock::BINDING_INDEX);
+}
+
+void LightClusters::initBuffers() {
+    GLuint buffers[3];
+    glGenBuffers(3, buffers);
+    m_light_buffer = buffers[0];
+    m_count_buffer = buffers[1];
+    m_index_buffer = buffers[2];
+
+    // Until there are lights, the light buffer holds a single unused
+    // one, so that it can be bound.
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_light_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(LocalLight), nullptr, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_count_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, clusterCount()*sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_index_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, clusterCount()*MAX_LIGHTS_PER_CLUSTER*sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
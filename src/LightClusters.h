@@ -0,0 +1,53 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_LIGHT_CLUSTERS_H_
+#define _PLANET_LIGHT_CLUSTERS_H_
+
+#include <cstddef>
+
+#include "opengl.h"
+
+class LightListBlock;
+class ViewAndProjectionBlock;
+
+// Clustered forward lighting. The view frustum is cut into a grid of
+// clusters, tiles across the screen by slices in depth, and a compute
+// shader lists the local lights that reach each one in shader storage
+// buffers. The fragment shaders (through lighting.glsl) then only
+// look at the lights in their own cluster, so what a fragment costs
+// depends on how many lights reach it rather than how many there are.
+class LightClusters {
+public:
+    LightClusters();
+    LightClusters(const LightClusters &other) = delete;
+    LightClusters(LightClusters &&other) = delete;
+    ~LightClusters();
+
+    LightClusters& operator=(const LightClusters &other) = delete;
+    LightClusters& operator=(LightClusters &&other) = delete;
+
+    // Whether the context has compute shaders and the program built.
+    bool isAvailable() const;
+
+    // Upload the local lights if they've changed, bin them for the
+    // camera in vp_block, which must already be bound, and bind the
+    // clusters for the fragment shaders. lights is told where they
+    // are; it has to be written to the ring after this.
+    void update(LightListBlock &lights, const ViewAndProjectionBlock &vp_block, int viewport_width, int viewport_height);
+
+    std::size_t clusterCount() const;
+    std::size_t bufferBytes() const;
+
+private:
+    void initProgram();
+    void initBuffers();
+
+    GLuint m_compute_shader, m_program;
+    GLint m_cluster_grid_loc, m_cluster_depth_loc, m_light_count_loc;
+
+    GLuint m_light_buffer, m_count_buffer, m_index_buffer;
+    std::size_t m_light_count;
+    unsigned int m_light_generation;
+};
+
+#endif
@@ -2,17 +2,23 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <iostream>
-#include <map>
-#include <utility>
+#include <stdexcept>
 #include <vector>
 
 #include "glm_defines.h"
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
 #include <glm/gtc/epsilon.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/vec3.hpp>
 
 #include "Models.h"
+#include "TaskPool.h"
+
+// Triangles or vertices per normal task.
+const std::size_t NORMALS_GRAIN = 4096;
 
 PositionsAndElements icosahedron() {
     PositionsAndElements rv;
@@ -25,128 +31,467 @@ PositionsAndElements icosahedron() {
     return rv;
 }
 
-std::pair<unsigned int, unsigned int> edgeKey(unsigned int e1, unsigned int e2) {
-    return std::pair<unsigned int, unsigned int>{std::min(e1, e2), std::max(e1, e2)};
+// Vertices in the post-transform cache that optimizeMesh optimizes
+// for and reports against.
+const unsigned int VERTEX_CACHE_SIZE = 16;
+
+// Faces per task when writing a geodesic sphere.
+const std::size_t GEODESIC_GRAIN = 1;
+
+const unsigned int ICOSAHEDRON_EDGE_COUNT = 30;
+
+unsigned int geodesicVertexCount(unsigned int subdivisions) {
+    return 10u * subdivisions * subdivisions + 2u;
 }
 
-PositionsAndElements refine(const PositionsAndElements &old_vertices) {
-    PositionsAndElements new_vertices;
-    std::map<std::pair<unsigned int, unsigned int>, unsigned int> edge_map;
-    new_vertices.positions = old_vertices.positions;
+unsigned int geodesicFaceCount(unsigned int subdivisions) {
+    return 20u * subdivisions * subdivisions;
+}
 
-    for (unsigned int i = 0; i < old_vertices.elements.size(); i += 3) {
-        unsigned int
-            e1 = old_vertices.elements[i+0],
-            e2 = old_vertices.elements[i+1],
-            e3 = old_vertices.elements[i+2];
+// The icosahedron's edges, each as its lower and higher vertex, in the
+// order they first turn up in ICOSAHEDRON_ELEMS.
+struct IcosahedronEdges {
+    unsigned int ends[ICOSAHEDRON_EDGE_COUNT][2];
 
-        const glm::vec3
-            &p1 = old_vertices.positions[e1],
-            &p2 = old_vertices.positions[e2],
-            &p3 = old_vertices.positions[e3];
+    IcosahedronEdges() {
+        unsigned int count = 0;
+        for (unsigned int i = 0; i < ICOSAHEDRON_ELEM_COUNT; ++i) {
+            unsigned int u = ICOSAHEDRON_ELEMS[i];
+            unsigned int v = ICOSAHEDRON_ELEMS[i - i % 3 + (i + 1) % 3];
+            if (find(u, v) == ICOSAHEDRON_EDGE_COUNT) {
+                ends[count][0] = std::min(u, v);
+                ends[count][1] = std::max(u, v);
+                ++count;
+            }
 
-        auto e12 = edge_map.find(edgeKey(e1, e2));
-        if (e12 == edge_map.end()) {
-            e12 = edge_map.insert({ edgeKey(e1, e2), static_cast<unsigned int>(new_vertices.positions.size()) }).first;
-            new_vertices.positions.push_back((p1 + p2) * 0.5f);
+            if (count == ICOSAHEDRON_EDGE_COUNT) {
+                break;
+            }
         }
+    }
 
-        auto e23 = edge_map.find(edgeKey(e2, e3));
-        if (e23 == edge_map.end()) {
-            e23 = edge_map.insert({ edgeKey(e2, e3), static_cast<unsigned int>(new_vertices.positions.size()) }).first;
-            new_vertices.positions.push_back((p2 + p3) * 0.5f);
+    unsigned int find(unsigned int u, unsigned int v) const {
+        for (unsigned int e = 0; e < ICOSAHEDRON_EDGE_COUNT; ++e) {
+            if (ends[e][0] == std::min(u, v) && ends[e][1] == std::max(u, v)) {
+                return e;
+            }
         }
+        return ICOSAHEDRON_EDGE_COUNT;
+    }
+};
 
-        auto e13 = edge_map.find(edgeKey(e1, e3));
-        if (e13 == edge_map.end()) {
-            e13 = edge_map.insert({ edgeKey(e1, e3), static_cast<unsigned int>(new_vertices.positions.size()) }).first;
-            new_vertices.positions.push_back((p1 + p3) * 0.5f);
-        }
+const IcosahedronEdges& icosahedronEdges() {
+    static const IcosahedronEdges edges{};
+    return edges;
+}
+
+// The point on the sphere over the point a fraction t of the way from
+// icosahedron corner u to corner v.
+glm::dvec3 icosahedronVertex(unsigned int i) {
+    return glm::dvec3{ICOSAHEDRON_VERTICES[i][0], ICOSAHEDRON_VERTICES[i][1], ICOSAHEDRON_VERTICES[i][2]};
+}
 
-        new_vertices.elements.push_back(e1);
-        new_vertices.elements.push_back(e12->second);
-        new_vertices.elements.push_back(e13->second);
+glm::vec3 spherePoint(float radius, unsigned int u, unsigned int v, double t) {
+    glm::dvec3 a = icosahedronVertex(u);
+    glm::dvec3 b = icosahedronVertex(v);
+    return glm::vec3{glm::normalize(a + (b - a) * t) * static_cast<double>(radius)};
+}
 
-        new_vertices.elements.push_back(e2);
-        new_vertices.elements.push_back(e23->second);
-        new_vertices.elements.push_back(e12->second);
+// The point on the sphere over the point of triangle u, v, w with
+// barycentric coordinates (1-t-r, t, r).
+glm::vec3 spherePoint(float radius, unsigned int u, unsigned int v, unsigned int w, double t, double r) {
+    glm::dvec3 a = icosahedronVertex(u);
+    glm::dvec3 b = icosahedronVertex(v);
+    glm::dvec3 c = icosahedronVertex(w);
+    return glm::vec3{glm::normalize(a + (b - a) * t + (c - a) * r) * static_cast<double>(radius)};
+}
 
-        new_vertices.elements.push_back(e3);
-        new_vertices.elements.push_back(e13->second);
-        new_vertices.elements.push_back(e23->second);
+void writeGeodesicSphere(float radius, unsigned int subdivisions, glm::vec3 *positions, unsigned int *elements) {
+    // Vertices are numbered canonically, so that faces sharing an edge
+    // or corner agree on its vertices without having to look them up:
+    // first the 12 corners, then s-1 vertices along each edge, running
+    // from its lower corner to its higher one, then the
+    // (s-1)(s-2)/2 vertices inside each face.
+    if (subdivisions == 0) {
+        throw std::runtime_error("A geodesic sphere needs at least one subdivision");
+    }
+
+    const unsigned int s = subdivisions;
+    const unsigned int edge_base = ICOSAHEDRON_VERTEX_COUNT;
+    const unsigned int face_base = edge_base + ICOSAHEDRON_EDGE_COUNT * (s - 1);
+    const unsigned int face_interior = (s - 1) * (s - 2) / 2;
+    const IcosahedronEdges &edges = icosahedronEdges();
+
+    if (positions) {
+        for (unsigned int c = 0; c < ICOSAHEDRON_VERTEX_COUNT; ++c) {
+            positions[c] = spherePoint(radius, c, c, 0.0);
+        }
 
-        new_vertices.elements.push_back(e12->second);
-        new_vertices.elements.push_back(e23->second);
-        new_vertices.elements.push_back(e13->second);
+        for (unsigned int e = 0; e < ICOSAHEDRON_EDGE_COUNT; ++e) {
+            for (unsigned int k = 1; k < s; ++k) {
+                positions[edge_base + e * (s - 1) + (k - 1)] =
+                    spherePoint(radius, edges.ends[e][0], edges.ends[e][1], static_cast<double>(k) / s);
+            }
+        }
     }
 
-    return new_vertices;
+    // Each face is a triangular grid of s+1 rows. Point (i, j), with
+    // 0 <= j <= i <= s, is i rows from the face's first corner a and
+    // j points along the row, so (s, 0) is b and (s, s) is c.
+    unsigned int face_count = ICOSAHEDRON_ELEM_COUNT / 3;
+    TaskPool::shared().parallelFor(face_count, GEODESIC_GRAIN, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t f = begin; f < end; ++f) {
+            unsigned int a = ICOSAHEDRON_ELEMS[3*f+0];
+            unsigned int b = ICOSAHEDRON_ELEMS[3*f+1];
+            unsigned int c = ICOSAHEDRON_ELEMS[3*f+2];
+
+            unsigned int ab = edges.find(a, b), ac = edges.find(a, c), bc = edges.find(b, c);
+
+            // The k-th vertex from u along the edge u-v, which is edge e.
+            auto along = [&](unsigned int u, unsigned int v, unsigned int e, unsigned int k) -> unsigned int {
+                if (k == 0) {
+                    return u;
+                }
+                if (k == s) {
+                    return v;
+                }
+                return edge_base + e * (s - 1) + (u < v ? k - 1 : s - 1 - k);
+            };
+
+            unsigned int interior_base = face_base + static_cast<unsigned int>(f) * face_interior;
+            auto vertex = [&](unsigned int i, unsigned int j) -> unsigned int {
+                if (j == 0) {
+                    return along(a, b, ab, i);
+                }
+                if (j == i) {
+                    return along(a, c, ac, i);
+                }
+                if (i == s) {
+                    return along(b, c, bc, j);
+                }
+                return interior_base + (i - 2) * (i - 1) / 2 + (j - 1);
+            };
+
+            if (positions) {
+                for (unsigned int i = 2; i < s; ++i) {
+                    for (unsigned int j = 1; j < i; ++j) {
+                        positions[vertex(i, j)] = spherePoint(
+                            radius, a, b, c,
+                            static_cast<double>(i - j) / s,
+                            static_cast<double>(j) / s);
+                    }
+                }
+            }
+
+            if (elements) {
+                unsigned int *out = elements + 3 * f * s * s;
+                for (unsigned int i = 0; i < s; ++i) {
+                    for (unsigned int j = 0; j <= i; ++j) {
+                        *out++ = vertex(i, j);
+                        *out++ = vertex(i + 1, j);
+                        *out++ = vertex(i + 1, j + 1);
+
+                        if (j < i) {
+                            *out++ = vertex(i, j);
+                            *out++ = vertex(i + 1, j + 1);
+                            *out++ = vertex(i, j + 1);
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+PositionsAndElements geodesicSphere(float radius, unsigned int subdivisions) {
+    PositionsAndElements rv;
+    rv.positions.resize(geodesicVertexCount(subdivisions));
+    rv.elements.resize(3 * geodesicFaceCount(subdivisions));
+    writeGeodesicSphere(radius, subdivisions, rv.positions.data(), rv.elements.data());
+    return rv;
 }
 
 PositionsAndElements icosphere(float radius, int refinements) {
-    PositionsAndElements rv = icosahedron();
-    for (int i = 0; i < refinements; ++i) {
-        rv = refine(rv);
+    return geodesicSphere(radius, 1u << refinements);
+}
+
+glm::vec3 cubeFacePoint(int face, float s, float t) {
+    switch (face) {
+    case 0: return glm::vec3{ 1.0f, -t, -s };
+    case 1: return glm::vec3{ -1.0f, -t, s };
+    case 2: return glm::vec3{ s, 1.0f, t };
+    case 3: return glm::vec3{ s, -1.0f, -t };
+    case 4: return glm::vec3{ s, -t, 1.0f };
+    default: return glm::vec3{ -s, -t, -1.0f };
     }
-    for (auto &pos : rv.positions) {
-        pos = glm::normalize(pos) * radius;
+}
+
+int cubeFaceOf(const glm::vec3 &v, float &s, float &t) {
+    glm::vec3 a = glm::abs(v);
+    if (a.x >= a.y && a.x >= a.z) {
+        s = (v.x > 0.0f ? -v.z : v.z) / a.x;
+        t = -v.y / a.x;
+        return v.x > 0.0f ? 0 : 1;
+    } else if (a.y >= a.z) {
+        s = v.x / a.y;
+        t = (v.y > 0.0f ? v.z : -v.z) / a.y;
+        return v.y > 0.0f ? 2 : 3;
+    } else {
+        s = (v.z > 0.0f ? v.x : -v.x) / a.z;
+        t = -v.y / a.z;
+        return v.z > 0.0f ? 4 : 5;
+    }
+}
+
+glm::vec3 cubeTexelDirection(int face, unsigned int x, unsigned int y, unsigned int texels) {
+    float s = 2.0f * (x + 0.5f) / texels - 1.0f;
+    float t = 2.0f * (y + 0.5f) / texels - 1.0f;
+    return glm::normalize(cubeFacePoint(face, s, t));
+}
+
+PositionsAndElements cubeSphere(float radius, unsigned int divisions) {
+    PositionsAndElements rv;
+    unsigned int side = divisions + 1;
+    rv.positions.reserve(6 * side * side);
+    rv.elements.reserve(6 * 6 * divisions * divisions);
+
+    for (int face = 0; face < 6; ++face) {
+        unsigned int first = static_cast<unsigned int>(rv.positions.size());
+        for (unsigned int j = 0; j < side; ++j) {
+            for (unsigned int i = 0; i < side; ++i) {
+                // Exact for a power of two, so the repeated points on
+                // the edges match.
+                float s = 2.0f * i / divisions - 1.0f;
+                float t = 2.0f * j / divisions - 1.0f;
+                rv.positions.push_back(glm::normalize(cubeFacePoint(face, s, t)) * radius);
+            }
+        }
+
+        for (unsigned int j = 0; j < divisions; ++j) {
+            for (unsigned int i = 0; i < divisions; ++i) {
+                unsigned int a = first + j*side + i;
+                unsigned int b = a + 1, c = a + side, d = c + 1;
+                rv.elements.insert(rv.elements.end(), { a, c, b, b, c, d });
+            }
+        }
     }
+
     return rv;
 }
 
+Adjacency vertexCorners(const PositionsAndElements &pne) {
+    Adjacency adj;
+    adj.offsets.assign(pne.positions.size() + 1, 0);
+    adj.items.resize(pne.elements.size());
+
+    // Count each vertex's corners, then turn the counts into offsets.
+    for (auto vid : pne.elements) {
+        ++adj.offsets[vid + 1];
+    }
+    for (std::size_t vid = 0; vid < pne.positions.size(); ++vid) {
+        adj.offsets[vid + 1] += adj.offsets[vid];
+    }
+
+    // Fill in the corners, in element order.
+    std::vector<uint32_t> next{adj.offsets.begin(), adj.offsets.end() - 1};
+    for (uint32_t corner = 0; corner < pne.elements.size(); ++corner) {
+        adj.items[next[pne.elements[corner]]++] = corner;
+    }
+
+    return adj;
+}
+
+CacheStats vertexCacheStats(const std::vector<unsigned int> &elements, std::size_t vertex_count, unsigned int cache_size) {
+    // Simulate a FIFO cache of post-transform vertices, as a ring of
+    // the last cache_size vertices loaded. time_loaded says when each
+    // vertex went into the cache; it is still there if fewer than
+    // cache_size misses have happened since.
+    std::vector<std::size_t> time_loaded(vertex_count, 0);
+    std::size_t misses = 0;
+    for (auto vid : elements) {
+        if (time_loaded[vid] == 0 || misses - time_loaded[vid] >= cache_size) {
+            ++misses;
+            time_loaded[vid] = misses;
+        }
+    }
+
+    CacheStats stats;
+    std::size_t triangles = elements.size() / 3;
+    stats.acmr = triangles > 0 ? static_cast<double>(misses) / triangles : 0.0;
+    stats.atvr = vertex_count > 0 ? static_cast<double>(misses) / vertex_count : 0.0;
+    return stats;
+}
+
+void optimizeVertexCache(PositionsAndElements &pne, unsigned int cache_size) {
+    // Tipsify (Sander, Nehab and Barczak, "Fast Triangle Reordering for
+    // Vertex Locality and Reduced Overdraw", 2007). Fan out around one
+    // vertex at a time, emitting all its remaining triangles, then move
+    // on to whichever vertex those triangles touched that will still be
+    // in the cache after its own remaining triangles are emitted. When
+    // there is none, back up to the most recent vertex with triangles
+    // left, or failing that the next one in index order.
+    const Adjacency corners = vertexCorners(pne);
+    const std::size_t vertex_count = pne.positions.size();
+    const std::size_t triangle_count = pne.elements.size() / 3;
+    const std::size_t k = cache_size;
+
+    std::vector<uint32_t> live(vertex_count);
+    for (std::size_t vid = 0; vid < vertex_count; ++vid) {
+        live[vid] = corners.offsets[vid + 1] - corners.offsets[vid];
+    }
+
+    std::vector<std::size_t> cache_time(vertex_count, 0);
+    std::vector<bool> emitted(triangle_count, false);
+    std::vector<uint32_t> dead_end;
+    std::vector<uint32_t> candidates;
+    std::vector<unsigned int> out;
+    out.reserve(pne.elements.size());
+
+    std::size_t time = k + 1;
+    std::size_t cursor = 0;
+    long long fan = vertex_count > 0 ? 0 : -1;
+
+    while (fan >= 0) {
+        candidates.clear();
+        for (uint32_t i = corners.offsets[fan]; i < corners.offsets[fan + 1]; ++i) {
+            uint32_t tid = corners.items[i] / 3;
+            if (emitted[tid]) {
+                continue;
+            }
+
+            for (int c = 0; c < 3; ++c) {
+                unsigned int vid = pne.elements[3*tid + c];
+                out.push_back(vid);
+                dead_end.push_back(vid);
+                candidates.push_back(vid);
+                --live[vid];
+                if (time - cache_time[vid] > k) {
+                    cache_time[vid] = time;
+                    ++time;
+                }
+            }
+            emitted[tid] = true;
+        }
+
+        // Pick the next fanning vertex.
+        fan = -1;
+        long long best_priority = -1;
+        for (auto vid : candidates) {
+            if (live[vid] == 0) {
+                continue;
+            }
+
+            long long priority = 0;
+            if (time - cache_time[vid] + 2 * live[vid] <= k) {
+                priority = static_cast<long long>(time - cache_time[vid]);
+            }
+            if (priority > best_priority) {
+                best_priority = priority;
+                fan = vid;
+            }
+        }
+
+        while (fan < 0 && !dead_end.empty()) {
+            uint32_t vid = dead_end.back();
+            dead_end.pop_back();
+            if (live[vid] > 0) {
+                fan = vid;
+            }
+        }
+
+        while (fan < 0 && cursor < vertex_count) {
+            if (live[cursor] > 0) {
+                fan = static_cast<long long>(cursor);
+            } else {
+                ++cursor;
+            }
+        }
+    }
+
+    pne.elements.swap(out);
+}
+
+void optimizeVertexFetch(PositionsAndElements &pne) {
+    // Renumber vertices in the order the triangles first use them, so
+    // vertex fetches walk through memory. Unused vertices go last.
+    const unsigned int unassigned = 0xFFFFFFFFu;
+    std::vector<unsigned int> remap(pne.positions.size(), unassigned);
+    std::vector<glm::vec3> positions;
+    positions.reserve(pne.positions.size());
+
+    for (auto &vid : pne.elements) {
+        if (remap[vid] == unassigned) {
+            remap[vid] = static_cast<unsigned int>(positions.size());
+            positions.push_back(pne.positions[vid]);
+        }
+        vid = remap[vid];
+    }
+
+    for (std::size_t vid = 0; vid < pne.positions.size(); ++vid) {
+        if (remap[vid] == unassigned) {
+            positions.push_back(pne.positions[vid]);
+        }
+    }
+
+    pne.positions.swap(positions);
+}
+
+MeshOptimization optimizeMesh(PositionsAndElements &pne) {
+    MeshOptimization stats;
+    stats.before = vertexCacheStats(pne.elements, pne.positions.size(), VERTEX_CACHE_SIZE);
+
+    optimizeVertexCache(pne, VERTEX_CACHE_SIZE);
+    optimizeVertexFetch(pne);
+
+    stats.after = vertexCacheStats(pne.elements, pne.positions.size(), VERTEX_CACHE_SIZE);
+    return stats;
+}
+
 std::vector<glm::vec3> computeNormals(const PositionsAndElements &pne) {
+    return computeNormals(pne, vertexCorners(pne));
+}
+
+std::vector<glm::vec3> computeNormals(const PositionsAndElements &pne, const Adjacency &corners) {
+    // Each vertex normal is an average of the facet normals of the
+    // triangles around it, weighted by their areas and by their angles
+    // at the vertex. First work out each triangle's cross product. Its
+    // magnitude is twice the area of the triangle, so it is already the
+    // facet normal weighted by area. The extra factor of 2 is
+    // unimportant, since we're normalizing the result.
+    std::vector<glm::vec3> crosses(pne.elements.size() / 3);
+    TaskPool::shared().parallelFor(crosses.size(), NORMALS_GRAIN, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t t = begin; t < end; ++t) {
+            const glm::vec3 &v1 = pne.positions[pne.elements[3*t+0]];
+            const glm::vec3 &v2 = pne.positions[pne.elements[3*t+1]];
+            const glm::vec3 &v3 = pne.positions[pne.elements[3*t+2]];
+            crosses[t] = glm::cross(v2 - v1, v3 - v1);
+        }
+    });
+
+    // Then add up each vertex's corners, weighting by the angle of the
+    // triangle at the vertex. They are always added in the same order,
+    // so the result doesn't depend on how the work was split up.
     std::vector<glm::vec3> normals{pne.positions.size()};
+    TaskPool::shared().parallelFor(pne.positions.size(), NORMALS_GRAIN, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t vid = begin; vid < end; ++vid) {
+            uint32_t first = corners.offsets[vid], last = corners.offsets[vid + 1];
+            if (first == last) {
+                continue;
+            }
 
-    // Build an adjacency map of vertices to triangles (as base
-    // element indices).
-    std::map<uint32_t, std::vector<uint32_t> > adj_map;
-    for (uint32_t tid = 0; tid < pne.elements.size(); tid += 3) {
-        adj_map[pne.elements[tid+0]].push_back(tid);
-        adj_map[pne.elements[tid+1]].push_back(tid);
-        adj_map[pne.elements[tid+2]].push_back(tid);
-    }
-
-    // Compute the normal for each vertex.
-    for (uint32_t vid = 0; vid < pne.positions.size(); ++vid) {
-        // Compute the vertex normal as a weighted average of the
-        // facet normals for the triangles adjacent to this vertex.
-        glm::vec3 vertex_normal{0.0f, 0.0f, 0.0f};
-
-        for (auto tid : adj_map[vid]) {
-            unsigned int vid1 = pne.elements[tid+0];
-            unsigned int vid2 = pne.elements[tid+1];
-            unsigned int vid3 = pne.elements[tid+2];
-            const glm::vec3 &v1 = pne.positions[vid1];
-            const glm::vec3 &v2 = pne.positions[vid2];
-            const glm::vec3 &v3 = pne.positions[vid3];
-            glm::vec3 cross = glm::cross(v2 - v1, v3 - v1);
-            glm::vec3 face_normal = glm::normalize(cross);
-
-            // Weight by the area (the mangitude of the cross product
-            // is twice the area of the triangle). The extra factor of
-            // 2 is unimportant, since we're normalizing the result.
-            float area = glm::length(cross);
-
-            // Also weight by the angle of the triangle at this
-            // vertex.
-            glm::vec3 s1, s2;
-            if (vid == vid1) {
-                s1 = v1 - v2;
-                s2 = v1 - v3;
-            } else if (vid == vid2) {
-                s1 = v2 - v1;
-                s2 = v2 - v3;
-            } else if (vid == vid3) {
-                s1 = v3 - v1;
-                s2 = v3 - v2;
-            }
-            float angle = std::acos(glm::dot(s1, s2) / glm::length(s1) / glm::length(s2));
-
-            vertex_normal += face_normal * area * angle;
-        }
-
-        normals[vid] = glm::normalize(vertex_normal);
-    }
+            const glm::vec3 &v = pne.positions[vid];
+            glm::vec3 vertex_normal{0.0f, 0.0f, 0.0f};
+            for (uint32_t i = first; i < last; ++i) {
+                uint32_t corner = corners.items[i];
+                uint32_t tid = corner - corner % 3;
+                glm::vec3 s1 = v - pne.positions[pne.elements[tid + (corner + 1) % 3]];
+                glm::vec3 s2 = v - pne.positions[pne.elements[tid + (corner + 2) % 3]];
+                float angle = std::acos(glm::dot(s1, s2) / glm::length(s1) / glm::length(s2));
+                vertex_normal += crosses[tid / 3] * angle;
+            }
+            normals[vid] = glm::normalize(vertex_normal);
+        }
+    });
 
     return normals;
 }
@@ -3,26 +3,98 @@
 #ifndef _PLANET_MODELS_H_
 #define _PLANET_MODELS_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
 #include "glm_defines.h"
 #include <glm/vec3.hpp>
 
-struct PCNVertex {
-    float position[3];
-    float color[4];
-    float normal[3];
-};
-
 struct PositionsAndElements {
     std::vector<glm::vec3> positions;
     std::vector<unsigned int> elements;
 };
 
 PositionsAndElements icosahedron();
+
+// A sphere made by splitting each edge of an icosahedron into
+// subdivisions pieces, so each face into subdivisions^2 triangles.
+PositionsAndElements geodesicSphere(float radius, unsigned int subdivisions);
+
+// The same, written straight into caller-provided buffers (mapped GL
+// buffers, say) of geodesicVertexCount positions and
+// 3 * geodesicFaceCount elements. Either may be null to skip it.
+void writeGeodesicSphere(float radius, unsigned int subdivisions, glm::vec3 *positions, unsigned int *elements);
+unsigned int geodesicVertexCount(unsigned int subdivisions);
+unsigned int geodesicFaceCount(unsigned int subdivisions);
+
+// A geodesic sphere with 2^refinements subdivisions, as though each
+// triangle of an icosahedron had been split into four, refinements
+// times. The positions are the ones that splitting gave, but it's
+// built directly, so the splitting and its edge table are gone; its
+// sizes are geodesicVertexCount and geodesicFaceCount of
+// 2^refinements.
 PositionsAndElements icosphere(float radius, int refinements);
 
+// The point on the cube [-1, 1]^3 at (s, t), each in [-1, 1], on face
+// 0 to 5, in the order and orientation of the faces of an OpenGL cube
+// map (+X, -X, +Y, -Y, +Z, -Z).
+glm::vec3 cubeFacePoint(int face, float s, float t);
+
+// The cube-map face v points at, and where on it, in s and t.
+int cubeFaceOf(const glm::vec3 &v, float &s, float &t);
+
+// The unit direction through the centre of texel (x, y) of a cube-map
+// face texels across.
+glm::vec3 cubeTexelDirection(int face, unsigned int x, unsigned int y, unsigned int texels);
+
+// A sphere made by splitting each face of a cube into a grid of
+// divisions^2 squares, of two triangles each, and pushing its points
+// out to radius. Points on the edges between faces are repeated once
+// for each face; with divisions a power of two, they come out in
+// exactly the same place.
+PositionsAndElements cubeSphere(float radius, unsigned int divisions);
+
+// Adjacency in compressed sparse row form: the items adjacent to
+// vertex v are items[offsets[v]] up to items[offsets[v+1]].
+struct Adjacency {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> items;
+};
+
+// The corners (element indices) at each vertex, in element order. The
+// triangle of a corner starts at corner - corner % 3.
+Adjacency vertexCorners(const PositionsAndElements &pne);
+
+// Average cache miss ratio (vertices transformed per triangle) and
+// average transform to vertex ratio (vertices transformed per vertex)
+// for a FIFO post-transform cache of cache_size vertices.
+struct CacheStats {
+    double acmr;
+    double atvr;
+};
+
+CacheStats vertexCacheStats(const std::vector<unsigned int> &elements, std::size_t vertex_count, unsigned int cache_size);
+
+// Reorder triangles so that their vertices are more often still in a
+// cache of cache_size vertices. Linear in the size of the mesh.
+void optimizeVertexCache(PositionsAndElements &pne, unsigned int cache_size);
+
+// Renumber vertices in the order the triangles first use them.
+void optimizeVertexFetch(PositionsAndElements &pne);
+
+// The cache statistics of a mesh before and after optimizeMesh.
+struct MeshOptimization {
+    CacheStats before;
+    CacheStats after;
+};
+
+// Both of the above, for a cache of the size most GPUs have. Doesn't
+// print anything; whatever wants the statistics reports them.
+MeshOptimization optimizeMesh(PositionsAndElements &pne);
+
 std::vector<glm::vec3> computeNormals(const PositionsAndElements &pne);
+std::vector<glm::vec3> computeNormals(const PositionsAndElements &pne, const Adjacency &corners);
 
 extern const double ICOSAHEDRON_VERTICES[12][3];
 extern const unsigned int ICOSAHEDRON_VERTEX_COUNT;
@@ -1,12 +1,32 @@
 // -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <limits>
 #include <random>
+#include <utility>
 
 #include "Noise.h"
+#include "NoiseKernels.h"
 
-double reduceToRange(double x, double modulus);
+// Octave and Curve work through batches in chunks of this many points,
+// so their scratch space can live on the stack.
+const std::size_t BATCH_CHUNK = 256;
+
+struct SelectedPerlinKernel {
+    PerlinKernel kernel;
+    const char *name;
+
+    SelectedPerlinKernel() : kernel{nullptr}, name{nullptr} {
+        kernel = selectPerlinKernel(&name);
+    }
+};
+
+const SelectedPerlinKernel& perlinKernel() {
+    static const SelectedPerlinKernel selected{};
+    return selected;
+}
 
 PermutationTable::PermutationTable() {
     std::random_device seed;
@@ -25,6 +45,10 @@ PermutationTable::PermutationTable() {
     for (int i = 256; i < 512; ++i) {
         table[i] = table[i-256];
     }
+
+    for (int i = 0; i < 512; ++i) {
+        wide_table[i] = table[i];
+    }
 }
 
 PermutationTable::~PermutationTable() {}
@@ -33,6 +57,32 @@ NoiseFunction::NoiseFunction() {}
 
 NoiseFunction::~NoiseFunction() {}
 
+void NoiseFunction::evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const {
+    for (std::size_t i = 0; i < count; ++i) {
+        out[i] = (*this)(xs[i], ys[i], zs[i]);
+    }
+}
+
+NoiseSample NoiseFunction::sample(double x, double y, double z) const {
+    const double h = 1.0e-5;
+    NoiseSample rv;
+    rv.value = (*this)(x, y, z);
+    rv.dx = ((*this)(x + h, y, z) - (*this)(x - h, y, z)) / (2*h);
+    rv.dy = ((*this)(x, y + h, z) - (*this)(x, y - h, z)) / (2*h);
+    rv.dz = ((*this)(x, y, z + h) - (*this)(x, y, z - h)) / (2*h);
+    return rv;
+}
+
+void NoiseFunction::evaluateWithGradient(std::size_t count, const double *xs, const double *ys, const double *zs, NoiseSample *out) const {
+    for (std::size_t i = 0; i < count; ++i) {
+        out[i] = sample(xs[i], ys[i], zs[i]);
+    }
+}
+
+std::pair<double, double> NoiseFunction::range() const {
+    return std::pair<double, double>{-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity()};
+}
+
 Perlin::Perlin()
     : m_permutation{},
       m_x_scale{1.0},
@@ -60,34 +110,15 @@ void Perlin::setScales(double x, double y, double z) {
     m_z_scale = z;
 }
 
-double Perlin::operator()(double xx, double yy) const {
-    const unsigned char *const p = m_permutation.table;
-
-    double x = reduceToRange(xx * m_x_scale, 256.0);
-    double y = reduceToRange(yy * m_y_scale, 256.0);
-
-    int xa = static_cast<int>(std::floor(x));
-    int xb = (xa + 1) % 256;
-    int ya = static_cast<int>(std::floor(y));
-    int yb = (ya + 1) % 256;
-    double xf = x - xa;
-    double yf = y - ya;
-
-    double u = Perlin::fade(xf);
-    double v = Perlin::fade(yf);
-
-    int aa = p[p[xa] + ya];
-    int ab = p[p[xa] + yb];
-    int ba = p[p[xb] + ya];
-    int bb = p[p[xb] + yb];
+double Perlin::operator()(double x, double y) const {
+    return noise(m_permutation, x * m_x_scale, y * m_y_scale);
+}
 
-    double x1 = lerp(u, grad(aa, xf, yf),   grad(ba, xf-1, yf));
-    double x2 = lerp(u, grad(ab, xf, yf-1), grad(bb, xf-1, yf-1));
-    double rv = lerp(v, x1, x2);
-    return rv;
+double Perlin::operator()(double x, double y, double z) const {
+    return noise(m_permutation, x * m_x_scale, y * m_y_scale, z * m_z_scale);
 }
 
-double Perlin::operator()(double xx, double yy, double zz) const {
+NoiseSample Perlin::sample(double xx, double yy, double zz) const {
     const unsigned char *const p = m_permutation.table;
 
     double x = reduceToRange(xx * m_x_scale, 256.0);
@@ -109,69 +140,131 @@ double Perlin::operator()(double xx, double yy, double zz) const {
     double v = fade(yf);
     double w = fade(zf);
 
-    int aaa = p[p[p[xa] + ya] + za];
-    int aab = p[p[p[xa] + ya] + zb];
-    int aba = p[p[p[xa] + yb] + za];
-    int abb = p[p[p[xa] + yb] + zb];
-    int baa = p[p[p[xb] + ya] + za];
-    int bab = p[p[p[xb] + ya] + zb];
-    int bba = p[p[p[xb] + yb] + za];
-    int bbb = p[p[p[xb] + yb] + zb];
+    int hashes[8] = {
+        p[p[p[xa] + ya] + za],
+        p[p[p[xb] + ya] + za],
+        p[p[p[xa] + yb] + za],
+        p[p[p[xb] + yb] + za],
+        p[p[p[xa] + ya] + zb],
+        p[p[p[xb] + ya] + zb],
+        p[p[p[xa] + yb] + zb],
+        p[p[p[xb] + yb] + zb],
+    };
+
+    // Corner i sits at (i & 1, (i >> 1) & 1, (i >> 2) & 1) in the cell.
+    double n[8], gx[8], gy[8], gz[8];
+    for (int i = 0; i < 8; ++i) {
+        double cx = xf - (i & 1), cy = yf - ((i >> 1) & 1), cz = zf - ((i >> 2) & 1);
+        n[i] = grad(hashes[i], cx, cy, cz);
+        gradVector(hashes[i], gx[i], gy[i], gz[i]);
+    }
+
+    NoiseSample rv;
 
+    // The value, computed exactly as operator() does.
     double x1, y1, x2, y2;
-    x1 = lerp(u, grad(aaa, xf, yf, zf),   grad(baa, xf-1, yf, zf));
-    x2 = lerp(u, grad(aba, xf, yf-1, zf), grad(bba, xf-1, yf-1, zf));
+    x1 = lerp(u, n[0], n[1]);
+    x2 = lerp(u, n[2], n[3]);
     y1 = lerp(v, x1, x2);
-
-    x1 = lerp(u, grad(aab, xf, yf, zf-1),   grad(bab, xf-1, yf, zf-1));
-    x2 = lerp(u, grad(abb, xf, yf-1, zf-1), grad(bbb, xf-1, yf-1, zf-1));
+    x1 = lerp(u, n[4], n[5]);
+    x2 = lerp(u, n[6], n[7]);
     y2 = lerp(v, x1, x2);
+    rv.value = lerp(w, y1, y2);
+
+    // Written out as a polynomial in u, v, and w, the value is
+    // k0 + k1 u + k2 v + k3 w + k4 uv + k5 vw + k6 uw + k7 uvw, plus
+    // each corner's gradient weighted by its trilinear weight.
+    double k1 = n[1] - n[0];
+    double k2 = n[2] - n[0];
+    double k3 = n[4] - n[0];
+    double k4 = n[0] - n[1] - n[2] + n[3];
+    double k5 = n[0] - n[2] - n[4] + n[6];
+    double k6 = n[0] - n[1] - n[4] + n[5];
+    double k7 = -n[0] + n[1] + n[2] - n[3] + n[4] - n[5] - n[6] + n[7];
+
+    double du = fadeDerivative(xf), dv = fadeDerivative(yf), dw = fadeDerivative(zf);
+    double dx = du * (k1 + k4*v + k6*w + k7*v*w);
+    double dy = dv * (k2 + k4*u + k5*w + k7*u*w);
+    double dz = dw * (k3 + k5*v + k6*u + k7*u*v);
+
+    for (int i = 0; i < 8; ++i) {
+        double weight =
+            ((i & 1) ? u : 1.0 - u) *
+            (((i >> 1) & 1) ? v : 1.0 - v) *
+            (((i >> 2) & 1) ? w : 1.0 - w);
+        dx += weight * gx[i];
+        dy += weight * gy[i];
+        dz += weight * gz[i];
+    }
 
-    double rv = lerp(w, y1, y2);
-    static double min_rv = rv, max_rv = rv;
-    min_rv = std::min(rv, min_rv);
-    max_rv = std::max(rv, max_rv);
+    rv.dx = dx * m_x_scale;
+    rv.dy = dy * m_y_scale;
+    rv.dz = dz * m_z_scale;
     return rv;
 }
 
-double Perlin::fade(double t) {
-    // 6t^5 - 15t^4 + 10t^3
-    return t * t * t * (t * (t * 6 - 15) + 10);
+void Perlin::evaluateWithGradient(std::size_t count, const double *xs, const double *ys, const double *zs, NoiseSample *out) const {
+    for (std::size_t i = 0; i < count; ++i) {
+        out[i] = Perlin::sample(xs[i], ys[i], zs[i]);
+    }
+}
+
+const PermutationTable& Perlin::permutation() const {
+    return m_permutation;
+}
+
+double Perlin::xScale() const {
+    return m_x_scale;
+}
+
+double Perlin::yScale() const {
+    return m_y_scale;
 }
 
-double Perlin::lerp(double t, double a, double b) {
-    return t*(b - a) + a;
+double Perlin::zScale() const {
+    return m_z_scale;
 }
 
-double Perlin::grad(int hash, double x, double y) {
-    switch (hash & 0x3) {
-        case 0x0: return  x +  y;
-        case 0x1: return -x +  y;
-        case 0x2: return  x + -y;
-        case 0x3: return -x + -y;
-        default : return 0;
+void Perlin::evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const {
+    PerlinKernel kernel = perlinKernel().kernel;
+    if (kernel) {
+        kernel(m_permutation.wide_table, m_x_scale, m_y_scale, m_z_scale, count, xs, ys, zs, out);
+    } else {
+        for (std::size_t i = 0; i < count; ++i) {
+            out[i] = Perlin::operator()(xs[i], ys[i], zs[i]);
+        }
     }
 }
 
-double Perlin::grad(int hash, double x, double y, double z) {
+const char* Perlin::batchKernelName() {
+    return perlinKernel().name;
+}
+
+double Perlin::fadeDerivative(double t) {
+    // 30t^4 - 60t^3 + 30t^2
+    return 30 * t * t * (t - 1) * (t - 1);
+}
+
+void Perlin::gradVector(int hash, double &gx, double &gy, double &gz) {
+    // The coefficients of x, y, and z in grad().
+    gx = gy = gz = 0;
     switch (hash & 0xF) {
-        case 0x0: return  x +  y;
-        case 0x1: return -x +  y;
-        case 0x2: return  x + -y;
-        case 0x3: return -x + -y;
-        case 0x4: return  x +  z;
-        case 0x5: return -x +  z;
-        case 0x6: return  x + -z;
-        case 0x7: return -x + -z;
-        case 0x8: return  y +  z;
-        case 0x9: return -y +  z;
-        case 0xA: return  y + -z;
-        case 0xB: return -y + -z;
-        case 0xC: return  x +  y;
-        case 0xD: return -x +  y;
-        case 0xE: return -y +  z;
-        case 0xF: return -y + -z;
-        default: return 0;
+        case 0x0: gx =  1; gy =  1; break;
+        case 0x1: gx = -1; gy =  1; break;
+        case 0x2: gx =  1; gy = -1; break;
+        case 0x3: gx = -1; gy = -1; break;
+        case 0x4: gx =  1; gz =  1; break;
+        case 0x5: gx = -1; gz =  1; break;
+        case 0x6: gx =  1; gz = -1; break;
+        case 0x7: gx = -1; gz = -1; break;
+        case 0x8: gy =  1; gz =  1; break;
+        case 0x9: gy = -1; gz =  1; break;
+        case 0xA: gy =  1; gz = -1; break;
+        case 0xB: gy = -1; gz = -1; break;
+        case 0xC: gx =  1; gy =  1; break;
+        case 0xD: gx = -1; gy =  1; break;
+        case 0xE: gy = -1; gz =  1; break;
+        case 0xF: gy = -1; gz = -1; break;
     }
 }
 
@@ -220,6 +313,106 @@ double Octave::operator()(double x, double y, double z) const {
     return total;
 }
 
+void Octave::evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const {
+    // The same sums as operator(), in the same order, but with each
+    // octave evaluated over a whole chunk at once.
+    double freq_factor = 1.0 / m_persistence;
+    double x[BATCH_CHUNK], y[BATCH_CHUNK], z[BATCH_CHUNK], n[BATCH_CHUNK];
+
+    for (std::size_t start = 0; start < count; start += BATCH_CHUNK) {
+        std::size_t len = std::min(BATCH_CHUNK, count - start);
+        double *total = out + start;
+
+        for (std::size_t i = 0; i < len; ++i) {
+            x[i] = xs[start + i];
+            y[i] = ys[start + i];
+            z[i] = zs[start + i];
+            total[i] = 0;
+        }
+
+        double amplitude = 1;
+        for (int o = 0; o < m_octaves; ++o) {
+            m_noise.evaluate(len, x, y, z, n);
+            for (std::size_t i = 0; i < len; ++i) {
+                total[i] += n[i] * amplitude;
+                x[i] *= freq_factor;
+                y[i] *= freq_factor;
+                z[i] *= freq_factor;
+            }
+            amplitude *= m_persistence;
+        }
+    }
+}
+
+NoiseSample Octave::sample(double x, double y, double z) const {
+    NoiseSample rv{0, 0, 0, 0};
+    double amplitude = 1;
+    double frequency = 1;
+    double freq_factor = 1.0 / m_persistence;
+
+    for (int i = 0; i < m_octaves; ++i) {
+        NoiseSample octave = m_noise.sample(x, y, z);
+        rv.value += octave.value * amplitude;
+        rv.dx += octave.dx * amplitude * frequency;
+        rv.dy += octave.dy * amplitude * frequency;
+        rv.dz += octave.dz * amplitude * frequency;
+        amplitude *= m_persistence;
+        frequency *= freq_factor;
+        x *= freq_factor;
+        y *= freq_factor;
+        z *= freq_factor;
+    }
+
+    return rv;
+}
+
+void Octave::evaluateWithGradient(std::size_t count, const double *xs, const double *ys, const double *zs, NoiseSample *out) const {
+    double freq_factor = 1.0 / m_persistence;
+    double x[BATCH_CHUNK], y[BATCH_CHUNK], z[BATCH_CHUNK];
+    NoiseSample n[BATCH_CHUNK];
+
+    for (std::size_t start = 0; start < count; start += BATCH_CHUNK) {
+        std::size_t len = std::min(BATCH_CHUNK, count - start);
+        NoiseSample *total = out + start;
+
+        for (std::size_t i = 0; i < len; ++i) {
+            x[i] = xs[start + i];
+            y[i] = ys[start + i];
+            z[i] = zs[start + i];
+            total[i] = NoiseSample{0, 0, 0, 0};
+        }
+
+        double amplitude = 1;
+        double frequency = 1;
+        for (int o = 0; o < m_octaves; ++o) {
+            m_noise.evaluateWithGradient(len, x, y, z, n);
+            for (std::size_t i = 0; i < len; ++i) {
+                total[i].value += n[i].value * amplitude;
+                total[i].dx += n[i].dx * amplitude * frequency;
+                total[i].dy += n[i].dy * amplitude * frequency;
+                total[i].dz += n[i].dz * amplitude * frequency;
+                x[i] *= freq_factor;
+                y[i] *= freq_factor;
+                z[i] *= freq_factor;
+            }
+            amplitude *= m_persistence;
+            frequency *= freq_factor;
+        }
+    }
+}
+
+const NoiseFunction& Octave::base() const {
+    return m_noise;
+}
+
+int Octave::octaves() const {
+    return m_octaves;
+}
+
+double Octave::persistence() const {
+    return m_persistence;
+}
+
 Curve::Curve(const NoiseFunction &base, const CubicSpline &curve)
     : m_noise{base},
       m_curve{curve}
@@ -237,14 +430,47 @@ double Curve::operator()(double x, double y, double z) const {
     return rv;
 }
 
-double reduceToRange(double x, double modulus) {
-    while (x >= modulus) {
-        x -= modulus;
+void Curve::evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const {
+    m_noise.evaluate(count, xs, ys, zs, out);
+    for (std::size_t i = 0; i < count; ++i) {
+        out[i] = m_curve(out[i]);
     }
+}
 
-    while (x < 0) {
-        x += modulus;
+NoiseSample Curve::sample(double x, double y, double z) const {
+    NoiseSample rv = m_noise.sample(x, y, z);
+    double slope = m_curve.derivative(rv.value);
+    rv.value = m_curve(rv.value);
+    rv.dx *= slope;
+    rv.dy *= slope;
+    rv.dz *= slope;
+    return rv;
+}
+
+void Curve::evaluateWithGradient(std::size_t count, const double *xs, const double *ys, const double *zs, NoiseSample *out) const {
+    m_noise.evaluateWithGradient(count, xs, ys, zs, out);
+    apply(count, out);
+}
+
+void Curve::apply(std::size_t count, NoiseSample *samples) const {
+    for (std::size_t i = 0; i < count; ++i) {
+        double slope = m_curve.derivative(samples[i].value);
+        samples[i].value = m_curve(samples[i].value);
+        samples[i].dx *= slope;
+        samples[i].dy *= slope;
+        samples[i].dz *= slope;
     }
+}
+
+std::pair<double, double> Curve::range() const {
+    // Whatever the base noise does, the curve can't leave its range.
+    return m_curve.range();
+}
+
+const NoiseFunction& Curve::base() const {
+    return m_noise;
+}
 
-    return x;
+const CubicSpline& Curve::curve() const {
+    return m_curve;
 }
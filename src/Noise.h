@@ -3,6 +3,10 @@
 #ifndef _PLANET_NOISE_H_
 #define _PLANET_NOISE_H_
 
+#include <cmath>
+#include <cstddef>
+#include <utility>
+
 #include "Curve.h"
 
 class PermutationTable {
@@ -11,6 +15,16 @@ public:
     ~PermutationTable();
 
     unsigned char table[512];
+
+    // The same values as table, widened so that the SIMD kernels can
+    // gather from it.
+    int wide_table[512];
+};
+
+// A noise value together with its gradient.
+struct NoiseSample {
+    double value;
+    double dx, dy, dz;
 };
 
 class NoiseFunction {
@@ -21,6 +35,24 @@ public:
     // double operator()(double x) const;
     virtual double operator()(double x, double y) const = 0;
     virtual double operator()(double x, double y, double z) const = 0;
+
+    // Evaluate count points given as separate x, y, and z arrays,
+    // writing the results to out. The results are bit-for-bit the
+    // same as calling operator()(x, y, z) on each point; this default
+    // does exactly that.
+    virtual void evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const;
+
+    // The value at (x, y, z) along with its gradient there. This
+    // default estimates the gradient with central differences; Perlin,
+    // Octave, and Curve compute it exactly.
+    virtual NoiseSample sample(double x, double y, double z) const;
+
+    // sample() over a batch of points, like evaluate().
+    virtual void evaluateWithGradient(std::size_t count, const double *xs, const double *ys, const double *zs, NoiseSample *out) const;
+
+    // Bounds on the values the function takes. This default doesn't
+    // know any, and returns infinities.
+    virtual std::pair<double, double> range() const;
 };
 
 class Perlin : public NoiseFunction {
@@ -35,6 +67,22 @@ public:
     // double operator()(double x) const;
     virtual double operator()(double x, double y) const;
     virtual double operator()(double x, double y, double z) const;
+    virtual void evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const;
+    virtual NoiseSample sample(double x, double y, double z) const;
+    virtual void evaluateWithGradient(std::size_t count, const double *xs, const double *ys, const double *zs, NoiseSample *out) const;
+
+    // The name of the batch kernel evaluate() uses on this CPU.
+    static const char* batchKernelName();
+
+    const PermutationTable& permutation() const;
+    double xScale() const;
+    double yScale() const;
+    double zScale() const;
+
+    // The noise at an already scaled point. These are inline so that
+    // the static noise graphs (StaticNoise.h) can be fully inlined.
+    static double noise(const PermutationTable &perm, double x, double y);
+    static double noise(const PermutationTable &perm, double x, double y, double z);
 
 private:
     static double fade(double t);
@@ -42,7 +90,10 @@ private:
     
     static double grad(int hash, double x, double y);
     static double grad(int hash, double x, double y, double z);
-    
+
+    static double fadeDerivative(double t);
+    static void gradVector(int hash, double &gx, double &gy, double &gz);
+
     PermutationTable m_permutation;
     double m_x_scale, m_y_scale, m_z_scale;
 };
@@ -54,6 +105,13 @@ public:
 
     virtual double operator()(double x, double y) const;
     virtual double operator()(double x, double y, double z) const;
+    virtual void evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const;
+    virtual NoiseSample sample(double x, double y, double z) const;
+    virtual void evaluateWithGradient(std::size_t count, const double *xs, const double *ys, const double *zs, NoiseSample *out) const;
+
+    const NoiseFunction& base() const;
+    int octaves() const;
+    double persistence() const;
 
 private:
     const NoiseFunction &m_noise;
@@ -68,10 +126,145 @@ public:
 
     virtual double operator()(double x, double y) const;
     virtual double operator()(double x, double y, double z) const;
+    virtual void evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const;
+    virtual NoiseSample sample(double x, double y, double z) const;
+    virtual void evaluateWithGradient(std::size_t count, const double *xs, const double *ys, const double *zs, NoiseSample *out) const;
+    virtual std::pair<double, double> range() const;
+
+    // Put count samples of the base noise through the curve, in
+    // place.
+    void apply(std::size_t count, NoiseSample *samples) const;
+
+    const NoiseFunction& base() const;
+    const CubicSpline& curve() const;
 
 private:
     const NoiseFunction &m_noise;
     const CubicSpline &m_curve;
 };
 
+inline double reduceToRange(double x, double modulus) {
+    while (x >= modulus) {
+        x -= modulus;
+    }
+
+    while (x < 0) {
+        x += modulus;
+    }
+
+    return x;
+}
+
+inline double Perlin::fade(double t) {
+    // 6t^5 - 15t^4 + 10t^3
+    return t * t * t * (t * (t * 6 - 15) + 10);
+}
+
+inline double Perlin::lerp(double t, double a, double b) {
+    return t*(b - a) + a;
+}
+
+inline double Perlin::grad(int hash, double x, double y) {
+    switch (hash & 0x3) {
+        case 0x0: return  x +  y;
+        case 0x1: return -x +  y;
+        case 0x2: return  x + -y;
+        case 0x3: return -x + -y;
+        default : return 0;
+    }
+}
+
+inline double Perlin::grad(int hash, double x, double y, double z) {
+    switch (hash & 0xF) {
+        case 0x0: return  x +  y;
+        case 0x1: return -x +  y;
+        case 0x2: return  x + -y;
+        case 0x3: return -x + -y;
+        case 0x4: return  x +  z;
+        case 0x5: return -x +  z;
+        case 0x6: return  x + -z;
+        case 0x7: return -x + -z;
+        case 0x8: return  y +  z;
+        case 0x9: return -y +  z;
+        case 0xA: return  y + -z;
+        case 0xB: return -y + -z;
+        case 0xC: return  x +  y;
+        case 0xD: return -x +  y;
+        case 0xE: return -y +  z;
+        case 0xF: return -y + -z;
+        default: return 0;
+    }
+}
+
+inline double Perlin::noise(const PermutationTable &perm, double xx, double yy) {
+    const unsigned char *const p = perm.table;
+
+    double x = reduceToRange(xx, 256.0);
+    double y = reduceToRange(yy, 256.0);
+
+    int xa = static_cast<int>(std::floor(x));
+    int xb = (xa + 1) % 256;
+    int ya = static_cast<int>(std::floor(y));
+    int yb = (ya + 1) % 256;
+    double xf = x - xa;
+    double yf = y - ya;
+
+    double u = Perlin::fade(xf);
+    double v = Perlin::fade(yf);
+
+    int aa = p[p[xa] + ya];
+    int ab = p[p[xa] + yb];
+    int ba = p[p[xb] + ya];
+    int bb = p[p[xb] + yb];
+
+    double x1 = lerp(u, grad(aa, xf, yf),   grad(ba, xf-1, yf));
+    double x2 = lerp(u, grad(ab, xf, yf-1), grad(bb, xf-1, yf-1));
+    double rv = lerp(v, x1, x2);
+    return rv;
+}
+
+inline double Perlin::noise(const PermutationTable &perm, double xx, double yy, double zz) {
+    const unsigned char *const p = perm.table;
+
+    double x = reduceToRange(xx, 256.0);
+    double y = reduceToRange(yy, 256.0);
+    double z = reduceToRange(zz, 256.0);
+
+    int xa = static_cast<int>(std::floor(x));
+    int xb = (xa + 1) % 256;
+    int ya = static_cast<int>(std::floor(y));
+    int yb = (ya + 1) % 256;
+    int za = static_cast<int>(std::floor(z));
+    int zb = (za + 1) % 256;
+
+    double xf = x - xa;
+    double yf = y - ya;
+    double zf = z - za;
+
+    double u = fade(xf);
+    double v = fade(yf);
+    double w = fade(zf);
+
+    int aaa = p[p[p[xa] + ya] + za];
+    int aab = p[p[p[xa] + ya] + zb];
+    int aba = p[p[p[xa] + yb] + za];
+    int abb = p[p[p[xa] + yb] + zb];
+    int baa = p[p[p[xb] + ya] + za];
+    int bab = p[p[p[xb] + ya] + zb];
+    int bba = p[p[p[xb] + yb] + za];
+    int bbb = p[p[p[xb] + yb] + zb];
+
+    double x1, y1, x2, y2;
+    x1 = lerp(u, grad(aaa, xf, yf, zf),   grad(baa, xf-1, yf, zf));
+    x2 = lerp(u, grad(aba, xf, yf-1, zf), grad(bba, xf-1, yf-1, zf));
+    y1 = lerp(v, x1, x2);
+
+    x1 = lerp(u, grad(aab, xf, yf, zf-1),   grad(bab, xf-1, yf, zf-1));
+    x2 = lerp(u, grad(abb, xf, yf-1, zf-1), grad(bbb, xf-1, yf-1, zf-1));
+    y2 = lerp(v, x1, x2);
+
+    double rv = lerp(w, y1, y2);
+    return rv;
+}
+
 #endif
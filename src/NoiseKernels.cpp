@@ -0,0 +1,84 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <cstddef>
+
+#if defined(PLANET_NOISE_SIMD) && defined(_MSC_VER)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+#include "NoiseKernels.h"
+
+#ifdef PLANET_NOISE_SIMD
+
+struct CpuFeatures {
+    bool sse42, avx2, avx512f;
+};
+
+#ifdef _MSC_VER
+
+CpuFeatures detectCpuFeatures() {
+    CpuFeatures rv{false, false, false};
+    int info[4];
+
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+
+    __cpuid(info, 1);
+    rv.sse42 = (info[2] & (1 << 20)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || max_leaf < 7) {
+        return rv;
+    }
+
+    // Check that the OS saves the YMM (and ZMM) registers.
+    unsigned long long xcr0 = _xgetbv(0);
+    bool ymm_state = (xcr0 & 0x06) == 0x06;
+    bool zmm_state = (xcr0 & 0xE6) == 0xE6;
+
+    __cpuidex(info, 7, 0);
+    rv.avx2 = ymm_state && (info[1] & (1 << 5)) != 0;
+    rv.avx512f = zmm_state && rv.avx2 && (info[1] & (1 << 16)) != 0;
+    return rv;
+}
+
+#else
+
+CpuFeatures detectCpuFeatures() {
+    __builtin_cpu_init();
+    CpuFeatures rv;
+    rv.sse42 = __builtin_cpu_supports("sse4.2");
+    rv.avx2 = __builtin_cpu_supports("avx2");
+    rv.avx512f = rv.avx2 && __builtin_cpu_supports("avx512f");
+    return rv;
+}
+
+#endif
+
+PerlinKernel selectPerlinKernel(const char **name) {
+    CpuFeatures features = detectCpuFeatures();
+
+    if (features.avx512f) {
+        *name = "avx512";
+        return perlinKernelAvx512;
+    } else if (features.avx2) {
+        *name = "avx2";
+        return perlinKernelAvx2;
+    } else if (features.sse42) {
+        *name = "sse4.2";
+        return perlinKernelSse42;
+    }
+
+    *name = "scalar";
+    return nullptr;
+}
+
+#else
+
+PerlinKernel selectPerlinKernel(const char **name) {
+    *name = "scalar";
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,45 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_NOISE_KERNELS_H_
+#define _PLANET_NOISE_KERNELS_H_
+
+#include <cstddef>
+
+// Batch kernels for 3D Perlin noise. Every kernel computes exactly
+// what Perlin::operator()(x, y, z) computes, in the same order and
+// without fused multiply-adds, so the results are bit-for-bit
+// identical to the scalar path.
+//
+// The kernel translation units are compiled with their own
+// instruction set flags, so they must not instantiate any inline or
+// template code (e.g. from the standard library) that could be merged
+// with the copies in the rest of the program.
+
+typedef void (*PerlinKernel)(
+    const int *perm,
+    double x_scale, double y_scale, double z_scale,
+    std::size_t count,
+    const double *xs, const double *ys, const double *zs,
+    double *out);
+
+// Bit sets, indexed by (hash & 0xF), describing Perlin::grad. The
+// gradient is (+/-)a + (+/-)b, where a is x or y and b is y or z.
+const unsigned int PERLIN_GRAD_A_IS_Y   = 0xCF00;
+const unsigned int PERLIN_GRAD_B_IS_Z   = 0xCFF0;
+const unsigned int PERLIN_GRAD_NEGATE_A = 0xEAAA;
+const unsigned int PERLIN_GRAD_NEGATE_B = 0x8CCC;
+
+#ifdef PLANET_NOISE_SIMD
+void perlinKernelSse42(const int *perm, double x_scale, double y_scale, double z_scale,
+                       std::size_t count, const double *xs, const double *ys, const double *zs, double *out);
+void perlinKernelAvx2(const int *perm, double x_scale, double y_scale, double z_scale,
+                      std::size_t count, const double *xs, const double *ys, const double *zs, double *out);
+void perlinKernelAvx512(const int *perm, double x_scale, double y_scale, double z_scale,
+                        std::size_t count, const double *xs, const double *ys, const double *zs, double *out);
+#endif
+
+// Pick the widest kernel the CPU supports. Returns nullptr if only the
+// scalar path is available.
+PerlinKernel selectPerlinKernel(const char **name);
+
+#endif
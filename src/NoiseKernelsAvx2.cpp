@@ -0,0 +1,163 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <cstddef>
+
+#include <immintrin.h>
+
+#include "NoiseKernels.h"
+
+namespace {
+
+const std::size_t LANES = 4;
+
+inline __m256d reduceToRange256(__m256d x) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d modulus = _mm256_set1_pd(256.0);
+    const __m256d inv_modulus = _mm256_set1_pd(1.0 / 256.0);
+    const __m256d minus_one = _mm256_set1_pd(-1.0);
+
+    // Values already in range (including -0.0) are left alone, like
+    // reduceToRange does. Otherwise take off the whole number of
+    // moduli at once; every step of the scalar loop is exact, so the
+    // result is the same.
+    __m256d negative = _mm256_cmp_pd(x, zero, _CMP_LT_OQ);
+    __m256d in_range = _mm256_andnot_pd(negative, _mm256_cmp_pd(x, modulus, _CMP_LT_OQ));
+    __m256d k = _mm256_floor_pd(_mm256_mul_pd(x, inv_modulus));
+
+    // Tiny negative values can underflow to -0.0 when scaled down.
+    k = _mm256_blendv_pd(k, _mm256_min_pd(k, minus_one), negative);
+
+    __m256d reduced = _mm256_sub_pd(x, _mm256_mul_pd(k, modulus));
+    return _mm256_blendv_pd(reduced, x, in_range);
+}
+
+inline __m256d fade(__m256d t) {
+    // 6t^5 - 15t^4 + 10t^3
+    const __m256d six = _mm256_set1_pd(6.0);
+    const __m256d fifteen = _mm256_set1_pd(15.0);
+    const __m256d ten = _mm256_set1_pd(10.0);
+    __m256d t3 = _mm256_mul_pd(_mm256_mul_pd(t, t), t);
+    __m256d poly = _mm256_add_pd(_mm256_mul_pd(t, _mm256_sub_pd(_mm256_mul_pd(t, six), fifteen)), ten);
+    return _mm256_mul_pd(t3, poly);
+}
+
+inline __m256d lerp(__m256d t, __m256d a, __m256d b) {
+    return _mm256_add_pd(_mm256_mul_pd(t, _mm256_sub_pd(b, a)), a);
+}
+
+inline __m256d gradMask(unsigned int bits, __m128i h) {
+    __m128i bit = _mm_and_si128(_mm_srlv_epi32(_mm_set1_epi32(static_cast<int>(bits)), h), _mm_set1_epi32(1));
+    __m128i mask = _mm_sub_epi32(_mm_setzero_si128(), bit);
+    return _mm256_castsi256_pd(_mm256_cvtepi32_epi64(mask));
+}
+
+inline __m256d grad(__m128i hash, __m256d x, __m256d y, __m256d z) {
+    const __m256d sign_bit = _mm256_set1_pd(-0.0);
+    __m128i h = _mm_and_si128(hash, _mm_set1_epi32(0xF));
+
+    __m256d a = _mm256_blendv_pd(x, y, gradMask(PERLIN_GRAD_A_IS_Y, h));
+    __m256d b = _mm256_blendv_pd(y, z, gradMask(PERLIN_GRAD_B_IS_Z, h));
+    a = _mm256_xor_pd(a, _mm256_and_pd(gradMask(PERLIN_GRAD_NEGATE_A, h), sign_bit));
+    b = _mm256_xor_pd(b, _mm256_and_pd(gradMask(PERLIN_GRAD_NEGATE_B, h), sign_bit));
+    return _mm256_add_pd(a, b);
+}
+
+inline __m128i lookup(const int *p, __m128i index) {
+    return _mm_i32gather_epi32(p, index, 4);
+}
+
+inline __m256d perlin(const int *p, __m256d xx, __m256d yy, __m256d zz) {
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i wrap = _mm_set1_epi32(0xFF);
+    const __m256d one_d = _mm256_set1_pd(1.0);
+
+    __m256d x = reduceToRange256(xx);
+    __m256d y = reduceToRange256(yy);
+    __m256d z = reduceToRange256(zz);
+
+    __m256d x_floor = _mm256_floor_pd(x);
+    __m256d y_floor = _mm256_floor_pd(y);
+    __m256d z_floor = _mm256_floor_pd(z);
+
+    __m128i xa = _mm256_cvttpd_epi32(x_floor);
+    __m128i xb = _mm_and_si128(_mm_add_epi32(xa, one), wrap);
+    __m128i ya = _mm256_cvttpd_epi32(y_floor);
+    __m128i yb = _mm_and_si128(_mm_add_epi32(ya, one), wrap);
+    __m128i za = _mm256_cvttpd_epi32(z_floor);
+    __m128i zb = _mm_and_si128(_mm_add_epi32(za, one), wrap);
+
+    __m256d xf = _mm256_sub_pd(x, x_floor);
+    __m256d yf = _mm256_sub_pd(y, y_floor);
+    __m256d zf = _mm256_sub_pd(z, z_floor);
+    __m256d xf1 = _mm256_sub_pd(xf, one_d);
+    __m256d yf1 = _mm256_sub_pd(yf, one_d);
+    __m256d zf1 = _mm256_sub_pd(zf, one_d);
+
+    __m256d u = fade(xf);
+    __m256d v = fade(yf);
+    __m256d w = fade(zf);
+
+    __m128i pa = lookup(p, xa);
+    __m128i pb = lookup(p, xb);
+    __m128i paa = lookup(p, _mm_add_epi32(pa, ya));
+    __m128i pab = lookup(p, _mm_add_epi32(pa, yb));
+    __m128i pba = lookup(p, _mm_add_epi32(pb, ya));
+    __m128i pbb = lookup(p, _mm_add_epi32(pb, yb));
+
+    __m128i aaa = lookup(p, _mm_add_epi32(paa, za));
+    __m128i aab = lookup(p, _mm_add_epi32(paa, zb));
+    __m128i aba = lookup(p, _mm_add_epi32(pab, za));
+    __m128i abb = lookup(p, _mm_add_epi32(pab, zb));
+    __m128i baa = lookup(p, _mm_add_epi32(pba, za));
+    __m128i bab = lookup(p, _mm_add_epi32(pba, zb));
+    __m128i bba = lookup(p, _mm_add_epi32(pbb, za));
+    __m128i bbb = lookup(p, _mm_add_epi32(pbb, zb));
+
+    __m256d x1, x2, y1, y2;
+    x1 = lerp(u, grad(aaa, xf, yf, zf), grad(baa, xf1, yf, zf));
+    x2 = lerp(u, grad(aba, xf, yf1, zf), grad(bba, xf1, yf1, zf));
+    y1 = lerp(v, x1, x2);
+
+    x1 = lerp(u, grad(aab, xf, yf, zf1), grad(bab, xf1, yf, zf1));
+    x2 = lerp(u, grad(abb, xf, yf1, zf1), grad(bbb, xf1, yf1, zf1));
+    y2 = lerp(v, x1, x2);
+
+    return lerp(w, y1, y2);
+}
+
+}
+
+void perlinKernelAvx2(const int *perm, double x_scale, double y_scale, double z_scale,
+                      std::size_t count, const double *xs, const double *ys, const double *zs, double *out)
+{
+    const __m256d sx = _mm256_set1_pd(x_scale);
+    const __m256d sy = _mm256_set1_pd(y_scale);
+    const __m256d sz = _mm256_set1_pd(z_scale);
+
+    std::size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        __m256d x = _mm256_mul_pd(_mm256_loadu_pd(xs + i), sx);
+        __m256d y = _mm256_mul_pd(_mm256_loadu_pd(ys + i), sy);
+        __m256d z = _mm256_mul_pd(_mm256_loadu_pd(zs + i), sz);
+        _mm256_storeu_pd(out + i, perlin(perm, x, y, z));
+    }
+
+    if (i < count) {
+        double tail_x[LANES] = { 0.0 }, tail_y[LANES] = { 0.0 }, tail_z[LANES] = { 0.0 }, tail_out[LANES];
+        std::size_t rem = count - i;
+        for (std::size_t j = 0; j < rem; ++j) {
+            tail_x[j] = xs[i+j];
+            tail_y[j] = ys[i+j];
+            tail_z[j] = zs[i+j];
+        }
+
+        __m256d x = _mm256_mul_pd(_mm256_loadu_pd(tail_x), sx);
+        __m256d y = _mm256_mul_pd(_mm256_loadu_pd(tail_y), sy);
+        __m256d z = _mm256_mul_pd(_mm256_loadu_pd(tail_z), sz);
+        _mm256_storeu_pd(tail_out, perlin(perm, x, y, z));
+
+        for (std::size_t j = 0; j < rem; ++j) {
+            out[i+j] = tail_out[j];
+        }
+    }
+}
@@ -0,0 +1,159 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <cstddef>
+
+#include <immintrin.h>
+
+#include "NoiseKernels.h"
+
+namespace {
+
+const std::size_t LANES = 8;
+
+inline __m512d reduceToRange256(__m512d x) {
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d modulus = _mm512_set1_pd(256.0);
+    const __m512d inv_modulus = _mm512_set1_pd(1.0 / 256.0);
+    const __m512d minus_one = _mm512_set1_pd(-1.0);
+
+    // Values already in range (including -0.0) are left alone, like
+    // reduceToRange does. Otherwise take off the whole number of
+    // moduli at once; every step of the scalar loop is exact, so the
+    // result is the same.
+    __mmask8 negative = _mm512_cmp_pd_mask(x, zero, _CMP_LT_OQ);
+    __mmask8 in_range = _mm512_kandn(negative, _mm512_cmp_pd_mask(x, modulus, _CMP_LT_OQ));
+    __m512d k = _mm512_roundscale_pd(_mm512_mul_pd(x, inv_modulus), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+
+    // Tiny negative values can underflow to -0.0 when scaled down.
+    k = _mm512_mask_min_pd(k, negative, k, minus_one);
+
+    __m512d reduced = _mm512_sub_pd(x, _mm512_mul_pd(k, modulus));
+    return _mm512_mask_blend_pd(in_range, reduced, x);
+}
+
+inline __m512d floor(__m512d x) {
+    return _mm512_roundscale_pd(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+
+inline __m512d fade(__m512d t) {
+    // 6t^5 - 15t^4 + 10t^3
+    const __m512d six = _mm512_set1_pd(6.0);
+    const __m512d fifteen = _mm512_set1_pd(15.0);
+    const __m512d ten = _mm512_set1_pd(10.0);
+    __m512d t3 = _mm512_mul_pd(_mm512_mul_pd(t, t), t);
+    __m512d poly = _mm512_add_pd(_mm512_mul_pd(t, _mm512_sub_pd(_mm512_mul_pd(t, six), fifteen)), ten);
+    return _mm512_mul_pd(t3, poly);
+}
+
+inline __m512d lerp(__m512d t, __m512d a, __m512d b) {
+    return _mm512_add_pd(_mm512_mul_pd(t, _mm512_sub_pd(b, a)), a);
+}
+
+inline __m512d negate(__m512d x, __mmask8 mask) {
+    const __m512i sign_bit = _mm512_set1_epi64(static_cast<long long>(0x8000000000000000ULL));
+    __m512i bits = _mm512_castpd_si512(x);
+    return _mm512_castsi512_pd(_mm512_mask_xor_epi64(bits, mask, bits, sign_bit));
+}
+
+inline __m512d grad(__m256i hash, __m512d x, __m512d y, __m512d z) {
+    const __m512i one = _mm512_set1_epi64(1);
+    __m512i h = _mm512_cvtepi32_epi64(_mm256_and_si256(hash, _mm256_set1_epi32(0xF)));
+
+    __mmask8 a_is_y = _mm512_test_epi64_mask(_mm512_srlv_epi64(_mm512_set1_epi64(PERLIN_GRAD_A_IS_Y), h), one);
+    __mmask8 b_is_z = _mm512_test_epi64_mask(_mm512_srlv_epi64(_mm512_set1_epi64(PERLIN_GRAD_B_IS_Z), h), one);
+    __mmask8 negate_a = _mm512_test_epi64_mask(_mm512_srlv_epi64(_mm512_set1_epi64(PERLIN_GRAD_NEGATE_A), h), one);
+    __mmask8 negate_b = _mm512_test_epi64_mask(_mm512_srlv_epi64(_mm512_set1_epi64(PERLIN_GRAD_NEGATE_B), h), one);
+
+    __m512d a = negate(_mm512_mask_blend_pd(a_is_y, x, y), negate_a);
+    __m512d b = negate(_mm512_mask_blend_pd(b_is_z, y, z), negate_b);
+    return _mm512_add_pd(a, b);
+}
+
+inline __m256i lookup(const int *p, __m256i index) {
+    return _mm256_i32gather_epi32(p, index, 4);
+}
+
+inline __m512d perlin(const int *p, __m512d xx, __m512d yy, __m512d zz) {
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i wrap = _mm256_set1_epi32(0xFF);
+    const __m512d one_d = _mm512_set1_pd(1.0);
+
+    __m512d x = reduceToRange256(xx);
+    __m512d y = reduceToRange256(yy);
+    __m512d z = reduceToRange256(zz);
+
+    __m512d x_floor = floor(x);
+    __m512d y_floor = floor(y);
+    __m512d z_floor = floor(z);
+
+    __m256i xa = _mm512_cvttpd_epi32(x_floor);
+    __m256i xb = _mm256_and_si256(_mm256_add_epi32(xa, one), wrap);
+    __m256i ya = _mm512_cvttpd_epi32(y_floor);
+    __m256i yb = _mm256_and_si256(_mm256_add_epi32(ya, one), wrap);
+    __m256i za = _mm512_cvttpd_epi32(z_floor);
+    __m256i zb = _mm256_and_si256(_mm256_add_epi32(za, one), wrap);
+
+    __m512d xf = _mm512_sub_pd(x, x_floor);
+    __m512d yf = _mm512_sub_pd(y, y_floor);
+    __m512d zf = _mm512_sub_pd(z, z_floor);
+    __m512d xf1 = _mm512_sub_pd(xf, one_d);
+    __m512d yf1 = _mm512_sub_pd(yf, one_d);
+    __m512d zf1 = _mm512_sub_pd(zf, one_d);
+
+    __m512d u = fade(xf);
+    __m512d v = fade(yf);
+    __m512d w = fade(zf);
+
+    __m256i pa = lookup(p, xa);
+    __m256i pb = lookup(p, xb);
+    __m256i paa = lookup(p, _mm256_add_epi32(pa, ya));
+    __m256i pab = lookup(p, _mm256_add_epi32(pa, yb));
+    __m256i pba = lookup(p, _mm256_add_epi32(pb, ya));
+    __m256i pbb = lookup(p, _mm256_add_epi32(pb, yb));
+
+    __m256i aaa = lookup(p, _mm256_add_epi32(paa, za));
+    __m256i aab = lookup(p, _mm256_add_epi32(paa, zb));
+    __m256i aba = lookup(p, _mm256_add_epi32(pab, za));
+    __m256i abb = lookup(p, _mm256_add_epi32(pab, zb));
+    __m256i baa = lookup(p, _mm256_add_epi32(pba, za));
+    __m256i bab = lookup(p, _mm256_add_epi32(pba, zb));
+    __m256i bba = lookup(p, _mm256_add_epi32(pbb, za));
+    __m256i bbb = lookup(p, _mm256_add_epi32(pbb, zb));
+
+    __m512d x1, x2, y1, y2;
+    x1 = lerp(u, grad(aaa, xf, yf, zf), grad(baa, xf1, yf, zf));
+    x2 = lerp(u, grad(aba, xf, yf1, zf), grad(bba, xf1, yf1, zf));
+    y1 = lerp(v, x1, x2);
+
+    x1 = lerp(u, grad(aab, xf, yf, zf1), grad(bab, xf1, yf, zf1));
+    x2 = lerp(u, grad(abb, xf, yf1, zf1), grad(bbb, xf1, yf1, zf1));
+    y2 = lerp(v, x1, x2);
+
+    return lerp(w, y1, y2);
+}
+
+}
+
+void perlinKernelAvx512(const int *perm, double x_scale, double y_scale, double z_scale,
+                        std::size_t count, const double *xs, const double *ys, const double *zs, double *out)
+{
+    const __m512d sx = _mm512_set1_pd(x_scale);
+    const __m512d sy = _mm512_set1_pd(y_scale);
+    const __m512d sz = _mm512_set1_pd(z_scale);
+
+    std::size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        __m512d x = _mm512_mul_pd(_mm512_loadu_pd(xs + i), sx);
+        __m512d y = _mm512_mul_pd(_mm512_loadu_pd(ys + i), sy);
+        __m512d z = _mm512_mul_pd(_mm512_loadu_pd(zs + i), sz);
+        _mm512_storeu_pd(out + i, perlin(perm, x, y, z));
+    }
+
+    if (i < count) {
+        __mmask8 tail = static_cast<__mmask8>((1u << (count - i)) - 1);
+        __m512d x = _mm512_mul_pd(_mm512_maskz_loadu_pd(tail, xs + i), sx);
+        __m512d y = _mm512_mul_pd(_mm512_maskz_loadu_pd(tail, ys + i), sy);
+        __m512d z = _mm512_mul_pd(_mm512_maskz_loadu_pd(tail, zs + i), sz);
+        _mm512_mask_storeu_pd(out + i, tail, perlin(perm, x, y, z));
+    }
+}
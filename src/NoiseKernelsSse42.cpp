@@ -0,0 +1,146 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <cstddef>
+
+#include <nmmintrin.h>
+
+#include "NoiseKernels.h"
+
+namespace {
+
+const std::size_t LANES = 2;
+
+inline __m128d reduceToRange256(__m128d x) {
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d modulus = _mm_set1_pd(256.0);
+    const __m128d inv_modulus = _mm_set1_pd(1.0 / 256.0);
+    const __m128d minus_one = _mm_set1_pd(-1.0);
+
+    // Values already in range (including -0.0) are left alone, like
+    // reduceToRange does. Otherwise take off the whole number of
+    // moduli at once; every step of the scalar loop is exact, so the
+    // result is the same.
+    __m128d negative = _mm_cmplt_pd(x, zero);
+    __m128d in_range = _mm_andnot_pd(negative, _mm_cmplt_pd(x, modulus));
+    __m128d k = _mm_floor_pd(_mm_mul_pd(x, inv_modulus));
+
+    // Tiny negative values can underflow to -0.0 when scaled down.
+    k = _mm_blendv_pd(k, _mm_min_pd(k, minus_one), negative);
+
+    __m128d reduced = _mm_sub_pd(x, _mm_mul_pd(k, modulus));
+    return _mm_blendv_pd(reduced, x, in_range);
+}
+
+inline __m128d fade(__m128d t) {
+    // 6t^5 - 15t^4 + 10t^3
+    const __m128d six = _mm_set1_pd(6.0);
+    const __m128d fifteen = _mm_set1_pd(15.0);
+    const __m128d ten = _mm_set1_pd(10.0);
+    __m128d t3 = _mm_mul_pd(_mm_mul_pd(t, t), t);
+    __m128d poly = _mm_add_pd(_mm_mul_pd(t, _mm_sub_pd(_mm_mul_pd(t, six), fifteen)), ten);
+    return _mm_mul_pd(t3, poly);
+}
+
+inline __m128d lerp(__m128d t, __m128d a, __m128d b) {
+    return _mm_add_pd(_mm_mul_pd(t, _mm_sub_pd(b, a)), a);
+}
+
+inline long long gradBit(unsigned int bits, int hash) {
+    return -static_cast<long long>((bits >> (hash & 0xF)) & 1);
+}
+
+inline __m128d gradMask(unsigned int bits, const int *hash) {
+    return _mm_castsi128_pd(_mm_set_epi64x(gradBit(bits, hash[1]), gradBit(bits, hash[0])));
+}
+
+// There are no gathers before AVX2, so the hashes are looked up one
+// lane at a time.
+inline __m128d grad(const int *hash, __m128d x, __m128d y, __m128d z) {
+    const __m128d sign_bit = _mm_set1_pd(-0.0);
+
+    __m128d a = _mm_blendv_pd(x, y, gradMask(PERLIN_GRAD_A_IS_Y, hash));
+    __m128d b = _mm_blendv_pd(y, z, gradMask(PERLIN_GRAD_B_IS_Z, hash));
+    a = _mm_xor_pd(a, _mm_and_pd(gradMask(PERLIN_GRAD_NEGATE_A, hash), sign_bit));
+    b = _mm_xor_pd(b, _mm_and_pd(gradMask(PERLIN_GRAD_NEGATE_B, hash), sign_bit));
+    return _mm_add_pd(a, b);
+}
+
+inline __m128d perlin(const int *p, __m128d xx, __m128d yy, __m128d zz) {
+    const __m128d one_d = _mm_set1_pd(1.0);
+
+    __m128d x = reduceToRange256(xx);
+    __m128d y = reduceToRange256(yy);
+    __m128d z = reduceToRange256(zz);
+
+    __m128d x_floor = _mm_floor_pd(x);
+    __m128d y_floor = _mm_floor_pd(y);
+    __m128d z_floor = _mm_floor_pd(z);
+
+    int xi[4], yi[4], zi[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(xi), _mm_cvttpd_epi32(x_floor));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(yi), _mm_cvttpd_epi32(y_floor));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(zi), _mm_cvttpd_epi32(z_floor));
+
+    int aaa[LANES], aab[LANES], aba[LANES], abb[LANES];
+    int baa[LANES], bab[LANES], bba[LANES], bbb[LANES];
+    for (std::size_t i = 0; i < LANES; ++i) {
+        int xa = xi[i], ya = yi[i], za = zi[i];
+        int xb = (xa + 1) & 0xFF, yb = (ya + 1) & 0xFF, zb = (za + 1) & 0xFF;
+
+        aaa[i] = p[p[p[xa] + ya] + za];
+        aab[i] = p[p[p[xa] + ya] + zb];
+        aba[i] = p[p[p[xa] + yb] + za];
+        abb[i] = p[p[p[xa] + yb] + zb];
+        baa[i] = p[p[p[xb] + ya] + za];
+        bab[i] = p[p[p[xb] + ya] + zb];
+        bba[i] = p[p[p[xb] + yb] + za];
+        bbb[i] = p[p[p[xb] + yb] + zb];
+    }
+
+    __m128d xf = _mm_sub_pd(x, x_floor);
+    __m128d yf = _mm_sub_pd(y, y_floor);
+    __m128d zf = _mm_sub_pd(z, z_floor);
+    __m128d xf1 = _mm_sub_pd(xf, one_d);
+    __m128d yf1 = _mm_sub_pd(yf, one_d);
+    __m128d zf1 = _mm_sub_pd(zf, one_d);
+
+    __m128d u = fade(xf);
+    __m128d v = fade(yf);
+    __m128d w = fade(zf);
+
+    __m128d x1, x2, y1, y2;
+    x1 = lerp(u, grad(aaa, xf, yf, zf), grad(baa, xf1, yf, zf));
+    x2 = lerp(u, grad(aba, xf, yf1, zf), grad(bba, xf1, yf1, zf));
+    y1 = lerp(v, x1, x2);
+
+    x1 = lerp(u, grad(aab, xf, yf, zf1), grad(bab, xf1, yf, zf1));
+    x2 = lerp(u, grad(abb, xf, yf1, zf1), grad(bbb, xf1, yf1, zf1));
+    y2 = lerp(v, x1, x2);
+
+    return lerp(w, y1, y2);
+}
+
+}
+
+void perlinKernelSse42(const int *perm, double x_scale, double y_scale, double z_scale,
+                       std::size_t count, const double *xs, const double *ys, const double *zs, double *out)
+{
+    const __m128d sx = _mm_set1_pd(x_scale);
+    const __m128d sy = _mm_set1_pd(y_scale);
+    const __m128d sz = _mm_set1_pd(z_scale);
+
+    std::size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        __m128d x = _mm_mul_pd(_mm_loadu_pd(xs + i), sx);
+        __m128d y = _mm_mul_pd(_mm_loadu_pd(ys + i), sy);
+        __m128d z = _mm_mul_pd(_mm_loadu_pd(zs + i), sz);
+        _mm_storeu_pd(out + i, perlin(perm, x, y, z));
+    }
+
+    if (i < count) {
+        __m128d x = _mm_mul_pd(_mm_load_sd(xs + i), sx);
+        __m128d y = _mm_mul_pd(_mm_load_sd(ys + i), sy);
+        __m128d z = _mm_mul_pd(_mm_load_sd(zs + i), sz);
+        _mm_store_sd(out + i, perlin(perm, x, y, z));
+    }
+}
@@ -1,61 +1,98 @@
 // -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
 
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <memory>
 #include <random>
 #include <vector>
 
 #include "glm_defines.h"
+#include <glm/geometric.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/mat4x4.hpp>
 
 #include "opengl.h"
 
+#include "Culling.h"
 #include "Models.h"
 #include "OpenGLUtils.h"
 #include "Ocean.h"
+#include "PackedVertex.h"
+#include "ProgressiveMesh.h"
+#include "RenderQueue.h"
 #include "Resource.h"
 #include "SharedBlocks.h"
 
-Ocean::Ocean()
-    : m_vertices{},
-      m_indices{},
+const float OCEAN_RADIUS = 1.97f;
+
+namespace {
+
+// Roughens each refinement of the ocean a little.
+class OceanSource : public MeshSource {
+public:
+    OceanSource();
+    virtual ~OceanSource();
+
+    virtual HeightRange prepare(PositionsAndElements &sphere);
+    virtual void build(const PositionsAndElements &sphere, std::size_t first, std::size_t count, TerrainVertex *out);
+
+private:
+    std::default_random_engine m_eng;
+    std::vector<glm::vec3> m_normals;
+};
+
+OceanSource::OceanSource()
+    : m_eng{std::random_device{}()},
+      m_normals{}
+{}
+
+OceanSource::~OceanSource() {}
+
+HeightRange OceanSource::prepare(PositionsAndElements &sphere) {
+    std::uniform_real_distribution<float> dist{0.995f, 1.005f};
+    for (unsigned int i = 0; i < sphere.positions.size(); ++i) {
+        float factor = dist(m_eng);
+        sphere.positions[i] *= factor;
+    }
+
+    m_normals = computeNormals(sphere);
+
+    HeightRange rv{glm::length(sphere.positions[0]), glm::length(sphere.positions[0])};
+    for (const glm::vec3 &pos : sphere.positions) {
+        rv.min = std::min(rv.min, glm::length(pos));
+        rv.max = std::max(rv.max, glm::length(pos));
+    }
+    return rv;
+}
+
+void OceanSource::build(const PositionsAndElements &sphere, std::size_t first, std::size_t count, TerrainVertex *out) {
+    for (std::size_t i = 0; i < count; ++i) {
+        out[i].position = sphere.positions[first + i];
+        out[i].normal = m_normals[first + i];
+    }
+}
+
+}
+
+Ocean::Ocean(const std::vector<int> &refinements, const ShaderFeatures &lighting)
+    : m_mesh{"Ocean"},
+      m_color{0.2f, 0.3f, 0.6f, 1.0f},
       m_specular_pow{0.0},
-      m_array_buffer{0},
-      m_elem_buffer{0},
       m_vertex_shader{0},
       m_fragment_shader{0},
       m_program{0},
-      m_position_loc{-1},
-      m_color_loc{-1},
-      m_normal_loc{-1},
       m_model_loc{-1},
-      m_specular_pow_loc{-1},
-      m_array_object{0}
+      m_height_range_loc{-1},
+      m_color_loc{-1},
+      m_specular_pow_loc{-1}
 {
-    initGeometry();
     m_specular_pow = 40.0;
-    initBuffers();
-    initProgram();
-    initVAO();
+    initProgram(lighting);
+    m_mesh.generate(OCEAN_RADIUS, refinements, std::shared_ptr<MeshSource>{new OceanSource{}});
 }
 
 Ocean::~Ocean() {
-    std::vector<GLuint> bufs_to_delete;
-
-    if (glIsBuffer(m_array_buffer)) {
-        bufs_to_delete.push_back(m_array_buffer);
-    }
-
-    if (glIsBuffer(m_elem_buffer)) {
-        bufs_to_delete.push_back(m_elem_buffer);
-    }
-
-    if (bufs_to_delete.size() > 0) {
-        glDeleteBuffers(static_cast<GLsizei>(bufs_to_delete.size()), bufs_to_delete.data());
-    }
-
-    m_array_buffer = 0;
-    m_elem_buffer = 0;
-
     if (glIsProgram(m_program)) {
         if (glIsShader(m_vertex_shader)) {
             glDetachShader(m_program, m_vertex_shader);
@@ -63,105 +100,69 @@ Ocean::~Ocean() {
         }
         m_vertex_shader = 0;
 
+        // The ShaderCache owns the fragment shader.
         if (glIsShader(m_fragment_shader)) {
             glDetachShader(m_program, m_fragment_shader);
-            glDeleteShader(m_fragment_shader);
         }
         m_fragment_shader = 0;
 
+        GLState::current().forgetProgram(m_program);
         glDeleteProgram(m_program);
     }
 
     m_program = 0;
-
-    if (glIsVertexArray(m_array_object)) {
-        glDeleteVertexArrays(1, &m_array_object);
-    }
-
-    m_array_object = 0;
 }
 
-void Ocean::render(const glm::mat4x4 &model) const {
-    glUseProgram(m_program);
-
-    glEnable(GL_DEPTH_TEST);
-    glUniformMatrix4fv(m_model_loc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniform1f(m_specular_pow_loc, m_specular_pow);
-    glBindVertexArray(m_array_object);
-
-    // static int i = 0;
-    // if (i % 500 == 0) {
-    //     dumpOpenGLState();
-    // }
-    // ++i;
-
-    glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(m_indices.size()), GL_UNSIGNED_INT, 0);
-
-    glBindVertexArray(0);
-    glUseProgram(0);
+void Ocean::update(StagingBuffer &staging) {
+    m_mesh.update(staging);
 }
 
-void Ocean::initGeometry() {
-    std::random_device seed;
-    std::default_random_engine eng{seed()};
-    std::uniform_real_distribution<float> dist{0.995f, 1.005f};
-    PositionsAndElements sphere = icosphere(1.97f, 5);
-    m_vertices.resize(sphere.positions.size());
-    m_indices = sphere.elements;
-
-    for (unsigned int i = 0; i < sphere.positions.size(); ++i) {
-        float factor = dist(eng);
-        sphere.positions[i] *= factor;
-    }
+void Ocean::cull(const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model) {
+    m_mesh.cull(vp_block, model);
+}
 
-    std::vector<glm::vec3> normals = computeNormals(sphere);
+const CullStats& Ocean::cullStats() const {
+    return m_mesh.cullStats();
+}
 
-    for (unsigned int i = 0; i < sphere.positions.size(); ++i) {
-        glm::vec3 &pos = sphere.positions[i];
-        glm::vec3 &norm = normals[i];
-        m_vertices[i] = {
-            { pos.x, pos.y, pos.z },
-            { 0.2f, 0.3f, 0.6f, 1.0f },
-            { norm.x, norm.y, norm.z }
-        };
-    }
+const ProgressiveMesh& Ocean::mesh() const {
+    return m_mesh;
 }
 
-void Ocean::initBuffers() {
-    GLuint bufs[2];
-    glGenBuffers(2, bufs);
-    m_array_buffer = bufs[0];
-    m_elem_buffer = bufs[1];
-
-    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        m_vertices.size()*sizeof(PCNVertex),
-        m_vertices.data(),
-        GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
-    glBufferData(
-        GL_ELEMENT_ARRAY_BUFFER,
-        m_indices.size()*sizeof(GLuint),
-        m_indices.data(),
-        GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+void Ocean::submit(RenderQueue &queue, const glm::mat4x4 &model) {
+    HeightRange height_range = m_mesh.heightRange();
+    queue.submit(DrawPacket{
+        SCENE_LAYER, m_program, m_mesh.arrayObject(), true,
+        glm::vec3{model[3]}, height_range.max,
+        [this, model, height_range]() {
+            glUniformMatrix4fv(m_model_loc, 1, GL_FALSE, glm::value_ptr(model));
+            glUniform2f(m_height_range_loc, height_range.min, height_range.max);
+            glUniform4fv(m_color_loc, 1, glm::value_ptr(m_color));
+            glUniform1f(m_specular_pow_loc, m_specular_pow);
+
+            // static int i = 0;
+            // if (i % 500 == 0) {
+            //     dumpOpenGLState();
+            // }
+            // ++i;
+
+            m_mesh.draw();
+        }});
 }
 
-void Ocean::initProgram() {
+void Ocean::initProgram(const ShaderFeatures &lighting) {
     const std::vector<char> &vert_code = LOAD_RESOURCE(ocean_vert);
     const std::vector<char> &frag_code = LOAD_RESOURCE(ocean_frag);
+    const std::vector<char> &lighting_code = LOAD_RESOURCE(lighting_glsl);
 
     m_vertex_shader = createAndCompileShader(GL_VERTEX_SHADER, vert_code.data());
-    m_fragment_shader = createAndCompileShader(GL_FRAGMENT_SHADER, frag_code.data());
+    m_fragment_shader = ShaderCache::current().shader(GL_FRAGMENT_SHADER, {frag_code.data(), lighting_code.data()}, lighting);
     m_program = createProgramFromShaders(m_vertex_shader, m_fragment_shader);
-    LightListBlock::setOffsets(m_program, "LightListBlock");
-    m_position_loc = 0;
-    m_color_loc = 1;
-    m_normal_loc = 2;
+    ViewAndProjectionBlock::checkLayout(m_program, "ViewAndProjectionBlock");
+    LightListBlock::checkLayout(m_program, "LightListBlock");
     m_model_loc = glGetUniformLocation(m_program, "model");
+    m_height_range_loc = glGetUniformLocation(m_program, "height_range");
+    m_color_loc = glGetUniformLocation(m_program, "color");
     m_specular_pow_loc = glGetUniformLocation(m_program, "specular_pow");
 
     GLuint vp_block_idx = glGetUniformBlockIndex(m_program, "ViewAndProjectionBlock");
@@ -170,40 +171,3 @@ void Ocean::initProgram() {
     GLuint light_block_idx = glGetUniformBlockIndex(m_program, "LightListBlock");
     glUniformBlockBinding(m_program, light_block_idx, LightListBlock::BINDING_INDEX);
 }
-
-void Ocean::initVAO() {
-    glGenVertexArrays(1, &m_array_object);
-    glUseProgram(m_program);
-    glBindVertexArray(m_array_object);
-    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
-
-    glEnableVertexAttribArray(m_position_loc);
-    glVertexAttribPointer(
-        m_position_loc,
-        3, GL_FLOAT, GL_FALSE,
-        sizeof(PCNVertex),
-        (const void *)(offsetof(PCNVertex, position))
-    );
-
-    glEnableVertexAttribArray(m_color_loc);
-    glVertexAttribPointer(
-        m_color_loc,
-        4, GL_FLOAT, GL_FALSE,
-        sizeof(PCNVertex),
-        (const void *)(offsetof(PCNVertex, color))
-    );
-
-    glEnableVertexAttribArray(m_normal_loc);
-    glVertexAttribPointer(
-        m_normal_loc,
-        3, GL_FLOAT, GL_FALSE,
-        sizeof(PCNVertex),
-        (const void *)(offsetof(PCNVertex, normal))
-    );
-
-    glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glUseProgram(0);
-}
@@ -7,14 +7,24 @@
 
 #include "glm_defines.h"
 #include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
 
 #include "opengl.h"
 
-#include "Models.h"
+class RenderQueue;
+class ShaderFeatures;
+class StagingBuffer;
+class ViewAndProjectionBlock;
+
+#include "Culling.h"
+#include "ProgressiveMesh.h"
 
 class Ocean {
 public:
-    Ocean();
+    // Built on a background thread at each of refinements in turn,
+    // and streamed in by update(). lighting is what the fragment
+    // shader is specialised on.
+    Ocean(const std::vector<int> &refinements, const ShaderFeatures &lighting);
     Ocean(const Ocean &other) = delete;
     Ocean(Ocean &&other) = delete;
     ~Ocean();
@@ -22,25 +32,24 @@ public:
     Ocean& operator=(const Ocean &other) = delete;
     Ocean& operator=(Ocean &&other) = delete;
 
-    void render(const glm::mat4x4 &model) const;
+    // As Terrain's.
+    void update(StagingBuffer &staging);
+    void cull(const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model);
+    void submit(RenderQueue &queue, const glm::mat4x4 &model);
+
+    const CullStats& cullStats() const;
+    const ProgressiveMesh& mesh() const;
 
 private:
-    void initGeometry();
-    void initBuffers();
-    void initProgram();
-    void initVAO();
+    void initProgram(const ShaderFeatures &lighting);
+
+    ProgressiveMesh m_mesh;
+    glm::vec4 m_color;
 
-    std::vector<PCNVertex> m_vertices;
-    std::vector<GLuint> m_indices;
     GLfloat m_specular_pow;
 
-    GLuint m_array_buffer, m_elem_buffer;
-    
     GLuint m_vertex_shader, m_fragment_shader, m_program;
-    GLint m_position_loc, m_color_loc, m_normal_loc;
-    GLint m_model_loc, m_specular_pow_loc;
-
-    GLuint m_array_object;
+    GLint m_model_loc, m_height_range_loc, m_color_loc, m_specular_pow_loc;
 };
 
 #endif
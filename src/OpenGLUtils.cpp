@@ -1,10 +1,14 @@
 // -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*-
 
+#include <algorithm>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include "OpenGLUtils.h"
@@ -22,14 +26,22 @@ struct VAPState {
 };
 
 GLuint createAndCompileShader(GLenum shader_type, const char* shader_src) {
+    return createAndCompileShader(shader_type, std::vector<const char*>{shader_src});
+}
+
+GLuint createAndCompileShader(GLenum shader_type, const std::vector<const char*> &shader_srcs) {
     GLuint shader = glCreateShader(shader_type);
     if (shader == 0) {
         throw std::runtime_error("Error creating shader");
     }
 
-    GLint errlen, status, src_length = (GLint)std::strlen(shader_src);
+    GLint errlen, status;
+    std::vector<GLint> src_lengths;
+    for (const char *src : shader_srcs) {
+        src_lengths.push_back((GLint)std::strlen(src));
+    }
 
-    glShaderSource(shader, 1, &shader_src, &src_length);
+    glShaderSource(shader, (GLsizei)shader_srcs.size(), shader_srcs.data(), src_lengths.data());
     glCompileShader(shader);
     glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
     if (status != GL_TRUE) {
@@ -40,7 +52,10 @@ GLuint createAndCompileShader(GLenum shader_type, const char* shader_src) {
         std::ostringstream msg_stream;
         msg_stream << "Could not compile shader!\n"
                    << "  error: " << err << "\n"
-                   << "  source:\n" << shader_src << "\n";
+                   << "  source:\n";
+        for (const char *src : shader_srcs) {
+            msg_stream << src << "\n";
+        }
         delete[] err;
 
         std::string msg{msg_stream.str()};
@@ -50,14 +65,36 @@ GLuint createAndCompileShader(GLenum shader_type, const char* shader_src) {
     return shader;
 }
 
-GLuint createProgramFromShaders(GLuint vertex_shader, GLuint fragment_shader) {
+GLuint createAndCompileShader(GLenum shader_type, const std::vector<const char*> &shader_srcs, const ShaderFeatures &features) {
+    if (features.empty() || shader_srcs.empty()) {
+        return createAndCompileShader(shader_type, shader_srcs);
+    }
+
+    // The defines go in after the line with the #version, and a #line
+    // puts the line numbers in errors back as they were.
+    std::string first{shader_srcs[0]};
+    std::size_t split = first.find("#version");
+    split = split == std::string::npos ? 0 : first.find('\n', split);
+    split = split == std::string::npos ? first.size() : split + 1;
+    std::string head = first.substr(0, split);
+    std::string tail = first.substr(split);
+    std::string defines = features.defines()
+        + "#line " + std::to_string(std::count(head.begin(), head.end(), '\n') + 1) + "\n";
+
+    std::vector<const char*> srcs{head.c_str(), defines.c_str(), tail.c_str()};
+    srcs.insert(srcs.end(), shader_srcs.begin() + 1, shader_srcs.end());
+    return createAndCompileShader(shader_type, srcs);
+}
+
+GLuint linkProgram(const std::vector<GLuint> &shaders) {
     GLuint program = glCreateProgram();
     if (program == 0) {
         throw std::runtime_error("Error creating program");
     }
-    
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
+
+    for (GLuint shader : shaders) {
+        glAttachShader(program, shader);
+    }
     glLinkProgram(program);
 
     GLint status;
@@ -79,6 +116,268 @@ GLuint createProgramFromShaders(GLuint vertex_shader, GLuint fragment_shader) {
     return program;
 }
 
+GLuint createProgramFromShaders(GLuint vertex_shader, GLuint fragment_shader) {
+    return linkProgram({vertex_shader, fragment_shader});
+}
+
+GLuint createTessellationProgram(GLuint vertex_shader, GLuint control_shader, GLuint evaluation_shader, GLuint fragment_shader) {
+    return linkProgram({vertex_shader, control_shader, evaluation_shader, fragment_shader});
+}
+
+GLuint createComputeProgram(GLuint compute_shader) {
+    return linkProgram({compute_shader});
+}
+
+bool isProgramLinked(GLuint program) {
+    GLint status = GL_FALSE;
+    if (glIsProgram(program)) {
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+    }
+    return status == GL_TRUE;
+}
+
+ShaderFeatures::ShaderFeatures()
+    : m_values{}
+{}
+
+ShaderFeatures::~ShaderFeatures() {}
+
+ShaderFeatures& ShaderFeatures::set(const std::string &name, int value) {
+    m_values[name] = value;
+    return *this;
+}
+
+bool ShaderFeatures::empty() const {
+    return m_values.empty();
+}
+
+std::string ShaderFeatures::defines() const {
+    std::ostringstream defines;
+    for (const auto &value : m_values) {
+        defines << "#define " << value.first << " " << value.second << "\n";
+    }
+    return defines.str();
+}
+
+ShaderCache& ShaderCache::current() {
+    static ShaderCache cache{};
+    return cache;
+}
+
+ShaderCache::ShaderCache()
+    : m_shaders{},
+      m_reused{0}
+{}
+
+ShaderCache::~ShaderCache() {}
+
+GLuint ShaderCache::shader(GLenum shader_type, const std::vector<const char*> &shader_srcs, const ShaderFeatures &features) {
+    Key key{shader_type, shader_srcs, features.defines()};
+    auto found = m_shaders.find(key);
+    if (found != m_shaders.end()) {
+        ++m_reused;
+        return found->second;
+    }
+
+    GLuint shader = createAndCompileShader(shader_type, shader_srcs, features);
+    m_shaders.emplace(std::move(key), shader);
+    return shader;
+}
+
+std::size_t ShaderCache::compiledCount() const {
+    return m_shaders.size();
+}
+
+std::size_t ShaderCache::reusedCount() const {
+    return m_reused;
+}
+
+void ShaderCache::clear() {
+    for (const auto &entry : m_shaders) {
+        if (glIsShader(entry.second)) {
+            glDeleteShader(entry.second);
+        }
+    }
+    m_shaders.clear();
+}
+
+GLState& GLState::current() {
+    static GLState state{};
+    return state;
+}
+
+GLState::GLState()
+    : m_program{0},
+      m_array_object{0},
+      m_uniform_buffers{},
+      m_storage_buffers{},
+      m_buffers{},
+      m_active_texture{0},
+      m_textures{},
+      m_enabled{},
+      m_counts{0, 0}
+{}
+
+GLState::~GLState() {}
+
+void GLState::useProgram(GLuint program) {
+    if (isRedundant(m_program == program)) {
+        return;
+    }
+
+    glUseProgram(program);
+    m_program = program;
+}
+
+void GLState::bindVertexArray(GLuint array_object) {
+    if (isRedundant(m_array_object == array_object)) {
+        return;
+    }
+
+    glBindVertexArray(array_object);
+    m_array_object = array_object;
+}
+
+void GLState::bindUniformBuffer(GLuint index, GLuint buffer) {
+    bindUniformBufferRange(index, buffer, 0, 0);
+}
+
+void GLState::bindUniformBufferRange(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+    if (index >= m_uniform_buffers.size()) {
+        m_uniform_buffers.resize(index + 1, BufferRange{0, 0, 0});
+    }
+
+    BufferRange &bound = m_uniform_buffers[index];
+    if (isRedundant(bound.buffer == buffer && bound.offset == offset && bound.size == size)) {
+        return;
+    }
+
+    if (size == 0) {
+        glBindBufferBase(GL_UNIFORM_BUFFER, index, buffer);
+    } else {
+        glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+    }
+    bound = BufferRange{buffer, offset, size};
+}
+
+void GLState::bindStorageBuffer(GLuint index, GLuint buffer) {
+    if (index >= m_storage_buffers.size()) {
+        m_storage_buffers.resize(index + 1, 0);
+    }
+
+    GLuint &bound = m_storage_buffers[index];
+    if (isRedundant(bound == buffer)) {
+        return;
+    }
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, buffer);
+    bound = buffer;
+}
+
+void GLState::bindBuffer(GLenum target, GLuint buffer) {
+    auto found = m_buffers.find(target);
+    if (isRedundant(found != m_buffers.end() && found->second == buffer)) {
+        return;
+    }
+
+    glBindBuffer(target, buffer);
+    m_buffers[target] = buffer;
+}
+
+void GLState::bindTexture(GLuint unit, GLenum target, GLuint texture) {
+    auto found = m_textures.find(std::make_pair(unit, target));
+    if (isRedundant(found != m_textures.end() && found->second == texture)) {
+        return;
+    }
+
+    if (!isRedundant(m_active_texture == unit)) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        m_active_texture = unit;
+    }
+    glBindTexture(target, texture);
+    m_textures[std::make_pair(unit, target)] = texture;
+}
+
+void GLState::enable(GLenum capability) {
+    setEnabled(capability, true);
+}
+
+void GLState::disable(GLenum capability) {
+    setEnabled(capability, false);
+}
+
+void GLState::forgetProgram(GLuint program) {
+    // A deleted program stays in use until another one is, so switch
+    // away from it while it's still known to be current.
+    if (m_program == program) {
+        useProgram(0);
+    }
+}
+
+void GLState::forgetVertexArray(GLuint array_object) {
+    // Deleting the bound vertex array binds 0 in its place.
+    if (m_array_object == array_object) {
+        m_array_object = 0;
+    }
+}
+
+void GLState::forgetBuffer(GLuint buffer) {
+    // Deleting a buffer unbinds it everywhere in the context.
+    for (BufferRange &bound : m_uniform_buffers) {
+        if (bound.buffer == buffer) {
+            bound = BufferRange{0, 0, 0};
+        }
+    }
+    for (GLuint &bound : m_storage_buffers) {
+        if (bound == buffer) {
+            bound = 0;
+        }
+    }
+    for (auto &bound : m_buffers) {
+        if (bound.second == buffer) {
+            bound.second = 0;
+        }
+    }
+}
+
+void GLState::forgetTexture(GLuint texture) {
+    // The same goes for a texture, on every unit.
+    for (auto &bound : m_textures) {
+        if (bound.second == texture) {
+            bound.second = 0;
+        }
+    }
+}
+
+GLCallCounts GLState::takeCallCounts() {
+    GLCallCounts counts = m_counts;
+    m_counts = GLCallCounts{0, 0};
+    return counts;
+}
+
+bool GLState::isRedundant(bool redundant) {
+    if (redundant) {
+        ++m_counts.skipped;
+    } else {
+        ++m_counts.issued;
+    }
+    return redundant;
+}
+
+void GLState::setEnabled(GLenum capability, bool enabled) {
+    auto found = m_enabled.find(capability);
+    if (isRedundant(found != m_enabled.end() && found->second == enabled)) {
+        return;
+    }
+
+    if (enabled) {
+        glEnable(capability);
+    } else {
+        glDisable(capability);
+    }
+    m_enabled[capability] = enabled;
+}
+
 void getAttachedShaders(GLuint program, std::vector<GLuint> &shaders) {
     int num_shaders;
     GLuint *shader_return;
@@ -3,16 +3,160 @@
 #ifndef _PLANET_OPENGL_UTILS_H_
 #define _PLANET_OPENGL_UTILS_H_
 
+#include <cstddef>
 #include <map>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include "opengl.h"
 
 typedef std::map<std::string, GLuint> IndexMap;
 
+// The GL calls GLState made and skipped.
+struct GLCallCounts {
+    std::size_t issued;
+    std::size_t skipped;
+};
+
+// The GL state that's set over and over to draw, as last set through
+// here, so that calls that wouldn't change it can be skipped. Nothing
+// is unbound after drawing; whatever draws next binds what it needs.
+// Programs, vertex arrays, textures and buffers bound here have to be
+// forgotten before they're deleted, since their names can be reused,
+// and textures have to be bound only through here, even to upload to,
+// since binding one changes whichever unit happens to be active.
+// Anything bound to GL_ELEMENT_ARRAY_BUFFER outside setting up a
+// vertex array needs bindVertexArray(0) first, or it would change
+// whichever one was drawn last.
+class GLState {
+public:
+    // The state of the one context.
+    static GLState& current();
+
+    GLState(const GLState &other) = delete;
+    GLState(GLState &&other) = delete;
+    ~GLState();
+
+    GLState& operator=(const GLState &other) = delete;
+    GLState& operator=(GLState &&other) = delete;
+
+    void useProgram(GLuint program);
+    void bindVertexArray(GLuint array_object);
+    void bindUniformBuffer(GLuint index, GLuint buffer);
+    void bindUniformBufferRange(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+    void bindStorageBuffer(GLuint index, GLuint buffer);
+    // Only for targets that aren't indexed, such as
+    // GL_DRAW_INDIRECT_BUFFER.
+    void bindBuffer(GLenum target, GLuint buffer);
+    void bindTexture(GLuint unit, GLenum target, GLuint texture);
+    void enable(GLenum capability);
+    void disable(GLenum capability);
+
+    void forgetProgram(GLuint program);
+    void forgetVertexArray(GLuint array_object);
+    void forgetBuffer(GLuint buffer);
+    void forgetTexture(GLuint texture);
+
+    // The calls made and skipped since the last time.
+    GLCallCounts takeCallCounts();
+
+private:
+    // A size of 0 means the whole buffer.
+    struct BufferRange {
+        GLuint buffer;
+        GLintptr offset;
+        GLsizeiptr size;
+    };
+
+    GLState();
+
+    bool isRedundant(bool redundant);
+    void setEnabled(GLenum capability, bool enabled);
+
+    GLuint m_program;
+    GLuint m_array_object;
+    std::vector<BufferRange> m_uniform_buffers;
+    std::vector<GLuint> m_storage_buffers;
+    std::map<GLenum, GLuint> m_buffers;
+    GLuint m_active_texture;
+    // By unit and target.
+    std::map<std::pair<GLuint, GLenum>, GLuint> m_textures;
+    std::map<GLenum, bool> m_enabled;
+    GLCallCounts m_counts;
+};
+
+// Preprocessor defines to specialise a shader on, such as how many
+// lights it has, so that its loops can be unrolled and the branches
+// it won't take left out. Kept in order of name, so the same features
+// always make the same defines.
+class ShaderFeatures {
+public:
+    ShaderFeatures();
+    ~ShaderFeatures();
+
+    ShaderFeatures& set(const std::string &name, int value);
+
+    bool empty() const;
+    // One #define line for each feature.
+    std::string defines() const;
+
+private:
+    std::map<std::string, int> m_values;
+};
+
+// Compiled shaders, one for each set of sources and features, shared
+// by every program that asks for the same one.
+class ShaderCache {
+public:
+    // The cache of the one context.
+    static ShaderCache& current();
+
+    ShaderCache(const ShaderCache &other) = delete;
+    ShaderCache(ShaderCache &&other) = delete;
+    ~ShaderCache();
+
+    ShaderCache& operator=(const ShaderCache &other) = delete;
+    ShaderCache& operator=(ShaderCache &&other) = delete;
+
+    // The shader from shader_srcs with features, compiled the first
+    // time it's asked for. The sources are told apart by address, so
+    // they have to be there for as long as the cache is, as
+    // LOAD_RESOURCE's are. The cache owns the shader: programs built
+    // from it detach it rather than delete it.
+    GLuint shader(GLenum shader_type, const std::vector<const char*> &shader_srcs, const ShaderFeatures &features);
+
+    // How many shaders have been compiled, and how many times one
+    // was asked for again.
+    std::size_t compiledCount() const;
+    std::size_t reusedCount() const;
+
+    // Delete all the shaders, while the context is still current.
+    void clear();
+
+private:
+    typedef std::tuple<GLenum, std::vector<const char*>, std::string> Key;
+
+    ShaderCache();
+
+    std::map<Key, GLuint> m_shaders;
+    std::size_t m_reused;
+};
+
 GLuint createAndCompileShader(GLenum shader_type, const char* shader_src);
+// One shader from several sources, compiled as if they were joined up
+// in order. Only the first should have a #version.
+GLuint createAndCompileShader(GLenum shader_type, const std::vector<const char*> &shader_srcs);
+// The same, with the features defined just after the #version.
+GLuint createAndCompileShader(GLenum shader_type, const std::vector<const char*> &shader_srcs, const ShaderFeatures &features);
+// A program of shaders, attached in order and linked. A failed link
+// is reported on stderr, and leaves the program unlinked.
+GLuint linkProgram(const std::vector<GLuint> &shaders);
 GLuint createProgramFromShaders(GLuint vertex_shader, GLuint fragment_shader);
+GLuint createTessellationProgram(GLuint vertex_shader, GLuint control_shader, GLuint evaluation_shader, GLuint fragment_shader);
+GLuint createComputeProgram(GLuint compute_shader);
+bool isProgramLinked(GLuint program);
 void getAttachedShaders(GLuint program, std::vector<GLuint> &shaders);
 void getAttributeInfo(GLuint program, IndexMap &attributes);
 void getUniformInfo(GLuint program, IndexMap &uniforms);
@@ -0,0 +1,122 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "glm_defines.h"
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/trigonometric.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+#include "PackedVertex.h"
+
+namespace {
+
+float signNotZero(float x) {
+    return x >= 0.0f ? 1.0f : -1.0f;
+}
+
+// Of the four codes around the exact one, keep the one that decodes
+// closest to v. This matters for the 8-bit normals.
+template <typename T>
+void octQuantizeTo(const glm::vec3 &v, T out[2]) {
+    const float scale = static_cast<float>(std::numeric_limits<T>::max());
+    glm::vec2 e = octEncode(v) * scale;
+
+    float best = -2.0f;
+    for (int i = 0; i < 4; ++i) {
+        glm::vec2 code{
+            (i & 1) ? std::ceil(e.x) : std::floor(e.x),
+            (i & 2) ? std::ceil(e.y) : std::floor(e.y)
+        };
+        code = glm::clamp(code, -scale, scale);
+
+        float similarity = glm::dot(octDecode(code / scale), v);
+        if (similarity > best) {
+            best = similarity;
+            out[0] = static_cast<T>(code.x);
+            out[1] = static_cast<T>(code.y);
+        }
+    }
+}
+
+template <typename T>
+glm::vec3 octDequantize(const T in[2]) {
+    const float scale = static_cast<float>(std::numeric_limits<T>::max());
+    return octDecode(glm::vec2{static_cast<float>(in[0]), static_cast<float>(in[1])} / scale);
+}
+
+double angleDegrees(const glm::vec3 &a, const glm::vec3 &b) {
+    double cosine = glm::dot(glm::dvec3{a}, glm::dvec3{b});
+    return glm::degrees(std::acos(std::min(1.0, std::max(-1.0, cosine))));
+}
+
+}
+
+glm::vec2 octEncode(const glm::vec3 &v) {
+    glm::vec2 p = glm::vec2{v.x, v.y} / (std::abs(v.x) + std::abs(v.y) + std::abs(v.z));
+    if (v.z < 0.0f) {
+        p = glm::vec2{
+            (1.0f - std::abs(p.y)) * signNotZero(p.x),
+            (1.0f - std::abs(p.x)) * signNotZero(p.y)
+        };
+    }
+    return p;
+}
+
+void octQuantize(const glm::vec3 &v, int16_t out[2]) {
+    octQuantizeTo(v, out);
+}
+
+void octQuantize(const glm::vec3 &v, int8_t out[2]) {
+    octQuantizeTo(v, out);
+}
+
+glm::vec3 octDecode(const glm::vec2 &e) {
+    glm::vec3 v{e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y)};
+    if (v.z < 0.0f) {
+        v.x = (1.0f - std::abs(e.y)) * signNotZero(e.x);
+        v.y = (1.0f - std::abs(e.x)) * signNotZero(e.y);
+    }
+    return glm::normalize(v);
+}
+
+PackedVertex packVertex(const glm::vec3 &position, const glm::vec3 &normal, const HeightRange &range) {
+    PackedVertex rv;
+    float height = glm::length(position);
+    octQuantize(position / height, rv.direction);
+    octQuantize(glm::normalize(normal), rv.normal);
+
+    float span = range.max - range.min;
+    float t = span > 0.0f ? (height - range.min) / span : 0.0f;
+    t = std::min(1.0f, std::max(0.0f, t));
+    rv.height = static_cast<uint16_t>(std::round(t * 65535.0f));
+    return rv;
+}
+
+void unpackVertex(const PackedVertex &packed, const HeightRange &range, glm::vec3 &position, glm::vec3 &normal) {
+    float height = range.min + (range.max - range.min) * (packed.height / 65535.0f);
+    position = octDequantize(packed.direction) * height;
+    normal = octDequantize(packed.normal);
+}
+
+PackingError::PackingError()
+    : position{0.0},
+      normal_degrees{0.0}
+{}
+
+void PackingError::measure(const PackedVertex &packed, const HeightRange &range, const glm::vec3 &original_position, const glm::vec3 &original_normal) {
+    glm::vec3 unpacked_position, unpacked_normal;
+    unpackVertex(packed, range, unpacked_position, unpacked_normal);
+    position = std::max(position, static_cast<double>(glm::distance(unpacked_position, original_position)));
+    normal_degrees = std::max(normal_degrees, angleDegrees(unpacked_normal, glm::normalize(original_normal)));
+}
+
+void PackingError::merge(const PackingError &other) {
+    position = std::max(position, other.position);
+    normal_degrees = std::max(normal_degrees, other.normal_degrees);
+}
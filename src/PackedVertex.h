@@ -0,0 +1,65 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_PACKED_VERTEX_H_
+#define _PLANET_PACKED_VERTEX_H_
+
+#include <cstdint>
+
+#include "glm_defines.h"
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+// A vertex of a sphere-like mesh in 8 bytes. The direction from the
+// centre and the normal are octahedrally encoded, as snorm16s and
+// snorm8s, and the distance from the centre is a unorm16 between the
+// ends of the mesh's HeightRange. terrain.vert, ocean.vert and
+// terrain_displace.comp decode it.
+struct PackedVertex {
+    int16_t direction[2];
+    uint16_t height;
+    int8_t normal[2];
+};
+
+static_assert(sizeof(PackedVertex) == 8, "PackedVertex must be 8 bytes");
+
+// The unpacked vertex: what meshes are built from before they're
+// packed, and what the packed vertices are checked against.
+struct TerrainVertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+};
+
+// The distances from the centre that a mesh's heights are spread
+// over.
+struct HeightRange {
+    float min;
+    float max;
+};
+
+// Map a unit vector onto the square [-1, 1]^2, and back.
+glm::vec2 octEncode(const glm::vec3 &v);
+glm::vec3 octDecode(const glm::vec2 &e);
+
+// Octahedrally encode the unit vector v in two snorms.
+void octQuantize(const glm::vec3 &v, int16_t out[2]);
+void octQuantize(const glm::vec3 &v, int8_t out[2]);
+
+PackedVertex packVertex(const glm::vec3 &position, const glm::vec3 &normal, const HeightRange &range);
+void unpackVertex(const PackedVertex &packed, const HeightRange &range, glm::vec3 &position, glm::vec3 &normal);
+
+// The largest errors packing has introduced into a mesh: the distance
+// from the original positions and the angle, in degrees, from the
+// original normals.
+struct PackingError {
+    PackingError();
+
+    // Widen the errors to cover packed, which was made from
+    // original_position and original_normal.
+    void measure(const PackedVertex &packed, const HeightRange &range, const glm::vec3 &original_position, const glm::vec3 &original_normal);
+    void merge(const PackingError &other);
+
+    double position;
+    double normal_degrees;
+};
+
+#endif
@@ -0,0 +1,392 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/geometric.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/matrix.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "Culling.h"
+#include "Models.h"
+#include "OpenGLUtils.h"
+#include "PlanetInstances.h"
+#include "RenderQueue.h"
+#include "Resource.h"
+#include "SharedBlocks.h"
+
+// Where planet_instanced.vert takes a vertex's direction and its
+// body's index, and the bodies' shader storage buffer. The noise's
+// buffers are at 1 and 2.
+const GLuint INSTANCED_DIRECTION_LOCATION = 0;
+const GLuint INSTANCED_INDEX_LOCATION = 1;
+const GLuint INSTANCE_BUFFER_BINDING = 3;
+
+// Room for this many bodies to start with; it doubles as needed.
+const std::size_t INITIAL_INSTANCE_CAPACITY = 64;
+
+// The edges of an icosahedron are about this many times its radius.
+const float ICOSAHEDRON_EDGE = 1.05f;
+
+// The innermost orbits take this many frames; further out, orbits
+// take longer, as Kepler's third law has it.
+const float INNER_ORBIT_FRAMES = 1200.0f;
+
+// The bodies' sizes, against the sphere PlanetInstances draws, and
+// how far their orbits tilt, in radians.
+const float MIN_BODY_SCALE = 0.02f, MAX_BODY_SCALE = 0.08f;
+const float MAX_INCLINATION = 0.2f;
+
+// How far the bodies' terrain colours move up or down.
+const float MAX_HEIGHT_SHIFT = 0.1f;
+
+std::vector<PlanetOrbit> randomOrbits(std::size_t count, float min_distance, float max_distance, unsigned int seed) {
+    std::mt19937 rng{seed};
+    std::uniform_real_distribution<float> distance{min_distance, max_distance};
+    std::uniform_real_distribution<float> inclination{-MAX_INCLINATION, MAX_INCLINATION};
+    std::uniform_real_distribution<float> angle{0.0f, glm::two_pi<float>()};
+    std::uniform_real_distribution<float> scale{MIN_BODY_SCALE, MAX_BODY_SCALE};
+    // The noise repeats every 256 units.
+    std::uniform_real_distribution<float> offset{0.0f, 256.0f};
+    std::uniform_real_distribution<float> height_shift{-MAX_HEIGHT_SHIFT, MAX_HEIGHT_SHIFT};
+
+    std::vector<PlanetOrbit> orbits;
+    orbits.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        PlanetOrbit orbit;
+        orbit.distance = distance(rng);
+        orbit.inclination = inclination(rng);
+        orbit.node = angle(rng);
+        orbit.period = INNER_ORBIT_FRAMES * std::pow(orbit.distance / min_distance, 1.5f);
+        orbit.phase = angle(rng);
+        orbit.scale = scale(rng);
+        orbit.noise_offset = glm::vec3{offset(rng), offset(rng), offset(rng)};
+        orbit.height_shift = height_shift(rng);
+        orbits.push_back(orbit);
+    }
+    return orbits;
+}
+
+void placeBodies(const std::vector<PlanetOrbit> &orbits, float frame, std::vector<PlanetInstance> &instances) {
+    const glm::vec3 x_axis{1.0f, 0.0f, 0.0f}, y_axis{0.0f, 1.0f, 0.0f};
+
+    instances.resize(orbits.size());
+    for (std::size_t i = 0; i < orbits.size(); ++i) {
+        const PlanetOrbit &orbit = orbits[i];
+        float angle = orbit.phase + glm::two_pi<float>() * std::fmod(frame, orbit.period) / orbit.period;
+
+        glm::mat4x4 model = glm::rotate(glm::mat4x4{1.0f}, orbit.node, y_axis);
+        model = glm::rotate(model, orbit.inclination, x_axis);
+        model = glm::rotate(model, angle, y_axis);
+        model = glm::translate(model, glm::vec3{orbit.distance, 0.0f, 0.0f});
+        model = glm::scale(model, glm::vec3{orbit.scale});
+        instances[i] = PlanetInstance{model, orbit.noise_offset, orbit.height_shift};
+    }
+}
+
+PlanetInstances::PlanetInstances(float radius, const NoiseFunction &noise, int max_refinements, float pixels_per_edge, const ShaderFeatures &lighting)
+    : m_radius{radius},
+      m_pixels_per_edge{pixels_per_edge},
+      m_vertex_shader{0},
+      m_fragment_shader{0},
+      m_program{0},
+      m_radius_loc{-1},
+      m_noise_locs{-1, -1, -1, -1},
+      m_noise{},
+      m_has_noise{false},
+      m_levels{},
+      m_array_buffer{0},
+      m_elem_buffer{0},
+      m_instance_index_buffer{0},
+      m_array_object{0},
+      m_instance_buffer{0},
+      m_command_buffer{0},
+      m_instance_capacity{0},
+      m_body_levels{},
+      m_level_counts{},
+      m_sorted{},
+      m_commands{},
+      m_cull_stats{},
+      m_triangle_count{0},
+      m_bounds_radius{0.0f}
+{
+    // Shader storage and indirect multi-draws both came in with 4.3.
+    if (!GLAD_GL_VERSION_4_3) {
+        return;
+    }
+
+    setNoise(noise);
+    initProgram(lighting);
+    initGeometry(std::max(0, max_refinements));
+}
+
+PlanetInstances::~PlanetInstances() {
+    if (glIsVertexArray(m_array_object)) {
+        GLState::current().forgetVertexArray(m_array_object);
+        glDeleteVertexArrays(1, &m_array_object);
+    }
+    m_array_object = 0;
+
+    std::vector<GLuint> bufs{};
+    GLuint *buffers[] = { &m_array_buffer, &m_elem_buffer, &m_instance_index_buffer, &m_instance_buffer, &m_command_buffer };
+    for (GLuint *buffer : buffers) {
+        if (glIsBuffer(*buffer)) {
+            GLState::current().forgetBuffer(*buffer);
+            bufs.push_back(*buffer);
+        }
+        *buffer = 0;
+    }
+
+    if (bufs.size() > 0) {
+        glDeleteBuffers(static_cast<GLsizei>(bufs.size()), bufs.data());
+    }
+
+    if (glIsProgram(m_program)) {
+        if (glIsShader(m_vertex_shader)) {
+            glDetachShader(m_program, m_vertex_shader);
+            glDeleteShader(m_vertex_shader);
+        }
+        m_vertex_shader = 0;
+
+        // The ShaderCache owns the fragment shader.
+        if (glIsShader(m_fragment_shader)) {
+            glDetachShader(m_program, m_fragment_shader);
+        }
+        m_fragment_shader = 0;
+
+        GLState::current().forgetProgram(m_program);
+        glDeleteProgram(m_program);
+    }
+
+    m_program = 0;
+}
+
+bool PlanetInstances::isAvailable() const {
+    return m_has_noise && isProgramLinked(m_program);
+}
+
+bool PlanetInstances::setNoise(const NoiseFunction &noise) {
+    m_has_noise = m_noise.set(noise);
+    return m_has_noise;
+}
+
+void PlanetInstances::update(const std::vector<PlanetInstance> &instances, const ViewAndProjectionBlock &vp_block, int viewport_height, float occluder_radius) {
+    m_cull_stats = CullStats{};
+    m_commands.clear();
+    m_triangle_count = 0;
+    m_bounds_radius = 0.0f;
+    if (!isAvailable()) {
+        return;
+    }
+
+    glm::vec3 camera{glm::inverse(vp_block.view())[3]};
+    Culler culler{vp_block.projection() * vp_block.view(), camera, occluder_radius};
+    // How many pixels tall something a unit across is, a unit away.
+    float pixels_per_unit = 0.5f * static_cast<float>(viewport_height) * vp_block.projection()[1][1];
+    float max_height = m_noise.heightRange(m_radius).max;
+
+    // Choose each body's refinement, and count how many bodies each
+    // refinement has.
+    m_body_levels.assign(instances.size(), -1);
+    m_level_counts.assign(m_levels.size(), 0);
+    for (std::size_t i = 0; i < instances.size(); ++i) {
+        const glm::mat4x4 &model = instances[i].model;
+        glm::vec3 center{model[3]};
+        float radius = max_height * glm::length(glm::vec3{model[0]});
+
+        CullResult result = culler.classify(CullBounds{center, radius, glm::vec3{0.0f}, 1.0f});
+        m_cull_stats.count(result);
+        if (result != CULL_VISIBLE) {
+            continue;
+        }
+
+        float distance = std::max(glm::distance(camera, center), radius);
+        int level = chooseLevel(radius * pixels_per_unit / distance);
+        m_body_levels[i] = level;
+        ++m_level_counts[level];
+        m_bounds_radius = std::max(m_bounds_radius, glm::length(center) + radius);
+    }
+
+    // One command for each refinement in use, over a run of the
+    // bodies that starts at its base instance. The counts become where
+    // each run starts.
+    GLuint base_instance = 0;
+    for (std::size_t level = 0; level < m_levels.size(); ++level) {
+        GLuint count = m_level_counts[level];
+        if (count == 0) {
+            continue;
+        }
+
+        const Level &lvl = m_levels[level];
+        m_commands.push_back(DrawCommand{lvl.index_count, count, lvl.first_index, lvl.base_vertex, base_instance});
+        m_triangle_count += static_cast<std::size_t>(count) * lvl.index_count / 3;
+        m_level_counts[level] = base_instance;
+        base_instance += count;
+    }
+
+    if (base_instance == 0) {
+        return;
+    }
+
+    m_sorted.resize(base_instance);
+    for (std::size_t i = 0; i < instances.size(); ++i) {
+        if (m_body_levels[i] >= 0) {
+            m_sorted[m_level_counts[m_body_levels[i]]++] = instances[i];
+        }
+    }
+    reserveInstances(m_sorted.size());
+
+    // Both buffers are specified afresh each frame, so that the driver
+    // can give them new storage rather than wait for the last frame's
+    // draw to finish with them.
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_instance_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, m_sorted.size()*sizeof(PlanetInstance), m_sorted.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    GLState::current().bindBuffer(GL_DRAW_INDIRECT_BUFFER, m_command_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, m_commands.size()*sizeof(DrawCommand), m_commands.data(), GL_STREAM_DRAW);
+}
+
+void PlanetInstances::submit(RenderQueue &queue) {
+    if (!isAvailable() || m_commands.empty()) {
+        return;
+    }
+
+    queue.submit(DrawPacket{
+        SCENE_LAYER, m_program, m_array_object, true,
+        glm::vec3{0.0f}, m_bounds_radius,
+        [this]() {
+            glUniform1f(m_radius_loc, m_radius);
+            m_noise.bind(m_noise_locs);
+            GLState::current().bindStorageBuffer(INSTANCE_BUFFER_BINDING, m_instance_buffer);
+
+            GLState::current().bindBuffer(GL_DRAW_INDIRECT_BUFFER, m_command_buffer);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, static_cast<GLsizei>(m_commands.size()), 0);
+
+            m_noise.unbind();
+        }});
+}
+
+const CullStats& PlanetInstances::cullStats() const {
+    return m_cull_stats;
+}
+
+std::size_t PlanetInstances::commandCount() const {
+    return m_commands.size();
+}
+
+std::size_t PlanetInstances::triangleCount() const {
+    return m_triangle_count;
+}
+
+void PlanetInstances::initProgram(const ShaderFeatures &lighting) {
+    const std::vector<char> &vert_code = LOAD_RESOURCE(planet_instanced_vert);
+    const std::vector<char> &frag_code = LOAD_RESOURCE(terrain_frag);
+    const std::vector<char> &lighting_code = LOAD_RESOURCE(lighting_glsl);
+    const std::vector<char> &noise_code = LOAD_RESOURCE(terrain_noise_glsl);
+
+    m_vertex_shader = createAndCompileShader(GL_VERTEX_SHADER, std::vector<const char*>{vert_code.data(), noise_code.data()});
+    m_fragment_shader = ShaderCache::current().shader(GL_FRAGMENT_SHADER, {frag_code.data(), lighting_code.data()}, lighting);
+    m_program = createProgramFromShaders(m_vertex_shader, m_fragment_shader);
+    ViewAndProjectionBlock::checkLayout(m_program, "ViewAndProjectionBlock");
+    LightListBlock::checkLayout(m_program, "LightListBlock");
+
+    m_radius_loc = glGetUniformLocation(m_program, "radius");
+    m_noise_locs = GpuNoise::locate(m_program);
+
+    GLuint vp_block_idx = glGetUniformBlockIndex(m_program, "ViewAndProjectionBlock");
+    glUniformBlockBinding(m_program, vp_block_idx, ViewAndProjectionBlock::BINDING_INDEX);
+
+    GLuint light_block_idx = glGetUniformBlockIndex(m_program, "LightListBlock");
+    glUniformBlockBinding(m_program, light_block_idx, LightListBlock::BINDING_INDEX);
+}
+
+void PlanetInstances::initGeometry(int max_refinements) {
+    // Every refinement, one after the other, in one pair of buffers.
+    // The directions are all the shader needs, so unit spheres will
+    // do.
+    std::vector<glm::vec3> positions;
+    std::vector<GLuint> elements;
+    for (int refinements = 0; refinements <= max_refinements; ++refinements) {
+        PositionsAndElements sphere = icosphere(1.0f, refinements);
+        optimizeMesh(sphere);
+        m_levels.push_back(Level{
+            static_cast<GLuint>(elements.size()),
+            static_cast<GLuint>(sphere.elements.size()),
+            static_cast<GLint>(positions.size())});
+        positions.insert(positions.end(), sphere.positions.begin(), sphere.positions.end());
+        elements.insert(elements.end(), sphere.elements.begin(), sphere.elements.end());
+    }
+
+    GLuint buffers[5];
+    glGenBuffers(5, buffers);
+    m_array_buffer = buffers[0];
+    m_elem_buffer = buffers[1];
+    m_instance_index_buffer = buffers[2];
+    m_instance_buffer = buffers[3];
+    m_command_buffer = buffers[4];
+    reserveInstances(INITIAL_INSTANCE_CAPACITY);
+
+    glGenVertexArrays(1, &m_array_object);
+    GLState::current().bindVertexArray(m_array_object);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
+    glBufferData(GL_ARRAY_BUFFER, positions.size()*sizeof(glm::vec3), positions.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(INSTANCED_DIRECTION_LOCATION);
+    glVertexAttribPointer(INSTANCED_DIRECTION_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (const void *)0);
+
+    // gl_InstanceID starts from 0 in every command, but an instanced
+    // attribute starts from the command's base instance.
+    glBindBuffer(GL_ARRAY_BUFFER, m_instance_index_buffer);
+    glEnableVertexAttribArray(INSTANCED_INDEX_LOCATION);
+    glVertexAttribIPointer(INSTANCED_INDEX_LOCATION, 1, GL_UNSIGNED_INT, sizeof(GLuint), (const void *)0);
+    glVertexAttribDivisor(INSTANCED_INDEX_LOCATION, 1);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, elements.size()*sizeof(GLuint), elements.data(), GL_STATIC_DRAW);
+
+    GLState::current().bindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    std::cout << "Planet instances: refinements 0 to " << max_refinements << " in "
+              << (positions.size()*sizeof(glm::vec3) + elements.size()*sizeof(GLuint)) / 1024
+              << " KiB of buffers" << std::endl;
+}
+
+// The instanced attribute's buffer holds 0, 1, 2, ... for as many
+// bodies as there are. Its name stays the same as it grows, so the
+// vertex array needn't change.
+void PlanetInstances::reserveInstances(std::size_t count) {
+    if (count <= m_instance_capacity) {
+        return;
+    }
+
+    m_instance_capacity = std::max(count, 2*m_instance_capacity);
+    std::vector<GLuint> indices(m_instance_capacity);
+    std::iota(indices.begin(), indices.end(), 0u);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_instance_index_buffer);
+    glBufferData(GL_ARRAY_BUFFER, indices.size()*sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Each refinement halves the edges, so take enough of them to bring
+// the edges down to m_pixels_per_edge across a body screen_radius
+// pixels in radius.
+int PlanetInstances::chooseLevel(float screen_radius) const {
+    float edge_ratio = ICOSAHEDRON_EDGE * screen_radius / m_pixels_per_edge;
+    int level = edge_ratio > 1.0f ? static_cast<int>(std::ceil(std::log2(edge_ratio))) : 0;
+    return std::min(level, static_cast<int>(m_levels.size()) - 1);
+}
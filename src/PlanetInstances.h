@@ -0,0 +1,154 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_PLANET_INSTANCES_H_
+#define _PLANET_PLANET_INSTANCES_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "Culling.h"
+#include "TerrainCompute.h"
+
+class NoiseFunction;
+class RenderQueue;
+class ShaderFeatures;
+class ViewAndProjectionBlock;
+
+// One body as planet_instanced.vert reads it from its shader storage
+// buffer, laid out by the std430 rules. model places and scales the
+// body; the noise is sampled noise_offset away from everyone else's,
+// so that each has its own terrain; and height_shift moves it up or
+// down the terrain's colours, from sandy to snowy.
+struct PlanetInstance {
+    glm::mat4x4 model;
+    glm::vec3 noise_offset;
+    float height_shift;
+};
+
+static_assert(offsetof(PlanetInstance, model) == 0, "std430 puts model at 0");
+static_assert(offsetof(PlanetInstance, noise_offset) == 64, "std430 puts noise_offset at 64");
+static_assert(offsetof(PlanetInstance, height_shift) == 76, "std430 puts height_shift at 76");
+static_assert(sizeof(PlanetInstance) == 80, "PlanetInstance is 80 bytes apart in a std430 array");
+
+// A body on a circular orbit around the origin, tilted by inclination
+// about an axis in the xz plane at node. It goes around once in period
+// frames, keeping the same face to the origin. scale, noise_offset and
+// height_shift make its PlanetInstance.
+struct PlanetOrbit {
+    float distance;
+    float inclination;
+    float node;
+    float period;
+    float phase;
+    float scale;
+    glm::vec3 noise_offset;
+    float height_shift;
+};
+
+// count orbits, between min_distance and max_distance from the origin,
+// the same for the same seed. Further bodies go around slower.
+std::vector<PlanetOrbit> randomOrbits(std::size_t count, float min_distance, float max_distance, unsigned int seed);
+
+// Where each of the orbits has its body at frame.
+void placeBodies(const std::vector<PlanetOrbit> &orbits, float frame, std::vector<PlanetInstance> &instances);
+
+// Any number of bodies with the same terrain noise (a Curve over an
+// Octave over a Perlin, run in the vertex shader), each with its own
+// place, size and offset into the noise. Icospheres of every
+// refinement up to max_refinements share one pair of buffers. Each
+// body gets the refinement that suits its size on screen, and the
+// bodies are sorted by it, so that they all draw with one
+// glMultiDrawElementsIndirect of a command per refinement, instanced
+// over the bodies that use it. The bodies' data goes into a shader
+// storage buffer, so drawing five hundred of them takes the same calls
+// as drawing five.
+class PlanetInstances {
+public:
+    // The bodies are spheres of radius before their models scale
+    // them. Their triangles' edges are kept about pixels_per_edge
+    // pixels long on screen, as far as max_refinements allows.
+    // lighting is what the fragment shader is specialised on.
+    PlanetInstances(float radius, const NoiseFunction &noise, int max_refinements, float pixels_per_edge, const ShaderFeatures &lighting);
+    PlanetInstances(const PlanetInstances &other) = delete;
+    PlanetInstances(PlanetInstances &&other) = delete;
+    ~PlanetInstances();
+
+    PlanetInstances& operator=(const PlanetInstances &other) = delete;
+    PlanetInstances& operator=(PlanetInstances &&other) = delete;
+
+    // Whether the context has what the shaders need, and the noise has
+    // the shape they implement.
+    bool isAvailable() const;
+
+    bool setNoise(const NoiseFunction &noise);
+
+    // Cull the bodies against the camera in vp_block, and behind a
+    // sphere of occluder_radius about the origin (0 for none); choose
+    // the refinement of the rest; and upload them and their draw
+    // commands.
+    void update(const std::vector<PlanetInstance> &instances, const ViewAndProjectionBlock &vp_block, int viewport_height, float occluder_radius);
+
+    // Queue the bodies the last update() chose.
+    void submit(RenderQueue &queue);
+
+    // What the last update() drew and culled, in how many commands,
+    // and how many triangles those come to.
+    const CullStats& cullStats() const;
+    std::size_t commandCount() const;
+    std::size_t triangleCount() const;
+
+private:
+    // The part of the shared buffers that holds one refinement.
+    struct Level {
+        GLuint first_index;
+        GLuint index_count;
+        GLint base_vertex;
+    };
+
+    // As glMultiDrawElementsIndirect reads them.
+    struct DrawCommand {
+        GLuint count;
+        GLuint instance_count;
+        GLuint first_index;
+        GLint base_vertex;
+        GLuint base_instance;
+    };
+
+    void initProgram(const ShaderFeatures &lighting);
+    void initGeometry(int max_refinements);
+    void reserveInstances(std::size_t count);
+    int chooseLevel(float screen_radius) const;
+
+    float m_radius;
+    float m_pixels_per_edge;
+
+    GLuint m_vertex_shader, m_fragment_shader, m_program;
+    GLint m_radius_loc;
+    GpuNoise::Locations m_noise_locs;
+
+    GpuNoise m_noise;
+    bool m_has_noise;
+
+    std::vector<Level> m_levels;
+    GLuint m_array_buffer, m_elem_buffer, m_instance_index_buffer, m_array_object;
+    GLuint m_instance_buffer, m_command_buffer;
+    std::size_t m_instance_capacity;
+
+    // Per-frame scratch space, kept to save reallocating it.
+    std::vector<int> m_body_levels;
+    std::vector<GLuint> m_level_counts;
+    std::vector<PlanetInstance> m_sorted;
+    std::vector<DrawCommand> m_commands;
+
+    CullStats m_cull_stats;
+    std::size_t m_triangle_count;
+    float m_bounds_radius;
+};
+
+#endif
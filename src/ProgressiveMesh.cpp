@@ -0,0 +1,581 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "Culling.h"
+#include "Models.h"
+#include "OpenGLUtils.h"
+#include "PackedVertex.h"
+#include "ProgressiveMesh.h"
+#include "SharedBlocks.h"
+#include "Streaming.h"
+#include "TaskPool.h"
+
+// Vertices per build task.
+const std::size_t BUILD_GRAIN = 4096;
+
+// Vertices the background thread finishes before handing a block over.
+const std::size_t BLOCK_VERTICES = 4 * BUILD_GRAIN;
+
+// Changed vertices closer together than this are uploaded as one run.
+const std::size_t RUN_GAP = 256;
+
+// Where terrain.vert and ocean.vert take a PackedVertex's attributes.
+const GLuint DIRECTION_LOCATION = 0;
+const GLuint HEIGHT_LOCATION = 1;
+const GLuint NORMAL_LOCATION = 2;
+
+const unsigned int ProgressiveMesh::CLUSTER_TRIANGLES;
+
+MeshSource::~MeshSource() {}
+
+std::vector<int> refinementSchedule(int first, int last, int step) {
+    std::vector<int> rv;
+    for (int r = std::min(first, last); r < last; r += std::max(1, step)) {
+        rv.push_back(r);
+    }
+    rv.push_back(last);
+    return rv;
+}
+
+ProgressiveMesh::Level::Level()
+    : refinements{-1},
+      vertex_count{0},
+      indices{},
+      height_range{0.0f, 0.0f},
+      blocks{},
+      generated{false},
+      occluder_radius{0.0f},
+      array_buffer{0},
+      elem_buffer{0},
+      vertices{},
+      index_bytes_uploaded{0},
+      block_bytes_uploaded{0},
+      clusters{}
+{}
+
+ProgressiveMesh::ProgressiveMesh(const std::string &name)
+    : m_name{name},
+      m_start{std::chrono::steady_clock::now()},
+      m_first_frame_ms{-1.0},
+      m_final_quality_ms{-1.0},
+      m_final_refinements{-1},
+      m_generated_mutex{},
+      m_generated{},
+      m_cancelled{false},
+      m_loading{},
+      m_current{},
+      m_cull_stats{},
+      m_draw_counts{},
+      m_draw_offsets{},
+      m_array_object{0},
+      m_source{},
+      m_worker{}
+{
+    glGenVertexArrays(1, &m_array_object);
+    GLState::current().bindVertexArray(m_array_object);
+    glEnableVertexAttribArray(DIRECTION_LOCATION);
+    glEnableVertexAttribArray(HEIGHT_LOCATION);
+    glEnableVertexAttribArray(NORMAL_LOCATION);
+    GLState::current().bindVertexArray(0);
+}
+
+ProgressiveMesh::~ProgressiveMesh() {
+    // Stop the background thread before anything it uses goes away.
+    m_cancelled = true;
+    m_worker.reset();
+    m_source.reset();
+
+    if (m_loading) {
+        release(*m_loading);
+    }
+
+    if (m_current) {
+        release(*m_current);
+    }
+
+    if (glIsVertexArray(m_array_object)) {
+        GLState::current().forgetVertexArray(m_array_object);
+        glDeleteVertexArrays(1, &m_array_object);
+    }
+
+    m_array_object = 0;
+}
+
+void ProgressiveMesh::generate(float radius, const std::vector<int> &refinements, std::shared_ptr<MeshSource> source) {
+    if (refinements.empty()) {
+        return;
+    }
+
+    m_final_refinements = refinements.back();
+    m_source = std::move(source);
+    m_worker.reset(new BackgroundWorker{});
+
+    MeshSource *mesh_source = m_source.get();
+    for (int r : refinements) {
+        m_worker->push([this, radius, r, mesh_source]() {
+            if (!m_cancelled) {
+                generateLevel(radius, r, *mesh_source);
+            }
+        });
+    }
+}
+
+void ProgressiveMesh::load(int refinements, const std::vector<PackedVertex> &vertices, const std::vector<GLuint> &indices, const std::vector<MeshCluster> &clusters, const HeightRange &height_range, float occluder_radius) {
+    std::unique_ptr<Level> level{new Level};
+    level->refinements = refinements;
+    level->vertex_count = vertices.size();
+    level->indices = indices;
+    level->height_range = height_range;
+    level->generated = true;
+    level->occluder_radius = occluder_radius;
+    level->vertices = vertices;
+    level->clusters = clusters;
+    allocate(*level, vertices.data(), indices.data());
+
+    if (m_current) {
+        release(*m_current);
+    }
+
+    m_current = std::move(level);
+    attach(*m_current);
+    m_draw_counts.clear();
+    m_draw_offsets.clear();
+
+    m_final_refinements = refinements;
+    m_final_quality_ms = millisecondsSinceStart();
+}
+
+void ProgressiveMesh::update(StagingBuffer &staging) {
+    if (isComplete()) {
+        return;
+    }
+
+    takeGenerated();
+    if (!m_loading || !upload(*m_loading, staging) || !m_loading->generated) {
+        return;
+    }
+
+    // All of it is resident, so it can take over from the refinement
+    // before.
+    std::unique_ptr<Level> previous = std::move(m_current);
+    m_current = std::move(m_loading);
+    attach(*m_current);
+    m_draw_counts.clear();
+    m_draw_offsets.clear();
+    if (previous) {
+        release(*previous);
+    }
+
+    double now = millisecondsSinceStart();
+    std::cout << m_name << ": refinement " << m_current->refinements
+              << " resident after " << now << " ms" << std::endl;
+
+    if (m_current->refinements == m_final_refinements) {
+        m_final_quality_ms = now;
+        m_worker.reset();
+        m_source.reset();
+    }
+}
+
+VertexUpdate ProgressiveMesh::replaceVertices(const std::vector<PackedVertex> &vertices, const HeightRange &height_range) {
+    VertexUpdate rv{0, 0, 0};
+    if (!isComplete() || !m_current || vertices.size() != m_current->vertex_count) {
+        return rv;
+    }
+
+    // A new height range moves every vertex.
+    Level &level = *m_current;
+    bool all = height_range.min != level.height_range.min || height_range.max != level.height_range.max;
+    std::vector<char> changed(vertices.size(), 0);
+    for (std::size_t i = 0; i < vertices.size(); ++i) {
+        if (all || std::memcmp(&vertices[i], &level.vertices[i], sizeof(PackedVertex)) != 0) {
+            changed[i] = 1;
+            ++rv.changed;
+        }
+    }
+
+    if (rv.changed == 0) {
+        return rv;
+    }
+
+    // Upload the runs of changed vertices, taking in short gaps of
+    // unchanged ones rather than starting a new run for each.
+    glBindBuffer(GL_ARRAY_BUFFER, level.array_buffer);
+    std::size_t i = 0;
+    while (i < vertices.size()) {
+        if (!changed[i]) {
+            ++i;
+            continue;
+        }
+
+        std::size_t first = i, last = i;
+        for (++i; i < vertices.size() && i - last <= RUN_GAP; ++i) {
+            if (changed[i]) {
+                last = i;
+            }
+        }
+
+        std::size_t count = last + 1 - first;
+        glBufferSubData(
+            GL_ARRAY_BUFFER,
+            first*sizeof(PackedVertex),
+            count*sizeof(PackedVertex),
+            &vertices[first]);
+        rv.uploaded += count;
+        ++rv.runs;
+        i = last + 1;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    level.vertices = vertices;
+    level.height_range = height_range;
+
+    // Bound the clusters that use the vertices that changed, and the
+    // whole mesh's occluder, from what the vertex shader will draw.
+    std::vector<glm::vec3> unpacked(vertices.size());
+    TaskPool::shared().parallelFor(vertices.size(), BUILD_GRAIN, [&](std::size_t begin, std::size_t end) {
+        glm::vec3 normal;
+        for (std::size_t v = begin; v < end; ++v) {
+            unpackVertex(vertices[v], height_range, unpacked[v], normal);
+        }
+    });
+
+    for (MeshCluster &cluster : level.clusters) {
+        const unsigned int *elements = &level.indices[cluster.first];
+        if (std::any_of(elements, elements + cluster.count, [&](unsigned int e) { return changed[e] != 0; })) {
+            cluster.bounds = boundTriangles(unpacked.data(), elements, cluster.count);
+        }
+    }
+    level.occluder_radius = enclosedRadius(unpacked.data(), level.indices.data(), level.indices.size());
+
+    return rv;
+}
+
+void ProgressiveMesh::cull(const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model) {
+    const Level *level = drawnLevel();
+    if (!level) {
+        m_cull_stats = CullStats{};
+        m_draw_counts.clear();
+        m_draw_offsets.clear();
+        return;
+    }
+
+    Culler culler{vp_block.projection() * vp_block.view() * model, modelCamera(vp_block.view(), model), level->occluder_radius};
+    cullClusters(level->clusters, culler, m_cull_stats, m_draw_counts, m_draw_offsets);
+}
+
+void ProgressiveMesh::draw() {
+    if (m_draw_counts.empty()) {
+        return;
+    }
+
+    if (m_first_frame_ms < 0.0) {
+        m_first_frame_ms = millisecondsSinceStart();
+        std::cout << m_name << ": first drawn after " << m_first_frame_ms << " ms" << std::endl;
+    }
+
+    GLState::current().bindVertexArray(m_array_object);
+    glMultiDrawElements(
+        GL_TRIANGLES,
+        m_draw_counts.data(),
+        GL_UNSIGNED_INT,
+        m_draw_offsets.data(),
+        static_cast<GLsizei>(m_draw_counts.size()));
+}
+
+GLuint ProgressiveMesh::arrayObject() const {
+    return m_array_object;
+}
+
+HeightRange ProgressiveMesh::heightRange() const {
+    const Level *level = drawnLevel();
+    return level ? level->height_range : HeightRange{0.0f, 0.0f};
+}
+
+const CullStats& ProgressiveMesh::cullStats() const {
+    return m_cull_stats;
+}
+
+int ProgressiveMesh::refinements() const {
+    return m_current ? m_current->refinements : -1;
+}
+
+bool ProgressiveMesh::isComplete() const {
+    return m_final_quality_ms >= 0.0;
+}
+
+double ProgressiveMesh::timeToFirstFrame() const {
+    return m_first_frame_ms;
+}
+
+double ProgressiveMesh::timeToFinalQuality() const {
+    return m_final_quality_ms;
+}
+
+void ProgressiveMesh::generateLevel(float radius, int refinements, MeshSource &source) {
+    auto start = std::chrono::steady_clock::now();
+
+    // Create a sphere from an icosahredron.
+    PositionsAndElements sphere = icosphere(radius, refinements);
+    MeshOptimization optimization = optimizeMesh(sphere);
+    std::vector<MeshCluster> clusters = clusterMesh(sphere, CLUSTER_TRIANGLES);
+    HeightRange height_range = source.prepare(sphere);
+    std::size_t vertex_count = sphere.positions.size();
+
+    {
+        std::lock_guard<std::mutex> lock{m_generated_mutex};
+        m_generated.emplace_back();
+        Level &level = m_generated.back();
+        level.refinements = refinements;
+        level.vertex_count = vertex_count;
+        level.indices = sphere.elements;
+        level.height_range = height_range;
+    }
+
+    // Optimizing the vertex fetch numbered the vertices in the order
+    // the clusters first use them, so each run of clusters adds a run
+    // of vertices, and uses only those and the ones before.
+    std::vector<glm::vec3> unpacked(vertex_count);
+    PackingError error;
+    std::mutex error_mutex;
+    float occluder_radius = std::numeric_limits<float>::max();
+    std::size_t next_cluster = 0, first_vertex = 0;
+    while (next_cluster < clusters.size() && !m_cancelled) {
+        Block block;
+        block.first_vertex = first_vertex;
+        std::size_t end_vertex = first_vertex;
+        while (next_cluster < clusters.size() && end_vertex - first_vertex < BLOCK_VERTICES) {
+            const MeshCluster &cluster = clusters[next_cluster++];
+            for (unsigned int i = cluster.first; i < cluster.first + cluster.count; ++i) {
+                end_vertex = std::max<std::size_t>(end_vertex, sphere.elements[i] + 1);
+            }
+            block.clusters.push_back(cluster);
+        }
+
+        block.vertices.resize(end_vertex - first_vertex);
+        TaskPool::shared().parallelFor(block.vertices.size(), BUILD_GRAIN, [&](std::size_t begin, std::size_t end) {
+            std::vector<TerrainVertex> built(end - begin);
+            source.build(sphere, first_vertex + begin, end - begin, built.data());
+
+            PackingError range_error;
+            for (std::size_t i = 0; i < built.size(); ++i) {
+                PackedVertex &packed = block.vertices[begin + i];
+                packed = packVertex(built[i].position, built[i].normal, height_range);
+                range_error.measure(packed, height_range, built[i].position, built[i].normal);
+
+                // Bound what the vertex shader will draw, not the
+                // unpacked mesh.
+                glm::vec3 normal;
+                unpackVertex(packed, height_range, unpacked[first_vertex + begin + i], normal);
+            }
+
+            std::lock_guard<std::mutex> lock{error_mutex};
+            error.merge(range_error);
+        });
+
+        for (MeshCluster &cluster : block.clusters) {
+            const unsigned int *elements = &sphere.elements[cluster.first];
+            cluster.bounds = boundTriangles(unpacked.data(), elements, cluster.count);
+            occluder_radius = std::min(occluder_radius, enclosedRadius(unpacked.data(), elements, cluster.count));
+        }
+
+        first_vertex = end_vertex;
+        std::lock_guard<std::mutex> lock{m_generated_mutex};
+        m_generated.back().blocks.push_back(std::move(block));
+    }
+
+    if (m_cancelled) {
+        return;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    std::cout << m_name << ": refinement " << refinements << " has "
+              << vertex_count << " vertices, built in "
+              << std::chrono::duration<double, std::milli>(end - start).count() << " ms on "
+              << TaskPool::shared().threadCount() << " threads; "
+              << vertex_count*sizeof(PackedVertex)/1024 << " KiB packed, "
+              << vertex_count*sizeof(TerrainVertex)/1024 << " KiB unpacked, "
+              << "max position error " << error.position << ", "
+              << "max normal error " << error.normal_degrees << " degrees; "
+              << "ACMR " << optimization.before.acmr << " -> " << optimization.after.acmr << ", "
+              << "ATVR " << optimization.before.atvr << " -> " << optimization.after.atvr << std::endl;
+
+    std::lock_guard<std::mutex> lock{m_generated_mutex};
+    m_generated.back().generated = true;
+    m_generated.back().occluder_radius = clusters.empty() ? 0.0f : occluder_radius;
+}
+
+void ProgressiveMesh::takeGenerated() {
+    bool new_level = false;
+    {
+        std::lock_guard<std::mutex> lock{m_generated_mutex};
+        if (!m_loading && !m_generated.empty()) {
+            Level &source = m_generated.front();
+            m_loading.reset(new Level);
+            m_loading->refinements = source.refinements;
+            m_loading->vertex_count = source.vertex_count;
+            m_loading->indices.swap(source.indices);
+            m_loading->height_range = source.height_range;
+            new_level = true;
+        }
+
+        if (m_loading && !m_loading->generated && !m_generated.empty()) {
+            Level &source = m_generated.front();
+            while (!source.blocks.empty()) {
+                m_loading->blocks.push_back(std::move(source.blocks.front()));
+                source.blocks.pop_front();
+            }
+
+            if (source.generated) {
+                m_loading->generated = true;
+                m_loading->occluder_radius = source.occluder_radius;
+                m_generated.pop_front();
+            }
+        }
+    }
+
+    // Only space for the vertices is made up front, so nothing big is
+    // copied in one go. The first refinement is drawn as it arrives.
+    if (new_level) {
+        m_loading->vertices.resize(m_loading->vertex_count);
+        allocate(*m_loading, nullptr, nullptr);
+        if (!m_current) {
+            attach(*m_loading);
+        }
+    }
+}
+
+bool ProgressiveMesh::upload(Level &level, StagingBuffer &staging) {
+    // The indices go first, since every cluster needs them.
+    const char *indices = reinterpret_cast<const char *>(level.indices.data());
+    std::size_t index_bytes = level.indices.size()*sizeof(GLuint);
+    if (level.index_bytes_uploaded < index_bytes) {
+        level.index_bytes_uploaded += staging.upload(
+            level.elem_buffer, level.index_bytes_uploaded,
+            indices + level.index_bytes_uploaded, index_bytes - level.index_bytes_uploaded);
+        if (level.index_bytes_uploaded < index_bytes) {
+            return false;
+        }
+    }
+
+    while (!level.blocks.empty()) {
+        Block &block = level.blocks.front();
+        const char *vertices = reinterpret_cast<const char *>(block.vertices.data());
+        std::size_t block_bytes = block.vertices.size()*sizeof(PackedVertex);
+        level.block_bytes_uploaded += staging.upload(
+            level.array_buffer, block.first_vertex*sizeof(PackedVertex) + level.block_bytes_uploaded,
+            vertices + level.block_bytes_uploaded, block_bytes - level.block_bytes_uploaded);
+        if (level.block_bytes_uploaded < block_bytes) {
+            return false;
+        }
+
+        // The block's clusters all start being drawn together, once
+        // the last of their vertices is in.
+        std::copy(block.vertices.begin(), block.vertices.end(), level.vertices.begin() + block.first_vertex);
+        level.clusters.insert(level.clusters.end(), block.clusters.begin(), block.clusters.end());
+        level.blocks.pop_front();
+        level.block_bytes_uploaded = 0;
+    }
+
+    return true;
+}
+
+void ProgressiveMesh::allocate(Level &level, const PackedVertex *vertices, const GLuint *indices) {
+    GLuint buffers[2];
+    glGenBuffers(2, buffers);
+    level.array_buffer = buffers[0];
+    level.elem_buffer = buffers[1];
+
+    // Whichever vertex array was drawn last is still bound; binding
+    // the index buffer would attach it there.
+    GLState::current().bindVertexArray(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, level.array_buffer);
+    glBufferData(
+        GL_ARRAY_BUFFER,
+        level.vertex_count*sizeof(PackedVertex),
+        vertices,
+        GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, level.elem_buffer);
+    glBufferData(
+        GL_ELEMENT_ARRAY_BUFFER,
+        level.indices.size()*sizeof(GLuint),
+        indices,
+        GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void ProgressiveMesh::attach(const Level &level) {
+    GLState::current().bindVertexArray(m_array_object);
+    glBindBuffer(GL_ARRAY_BUFFER, level.array_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, level.elem_buffer);
+
+    glVertexAttribPointer(
+        DIRECTION_LOCATION,
+        2, GL_SHORT, GL_TRUE,
+        sizeof(PackedVertex),
+        (const void *)(offsetof(PackedVertex, direction))
+    );
+
+    glVertexAttribPointer(
+        HEIGHT_LOCATION,
+        1, GL_UNSIGNED_SHORT, GL_TRUE,
+        sizeof(PackedVertex),
+        (const void *)(offsetof(PackedVertex, height))
+    );
+
+    glVertexAttribPointer(
+        NORMAL_LOCATION,
+        2, GL_BYTE, GL_TRUE,
+        sizeof(PackedVertex),
+        (const void *)(offsetof(PackedVertex, normal))
+    );
+
+    GLState::current().bindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void ProgressiveMesh::release(Level &level) {
+    std::vector<GLuint> bufs{};
+
+    if (glIsBuffer(level.array_buffer)) {
+        bufs.push_back(level.array_buffer);
+    }
+
+    if (glIsBuffer(level.elem_buffer)) {
+        bufs.push_back(level.elem_buffer);
+    }
+
+    if (bufs.size() > 0) {
+        glDeleteBuffers(static_cast<GLsizei>(bufs.size()), bufs.data());
+    }
+
+    level.array_buffer = 0;
+    level.elem_buffer = 0;
+}
+
+const ProgressiveMesh::Level* ProgressiveMesh::drawnLevel() const {
+    return m_current ? m_current.get() : m_loading.get();
+}
+
+double ProgressiveMesh::millisecondsSinceStart() const {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+}
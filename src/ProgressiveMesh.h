@@ -0,0 +1,181 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_PROGRESSIVE_MESH_H_
+#define _PLANET_PROGRESSIVE_MESH_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/mat4x4.hpp>
+
+#include "opengl.h"
+
+#include "Culling.h"
+#include "PackedVertex.h"
+
+class BackgroundWorker;
+class StagingBuffer;
+class ViewAndProjectionBlock;
+struct PositionsAndElements;
+
+// Fills in the vertices of a sphere-like mesh at one refinement, for
+// ProgressiveMesh, on its background thread.
+class MeshSource {
+public:
+    virtual ~MeshSource();
+
+    // Called with each refinement's sphere once it's optimized and
+    // clustered, to do whatever needs all of it at once. Returns the
+    // range its heights will cover.
+    virtual HeightRange prepare(PositionsAndElements &sphere) = 0;
+
+    // The count vertices from first. Called from several threads at
+    // once, for different vertices.
+    virtual void build(const PositionsAndElements &sphere, std::size_t first, std::size_t count, TerrainVertex *out) = 0;
+};
+
+// What ProgressiveMesh::replaceVertices() changed.
+struct VertexUpdate {
+    std::size_t changed;
+    std::size_t uploaded;
+    std::size_t runs;
+};
+
+// Refinements from first to last, step apart, always ending at last.
+std::vector<int> refinementSchedule(int first, int last, int step);
+
+// A sphere-like mesh of PackedVertex, built at a series of refinements
+// on a background thread, coarsest first, and streamed in by update().
+// Each refinement's buffers replace the last one's in the VAO once it
+// is all resident; until then, the last one stays drawn. The first
+// refinement is drawn a block of clusters at a time as it arrives.
+class ProgressiveMesh {
+public:
+    // name is what the timings it prints call it.
+    explicit ProgressiveMesh(const std::string &name);
+    ProgressiveMesh(const ProgressiveMesh &other) = delete;
+    ProgressiveMesh(ProgressiveMesh &&other) = delete;
+    ~ProgressiveMesh();
+
+    ProgressiveMesh& operator=(const ProgressiveMesh &other) = delete;
+    ProgressiveMesh& operator=(ProgressiveMesh &&other) = delete;
+
+    // Build spheres of radius at each of refinements from source.
+    void generate(float radius, const std::vector<int> &refinements, std::shared_ptr<MeshSource> source);
+
+    // Make a mesh that's already built resident straight away, as the
+    // only refinement.
+    void load(int refinements, const std::vector<PackedVertex> &vertices, const std::vector<GLuint> &indices, const std::vector<MeshCluster> &clusters, const HeightRange &height_range, float occluder_radius);
+
+    // Upload what the background thread has finished, as far as the
+    // staging buffer allows this frame.
+    void update(StagingBuffer &staging);
+
+    // Swap in new vertices for the last refinement, once it's
+    // complete, in the same order. Only the runs of vertices that
+    // differ are uploaded, straight away, and only the clusters that
+    // use them are bounded again.
+    VertexUpdate replaceVertices(const std::vector<PackedVertex> &vertices, const HeightRange &height_range);
+
+    // Choose the clusters to draw for the camera in vp_block, looking
+    // at the mesh placed by model. Until this is called, nothing is
+    // drawn.
+    void cull(const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model);
+
+    // Draw what the last cull() chose, with the program in use.
+    void draw();
+
+    // The vertex array draw() binds.
+    GLuint arrayObject() const;
+
+    // The range the drawn refinement's heights cover, for the
+    // shaders.
+    HeightRange heightRange() const;
+    const CullStats& cullStats() const;
+
+    // The refinement that's drawn, or -1 if there isn't one yet.
+    int refinements() const;
+    // Whether the last refinement is drawn.
+    bool isComplete() const;
+
+    // Milliseconds from when the mesh was made until it was first
+    // drawn, and until its last refinement was; negative until then.
+    double timeToFirstFrame() const;
+    double timeToFinalQuality() const;
+
+    // Triangles per cluster.
+    static const unsigned int CLUSTER_TRIANGLES = 512;
+
+private:
+    // Vertices the background thread has finished, from first_vertex
+    // on, and the clusters they complete, bounded.
+    struct Block {
+        std::size_t first_vertex;
+        std::vector<PackedVertex> vertices;
+        std::vector<MeshCluster> clusters;
+    };
+
+    // One refinement. The background thread hands its layout over
+    // first, then its blocks in order, then its occluder radius once
+    // it's generated. The render thread uploads it into its own
+    // buffers, indices first.
+    struct Level {
+        Level();
+
+        int refinements;
+        std::size_t vertex_count;
+        std::vector<GLuint> indices;
+        HeightRange height_range;
+        std::deque<Block> blocks;
+        bool generated;
+        float occluder_radius;
+
+        GLuint array_buffer, elem_buffer;
+        // What's in array_buffer, for replaceVertices() to compare
+        // against.
+        std::vector<PackedVertex> vertices;
+        std::size_t index_bytes_uploaded;
+        std::size_t block_bytes_uploaded;
+        // The clusters whose vertices are all resident.
+        std::vector<MeshCluster> clusters;
+    };
+
+    void generateLevel(float radius, int refinements, MeshSource &source);
+    void takeGenerated();
+    bool upload(Level &level, StagingBuffer &staging);
+    void allocate(Level &level, const PackedVertex *vertices, const GLuint *indices);
+    void attach(const Level &level);
+    void release(Level &level);
+    const Level* drawnLevel() const;
+    double millisecondsSinceStart() const;
+
+    std::string m_name;
+    std::chrono::steady_clock::time_point m_start;
+    double m_first_frame_ms, m_final_quality_ms;
+    int m_final_refinements;
+
+    // Handed over from the background thread under m_generated_mutex.
+    std::mutex m_generated_mutex;
+    std::deque<Level> m_generated;
+    std::atomic<bool> m_cancelled;
+
+    std::unique_ptr<Level> m_loading, m_current;
+
+    CullStats m_cull_stats;
+    std::vector<GLsizei> m_draw_counts;
+    std::vector<const void*> m_draw_offsets;
+
+    GLuint m_array_object;
+
+    std::shared_ptr<MeshSource> m_source;
+    std::unique_ptr<BackgroundWorker> m_worker;
+};
+
+#endif
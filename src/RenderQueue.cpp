@@ -0,0 +1,95 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/geometric.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/matrix.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "OpenGLUtils.h"
+#include "RenderQueue.h"
+#include "SharedBlocks.h"
+
+// Where each part of the key starts, and how many bits it has.
+const unsigned int LAYER_SHIFT = 60;
+const unsigned int DEPTH_SHIFT = 32, DEPTH_BITS = 28;
+const unsigned int PROGRAM_SHIFT = 16, PROGRAM_BITS = 16;
+const unsigned int ARRAY_OBJECT_BITS = 16;
+
+RenderQueue::RenderQueue()
+    : m_packets{},
+      m_order{},
+      m_stats{0, 0, 0}
+{}
+
+RenderQueue::~RenderQueue() {}
+
+void RenderQueue::submit(DrawPacket packet) {
+    m_packets.push_back(std::move(packet));
+}
+
+void RenderQueue::execute(const ViewAndProjectionBlock &vp_block) {
+    glm::vec3 camera{glm::inverse(vp_block.view())[3]};
+
+    m_order.clear();
+    for (std::size_t i = 0; i < m_packets.size(); ++i) {
+        const DrawPacket &packet = m_packets[i];
+        float depth = std::max(0.0f, glm::distance(camera, packet.center) - packet.radius);
+        m_order.emplace_back(sortKey(packet, depth), i);
+    }
+    // Ties keep the order they were submitted in.
+    std::sort(m_order.begin(), m_order.end());
+
+    m_stats = RenderQueueStats{m_packets.size(), 0, 0};
+    GLState &state = GLState::current();
+    const DrawPacket *last = nullptr;
+    for (const auto &entry : m_order) {
+        const DrawPacket &packet = m_packets[entry.second];
+        if (!last || packet.program != last->program) {
+            ++m_stats.programs;
+        }
+        if (!last || packet.array_object != last->array_object) {
+            ++m_stats.array_objects;
+        }
+
+        state.useProgram(packet.program);
+        state.bindVertexArray(packet.array_object);
+        if (packet.depth_test) {
+            state.enable(GL_DEPTH_TEST);
+        } else {
+            state.disable(GL_DEPTH_TEST);
+        }
+        packet.draw();
+        last = &packet;
+    }
+
+    m_packets.clear();
+}
+
+const RenderQueueStats& RenderQueue::stats() const {
+    return m_stats;
+}
+
+uint64_t RenderQueue::sortKey(const DrawPacket &packet, float depth) {
+    // Non-negative floats order the same as their bits, so the top
+    // bits of a depth order it, more finely the nearer it is.
+    uint32_t depth_bits = 0;
+    if (packet.layer == SCENE_LAYER) {
+        std::memcpy(&depth_bits, &depth, sizeof(depth_bits));
+        depth_bits >>= 31 - DEPTH_BITS;
+    }
+
+    return (static_cast<uint64_t>(packet.layer) << LAYER_SHIFT)
+        | (static_cast<uint64_t>(depth_bits) << DEPTH_SHIFT)
+        | (static_cast<uint64_t>(packet.program & ((1u << PROGRAM_BITS) - 1)) << PROGRAM_SHIFT)
+        | static_cast<uint64_t>(packet.array_object & ((1u << ARRAY_OBJECT_BITS) - 1));
+}
@@ -0,0 +1,83 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_RENDER_QUEUE_H_
+#define _PLANET_RENDER_QUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+class ViewAndProjectionBlock;
+
+// Layers are drawn in order: everything in the scene, then what's
+// drawn over it.
+enum RenderLayer {
+    SCENE_LAYER,
+    OVERLAY_LAYER
+};
+
+// One draw for RenderQueue: the state it needs, where it is, and what
+// sets its uniforms and draws it, with its program and vertex array
+// already bound.
+struct DrawPacket {
+    typedef std::function<void()> Draw;
+
+    RenderLayer layer;
+    GLuint program;
+    GLuint array_object;
+    bool depth_test;
+    // A sphere around what's drawn, in world coordinates, to order
+    // the scene front to back by.
+    glm::vec3 center;
+    float radius;
+    Draw draw;
+};
+
+// What the last RenderQueue::execute() drew, and the state changes
+// it made between packets.
+struct RenderQueueStats {
+    std::size_t packets;
+    std::size_t programs;
+    std::size_t array_objects;
+};
+
+// Draws submitted over a frame, sorted by a 64-bit key and drawn
+// together. From the top, the key holds the layer, the distance to the
+// nearest point of the packet's sphere (for the scene layer, so that
+// nearer things fill the depth buffer first and hide what's behind
+// them from the fragment shader), then the program and the vertex
+// array, so that packets at the same distance share their state.
+class RenderQueue {
+public:
+    RenderQueue();
+    RenderQueue(const RenderQueue &other) = delete;
+    RenderQueue(RenderQueue &&other) = delete;
+    ~RenderQueue();
+
+    RenderQueue& operator=(const RenderQueue &other) = delete;
+    RenderQueue& operator=(RenderQueue &&other) = delete;
+
+    void submit(DrawPacket packet);
+
+    // Sort what's been submitted for the camera in vp_block, draw
+    // it, and empty the queue.
+    void execute(const ViewAndProjectionBlock &vp_block);
+
+    const RenderQueueStats& stats() const;
+
+    static uint64_t sortKey(const DrawPacket &packet, float depth);
+
+private:
+    std::vector<DrawPacket> m_packets;
+    std::vector<std::pair<uint64_t, std::size_t>> m_order;
+    RenderQueueStats m_stats;
+};
+
+#endif
@@ -1,283 +1,315 @@
 // -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
-#include <limits>
-#include <regex>
+#include <iostream>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "opengl.h"
 
 #include "glm_defines.h"
+#include <glm/geometric.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "OpenGLUtils.h"
 #include "SharedBlocks.h"
 
-const GLuint MAX_GLUINT = std::numeric_limits<GLuint>::max();
-
 const GLuint ViewAndProjectionBlock::BINDING_INDEX = 0;
 const GLuint LightListBlock::BINDING_INDEX = 1;
 
-GLuint ViewAndProjectionBlock::SIZE = 0;
-GLuint ViewAndProjectionBlock::VIEW_OFFSET = MAX_GLUINT;
-GLuint ViewAndProjectionBlock::VIEW_INV_OFFSET = MAX_GLUINT;
-GLuint ViewAndProjectionBlock::PROJECTION_OFFSET = MAX_GLUINT;
+#if defined(_DEBUG) || !defined(NDEBUG)
+// Compare the size of block_name in program, and the offsets of the
+// named uniforms in it, as the driver lays them out, against what the
+// C++ struct has, and say which differ. Blocks the program doesn't
+// use are skipped.
+void checkBlockLayout(GLuint program, const char *block_name, std::size_t size, const std::vector<std::pair<std::string, std::size_t>> &offsets) {
+    GLuint block_index = glGetUniformBlockIndex(program, block_name);
+    if (block_index == GL_INVALID_INDEX) {
+        return;
+    }
 
-ViewAndProjectionBlock::ViewAndProjectionBlock()
-    : m_buffer{0},
-      m_view{1.0},
-      m_projection{1.0}
-{}
+    GLint block_size = 0;
+    glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_DATA_SIZE, &block_size);
+    if (static_cast<std::size_t>(block_size) != size) {
+        std::cerr << block_name << " is " << block_size << " bytes in program "
+                  << program << ", not " << size << std::endl;
+    }
 
-ViewAndProjectionBlock::ViewAndProjectionBlock(glm::mat4x4 &view, glm::mat4x4 &projection)
-    : m_buffer{0},
-      m_view{view},
-      m_projection{projection}
-{}
+    for (const auto &expected : offsets) {
+        const char *name = expected.first.c_str();
+        GLuint index = GL_INVALID_INDEX;
+        glGetUniformIndices(program, 1, &name, &index);
+        if (index == GL_INVALID_INDEX) {
+            continue;
+        }
 
-ViewAndProjectionBlock::~ViewAndProjectionBlock() {
-    destroyBuffer();
+        GLint offset = -1;
+        glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_OFFSET, &offset);
+        if (offset < 0 || static_cast<std::size_t>(offset) != expected.second) {
+            std::cerr << block_name << "." << expected.first << " is at " << offset
+                      << " in program " << program << ", not " << expected.second << std::endl;
+        }
+    }
 }
+#endif
 
-void ViewAndProjectionBlock::setOffsets(GLuint program, const char *block_name) {
-    // Get the index of this uniform block.
-    GLuint block_index = glGetUniformBlockIndex(program, block_name);
+// How long beginFrame() waits on a fence at a time before flushing
+// and trying again, in nanoseconds.
+const GLuint64 RING_WAIT_NS = 1000000;
 
-    // Get the size of the buffer necessary for the block.
-    GLint block_size;
-    glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_DATA_SIZE, &block_size);
-    SIZE = block_size;
-
-    // Get how many uniforms are in this block.
-    GLint num_unifs;
-    glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_ACTIVE_UNIFORMS, &num_unifs);
-
-    // Get the indices of the uniforms in this block. OpenGL gives you the
-    // indices as ints, but wants them back as unsigned ints. Of course.
-    GLint *unif_indices_int = new GLint[num_unifs];
-    GLuint *unif_indices = new GLuint[num_unifs];
-    glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES, unif_indices_int);
-    for (int i = 0; i < num_unifs; ++i) {
-        unif_indices[i] = unif_indices_int[i];
+UniformRing::UniformRing(std::size_t frame_bytes, unsigned int frames_in_flight)
+    : m_buffer{0},
+      m_mapped{nullptr},
+      m_frame_bytes{frame_bytes},
+      m_alignment{1},
+      m_frame{0},
+      m_used{0},
+      m_fences(std::max(1u, frames_in_flight), nullptr),
+      m_stalls{0},
+      m_stall_ms{0.0}
+{
+    GLint alignment = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    m_alignment = static_cast<std::size_t>(std::max(1, alignment));
+    // Keep each slice aligned too.
+    m_frame_bytes = (m_frame_bytes + m_alignment - 1) / m_alignment * m_alignment;
+    std::size_t capacity = m_frame_bytes * m_fences.size();
+
+    glGenBuffers(1, &m_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+    if (GLAD_GL_VERSION_4_4) {
+        // Dynamic as well, in case it can't be mapped after all, and
+        // has to fall back to glBufferSubData.
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_UNIFORM_BUFFER, capacity, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
+        m_mapped = static_cast<char *>(glMapBufferRange(GL_UNIFORM_BUFFER, 0, capacity, flags));
+    } else {
+        glBufferData(GL_UNIFORM_BUFFER, capacity, nullptr, GL_DYNAMIC_DRAW);
     }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
 
-    // Get the offsets of the uniforms in the block.
-    GLint *unif_offs = new GLint[num_unifs];
-    glGetActiveUniformsiv(program, num_unifs, unif_indices, GL_UNIFORM_OFFSET, unif_offs);
-
-    GLint name_len;
-    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &name_len);
-    char *name = new char[name_len];
-
-    for (int i = 0; i < num_unifs; ++i) {
-        glGetActiveUniformName(program, unif_indices[i], name_len, nullptr, name);
-        if (std::strncmp("view", name, name_len) == 0) {
-            VIEW_OFFSET = unif_offs[i];
-        } else if (std::strncmp("view_inv", name, name_len) == 0) {
-            VIEW_INV_OFFSET = unif_offs[i];
-        } else if (std::strncmp("projection", name, name_len) == 0) {
-            PROJECTION_OFFSET = unif_offs[i];
+UniformRing::~UniformRing() {
+    for (GLsync &fence : m_fences) {
+        if (fence) {
+            glDeleteSync(fence);
         }
+        fence = nullptr;
     }
 
-    // Cleanup.
-    delete[] unif_indices_int;
-    delete[] unif_indices;
-    delete[] unif_offs;
-    delete[] name;
-}
+    if (glIsBuffer(m_buffer)) {
+        GLState::current().forgetBuffer(m_buffer);
+        if (m_mapped) {
+            glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+            glUnmapBuffer(GL_UNIFORM_BUFFER);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &m_buffer);
+    }
 
-void ViewAndProjectionBlock::setView(const glm::mat4x4 &new_view) {
-    m_view = new_view;
+    m_buffer = 0;
+    m_mapped = nullptr;
 }
 
-const glm::mat4x4& ViewAndProjectionBlock::view() const {
-    return m_view;
-}
+void UniformRing::beginFrame() {
+    m_frame = (m_frame + 1) % m_fences.size();
+    m_used = 0;
 
-void ViewAndProjectionBlock::setProjection(const glm::mat4x4 &new_proj) {
-    m_projection = new_proj;
-}
+    GLsync &fence = m_fences[m_frame];
+    if (!fence) {
+        return;
+    }
 
-const glm::mat4x4& ViewAndProjectionBlock::projection() const {
-    return m_projection;
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+        auto start = std::chrono::steady_clock::now();
+        do {
+            status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, RING_WAIT_NS);
+        } while (status == GL_TIMEOUT_EXPIRED);
+        auto end = std::chrono::steady_clock::now();
+
+        ++m_stalls;
+        m_stall_ms += std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    glDeleteSync(fence);
+    fence = nullptr;
 }
 
-void ViewAndProjectionBlock::writeToBuffer() {
-    if (m_buffer == 0) {
-        createBuffer();
+GLintptr UniformRing::write(const void *data, std::size_t size) {
+    std::size_t start = (m_used + m_alignment - 1) / m_alignment * m_alignment;
+    if (start + size > m_frame_bytes) {
+        throw std::runtime_error("Uniform ring slice is full");
     }
 
-    glm::mat4x4 view_inv = glm::inverse(m_view);
+    GLintptr offset = static_cast<GLintptr>(m_frame * m_frame_bytes + start);
+    if (m_mapped) {
+        std::memcpy(m_mapped + offset, data, size);
+    } else {
+        glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
 
-    glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
-    uint8_t *data = static_cast<uint8_t*>(glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY));
-    std::memcpy(data + VIEW_OFFSET, glm::value_ptr(m_view), sizeof(m_view));
-    std::memcpy(data + VIEW_INV_OFFSET, glm::value_ptr(view_inv), sizeof(view_inv));
-    std::memcpy(data + PROJECTION_OFFSET, glm::value_ptr(m_projection), sizeof(m_projection));
-    glUnmapBuffer(GL_UNIFORM_BUFFER);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    m_used = start + size;
+    return offset;
 }
 
-void ViewAndProjectionBlock::bind() const {
-    glBindBufferBase(GL_UNIFORM_BUFFER, BINDING_INDEX, m_buffer);
+void UniformRing::endFrame() {
+    if (m_used > 0) {
+        m_fences[m_frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
 }
 
-void ViewAndProjectionBlock::unbind() const {
-    glBindBufferBase(GL_UNIFORM_BUFFER, BINDING_INDEX, 0);
+GLuint UniformRing::buffer() const {
+    return m_buffer;
 }
 
-void ViewAndProjectionBlock::createBuffer() {
-    if (m_buffer > 0) {
-        destroyBuffer();
-        m_buffer = 0;
-    }
-
-    glGenBuffers(1, &m_buffer);
-    glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
-    glBufferData(GL_UNIFORM_BUFFER, SIZE, nullptr, GL_STATIC_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+bool UniformRing::isPersistent() const {
+    return m_mapped != nullptr;
 }
 
-void ViewAndProjectionBlock::destroyBuffer() {
-    if (glIsBuffer(m_buffer)) {
-        glDeleteBuffers(1, &m_buffer);
-    }
-    m_buffer = 0;
+unsigned int UniformRing::takeStalls(double &stall_ms) {
+    unsigned int stalls = m_stalls;
+    stall_ms = m_stall_ms;
+    m_stalls = 0;
+    m_stall_ms = 0.0;
+    return stalls;
 }
 
-LightInfo::LightInfo()
-    : enabled{GL_FALSE},
-      direction{0.0, 0.0, 0.0}
+ViewAndProjectionBlock::ViewAndProjectionBlock()
+    : m_view{1.0},
+      m_projection{1.0}
 {}
 
-LightInfo::~LightInfo() {}
-
-GLuint LightListBlock::SIZE = 0;
-GLuint LightListBlock::NUM_LIGHTS = 0;
-std::vector<LightOffsetInfo> LightListBlock::OFFSETS{};
-
-LightListBlock::LightListBlock()
-    : m_buffer{0},
-      m_light_info{NUM_LIGHTS}
+ViewAndProjectionBlock::ViewAndProjectionBlock(glm::mat4x4 &view, glm::mat4x4 &projection)
+    : m_view{view},
+      m_projection{projection}
 {}
 
-LightListBlock::~LightListBlock() {
-    destroyBuffer();
+ViewAndProjectionBlock::~ViewAndProjectionBlock() {}
+
+void ViewAndProjectionBlock::checkLayout(GLuint program, const char *block_name) {
+#if defined(_DEBUG) || !defined(NDEBUG)
+    checkBlockLayout(program, block_name, sizeof(ViewAndProjectionData), {
+        {"view", offsetof(ViewAndProjectionData, view)},
+        {"view_inv", offsetof(ViewAndProjectionData, view_inv)},
+        {"projection", offsetof(ViewAndProjectionData, projection)}
+    });
+#else
+    (void)program;
+    (void)block_name;
+#endif
 }
 
-void LightListBlock::setOffsets(GLuint program, const char *block_name) {
-    std::regex light_field_name("^lights\\[(\\d+)\\]\\.(\\w+)$");
-    std::cmatch light_field_parts;
-
-    // Get the index of this uniform block.
-    GLuint block_index = glGetUniformBlockIndex(program, block_name);
+void ViewAndProjectionBlock::setView(const glm::mat4x4 &new_view) {
+    m_view = new_view;
+}
 
-    // Get the size of the buffer necessary for the block.
-    GLint block_size;
-    glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_DATA_SIZE, &block_size);
-    SIZE = block_size;
-
-    // Allocate a buffer for the names of the uniforms in the block.
-    GLint max_name_len;
-    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_name_len);
-    char *name = new char[max_name_len];
-
-    // Get how many uniforms are in this block.
-    GLint num_unifs;
-    glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_ACTIVE_UNIFORMS, &num_unifs);
-
-    // We know there are 2 uniforms per array element, so set the size of the array.
-    NUM_LIGHTS = num_unifs / 2;
-    OFFSETS.resize(NUM_LIGHTS);
-
-    // Get the indices of the uniforms in this block. OpenGL gives you the
-    // indices as ints, but wants them back as unsigned ints. Of course.
-    GLint *unif_indices_int = new GLint[num_unifs];
-    GLuint *unif_indices = new GLuint[num_unifs];
-    GLint *unif_offs = new GLint[num_unifs];
-
-    // Get the offsets of the uniforms in the block.
-    glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES, unif_indices_int);
-    for (int i = 0; i < num_unifs; ++i) { unif_indices[i] = unif_indices_int[i]; }
-    glGetActiveUniformsiv(program, num_unifs, unif_indices, GL_UNIFORM_OFFSET, unif_offs);
-
-    // Set up the OFFSETS vector.
-    for (int i = 0; i < num_unifs; ++i) {
-        glGetActiveUniformName(program, unif_indices[i], max_name_len, nullptr, name);
-        if (std::regex_search(name, light_field_parts, light_field_name)) {
-            int light_index = std::stoi(light_field_parts[1]);
-            std::string field_str{light_field_parts[2]};
-
-            if (field_str == "enabled") {
-                OFFSETS[light_index].enabled = unif_offs[i];
-            } else if (field_str == "direction") {
-                OFFSETS[light_index].direction = unif_offs[i];
-            // } else if (field_str == "color") {
-            //     OFFSETS[light_index].color = unif_offs[i];
-            // } else if (field_str == "specular_exp") {
-            //     OFFSETS[light_index].specular_exp = unif_offs[i];
-            }
-        }
-    }
+const glm::mat4x4& ViewAndProjectionBlock::view() const {
+    return m_view;
+}
 
-    // Cleanup.
-    delete[] unif_indices_int;
-    delete[] unif_indices;
-    delete[] unif_offs;
-    delete[] name;
+void ViewAndProjectionBlock::setProjection(const glm::mat4x4 &new_proj) {
+    m_projection = new_proj;
 }
 
+const glm::mat4x4& ViewAndProjectionBlock::projection() const {
+    return m_projection;
+}
 
-void LightListBlock::enableLight(unsigned int index, const glm::vec3 &direction) {
-    m_light_info[index].enabled = GL_TRUE;
-    m_light_info[index].direction = direction;
+void ViewAndProjectionBlock::writeToBuffer(UniformRing &ring) {
+    ViewAndProjectionData data{m_view, glm::inverse(m_view), m_projection};
+    GLintptr offset = ring.write(&data, sizeof(data));
+    GLState::current().bindUniformBufferRange(BINDING_INDEX, ring.buffer(), offset, sizeof(data));
 }
 
-void LightListBlock::writeToBuffer() {
-    if (m_buffer == 0) {
-        createBuffer();
-    }
+LightListBlock::LightListBlock()
+    : m_data{},
+      m_local_lights{},
+      m_local_generation{0}
+{}
 
-    glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
-    uint8_t *data = static_cast<uint8_t*>(glMapBuffer(GL_UNIFORM_BUFFER, GL_READ_WRITE));
+LightListBlock::~LightListBlock() {}
 
-    for (unsigned int i = 0; i < NUM_LIGHTS; ++i) {
-        std::memcpy(data + OFFSETS[i].enabled, &m_light_info[i].enabled, sizeof(m_light_info[i].enabled));
-        std::memcpy(data + OFFSETS[i].direction, glm::value_ptr(m_light_info[i].direction), sizeof(m_light_info[i].direction));
-        // std::memcpy(data + OFFSETS[i].color, glm::value_ptr(m_light_info[i].color), sizeof(m_light_info[i].color));
-        // std::memcpy(data + OFFSETS[i].specular_exp, &m_light_info[i].specular_exp, sizeof(m_light_info[i].specular_exp));
+void LightListBlock::checkLayout(GLuint program, const char *block_name) {
+#if defined(_DEBUG) || !defined(NDEBUG)
+    std::vector<std::pair<std::string, std::size_t>> offsets;
+    for (unsigned int i = 0; i < LightListData::MAX_LIGHTS; ++i) {
+        std::string light = "lights[" + std::to_string(i) + "].";
+        std::size_t start = offsetof(LightListData, lights) + i*sizeof(LightInfo);
+        offsets.emplace_back(light + "enabled", start + offsetof(LightInfo, enabled));
+        offsets.emplace_back(light + "direction", start + offsetof(LightInfo, direction));
     }
+    offsets.emplace_back("light_count", offsetof(LightListData, light_count));
+    offsets.emplace_back("local_light_count", offsetof(LightListData, local_light_count));
+    offsets.emplace_back("cluster_grid", offsetof(LightListData, cluster_grid));
+    offsets.emplace_back("cluster_scale", offsetof(LightListData, cluster_scale));
+    offsets.emplace_back("depth_range", offsetof(LightListData, depth_range));
+    checkBlockLayout(program, block_name, sizeof(LightListData), offsets);
+#else
+    (void)program;
+    (void)block_name;
+#endif
+}
 
-    glUnmapBuffer(GL_UNIFORM_BUFFER);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+void LightListBlock::enableLight(unsigned int index, const glm::vec3 &direction) {
+    m_data.lights[index].enabled = GL_TRUE;
+    m_data.lights[index].direction = direction;
+    m_data.light_count = std::max(m_data.light_count, index + 1);
 }
 
-void LightListBlock::bind() const {
-    glBindBufferBase(GL_UNIFORM_BUFFER, BINDING_INDEX, m_buffer);
+void LightListBlock::addPointLight(const glm::vec3 &position, const glm::vec3 &color, float range) {
+    m_local_lights.push_back(LocalLight{position, range, color, -1.0f, glm::vec3{0.0f}, -1.0f});
+    ++m_local_generation;
 }
 
-void LightListBlock::unbind() const {
-    glBindBufferBase(GL_UNIFORM_BUFFER, BINDING_INDEX, 0);
+void LightListBlock::addSpotLight(const glm::vec3 &position, const glm::vec3 &direction, const glm::vec3 &color, float range, float inner_angle, float outer_angle) {
+    m_local_lights.push_back(LocalLight{
+        position, range, color, std::cos(outer_angle),
+        glm::normalize(direction), std::cos(inner_angle)});
+    ++m_local_generation;
 }
 
-void LightListBlock::createBuffer() {
-    if (m_buffer > 0) {
-        destroyBuffer();
-    }
+const std::vector<LocalLight>& LightListBlock::localLights() const {
+    return m_local_lights;
+}
 
-    glGenBuffers(1, &m_buffer);
-    glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
-    glBufferData(GL_UNIFORM_BUFFER, SIZE, nullptr, GL_STATIC_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+unsigned int LightListBlock::localLightGeneration() const {
+    return m_local_generation;
 }
 
-void LightListBlock::destroyBuffer() {
-    if (glIsBuffer(m_buffer)) {
-        glDeleteBuffers(1, &m_buffer);
+void LightListBlock::setClusters(unsigned int local_light_count, const glm::uvec4 &grid, const glm::vec4 &scale, const glm::vec4 &depth_range) {
+    m_data.local_light_count = local_light_count;
+    m_data.cluster_grid = grid;
+    m_data.cluster_scale = scale;
+    m_data.depth_range = depth_range;
+}
+
+ShaderFeatures LightListBlock::shaderFeatures(bool clustered) const {
+    ShaderFeatures features{};
+    bool contiguous = true;
+    for (unsigned int i = 0; i < m_data.light_count; ++i) {
+        contiguous = contiguous && m_data.lights[i].enabled;
     }
-    m_buffer = 0;
+    if (contiguous) {
+        features.set("LIGHT_COUNT", static_cast<int>(m_data.light_count));
+    }
+    features.set("LOCAL_LIGHTS", clustered ? 1 : 0);
+    return features;
+}
+
+void LightListBlock::writeToBuffer(UniformRing &ring) {
+    GLintptr offset = ring.write(&m_data, sizeof(m_data));
+    GLState::current().bindUniformBufferRange(BINDING_INDEX, ring.buffer(), offset, sizeof(m_data));
 }
@@ -3,6 +3,8 @@
 #ifndef _PLANET_SHARED_BLOCKS_H_
 #define _PLANET_SHARED_BLOCKS_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
 #include "opengl.h"
@@ -12,6 +14,72 @@
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 
+class ShaderFeatures;
+
+// Uniform data written afresh each frame, into a ring of one slice per
+// frame in flight of a buffer that stays mapped. Each slice is fenced
+// once its frame's commands are issued, and only written again once
+// the fence has passed, so writing never waits on the GPU to finish
+// with the data it replaces. beginFrame() waits if it has to, which
+// it only does when the GPU is more than frames_in_flight - 1 frames
+// behind. Without OpenGL 4.4's glBufferStorage, the slices are
+// written with glBufferSubData.
+class UniformRing {
+public:
+    // Each slice holds frame_bytes, less what aligning each write
+    // takes.
+    UniformRing(std::size_t frame_bytes, unsigned int frames_in_flight);
+    UniformRing(const UniformRing &other) = delete;
+    UniformRing(UniformRing &&other) = delete;
+    ~UniformRing();
+
+    UniformRing& operator=(const UniformRing &other) = delete;
+    UniformRing& operator=(UniformRing &&other) = delete;
+
+    // Move on to the next slice, once the GPU is done with it.
+    void beginFrame();
+
+    // Copy size bytes from data into this frame's slice, and return
+    // where they went, for glBindBufferRange. Throws if the slice is
+    // full.
+    GLintptr write(const void *data, std::size_t size);
+
+    // Fence this frame's slice.
+    void endFrame();
+
+    GLuint buffer() const;
+    bool isPersistent() const;
+
+    // How many times beginFrame() had to wait, and for how many
+    // milliseconds in all, since the last call.
+    unsigned int takeStalls(double &stall_ms);
+
+private:
+    GLuint m_buffer;
+    char *m_mapped;
+    std::size_t m_frame_bytes;
+    std::size_t m_alignment;
+
+    unsigned int m_frame;
+    std::size_t m_used;
+    std::vector<GLsync> m_fences;
+
+    unsigned int m_stalls;
+    double m_stall_ms;
+};
+
+// ViewAndProjectionBlock as the shaders declare it, std140.
+struct ViewAndProjectionData {
+    glm::mat4x4 view;
+    glm::mat4x4 view_inv;
+    glm::mat4x4 projection;
+};
+
+static_assert(offsetof(ViewAndProjectionData, view) == 0, "std140 puts view at 0");
+static_assert(offsetof(ViewAndProjectionData, view_inv) == 64, "std140 puts view_inv at 64");
+static_assert(offsetof(ViewAndProjectionData, projection) == 128, "std140 puts projection at 128");
+static_assert(sizeof(ViewAndProjectionData) == 192, "ViewAndProjectionBlock is 192 bytes in std140");
+
 class ViewAndProjectionBlock {
 public:
     ViewAndProjectionBlock();
@@ -19,7 +87,10 @@ public:
     ~ViewAndProjectionBlock();
 
     static const GLuint BINDING_INDEX;
-    static void setOffsets(GLuint program, const char *block_name);
+    // In debug builds, check that the driver lays out block_name in
+    // program the way ViewAndProjectionData does, and say where it
+    // doesn't.
+    static void checkLayout(GLuint program, const char *block_name);
 
     void setView(const glm::mat4x4 &new_view);
     const glm::mat4x4& view() const;
@@ -27,55 +98,117 @@ public:
     void setProjection(const glm::mat4x4 &new_proj);
     const glm::mat4x4& projection() const;
 
-    void writeToBuffer();
-    void bind() const;
-    void unbind() const;
+    // Write the block into this frame's slice of ring, and bind that
+    // to BINDING_INDEX.
+    void writeToBuffer(UniformRing &ring);
 
 private:
-    void createBuffer();
-    void destroyBuffer();
-
-    GLuint m_buffer;
     glm::mat4x4 m_view, m_projection;
-    static GLuint SIZE, VIEW_OFFSET, VIEW_INV_OFFSET, PROJECTION_OFFSET;
 };
 
+// One of the shaders' LightInfo, std140: the bool takes 4 bytes, the
+// vec3 is aligned to 16, and the struct is padded to a multiple of 16
+// in the array.
 struct LightInfo {
     GLuint enabled;
+    GLuint pad0[3];
     glm::vec3 direction;
+    float pad1;
     // glm::vec4 color;
     // GLuint specular_exp;
+};
 
-    LightInfo();
-    ~LightInfo();
+static_assert(offsetof(LightInfo, enabled) == 0, "std140 puts LightInfo.enabled at 0");
+static_assert(offsetof(LightInfo, direction) == 16, "std140 puts LightInfo.direction at 16");
+static_assert(sizeof(LightInfo) == 32, "LightInfo is 32 bytes in std140 arrays");
+
+// LightListBlock as the shaders declare it; MAX_LIGHTS matches theirs.
+// After the directional lights come the local lights' count and where
+// LightClusters put them: the number of clusters across, down and
+// deep, and how many lights each holds; the clusters per pixel across
+// and down, and the scale and bias that take the log of a view depth
+// to a slice; and the near and far planes, to take a fragment's depth
+// back to a view depth.
+struct LightListData {
+    static const unsigned int MAX_LIGHTS = 10;
+    LightInfo lights[MAX_LIGHTS];
+    GLuint light_count;
+    GLuint local_light_count;
+    GLuint pad0[2];
+    glm::uvec4 cluster_grid;
+    glm::vec4 cluster_scale;
+    glm::vec4 depth_range;
 };
 
-struct LightOffsetInfo {
-    GLuint enabled, direction; // , color, specular_exp;
+static_assert(offsetof(LightListData, light_count) == 320, "std140 puts light_count at 320");
+static_assert(offsetof(LightListData, local_light_count) == 324, "std140 puts local_light_count at 324");
+static_assert(offsetof(LightListData, cluster_grid) == 336, "std140 puts cluster_grid at 336");
+static_assert(offsetof(LightListData, cluster_scale) == 352, "std140 puts cluster_scale at 352");
+static_assert(offsetof(LightListData, depth_range) == 368, "std140 puts depth_range at 368");
+static_assert(sizeof(LightListData) == 384, "LightListBlock is 384 bytes in std140");
+
+// A point or spot light, std430, as the shaders' LocalLightBuffer
+// holds them. The light fades to nothing at range from position, in
+// world coordinates. A spot light shines along direction, fading out
+// between the cosines spot_inner and spot_outer of the angle off it; a
+// point light has a spot_outer of -1.
+struct LocalLight {
+    glm::vec3 position;
+    float range;
+    glm::vec3 color;
+    float spot_outer;
+    glm::vec3 direction;
+    float spot_inner;
 };
 
+static_assert(offsetof(LocalLight, range) == 12, "std430 puts LocalLight.range at 12");
+static_assert(offsetof(LocalLight, color) == 16, "std430 puts LocalLight.color at 16");
+static_assert(offsetof(LocalLight, spot_outer) == 28, "std430 puts LocalLight.spot_outer at 28");
+static_assert(offsetof(LocalLight, direction) == 32, "std430 puts LocalLight.direction at 32");
+static_assert(offsetof(LocalLight, spot_inner) == 44, "std430 puts LocalLight.spot_inner at 44");
+static_assert(sizeof(LocalLight) == 48, "LocalLight is 48 bytes apart in a std430 array");
+
+// The directional lights, which light everything and live in the
+// uniform block, and the local (point and spot) lights, which light
+// what's near them. There can be thousands of those, so they're kept
+// here for LightClusters to upload and bin; the block only says where
+// to find them.
 class LightListBlock {
 public:
     LightListBlock();
     ~LightListBlock();
 
     static const GLuint BINDING_INDEX;
-    static void setOffsets(GLuint program, const char *block_name);
+    // As ViewAndProjectionBlock's, for LightListData.
+    static void checkLayout(GLuint program, const char *block_name);
 
     void enableLight(unsigned int index, const glm::vec3 &direction);
 
-    void writeToBuffer();
-    void bind() const;
-    void unbind() const;
+    void addPointLight(const glm::vec3 &position, const glm::vec3 &color, float range);
+    // inner_angle and outer_angle are in radians off direction.
+    void addSpotLight(const glm::vec3 &position, const glm::vec3 &direction, const glm::vec3 &color, float range, float inner_angle, float outer_angle);
 
-private:
-    void createBuffer();
-    void destroyBuffer();
+    const std::vector<LocalLight>& localLights() const;
+    // Changes whenever a local light is added.
+    unsigned int localLightGeneration() const;
 
-    GLuint m_buffer;
-    std::vector<LightInfo> m_light_info;
-    static GLuint SIZE, NUM_LIGHTS;
-    static std::vector<LightOffsetInfo> OFFSETS;
+    // Where LightClusters binned local_light_count of the local
+    // lights. Until it's called, the local lights light nothing.
+    void setClusters(unsigned int local_light_count, const glm::uvec4 &grid, const glm::vec4 &scale, const glm::vec4 &depth_range);
+
+    // What to specialise lighting.glsl on for these lights: their
+    // LIGHT_COUNT, if the lights enabled so far are the first so many,
+    // and LOCAL_LIGHTS, whether they're clustered. Lights enabled
+    // later are only seen by shaders built without it.
+    ShaderFeatures shaderFeatures(bool clustered) const;
+
+    // As ViewAndProjectionBlock's.
+    void writeToBuffer(UniformRing &ring);
+
+private:
+    LightListData m_data;
+    std::vector<LocalLight> m_local_lights;
+    unsigned int m_local_generation;
 };
 
 #endif
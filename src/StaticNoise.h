@@ -0,0 +1,174 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_STATIC_NOISE_H_
+#define _PLANET_STATIC_NOISE_H_
+
+#include <cstddef>
+
+#include "Curve.h"
+#include "Noise.h"
+
+// Noise graphs composed at compile time, e.g.
+//
+//     StaticCurve<StaticOctave<StaticPerlin> >
+//
+// Each stage holds the stage below it by value and calls it directly,
+// so the compiler can inline the whole graph, down to Perlin's fade,
+// lerp, and grad. They compute exactly what the matching Perlin,
+// Octave, and Curve compute. Wrap a graph in a NoiseAdapter to pass
+// it to anything that takes a NoiseFunction.
+
+class StaticPerlin {
+public:
+    StaticPerlin()
+        : m_permutation{},
+          m_x_scale{1.0},
+          m_y_scale{1.0},
+          m_z_scale{1.0}
+    {}
+
+    StaticPerlin(double x_scale, double y_scale, double z_scale)
+        : m_permutation{},
+          m_x_scale{x_scale},
+          m_y_scale{y_scale},
+          m_z_scale{z_scale}
+    {}
+
+    // Use the same permutation and scales as an existing Perlin.
+    explicit StaticPerlin(const Perlin &source)
+        : m_permutation(source.permutation()),
+          m_x_scale{source.xScale()},
+          m_y_scale{source.yScale()},
+          m_z_scale{source.zScale()}
+    {}
+
+    double operator()(double x, double y) const {
+        return Perlin::noise(m_permutation, x * m_x_scale, y * m_y_scale);
+    }
+
+    double operator()(double x, double y, double z) const {
+        return Perlin::noise(m_permutation, x * m_x_scale, y * m_y_scale, z * m_z_scale);
+    }
+
+private:
+    PermutationTable m_permutation;
+    double m_x_scale, m_y_scale, m_z_scale;
+};
+
+template <typename Base>
+class StaticOctave {
+public:
+    StaticOctave(const Base &base, int octaves, double persistence)
+        : m_noise(base),
+          m_octaves{octaves},
+          m_persistence{persistence}
+    {}
+
+    double operator()(double x, double y) const {
+        double total = 0;
+        double frequency = 1;
+        double amplitude = 1;
+        double max_value = 0;
+
+        for (int i = 0; i < m_octaves; ++i) {
+            total += m_noise(x * frequency, y * frequency) * amplitude;
+            max_value += amplitude;
+            amplitude *= m_persistence;
+            frequency *= 2;
+        }
+
+        return total / max_value;
+    }
+
+    double operator()(double x, double y, double z) const {
+        double total = 0;
+        double amplitude = 1;
+        double freq_factor = 1.0 / m_persistence;
+
+        for (int i = 0; i < m_octaves; ++i) {
+            total += m_noise(x, y, z) * amplitude;
+            amplitude *= m_persistence;
+            x *= freq_factor;
+            y *= freq_factor;
+            z *= freq_factor;
+        }
+
+        return total;
+    }
+
+private:
+    Base m_noise;
+    int m_octaves;
+    double m_persistence;
+};
+
+template <typename Base>
+class StaticCurve {
+public:
+    StaticCurve(const Base &base, const CubicSpline &curve)
+        : m_noise(base),
+          m_curve(curve)
+    {}
+
+    double operator()(double x, double y) const {
+        return m_curve(m_noise(x, y));
+    }
+
+    double operator()(double x, double y, double z) const {
+        return m_curve(m_noise(x, y, z));
+    }
+
+private:
+    Base m_noise;
+    const CubicSpline &m_curve;
+};
+
+// Presents a static graph as a NoiseFunction. There is one virtual
+// call per operator() or per evaluate() batch, and none inside.
+template <typename Graph>
+class NoiseAdapter : public NoiseFunction {
+public:
+    explicit NoiseAdapter(const Graph &graph)
+        : m_graph(graph)
+    {}
+
+    virtual ~NoiseAdapter() {}
+
+    virtual double operator()(double x, double y) const {
+        return m_graph(x, y);
+    }
+
+    virtual double operator()(double x, double y, double z) const {
+        return m_graph(x, y, z);
+    }
+
+    virtual void evaluate(std::size_t count, const double *xs, const double *ys, const double *zs, double *out) const {
+        for (std::size_t i = 0; i < count; ++i) {
+            out[i] = m_graph(xs[i], ys[i], zs[i]);
+        }
+    }
+
+    const Graph& graph() const {
+        return m_graph;
+    }
+
+private:
+    Graph m_graph;
+};
+
+template <typename Base>
+StaticOctave<Base> staticOctave(const Base &base, int octaves, double persistence) {
+    return StaticOctave<Base>(base, octaves, persistence);
+}
+
+template <typename Base>
+StaticCurve<Base> staticCurve(const Base &base, const CubicSpline &curve) {
+    return StaticCurve<Base>(base, curve);
+}
+
+template <typename Graph>
+NoiseAdapter<Graph> noiseAdapter(const Graph &graph) {
+    return NoiseAdapter<Graph>(graph);
+}
+
+#endif
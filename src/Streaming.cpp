@@ -0,0 +1,218 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <utility>
+
+#include "opengl.h"
+
+#include "Streaming.h"
+
+BackgroundWorker::BackgroundWorker()
+    : m_mutex{},
+      m_wake{},
+      m_jobs{},
+      m_stopping{false},
+      m_thread{&BackgroundWorker::run, this}
+{}
+
+BackgroundWorker::~BackgroundWorker() {
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_stopping = true;
+        m_jobs.clear();
+    }
+    m_wake.notify_all();
+    m_thread.join();
+}
+
+void BackgroundWorker::push(Job job) {
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_jobs.push_back(std::move(job));
+    }
+    m_wake.notify_one();
+}
+
+void BackgroundWorker::run() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_wake.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+            if (m_stopping) {
+                return;
+            }
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+
+        job();
+    }
+}
+
+BackgroundBake::BackgroundBake(Bake bake)
+    : m_bake{std::move(bake)},
+      m_finished{false},
+      m_baking{false},
+      m_ready{false},
+      m_worker{}
+{}
+
+BackgroundBake::~BackgroundBake() {}
+
+void BackgroundBake::start() {
+    if (m_baking) {
+        return;
+    }
+
+    m_baking = true;
+    m_worker.push([this]() {
+        m_bake();
+        m_finished = true;
+    });
+}
+
+bool BackgroundBake::takeFinished() {
+    if (!m_finished) {
+        return false;
+    }
+
+    m_finished = false;
+    m_baking = false;
+    m_ready = true;
+    return true;
+}
+
+bool BackgroundBake::isReady() const {
+    return m_ready;
+}
+
+bool BackgroundBake::isBaking() const {
+    return m_baking;
+}
+
+StagingBuffer::StagingBuffer(std::size_t capacity, std::size_t frame_budget)
+    : m_buffer{0},
+      m_mapped{nullptr},
+      m_capacity{capacity},
+      m_frame_budget{frame_budget},
+      m_budget_left{frame_budget},
+      m_head{0},
+      m_tail{0},
+      m_frame_start{0},
+      m_regions{},
+      m_uploaded{0}
+{
+    if (!GLAD_GL_VERSION_4_4 || capacity == 0) {
+        return;
+    }
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &m_buffer);
+    glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+    glBufferStorage(GL_COPY_READ_BUFFER, m_capacity, nullptr, flags);
+    m_mapped = static_cast<char *>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, m_capacity, flags));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    if (!m_mapped) {
+        glDeleteBuffers(1, &m_buffer);
+        m_buffer = 0;
+    }
+}
+
+StagingBuffer::~StagingBuffer() {
+    for (Region &region : m_regions) {
+        glDeleteSync(region.fence);
+    }
+    m_regions.clear();
+
+    if (glIsBuffer(m_buffer)) {
+        glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteBuffers(1, &m_buffer);
+    }
+
+    m_buffer = 0;
+    m_mapped = nullptr;
+}
+
+void StagingBuffer::beginFrame() {
+    while (!m_regions.empty()) {
+        GLenum status = glClientWaitSync(m_regions.front().fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            break;
+        }
+
+        m_tail = m_regions.front().end;
+        glDeleteSync(m_regions.front().fence);
+        m_regions.pop_front();
+    }
+
+    m_budget_left = m_frame_budget;
+    m_frame_start = m_head;
+}
+
+std::size_t StagingBuffer::upload(GLuint buffer, std::size_t offset, const void *data, std::size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    std::size_t done = 0;
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    if (m_mapped) {
+        glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+    }
+
+    while (done < size && m_budget_left > 0) {
+        std::size_t chunk = std::min(size - done, m_budget_left);
+        if (m_mapped) {
+            // Up to the end of the ring or the oldest part still in
+            // use, whichever is first.
+            std::size_t position = m_head % m_capacity;
+            std::size_t free = m_capacity - (m_head - m_tail);
+            chunk = std::min(chunk, std::min(free, m_capacity - position));
+            if (chunk == 0) {
+                break;
+            }
+
+            std::memcpy(m_mapped + position, bytes + done, chunk);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, position, offset + done, chunk);
+            m_head += chunk;
+        } else {
+            glBufferSubData(GL_COPY_WRITE_BUFFER, offset + done, chunk, bytes + done);
+        }
+
+        done += chunk;
+        m_budget_left -= chunk;
+    }
+
+    if (m_mapped) {
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    m_uploaded += done;
+    return done;
+}
+
+void StagingBuffer::endFrame() {
+    if (m_head != m_frame_start) {
+        m_regions.push_back(Region{glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), m_head});
+    }
+}
+
+bool StagingBuffer::isPersistent() const {
+    return m_mapped != nullptr;
+}
+
+std::size_t StagingBuffer::frameBudget() const {
+    return m_frame_budget;
+}
+
+std::size_t StagingBuffer::takeUploadedBytes() {
+    std::size_t rv = m_uploaded;
+    m_uploaded = 0;
+    return rv;
+}
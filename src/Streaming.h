@@ -0,0 +1,139 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_STREAMING_H_
+#define _PLANET_STREAMING_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "opengl.h"
+
+// A thread that runs jobs one at a time, in the order they were
+// pushed. Jobs can use the shared TaskPool to spread their own work
+// out; the thread that pushed them never waits for them.
+class BackgroundWorker {
+public:
+    typedef std::function<void()> Job;
+
+    BackgroundWorker();
+    BackgroundWorker(const BackgroundWorker &other) = delete;
+    BackgroundWorker(BackgroundWorker &&other) = delete;
+    // Drops the jobs that haven't started, and waits for the one that
+    // has.
+    ~BackgroundWorker();
+
+    BackgroundWorker& operator=(const BackgroundWorker &other) = delete;
+    BackgroundWorker& operator=(BackgroundWorker &&other) = delete;
+
+    void push(Job job);
+
+private:
+    void run();
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<Job> m_jobs;
+    bool m_stopping;
+    // Last, so that it starts once the rest is set up.
+    std::thread m_thread;
+};
+
+// A bake that's run on a BackgroundWorker of its own whenever it's
+// asked for, one at a time, and handed over to the thread that asked
+// once it's done. What the bake fills in belongs to the background
+// thread from start() until takeFinished() says it's done.
+class BackgroundBake {
+public:
+    typedef std::function<void()> Bake;
+
+    explicit BackgroundBake(Bake bake);
+    BackgroundBake(const BackgroundBake &other) = delete;
+    BackgroundBake(BackgroundBake &&other) = delete;
+    // Waits for a bake underway.
+    ~BackgroundBake();
+
+    BackgroundBake& operator=(const BackgroundBake &other) = delete;
+    BackgroundBake& operator=(BackgroundBake &&other) = delete;
+
+    // Start baking, unless a bake is underway already.
+    void start();
+
+    // Whether a bake has finished since the last time, in which case
+    // it's no longer underway and what it filled in can be used.
+    bool takeFinished();
+
+    // Whether a bake has been taken, and whether one is underway.
+    bool isReady() const;
+    bool isBaking() const;
+
+private:
+    Bake m_bake;
+    std::atomic<bool> m_finished;
+    bool m_baking;
+    bool m_ready;
+    // Last, so that it's stopped before the rest goes away.
+    BackgroundWorker m_worker;
+};
+
+// Copies data into buffer objects through a ring of staging memory
+// that stays mapped, no more than a fixed number of bytes a frame.
+// Each frame's part of the ring is fenced once its copies are issued,
+// and is only written again once the fence has passed, which
+// beginFrame() checks without waiting. Without OpenGL 4.4's
+// glBufferStorage, it falls back to glBufferSubData, within the same
+// budget.
+class StagingBuffer {
+public:
+    StagingBuffer(std::size_t capacity, std::size_t frame_budget);
+    StagingBuffer(const StagingBuffer &other) = delete;
+    StagingBuffer(StagingBuffer &&other) = delete;
+    ~StagingBuffer();
+
+    StagingBuffer& operator=(const StagingBuffer &other) = delete;
+    StagingBuffer& operator=(StagingBuffer &&other) = delete;
+
+    // Take back the parts of the ring the GPU is done with, and start
+    // a new budget.
+    void beginFrame();
+
+    // Copy as much of the size bytes at data to offset in buffer as
+    // the budget and the ring allow, and return how much that was.
+    // The copies are ordered before any later commands, so whatever
+    // reads them can be drawn straight away.
+    std::size_t upload(GLuint buffer, std::size_t offset, const void *data, std::size_t size);
+
+    // Fence what this frame wrote.
+    void endFrame();
+
+    bool isPersistent() const;
+    std::size_t frameBudget() const;
+    // Bytes uploaded since the last call.
+    std::size_t takeUploadedBytes();
+
+private:
+    struct Region {
+        GLsync fence;
+        std::size_t end;
+    };
+
+    GLuint m_buffer;
+    char *m_mapped;
+    std::size_t m_capacity;
+    std::size_t m_frame_budget;
+    std::size_t m_budget_left;
+
+    // Running totals of bytes written and freed; the ring holds
+    // m_head - m_tail bytes the GPU may still be reading.
+    std::size_t m_head, m_tail;
+    std::size_t m_frame_start;
+    std::deque<Region> m_regions;
+
+    std::size_t m_uploaded;
+};
+
+#endif
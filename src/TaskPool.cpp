@@ -0,0 +1,150 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "TaskPool.h"
+
+unsigned int TaskPool::SHARED_THREAD_COUNT = 0;
+
+TaskPool::TaskPool(unsigned int threads)
+    : m_queues{},
+      m_workers{},
+      m_wake_mutex{},
+      m_wake{},
+      m_pending{0},
+      m_stopping{false}
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Queue 0 belongs to whichever thread calls parallelFor.
+    for (unsigned int i = 0; i < threads; ++i) {
+        m_queues.emplace_back(new WorkerQueue);
+    }
+
+    for (unsigned int i = 1; i < threads; ++i) {
+        m_workers.emplace_back(&TaskPool::workerLoop, this, i);
+    }
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lock{m_wake_mutex};
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    for (auto &worker : m_workers) {
+        worker.join();
+    }
+}
+
+unsigned int TaskPool::threadCount() const {
+    return static_cast<unsigned int>(m_queues.size());
+}
+
+void TaskPool::parallelFor(std::size_t count, std::size_t grain, const RangeTask &fn) {
+    if (count == 0) {
+        return;
+    }
+
+    grain = std::max<std::size_t>(grain, 1);
+    std::size_t num_tasks = (count + grain - 1) / grain;
+    if (num_tasks == 1 || m_workers.empty()) {
+        fn(0, count);
+        return;
+    }
+
+    std::atomic<std::size_t> remaining{num_tasks};
+    for (std::size_t t = 0; t < num_tasks; ++t) {
+        std::size_t begin = t * grain;
+        std::size_t end = std::min(count, begin + grain);
+        push(t % m_queues.size(), [&fn, &remaining, begin, end]() {
+            fn(begin, end);
+            remaining.fetch_sub(1, std::memory_order_release);
+        });
+    }
+
+    // Help out until every range is done. Once there is nothing left
+    // to take, the last few ranges are running on other threads.
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        if (!tryRunOne(0)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+TaskPool& TaskPool::shared() {
+    static TaskPool pool{SHARED_THREAD_COUNT};
+    return pool;
+}
+
+void TaskPool::setSharedThreadCount(unsigned int threads) {
+    SHARED_THREAD_COUNT = threads;
+}
+
+void TaskPool::push(std::size_t queue, Task task) {
+    {
+        std::lock_guard<std::mutex> lock{m_queues[queue]->mutex};
+        m_queues[queue]->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{m_wake_mutex};
+        m_pending.fetch_add(1);
+    }
+    m_wake.notify_one();
+}
+
+bool TaskPool::tryRunOne(std::size_t home) {
+    Task task;
+
+    // Newest first from our own queue, oldest first from everyone
+    // else's.
+    {
+        WorkerQueue &own = *m_queues[home];
+        std::lock_guard<std::mutex> lock{own.mutex};
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+        }
+    }
+
+    for (std::size_t i = 1; !task && i < m_queues.size(); ++i) {
+        WorkerQueue &victim = *m_queues[(home + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock{victim.mutex};
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+    }
+
+    if (!task) {
+        return false;
+    }
+
+    m_pending.fetch_sub(1);
+    task();
+    return true;
+}
+
+void TaskPool::workerLoop(std::size_t index) {
+    while (true) {
+        if (tryRunOne(index)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock{m_wake_mutex};
+        m_wake.wait(lock, [this]() { return m_stopping || m_pending.load() > 0; });
+        if (m_stopping) {
+            return;
+        }
+    }
+}
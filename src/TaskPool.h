@@ -0,0 +1,68 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_TASK_POOL_H_
+#define _PLANET_TASK_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, each with its own task queue. Workers
+// take tasks from the back of their own queue and, when it runs dry,
+// steal from the front of the others'.
+class TaskPool {
+public:
+    typedef std::function<void()> Task;
+    typedef std::function<void(std::size_t begin, std::size_t end)> RangeTask;
+
+    // threads counts the calling thread, which helps out in
+    // parallelFor, so a pool of 1 has no workers at all. 0 means one
+    // per hardware thread.
+    explicit TaskPool(unsigned int threads);
+    TaskPool(const TaskPool &other) = delete;
+    TaskPool(TaskPool &&other) = delete;
+    ~TaskPool();
+
+    TaskPool& operator=(const TaskPool &other) = delete;
+    TaskPool& operator=(TaskPool &&other) = delete;
+
+    unsigned int threadCount() const;
+
+    // Split [0, count) into ranges of about grain items and run fn on
+    // each of them across the pool. Returns when they have all
+    // finished.
+    void parallelFor(std::size_t count, std::size_t grain, const RangeTask &fn);
+
+    // The pool shared by the whole program. Its size is fixed the
+    // first time it is used; call setSharedThreadCount before that.
+    static TaskPool& shared();
+    static void setSharedThreadCount(unsigned int threads);
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void push(std::size_t queue, Task task);
+    bool tryRunOne(std::size_t home);
+    void workerLoop(std::size_t index);
+
+    std::vector<std::unique_ptr<WorkerQueue> > m_queues;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_wake_mutex;
+    std::condition_variable m_wake;
+    std::atomic<std::size_t> m_pending;
+    bool m_stopping;
+
+    static unsigned int SHARED_THREAD_COUNT;
+};
+
+#endif
@@ -1,62 +1,193 @@
 // -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
 #include <iostream>
+#include <utility>
 #include <vector>
 
 #include "glm_defines.h"
+#include <glm/geometric.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
 
 #include "opengl.h"
 
+#include "Culling.h"
+#include "DetailNormalMap.h"
 #include "Models.h"
 #include "Noise.h"
 #include "OpenGLUtils.h"
+#include "PackedVertex.h"
+#include "ProgressiveMesh.h"
+#include "RenderQueue.h"
 #include "Resource.h"
 #include "SharedBlocks.h"
+#include "TaskPool.h"
 #include "Terrain.h"
-
-Terrain::Terrain()
-    : m_vertices{},
-      m_indices{},
-      m_array_buffer{0},
-      m_elem_buffer{0},
-      m_vertex_shader{0},
-      m_fragment_shader{0},
-      m_program{0},
-      m_position_loc{-1},
-      m_normal_loc{-1},
-      m_model_loc{-1},
-      m_array_object{0}
+#include "TerrainCompute.h"
+
+// Vertices per noise task.
+const std::size_t DISPLACE_GRAIN = 4096;
+
+// The texture unit the detail normal map is bound to.
+const GLuint DETAIL_MAP_UNIT = 0;
+
+// Displaces each refinement of the terrain by the noise. If the noise
+// is a Curve, the noise under it is kept for each vertex of the last
+// refinement built, so that the curve can be changed without sampling
+// it again.
+class TerrainSource : public MeshSource {
+public:
+    TerrainSource(float radius, const NoiseFunction &noise);
+    virtual ~TerrainSource();
+
+    virtual HeightRange prepare(PositionsAndElements &sphere);
+    virtual void build(const PositionsAndElements &sphere, std::size_t first, std::size_t count, TerrainVertex *out);
+
+    // The range the noise's heights cover, if it's known.
+    bool heightRange(HeightRange &range) const;
+
+    // Whether recurve() can be used. Only to be asked once the mesh
+    // it builds is complete, when nothing else is filling it in.
+    bool isCurved() const;
+
+    // Displace the last refinement built through the curve again.
+    void recurve(std::vector<TerrainVertex> &vertices) const;
+
+private:
+    float m_radius;
+    const NoiseFunction &m_noise;
+    const Curve *m_curve;
+    // The whole refinement, if it had to be displaced up front.
+    std::vector<TerrainVertex> m_displaced;
+    // The last refinement's positions, and the noise under the curve
+    // at each.
+    std::vector<glm::vec3> m_positions;
+    std::vector<NoiseSample> m_base_samples;
+};
+
+TerrainSource::TerrainSource(float radius, const NoiseFunction &noise)
+    : m_radius{radius},
+      m_noise{noise},
+      m_curve{dynamic_cast<const Curve *>(&noise)},
+      m_displaced{},
+      m_positions{},
+      m_base_samples{}
 {}
 
-Terrain::Terrain(float radius, int refinements, const NoiseFunction &noise): Terrain() {
-    initGeometry(radius, refinements, noise);
-    initBuffers();
-    initProgram();
-    initVAO();
+TerrainSource::~TerrainSource() {}
+
+HeightRange TerrainSource::prepare(PositionsAndElements &sphere) {
+    // If the noise's range is known, each block can be displaced as
+    // it's built. Otherwise the whole terrain is displaced first, to
+    // find the range its heights cover.
+    HeightRange rv;
+    if (heightRange(rv)) {
+        m_displaced.clear();
+        if (m_curve) {
+            m_positions = sphere.positions;
+            m_base_samples.resize(sphere.positions.size());
+        }
+        return rv;
+    }
+
+    displaceSphere(sphere, m_radius, m_noise, m_displaced);
+    rv = HeightRange{m_radius, m_radius};
+    for (const TerrainVertex &vertex : m_displaced) {
+        float height = glm::length(vertex.position);
+        rv.min = std::min(rv.min, height);
+        rv.max = std::max(rv.max, height);
+    }
+    return rv;
 }
 
-Terrain::~Terrain() {
-    std::vector<GLuint> bufs{};
+void TerrainSource::build(const PositionsAndElements &sphere, std::size_t first, std::size_t count, TerrainVertex *out) {
+    if (!m_displaced.empty()) {
+        std::copy(m_displaced.begin() + first, m_displaced.begin() + first + count, out);
+    } else if (!m_curve) {
+        displaceVertices(&sphere.positions[first], count, m_radius, m_noise, out);
+    } else {
+        // Keep the noise under the curve, then curve a copy of it.
+        std::vector<double> xs(count), ys(count), zs(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            xs[i] = sphere.positions[first + i].x;
+            ys[i] = sphere.positions[first + i].y;
+            zs[i] = sphere.positions[first + i].z;
+        }
+
+        NoiseSample *base = &m_base_samples[first];
+        m_curve->base().evaluateWithGradient(count, xs.data(), ys.data(), zs.data(), base);
 
-    if (glIsBuffer(m_array_buffer)) {
-        bufs.push_back(m_array_buffer);
+        std::vector<NoiseSample> samples(base, base + count);
+        m_curve->apply(count, samples.data());
+        displaceBySamples(&sphere.positions[first], samples.data(), count, m_radius, out);
     }
+}
 
-    if (glIsBuffer(m_elem_buffer)) {
-        bufs.push_back(m_elem_buffer);
+bool TerrainSource::heightRange(HeightRange &range) const {
+    std::pair<double, double> value_range = m_noise.range();
+    if (!std::isfinite(value_range.first) || !std::isfinite(value_range.second)) {
+        return false;
     }
 
-    if (bufs.size() > 0) {
-        glDeleteBuffers(static_cast<GLsizei>(bufs.size()), bufs.data());
+    range = HeightRange{
+        static_cast<float>(m_radius * (value_range.first/8.0 + 1.0)),
+        static_cast<float>(m_radius * (value_range.second/8.0 + 1.0))
+    };
+    return true;
+}
+
+bool TerrainSource::isCurved() const {
+    return m_curve && !m_base_samples.empty();
+}
+
+void TerrainSource::recurve(std::vector<TerrainVertex> &vertices) const {
+    vertices.resize(m_positions.size());
+    TaskPool::shared().parallelFor(m_positions.size(), DISPLACE_GRAIN, [&](std::size_t begin, std::size_t end) {
+        std::vector<NoiseSample> samples(m_base_samples.begin() + begin, m_base_samples.begin() + end);
+        m_curve->apply(samples.size(), samples.data());
+        displaceBySamples(&m_positions[begin], samples.data(), samples.size(), m_radius, &vertices[begin]);
+    });
+}
+
+Terrain::Terrain(float radius, const std::vector<int> &refinements, const NoiseFunction &noise, bool use_compute, const ShaderFeatures &lighting)
+    : m_radius{radius},
+      m_noise{noise},
+      m_mesh{"Terrain"},
+      m_vertex_shader{0},
+      m_fragment_shader{0},
+      m_program{0},
+      m_model_loc{-1},
+      m_height_range_loc{-1},
+      m_has_detail_loc{-1},
+      m_detail_map_loc{-1},
+      m_compute{},
+      m_source{},
+      m_detail{}
+{
+    if (use_compute) {
+        m_compute.reset(new TerrainCompute{});
+        if (!m_compute->isAvailable() || !m_compute->setNoise(noise)) {
+            std::cerr << "Compute shader terrain is unavailable; building it on the CPU" << std::endl;
+            m_compute.reset();
+        }
     }
 
-    m_array_buffer = 0;
-    m_elem_buffer = 0;
+    initProgram(lighting);
 
+    if (m_compute) {
+        displaceOnGpu(radius, refinements.back());
+    } else {
+        m_source.reset(new TerrainSource{radius, noise});
+        m_mesh.generate(radius, refinements, m_source);
+    }
+}
+
+Terrain::~Terrain() {
     if (glIsProgram(m_program)) {
         if (glIsShader(m_vertex_shader)) {
             glDetachShader(m_program, m_vertex_shader);
@@ -64,81 +195,169 @@ Terrain::~Terrain() {
         }
         m_vertex_shader = 0;
         
+        // The ShaderCache owns the fragment shader.
         if (glIsShader(m_fragment_shader)) {
             glDetachShader(m_program, m_fragment_shader);
-            glDeleteShader(m_fragment_shader);
         }
         m_fragment_shader = 0;
         
+        GLState::current().forgetProgram(m_program);
         glDeleteProgram(m_program);
     }
 
     m_program = 0;
+}
+
+// The normal of the surface radius * (1 + n/8) * dir, where n is
+// sampled at radius * dir: dir, less the part of the height's gradient
+// along the surface, relative to the height.
+glm::vec3 displacedNormal(const glm::dvec3 &dir, double radius, const NoiseSample &n) {
+    double height = radius * (n.value/8.0 + 1.0);
+    glm::dvec3 height_grad = glm::dvec3{n.dx, n.dy, n.dz} * (radius * radius / 8.0);
+    glm::dvec3 tangential = height_grad - glm::dot(height_grad, dir) * dir;
+    return glm::vec3{glm::normalize(dir - tangential / height)};
+}
 
-    if (glIsVertexArray(m_array_object)) {
-        glDeleteVertexArrays(1, &m_array_object);
+void displaceSphere(const PositionsAndElements &sphere, float radius, const NoiseFunction &noise, std::vector<TerrainVertex> &vertices) {
+    // Each range of vertices is evaluated as one batch.
+    vertices.resize(sphere.positions.size());
+    TaskPool::shared().parallelFor(sphere.positions.size(), DISPLACE_GRAIN, [&](std::size_t begin, std::size_t end) {
+        displaceVertices(&sphere.positions[begin], end - begin, radius, noise, &vertices[begin]);
+    });
+}
+
+void displaceVertices(const glm::vec3 *positions, std::size_t count, float radius, const NoiseFunction &noise, TerrainVertex *out) {
+    // Displace the vertices with some noise, and work out their
+    // normals from the noise gradient as we go.
+    std::vector<double> xs(count), ys(count), zs(count);
+    std::vector<NoiseSample> samples(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        xs[i] = positions[i].x;
+        ys[i] = positions[i].y;
+        zs[i] = positions[i].z;
     }
 
-    m_array_object = 0;
+    noise.evaluateWithGradient(count, xs.data(), ys.data(), zs.data(), samples.data());
+    displaceBySamples(positions, samples.data(), count, radius, out);
 }
 
-void Terrain::initGeometry(float radius, int refinements, const NoiseFunction &noise) {
-    // Create a sphere from an icosahredron.
-    PositionsAndElements sphere = icosphere(radius, refinements);
+void displaceBySamples(const glm::vec3 *positions, const NoiseSample *samples, std::size_t count, float radius, TerrainVertex *out) {
+    for (std::size_t i = 0; i < count; ++i) {
+        const NoiseSample &n = samples[i];
+        out[i].position = positions[i];
+        out[i].position *= n.value/8.0 + 1.0;
+        out[i].normal = displacedNormal(glm::dvec3{positions[i]} / static_cast<double>(radius), radius, n);
+    }
+}
+
+void Terrain::setDetail(const NoiseFunction &full_noise, unsigned int texels) {
+    m_detail.reset(new DetailNormalMap{m_radius, full_noise, m_noise, texels});
+}
 
-    // Adjust the vertex positions with some noise.
-    for (unsigned int i = 0; i < sphere.positions.size(); ++i) {
-        glm::vec3 &pos = sphere.positions[i];
-        double n = noise(pos.x, pos.y, pos.z);
-        pos *= n/8.0 + 1.0;
+void Terrain::update(StagingBuffer &staging) {
+    m_mesh.update(staging);
+    if (m_detail) {
+        m_detail->update();
     }
+}
 
-    // Compute the normals for smoothness.
-    std::vector<glm::vec3> normals = computeNormals(sphere);
+bool Terrain::canRefreshCurve() const {
+    // The source's samples are the background thread's until the mesh
+    // is complete, which joins it, so that's checked before them.
+    return m_source && m_mesh.isComplete() && m_source->isCurved() && (!m_detail || !m_detail->isBaking());
+}
 
-    m_indices = sphere.elements;
-    m_vertices.resize(sphere.positions.size());
-    for (std::size_t i = 0; i < sphere.positions.size(); ++i) {
-        m_vertices[i].position = sphere.positions[i];
-        m_vertices[i].normal = normals[i];
+void Terrain::refreshCurve() {
+    if (!canRefreshCurve()) {
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<TerrainVertex> displaced;
+    m_source->recurve(displaced);
+
+    // The height range stays put while the curve fits in it, so that
+    // only the vertices the change moved are uploaded.
+    HeightRange height_range = m_mesh.heightRange(), needed;
+    m_source->heightRange(needed);
+    if (needed.min < height_range.min || needed.max > height_range.max) {
+        height_range = needed;
+    }
+
+    std::vector<PackedVertex> packed(displaced.size());
+    TaskPool::shared().parallelFor(displaced.size(), DISPLACE_GRAIN, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            packed[i] = packVertex(displaced[i].position, displaced[i].normal, height_range);
+        }
+    });
+
+    VertexUpdate update = m_mesh.replaceVertices(packed, height_range);
+    if (m_detail) {
+        m_detail->rebake();
     }
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Terrain curve: " << update.changed << " of " << packed.size()
+              << " vertices changed, " << update.uploaded << " uploaded in "
+              << update.runs << " runs, in "
+              << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
 }
 
-void Terrain::initBuffers() {
-    GLuint buffers[2];
-    glGenBuffers(2, buffers);
-    m_array_buffer = buffers[0];
-    m_elem_buffer = buffers[1];
+void Terrain::displaceOnGpu(float radius, int refinements) {
+    // Displace the plain sphere in a scratch buffer, and read it back
+    // once to bound its clusters.
+    PositionsAndElements sphere = icosphere(radius, refinements);
+    optimizeMesh(sphere);
+    std::vector<MeshCluster> clusters = clusterMesh(sphere, ProgressiveMesh::CLUSTER_TRIANGLES);
+
+    HeightRange height_range = m_compute->heightRange(radius);
+    std::vector<PackedVertex> vertices(sphere.positions.size());
+    for (std::size_t i = 0; i < sphere.positions.size(); ++i) {
+        vertices[i] = packVertex(sphere.positions[i], sphere.positions[i], height_range);
+    }
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        m_vertices.size()*sizeof(TerrainVertex),
-        m_vertices.data(),
-        GL_STATIC_DRAW);
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(PackedVertex), vertices.data(), GL_STATIC_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
-    glBufferData(
-        GL_ELEMENT_ARRAY_BUFFER,
-        m_indices.size()*sizeof(GLuint),
-        m_indices.data(),
-        GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    auto start = std::chrono::steady_clock::now();
+    m_compute->displace(buffer, vertices.size(), radius);
+    glFinish();
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Terrain geometry: " << vertices.size() << " vertices displaced on the GPU in "
+              << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glGetBufferSubData(GL_ARRAY_BUFFER, 0, vertices.size()*sizeof(PackedVertex), vertices.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDeleteBuffers(1, &buffer);
+
+    // Bound what the vertex shader will draw, not the unpacked terrain.
+    std::vector<glm::vec3> positions(vertices.size());
+    for (std::size_t i = 0; i < vertices.size(); ++i) {
+        glm::vec3 normal;
+        unpackVertex(vertices[i], height_range, positions[i], normal);
+    }
+    float occluder_radius = boundClusters(clusters, sphere.elements, positions);
+
+    m_mesh.load(refinements, vertices, sphere.elements, clusters, height_range, occluder_radius);
 }
 
-void Terrain::initProgram() {
+void Terrain::initProgram(const ShaderFeatures &lighting) {
     const std::vector<char> &vert_code = LOAD_RESOURCE(terrain_vert);
     const std::vector<char> &frag_code = LOAD_RESOURCE(terrain_frag);
+    const std::vector<char> &lighting_code = LOAD_RESOURCE(lighting_glsl);
 
     m_vertex_shader = createAndCompileShader(GL_VERTEX_SHADER, vert_code.data());
-    m_fragment_shader = createAndCompileShader(GL_FRAGMENT_SHADER, frag_code.data());
+    m_fragment_shader = ShaderCache::current().shader(GL_FRAGMENT_SHADER, {frag_code.data(), lighting_code.data()}, lighting);
     m_program = createProgramFromShaders(m_vertex_shader, m_fragment_shader);
-    ViewAndProjectionBlock::setOffsets(m_program, "ViewAndProjectionBlock");
-    LightListBlock::setOffsets(m_program, "LightListBlock");
-    m_position_loc = 0;
-    m_normal_loc = 1;
+    ViewAndProjectionBlock::checkLayout(m_program, "ViewAndProjectionBlock");
+    LightListBlock::checkLayout(m_program, "LightListBlock");
     m_model_loc = glGetUniformLocation(m_program, "model");
+    m_height_range_loc = glGetUniformLocation(m_program, "height_range");
+    m_has_detail_loc = glGetUniformLocation(m_program, "has_detail");
+    m_detail_map_loc = glGetUniformLocation(m_program, "detail_map");
 
     GLuint vp_block_idx = glGetUniformBlockIndex(m_program, "ViewAndProjectionBlock");
     glUniformBlockBinding(m_program, vp_block_idx, ViewAndProjectionBlock::BINDING_INDEX);
@@ -147,49 +366,40 @@ void Terrain::initProgram() {
     glUniformBlockBinding(m_program, light_block_idx, LightListBlock::BINDING_INDEX);
 }
 
-void Terrain::initVAO() {
-    glGenVertexArrays(1, &m_array_object);
-    glUseProgram(m_program);
-    glBindVertexArray(m_array_object);
-    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
-
-    glEnableVertexAttribArray(m_position_loc);
-    glVertexAttribPointer(
-        m_position_loc,
-        3, GL_FLOAT, GL_FALSE,
-        sizeof(TerrainVertex),
-        (const void *)(offsetof(TerrainVertex, position))
-    );
-
-    glEnableVertexAttribArray(m_normal_loc);
-    glVertexAttribPointer(
-        m_normal_loc,
-        3, GL_FLOAT, GL_FALSE,
-        sizeof(TerrainVertex),
-        (const void *)(offsetof(TerrainVertex, normal))
-    );
-
-    glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glUseProgram(0);    
+void Terrain::cull(const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model) {
+    m_mesh.cull(vp_block, model);
 }
 
-void Terrain::render(glm::mat4x4 &model) {
-    glUseProgram(m_program);
-
-    glEnable(GL_DEPTH_TEST);
-    glUniformMatrix4fv(m_model_loc, 1, GL_FALSE, glm::value_ptr(model));
-    glBindVertexArray(m_array_object);
+const CullStats& Terrain::cullStats() const {
+    return m_mesh.cullStats();
+}
 
-    // static int i = 0;
-    // if (i % 500 == 0) {
-    //     dumpOpenGLState();
-    // }
-    // ++i;
+const ProgressiveMesh& Terrain::mesh() const {
+    return m_mesh;
+}
 
-    glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(m_indices.size()), GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
-    glUseProgram(0);
+void Terrain::submit(RenderQueue &queue, const glm::mat4x4 &model) {
+    HeightRange height_range = m_mesh.heightRange();
+    queue.submit(DrawPacket{
+        SCENE_LAYER, m_program, m_mesh.arrayObject(), true,
+        glm::vec3{model[3]}, height_range.max,
+        [this, model, height_range]() {
+            glUniformMatrix4fv(m_model_loc, 1, GL_FALSE, glm::value_ptr(model));
+            glUniform2f(m_height_range_loc, height_range.min, height_range.max);
+
+            bool has_detail = m_detail && m_detail->isReady();
+            glUniform1i(m_has_detail_loc, has_detail ? GL_TRUE : GL_FALSE);
+            if (has_detail) {
+                glUniform1i(m_detail_map_loc, static_cast<GLint>(DETAIL_MAP_UNIT));
+                m_detail->bind(DETAIL_MAP_UNIT);
+            }
+
+            // static int i = 0;
+            // if (i % 500 == 0) {
+            //     dumpOpenGLState();
+            // }
+            // ++i;
+
+            m_mesh.draw();
+        }});
 }
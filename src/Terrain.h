@@ -3,6 +3,8 @@
 #ifndef _PLANET_TERRAIN_H_
 #define _PLANET_TERRAIN_H_
 
+#include <cstddef>
+#include <memory>
 #include <vector>
 
 #include "glm_defines.h"
@@ -11,18 +13,45 @@
 
 #include "opengl.h"
 
+#include "Culling.h"
+#include "PackedVertex.h"
+#include "ProgressiveMesh.h"
 #include "SharedBlocks.h"
 
+class DetailNormalMap;
 class NoiseFunction;
+class RenderQueue;
+class ShaderFeatures;
+class StagingBuffer;
+class TerrainCompute;
+class TerrainSource;
+struct NoiseSample;
+struct PositionsAndElements;
 
-struct TerrainVertex {
-    glm::vec3 position;
-    glm::vec3 normal;
-};
+// The normal of the terrain over the unit direction dir, where the
+// noise sampled at radius * dir is n.
+glm::vec3 displacedNormal(const glm::dvec3 &dir, double radius, const NoiseSample &n);
+
+// Displace a sphere of the given radius by the noise, with normals
+// from the noise gradient.
+void displaceSphere(const PositionsAndElements &sphere, float radius, const NoiseFunction &noise, std::vector<TerrainVertex> &vertices);
+
+// displaceSphere() for count of the sphere's positions.
+void displaceVertices(const glm::vec3 *positions, std::size_t count, float radius, const NoiseFunction &noise, TerrainVertex *out);
+
+// Displace count of a sphere's positions by noise already sampled at
+// them.
+void displaceBySamples(const glm::vec3 *positions, const NoiseSample *samples, std::size_t count, float radius, TerrainVertex *out);
 
 class Terrain {
 public:
-    Terrain(float radius, int refinements, const NoiseFunction &noise);
+    // With use_compute, the noise is applied by a compute shader, if
+    // the context and the noise allow it, at the last of refinements.
+    // Otherwise the terrain is generated on a background thread at
+    // each of refinements in turn and streamed in by update(); noise
+    // must outlive the Terrain. lighting is what its fragment shader
+    // is specialised on.
+    Terrain(float radius, const std::vector<int> &refinements, const NoiseFunction &noise, bool use_compute, const ShaderFeatures &lighting);
     Terrain(const Terrain &other) = delete;
     Terrain(Terrain &&other) = delete;
     ~Terrain();
@@ -30,26 +59,52 @@ public:
     Terrain& operator=(const Terrain &other) = delete;
     Terrain& operator=(Terrain &&other) = delete;
 
-    void render(glm::mat4x4 &model);
+    // Bake what full_noise adds to the terrain's own noise into a
+    // normal map of texels^2 on each face, and draw the terrain with
+    // it once it's ready. full_noise must outlive the Terrain.
+    void setDetail(const NoiseFunction &full_noise, unsigned int texels);
+
+    // Upload what the generator has finished, as far as the staging
+    // buffer allows this frame.
+    void update(StagingBuffer &staging);
+
+    // Whether refreshCurve() can be used: the terrain has to be
+    // complete, and its noise a Curve, applied on the CPU, and any
+    // detail baked. Until then, the curve mustn't change, since the
+    // generator is reading it.
+    bool canRefreshCurve() const;
+
+    // Bring the terrain up to date after its noise's curve has
+    // changed. The noise under the curve was kept for each vertex, so
+    // only the curve is evaluated again. The detail is baked again.
+    void refreshCurve();
+
+    // Choose the clusters of triangles to draw for the camera in
+    // vp_block, looking at the terrain placed by model.
+    void cull(const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model);
+    // Queue what the last cull() chose to be drawn, placed by model.
+    void submit(RenderQueue &queue, const glm::mat4x4 &model);
+
+    // What the last cull() drew and culled.
+    const CullStats& cullStats() const;
+
+    // The refinements as they're drawn, and how long they took.
+    const ProgressiveMesh& mesh() const;
 
 private:
-    Terrain();
-
-    void initGeometry(float radius, int refinements, const NoiseFunction &noise);
-    void initBuffers();
-    void initProgram();
-    void initVAO();
-
-    std::vector<TerrainVertex> m_vertices;
-    std::vector<GLuint> m_indices;
-    
-    GLuint m_array_buffer, m_elem_buffer;
-    
+    void displaceOnGpu(float radius, int refinements);
+    void initProgram(const ShaderFeatures &lighting);
+
+    float m_radius;
+    const NoiseFunction &m_noise;
+    ProgressiveMesh m_mesh;
+
     GLuint m_vertex_shader, m_fragment_shader, m_program;
-    GLint m_position_loc, m_normal_loc;
-    GLint m_model_loc;
-    
-    GLuint m_array_object;
+    GLint m_model_loc, m_height_range_loc, m_has_detail_loc, m_detail_map_loc;
+
+    std::unique_ptr<TerrainCompute> m_compute;
+    std::shared_ptr<TerrainSource> m_source;
+    std::unique_ptr<DetailNormalMap> m_detail;
 };
 
 #endif
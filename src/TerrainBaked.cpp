@@ -0,0 +1,395 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/geometric.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "Models.h"
+#include "Noise.h"
+#include "OpenGLUtils.h"
+#include "PackedVertex.h"
+#include "RenderQueue.h"
+#include "Resource.h"
+#include "SharedBlocks.h"
+#include "Streaming.h"
+#include "TaskPool.h"
+#include "Terrain.h"
+#include "TerrainBaked.h"
+
+// Texels per bake task.
+const std::size_t BAKE_GRAIN = 4096;
+
+// Random directions the baked maps are checked at.
+const std::size_t BAKE_ERROR_SAMPLES = 4096;
+
+// Where terrain_baked.vert takes a vertex's direction.
+const GLuint GRID_DIRECTION_LOCATION = 0;
+
+// The texture units the maps are bound to.
+const GLuint HEIGHT_MAP_UNIT = 0;
+const GLuint NORMAL_MAP_UNIT = 1;
+
+SphereGrid::SphereGrid(unsigned int divisions)
+    : m_array_buffer{0},
+      m_elem_buffer{0},
+      m_array_object{0},
+      m_vertex_count{0},
+      m_index_count{0}
+{
+    PositionsAndElements sphere = cubeSphere(1.0f, divisions);
+    optimizeMesh(sphere);
+    m_vertex_count = sphere.positions.size();
+    m_index_count = sphere.elements.size();
+
+    std::vector<int16_t> directions(2 * m_vertex_count);
+    for (std::size_t i = 0; i < m_vertex_count; ++i) {
+        octQuantize(sphere.positions[i], &directions[2*i]);
+    }
+
+    GLuint buffers[2];
+    glGenBuffers(2, buffers);
+    m_array_buffer = buffers[0];
+    m_elem_buffer = buffers[1];
+
+    glGenVertexArrays(1, &m_array_object);
+    GLState::current().bindVertexArray(m_array_object);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
+    glBufferData(GL_ARRAY_BUFFER, directions.size()*sizeof(int16_t), directions.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_index_count*sizeof(GLuint), sphere.elements.data(), GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray(GRID_DIRECTION_LOCATION);
+    glVertexAttribPointer(GRID_DIRECTION_LOCATION, 2, GL_SHORT, GL_TRUE, 2*sizeof(int16_t), (const void *)0);
+
+    GLState::current().bindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+SphereGrid::~SphereGrid() {
+    if (glIsVertexArray(m_array_object)) {
+        GLState::current().forgetVertexArray(m_array_object);
+        glDeleteVertexArrays(1, &m_array_object);
+    }
+    m_array_object = 0;
+
+    std::vector<GLuint> bufs{};
+
+    if (glIsBuffer(m_array_buffer)) {
+        bufs.push_back(m_array_buffer);
+    }
+
+    if (glIsBuffer(m_elem_buffer)) {
+        bufs.push_back(m_elem_buffer);
+    }
+
+    if (bufs.size() > 0) {
+        glDeleteBuffers(static_cast<GLsizei>(bufs.size()), bufs.data());
+    }
+
+    m_array_buffer = 0;
+    m_elem_buffer = 0;
+}
+
+GLuint SphereGrid::arrayObject() const {
+    return m_array_object;
+}
+
+void SphereGrid::draw() const {
+    GLState::current().bindVertexArray(m_array_object);
+    glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(m_index_count), GL_UNSIGNED_INT, 0);
+}
+
+std::size_t SphereGrid::vertexCount() const {
+    return m_vertex_count;
+}
+
+std::size_t SphereGrid::triangleCount() const {
+    return m_index_count / 3;
+}
+
+std::size_t SphereGrid::bufferBytes() const {
+    return m_vertex_count*2*sizeof(int16_t) + m_index_count*sizeof(GLuint);
+}
+
+TerrainBaked::TerrainBaked(float radius, const NoiseFunction &noise, unsigned int texels, const ShaderFeatures &lighting)
+    : m_radius{radius},
+      m_noise{noise},
+      m_texels{texels},
+      m_height_range{radius, radius},
+      m_baked_range{radius, radius},
+      m_heights{},
+      m_normals{},
+      m_bake_ms{0.0},
+      m_max_error{0.0},
+      m_rms_error{0.0},
+      m_height_map{0},
+      m_normal_map{0},
+      m_vertex_shader{0},
+      m_fragment_shader{0},
+      m_program{0},
+      m_model_loc{-1},
+      m_height_range_loc{-1},
+      m_height_map_loc{-1},
+      m_normal_map_loc{-1},
+      m_baker{[this]() { bake(); }}
+{
+    initProgram(lighting);
+    initTextures();
+    rebake();
+}
+
+TerrainBaked::~TerrainBaked() {
+    std::vector<GLuint> textures{};
+
+    if (glIsTexture(m_height_map)) {
+        GLState::current().forgetTexture(m_height_map);
+        textures.push_back(m_height_map);
+    }
+
+    if (glIsTexture(m_normal_map)) {
+        GLState::current().forgetTexture(m_normal_map);
+        textures.push_back(m_normal_map);
+    }
+
+    if (textures.size() > 0) {
+        glDeleteTextures(static_cast<GLsizei>(textures.size()), textures.data());
+    }
+
+    m_height_map = 0;
+    m_normal_map = 0;
+
+    if (glIsProgram(m_program)) {
+        if (glIsShader(m_vertex_shader)) {
+            glDetachShader(m_program, m_vertex_shader);
+            glDeleteShader(m_vertex_shader);
+        }
+        m_vertex_shader = 0;
+
+        // The ShaderCache owns the fragment shader.
+        if (glIsShader(m_fragment_shader)) {
+            glDetachShader(m_program, m_fragment_shader);
+        }
+        m_fragment_shader = 0;
+
+        GLState::current().forgetProgram(m_program);
+        glDeleteProgram(m_program);
+    }
+
+    m_program = 0;
+}
+
+void TerrainBaked::rebake() {
+    m_baker.start();
+}
+
+void TerrainBaked::update() {
+    if (!m_baker.takeFinished()) {
+        return;
+    }
+
+    std::size_t face_texels = static_cast<std::size_t>(m_texels) * m_texels;
+    for (int face = 0; face < 6; ++face) {
+        GLState::current().bindTexture(HEIGHT_MAP_UNIT, GL_TEXTURE_CUBE_MAP, m_height_map);
+        glTexSubImage2D(
+            GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, 0, 0, m_texels, m_texels,
+            GL_RED, GL_UNSIGNED_SHORT, &m_heights[face * face_texels]);
+
+        GLState::current().bindTexture(NORMAL_MAP_UNIT, GL_TEXTURE_CUBE_MAP, m_normal_map);
+        glTexSubImage2D(
+            GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, 0, 0, m_texels, m_texels,
+            GL_RG, GL_BYTE, &m_normals[2 * face * face_texels]);
+    }
+    m_height_range = m_baked_range;
+
+    std::cout << "Baked terrain: 6 x " << m_texels << "^2 texels baked in "
+              << m_bake_ms << " ms on " << TaskPool::shared().threadCount() << " threads; "
+              << textureBytes() / 1024 << " KiB of textures; height error at "
+              << BAKE_ERROR_SAMPLES << " random directions: max " << m_max_error
+              << ", rms " << m_rms_error << std::endl;
+}
+
+bool TerrainBaked::isReady() const {
+    return m_baker.isReady();
+}
+
+bool TerrainBaked::isBaking() const {
+    return m_baker.isBaking();
+}
+
+void TerrainBaked::submit(RenderQueue &queue, const SphereGrid &grid, const glm::mat4x4 &model) {
+    if (!isReady()) {
+        return;
+    }
+
+    queue.submit(DrawPacket{
+        SCENE_LAYER, m_program, grid.arrayObject(), true,
+        glm::vec3{model[3]}, m_height_range.max,
+        [this, &grid, model]() {
+            glUniformMatrix4fv(m_model_loc, 1, GL_FALSE, glm::value_ptr(model));
+            glUniform2f(m_height_range_loc, m_height_range.min, m_height_range.max);
+            glUniform1i(m_height_map_loc, static_cast<GLint>(HEIGHT_MAP_UNIT));
+            glUniform1i(m_normal_map_loc, static_cast<GLint>(NORMAL_MAP_UNIT));
+
+            GLState::current().bindTexture(HEIGHT_MAP_UNIT, GL_TEXTURE_CUBE_MAP, m_height_map);
+            GLState::current().bindTexture(NORMAL_MAP_UNIT, GL_TEXTURE_CUBE_MAP, m_normal_map);
+
+            grid.draw();
+        }});
+}
+
+std::size_t TerrainBaked::textureBytes() const {
+    // Counted from the size, since the background thread may be
+    // refilling the maps.
+    return 6 * static_cast<std::size_t>(m_texels) * m_texels * (sizeof(uint16_t) + 2*sizeof(int8_t));
+}
+
+void TerrainBaked::initProgram(const ShaderFeatures &lighting) {
+    const std::vector<char> &vert_code = LOAD_RESOURCE(terrain_baked_vert);
+    const std::vector<char> &frag_code = LOAD_RESOURCE(terrain_frag);
+    const std::vector<char> &lighting_code = LOAD_RESOURCE(lighting_glsl);
+
+    m_vertex_shader = createAndCompileShader(GL_VERTEX_SHADER, vert_code.data());
+    m_fragment_shader = ShaderCache::current().shader(GL_FRAGMENT_SHADER, {frag_code.data(), lighting_code.data()}, lighting);
+    m_program = createProgramFromShaders(m_vertex_shader, m_fragment_shader);
+    ViewAndProjectionBlock::checkLayout(m_program, "ViewAndProjectionBlock");
+    LightListBlock::checkLayout(m_program, "LightListBlock");
+    m_model_loc = glGetUniformLocation(m_program, "model");
+    m_height_range_loc = glGetUniformLocation(m_program, "height_range");
+    m_height_map_loc = glGetUniformLocation(m_program, "height_map");
+    m_normal_map_loc = glGetUniformLocation(m_program, "normal_map");
+
+    GLuint vp_block_idx = glGetUniformBlockIndex(m_program, "ViewAndProjectionBlock");
+    glUniformBlockBinding(m_program, vp_block_idx, ViewAndProjectionBlock::BINDING_INDEX);
+
+    GLuint light_block_idx = glGetUniformBlockIndex(m_program, "LightListBlock");
+    glUniformBlockBinding(m_program, light_block_idx, LightListBlock::BINDING_INDEX);
+}
+
+void TerrainBaked::initTextures() {
+    // Filtered across the edges between faces, like the terrain they
+    // hold.
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+    GLuint textures[2];
+    glGenTextures(2, textures);
+    m_height_map = textures[0];
+    m_normal_map = textures[1];
+
+    const GLenum formats[2] = { GL_R16, GL_RG8_SNORM };
+    const GLuint units[2] = { HEIGHT_MAP_UNIT, NORMAL_MAP_UNIT };
+    for (int i = 0; i < 2; ++i) {
+        GLState::current().bindTexture(units[i], GL_TEXTURE_CUBE_MAP, textures[i]);
+        glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, formats[i], m_texels, m_texels);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+}
+
+void TerrainBaked::bake() {
+    auto start = std::chrono::steady_clock::now();
+
+    // Each texel takes the terrain at its centre, the same way
+    // Terrain displaces a vertex.
+    std::size_t face_texels = static_cast<std::size_t>(m_texels) * m_texels;
+    std::size_t count = 6 * face_texels;
+    std::vector<TerrainVertex> displaced(count);
+    TaskPool::shared().parallelFor(count, BAKE_GRAIN, [&](std::size_t begin, std::size_t end) {
+        std::vector<glm::vec3> positions(end - begin);
+        for (std::size_t i = begin; i < end; ++i) {
+            int face = static_cast<int>(i / face_texels);
+            unsigned int texel = static_cast<unsigned int>(i % face_texels);
+            positions[i - begin] = cubeTexelDirection(face, texel % m_texels, texel / m_texels, m_texels) * m_radius;
+        }
+        displaceVertices(positions.data(), positions.size(), m_radius, m_noise, &displaced[begin]);
+    });
+
+    // The noise's own range, if it's known, so that the maps mean the
+    // same thing from one bake to the next.
+    std::pair<double, double> value_range = m_noise.range();
+    if (std::isfinite(value_range.first) && std::isfinite(value_range.second)) {
+        m_baked_range = HeightRange{
+            static_cast<float>(m_radius * (value_range.first/8.0 + 1.0)),
+            static_cast<float>(m_radius * (value_range.second/8.0 + 1.0))
+        };
+    } else {
+        m_baked_range = HeightRange{m_radius, m_radius};
+        for (const TerrainVertex &vertex : displaced) {
+            float height = glm::length(vertex.position);
+            m_baked_range.min = std::min(m_baked_range.min, height);
+            m_baked_range.max = std::max(m_baked_range.max, height);
+        }
+    }
+
+    m_heights.resize(count);
+    m_normals.resize(2 * count);
+    TaskPool::shared().parallelFor(count, BAKE_GRAIN, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            PackedVertex packed = packVertex(displaced[i].position, displaced[i].normal, m_baked_range);
+            m_heights[i] = packed.height;
+            m_normals[2*i] = packed.normal[0];
+            m_normals[2*i + 1] = packed.normal[1];
+        }
+    });
+
+    auto end = std::chrono::steady_clock::now();
+    m_bake_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+    // Check the maps against the noise between the texels, where the
+    // filtering has to fill in.
+    std::mt19937 rng{1};
+    std::normal_distribution<float> normal_dist;
+    std::vector<glm::vec3> positions(BAKE_ERROR_SAMPLES);
+    for (glm::vec3 &position : positions) {
+        position = glm::normalize(glm::vec3{normal_dist(rng), normal_dist(rng), normal_dist(rng)}) * m_radius;
+    }
+    std::vector<TerrainVertex> expected(BAKE_ERROR_SAMPLES);
+    displaceVertices(positions.data(), positions.size(), m_radius, m_noise, expected.data());
+
+    double max_error = 0.0, sum_squares = 0.0;
+    for (std::size_t i = 0; i < BAKE_ERROR_SAMPLES; ++i) {
+        double error = std::abs(bakedHeight(positions[i] / m_radius) - glm::length(expected[i].position));
+        max_error = std::max(max_error, error);
+        sum_squares += error * error;
+    }
+    m_max_error = max_error;
+    m_rms_error = std::sqrt(sum_squares / BAKE_ERROR_SAMPLES);
+}
+
+float TerrainBaked::bakedHeight(const glm::vec3 &dir) const {
+    float s, t;
+    int face = cubeFaceOf(dir, s, t);
+
+    // Between the four nearest texel centres, clamped at the face's
+    // edges.
+    float max_coord = static_cast<float>(m_texels - 1);
+    float x = std::max(0.0f, std::min(max_coord, 0.5f * (s + 1.0f) * m_texels - 0.5f));
+    float y = std::max(0.0f, std::min(max_coord, 0.5f * (t + 1.0f) * m_texels - 0.5f));
+    unsigned int x0 = std::min(static_cast<unsigned int>(x), m_texels - 1), y0 = std::min(static_cast<unsigned int>(y), m_texels - 1);
+    unsigned int x1 = std::min(x0 + 1, m_texels - 1), y1 = std::min(y0 + 1, m_texels - 1);
+    float fx = x - x0, fy = y - y0;
+
+    const uint16_t *heights = &m_heights[face * static_cast<std::size_t>(m_texels) * m_texels];
+    float top = (1.0f - fx) * heights[y0*m_texels + x0] + fx * heights[y0*m_texels + x1];
+    float bottom = (1.0f - fx) * heights[y1*m_texels + x0] + fx * heights[y1*m_texels + x1];
+    float fraction = ((1.0f - fy) * top + fy * bottom) / 65535.0f;
+    return m_baked_range.min + fraction * (m_baked_range.max - m_baked_range.min);
+}
@@ -0,0 +1,124 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_TERRAIN_BAKED_H_
+#define _PLANET_TERRAIN_BAKED_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "PackedVertex.h"
+#include "Streaming.h"
+
+class NoiseFunction;
+class RenderQueue;
+class ShaderFeatures;
+
+// A unit sphere made of a grid over each face of a cube, with only an
+// octahedrally encoded direction for each vertex. It carries no
+// terrain of its own, so any number of TerrainBaked can draw the same
+// one.
+class SphereGrid {
+public:
+    // divisions should be a power of two, so the faces meet exactly.
+    explicit SphereGrid(unsigned int divisions);
+    SphereGrid(const SphereGrid &other) = delete;
+    SphereGrid(SphereGrid &&other) = delete;
+    ~SphereGrid();
+
+    SphereGrid& operator=(const SphereGrid &other) = delete;
+    SphereGrid& operator=(SphereGrid &&other) = delete;
+
+    // Draw the whole grid, with the program in use.
+    void draw() const;
+    // The vertex array draw() binds.
+    GLuint arrayObject() const;
+
+    std::size_t vertexCount() const;
+    std::size_t triangleCount() const;
+    // Bytes of vertices and indices in the buffers.
+    std::size_t bufferBytes() const;
+
+private:
+    GLuint m_array_buffer, m_elem_buffer, m_array_object;
+    std::size_t m_vertex_count, m_index_count;
+};
+
+// Terrain baked into a pair of cube maps, one of heights (unorm16,
+// within the noise's HeightRange) and one of octahedrally encoded
+// normals (snorm8), and drawn by displacing a SphereGrid in
+// terrain_baked.vert. Changing the terrain only means baking the maps
+// again.
+class TerrainBaked {
+public:
+    // Bake noise, displacing a sphere of radius, into cube maps of
+    // texels^2 on each face. Baking happens on a background thread;
+    // noise must outlive the TerrainBaked, and stay unchanged while
+    // isBaking(). lighting is what the fragment shader is specialised
+    // on.
+    TerrainBaked(float radius, const NoiseFunction &noise, unsigned int texels, const ShaderFeatures &lighting);
+    TerrainBaked(const TerrainBaked &other) = delete;
+    TerrainBaked(TerrainBaked &&other) = delete;
+    ~TerrainBaked();
+
+    TerrainBaked& operator=(const TerrainBaked &other) = delete;
+    TerrainBaked& operator=(TerrainBaked &&other) = delete;
+
+    // Bake again, after the noise has changed. The last bake stays in
+    // use until this one is uploaded.
+    void rebake();
+
+    // Upload the bake once it's finished, and report how long it took
+    // and how far the maps are from the noise.
+    void update();
+
+    // Whether a bake has been uploaded, and whether one is underway.
+    bool isReady() const;
+    bool isBaking() const;
+
+    // Queue grid, displaced by the maps and placed by model, to be
+    // drawn, once a bake is ready. The grid must last until the queue
+    // is executed.
+    void submit(RenderQueue &queue, const SphereGrid &grid, const glm::mat4x4 &model);
+
+    // Bytes of texture memory the maps take.
+    std::size_t textureBytes() const;
+
+private:
+    void initProgram(const ShaderFeatures &lighting);
+    void initTextures();
+    void bake();
+
+    // The baked height at the unit direction dir, filtered the way the
+    // vertex shader does it, within a face, from the bake in progress.
+    float bakedHeight(const glm::vec3 &dir) const;
+
+    float m_radius;
+    const NoiseFunction &m_noise;
+    unsigned int m_texels;
+    // What the uploaded maps' heights are within.
+    HeightRange m_height_range;
+
+    // Filled in by m_baker's thread, and handed over by it. The maps
+    // are face by face, row by row, as uploaded.
+    HeightRange m_baked_range;
+    std::vector<uint16_t> m_heights;
+    std::vector<int8_t> m_normals;
+    double m_bake_ms, m_max_error, m_rms_error;
+
+    GLuint m_height_map, m_normal_map;
+
+    GLuint m_vertex_shader, m_fragment_shader, m_program;
+    GLint m_model_loc, m_height_range_loc, m_height_map_loc, m_normal_map_loc;
+
+    // Last, so that it's stopped before anything it uses goes away.
+    BackgroundBake m_baker;
+};
+
+#endif
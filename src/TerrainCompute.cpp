@@ -0,0 +1,281 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/trigonometric.hpp>
+
+#include "opengl.h"
+
+#include "Curve.h"
+#include "Models.h"
+#include "Noise.h"
+#include "OpenGLUtils.h"
+#include "PackedVertex.h"
+#include "Resource.h"
+#include "Terrain.h"
+#include "TerrainCompute.h"
+
+// Must match local_size_x in terrain_displace.comp.
+const std::size_t DISPLACE_GROUP_SIZE = 64;
+const GLuint MAX_GROUPS_PER_DIMENSION = 65535;
+
+const GLuint VERTEX_BUFFER_BINDING = 0;
+const GLuint PERM_BUFFER_BINDING = 1;
+const GLuint SPLINE_BUFFER_BINDING = 2;
+
+GpuNoise::GpuNoise()
+    : m_perm_buffer{0},
+      m_spline_buffer{0},
+      m_scales{1.0f, 1.0f, 1.0f},
+      m_octaves{0},
+      m_persistence{0.0f},
+      m_spline_points{0},
+      m_value_range{0.0f, 0.0f}
+{}
+
+GpuNoise::~GpuNoise() {
+    std::vector<GLuint> bufs{};
+
+    if (glIsBuffer(m_perm_buffer)) {
+        bufs.push_back(m_perm_buffer);
+    }
+
+    if (glIsBuffer(m_spline_buffer)) {
+        bufs.push_back(m_spline_buffer);
+    }
+
+    if (bufs.size() > 0) {
+        glDeleteBuffers(static_cast<GLsizei>(bufs.size()), bufs.data());
+    }
+
+    m_perm_buffer = 0;
+    m_spline_buffer = 0;
+}
+
+bool GpuNoise::set(const NoiseFunction &noise) {
+    // The shader implements exactly Curve(Octave(Perlin)).
+    const Curve *curve = dynamic_cast<const Curve*>(&noise);
+    const Octave *octave = curve ? dynamic_cast<const Octave*>(&curve->base()) : nullptr;
+    const Perlin *perlin = octave ? dynamic_cast<const Perlin*>(&octave->base()) : nullptr;
+    if (!perlin) {
+        return false;
+    }
+
+    const std::vector<std::pair<double, double> > &cps = curve->curve().controlPoints();
+    const std::vector<double> &coeffs = curve->curve().coefficients();
+    if (cps.size() < 2 || coeffs.size() != cps.size()) {
+        return false;
+    }
+
+    std::vector<GLfloat> spline(4 * cps.size());
+    for (std::size_t i = 0; i < cps.size(); ++i) {
+        spline[4*i + 0] = static_cast<GLfloat>(cps[i].first);
+        spline[4*i + 1] = static_cast<GLfloat>(cps[i].second);
+        spline[4*i + 2] = static_cast<GLfloat>(coeffs[i]);
+        spline[4*i + 3] = 0.0f;
+    }
+
+    if (m_perm_buffer == 0) {
+        GLuint buffers[2];
+        glGenBuffers(2, buffers);
+        m_perm_buffer = buffers[0];
+        m_spline_buffer = buffers[1];
+    }
+
+    const PermutationTable &perm = perlin->permutation();
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_perm_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(perm.wide_table), perm.wide_table, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_spline_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, spline.size()*sizeof(GLfloat), spline.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    m_scales[0] = static_cast<float>(perlin->xScale());
+    m_scales[1] = static_cast<float>(perlin->yScale());
+    m_scales[2] = static_cast<float>(perlin->zScale());
+    m_octaves = octave->octaves();
+    m_persistence = static_cast<float>(octave->persistence());
+    m_spline_points = static_cast<int>(cps.size());
+
+    std::pair<double, double> range = curve->curve().range();
+    m_value_range[0] = static_cast<float>(range.first);
+    m_value_range[1] = static_cast<float>(range.second);
+    return true;
+}
+
+HeightRange GpuNoise::heightRange(float radius) const {
+    return HeightRange{
+        radius * (m_value_range[0]/8.0f + 1.0f),
+        radius * (m_value_range[1]/8.0f + 1.0f)
+    };
+}
+
+GpuNoise::Locations GpuNoise::locate(GLuint program) {
+    return Locations{
+        glGetUniformLocation(program, "scales"),
+        glGetUniformLocation(program, "octaves"),
+        glGetUniformLocation(program, "persistence"),
+        glGetUniformLocation(program, "spline_points")
+    };
+}
+
+void GpuNoise::bind(const Locations &locations) const {
+    glUniform3fv(locations.scales, 1, m_scales);
+    glUniform1i(locations.octaves, m_octaves);
+    glUniform1f(locations.persistence, m_persistence);
+    glUniform1i(locations.spline_points, m_spline_points);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PERM_BUFFER_BINDING, m_perm_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SPLINE_BUFFER_BINDING, m_spline_buffer);
+}
+
+void GpuNoise::unbind() const {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PERM_BUFFER_BINDING, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SPLINE_BUFFER_BINDING, 0);
+}
+
+TerrainCompute::TerrainCompute()
+    : m_compute_shader{0},
+      m_program{0},
+      m_vertex_count_loc{-1},
+      m_radius_loc{-1},
+      m_height_range_loc{-1},
+      m_noise_locs{-1, -1, -1, -1},
+      m_noise{}
+{
+    if (GLAD_GL_VERSION_4_3) {
+        initProgram();
+    }
+}
+
+TerrainCompute::~TerrainCompute() {
+    if (glIsProgram(m_program)) {
+        if (glIsShader(m_compute_shader)) {
+            glDetachShader(m_program, m_compute_shader);
+            glDeleteShader(m_compute_shader);
+        }
+        m_compute_shader = 0;
+
+        GLState::current().forgetProgram(m_program);
+        glDeleteProgram(m_program);
+    }
+
+    m_program = 0;
+}
+
+bool TerrainCompute::isAvailable() const {
+    return isProgramLinked(m_program);
+}
+
+bool TerrainCompute::setNoise(const NoiseFunction &noise) {
+    return m_noise.set(noise);
+}
+
+HeightRange TerrainCompute::heightRange(float radius) const {
+    return m_noise.heightRange(radius);
+}
+
+void TerrainCompute::displace(GLuint vertex_buffer, std::size_t vertex_count, float radius) {
+    if (vertex_count == 0) {
+        return;
+    }
+
+    // Large meshes need more groups than one dimension allows, so
+    // spread them over a second one.
+    GLuint groups = static_cast<GLuint>((vertex_count + DISPLACE_GROUP_SIZE - 1) / DISPLACE_GROUP_SIZE);
+    GLuint groups_x = std::min(groups, MAX_GROUPS_PER_DIMENSION);
+    GLuint groups_y = (groups + groups_x - 1) / groups_x;
+
+    GLState::current().useProgram(m_program);
+    glUniform1ui(m_vertex_count_loc, static_cast<GLuint>(vertex_count));
+    glUniform1f(m_radius_loc, radius);
+    HeightRange range = heightRange(radius);
+    glUniform2f(m_height_range_loc, range.min, range.max);
+    m_noise.bind(m_noise_locs);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VERTEX_BUFFER_BINDING, vertex_buffer);
+
+    glDispatchCompute(groups_x, groups_y, 1);
+
+    // The buffer is drawn from, or read back, next.
+    glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VERTEX_BUFFER_BINDING, 0);
+    m_noise.unbind();
+}
+
+void TerrainCompute::initProgram() {
+    const std::vector<char> &comp_code = LOAD_RESOURCE(terrain_displace_comp);
+    const std::vector<char> &noise_code = LOAD_RESOURCE(terrain_noise_glsl);
+
+    m_compute_shader = createAndCompileShader(GL_COMPUTE_SHADER, std::vector<const char*>{comp_code.data(), noise_code.data()});
+    m_program = createComputeProgram(m_compute_shader);
+
+    m_vertex_count_loc = glGetUniformLocation(m_program, "vertex_count");
+    m_radius_loc = glGetUniformLocation(m_program, "radius");
+    m_height_range_loc = glGetUniformLocation(m_program, "height_range");
+    m_noise_locs = GpuNoise::locate(m_program);
+}
+
+bool validateTerrainCompute(float radius, int refinements, const NoiseFunction &noise, double tolerance) {
+    TerrainCompute compute;
+    if (!compute.isAvailable()) {
+        std::cerr << "Compute shaders are not available" << std::endl;
+        return false;
+    }
+
+    if (!compute.setNoise(noise)) {
+        std::cerr << "The compute shader can't run this noise" << std::endl;
+        return false;
+    }
+
+    PositionsAndElements sphere = icosphere(radius, refinements);
+    std::vector<TerrainVertex> expected;
+    displaceSphere(sphere, radius, noise, expected);
+
+    // What packing alone loses, on the CPU.
+    HeightRange range = compute.heightRange(radius);
+    PackingError packing_error;
+    for (const TerrainVertex &vertex : expected) {
+        packing_error.measure(packVertex(vertex.position, vertex.normal, range), range, vertex.position, vertex.normal);
+    }
+
+    std::vector<PackedVertex> packed(sphere.positions.size());
+    for (std::size_t i = 0; i < sphere.positions.size(); ++i) {
+        packed[i] = packVertex(sphere.positions[i], sphere.positions[i], range);
+    }
+
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, packed.size()*sizeof(PackedVertex), packed.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    compute.displace(buffer, packed.size(), radius);
+
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glGetBufferSubData(GL_ARRAY_BUFFER, 0, packed.size()*sizeof(PackedVertex), packed.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDeleteBuffers(1, &buffer);
+
+    PackingError error;
+    for (std::size_t i = 0; i < packed.size(); ++i) {
+        error.measure(packed[i], range, expected[i].position, expected[i].normal);
+    }
+
+    // The shader rounds rather than searching for the nearest code, so
+    // it can be off by up to twice what the CPU packing is.
+    double position_tolerance = tolerance + 2.0 * packing_error.position;
+    double normal_tolerance = glm::degrees(tolerance) + 2.0 * packing_error.normal_degrees;
+    bool passed = error.position <= position_tolerance && error.normal_degrees <= normal_tolerance;
+    std::cout << "Compute terrain: " << packed.size() << " vertices, "
+              << "max position error " << error.position << " (packing " << packing_error.position << "), "
+              << "max normal error " << error.normal_degrees << " degrees (packing " << packing_error.normal_degrees << "), "
+              << (passed ? "passed" : "FAILED") << std::endl;
+    return passed;
+}
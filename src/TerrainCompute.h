@@ -0,0 +1,103 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_TERRAIN_COMPUTE_H_
+#define _PLANET_TERRAIN_COMPUTE_H_
+
+#include <cstddef>
+
+#include "opengl.h"
+
+#include "PackedVertex.h"
+
+class NoiseFunction;
+
+// The terrain noise (a Curve over an Octave over a Perlin) as
+// terrain_noise.glsl takes it: the permutation table and the spline in
+// shader storage buffers, and the rest as uniforms.
+class GpuNoise {
+public:
+    // Where a program that links terrain_noise.glsl takes the noise's
+    // uniforms.
+    struct Locations {
+        GLint scales, octaves, persistence, spline_points;
+    };
+
+    GpuNoise();
+    GpuNoise(const GpuNoise &other) = delete;
+    GpuNoise(GpuNoise &&other) = delete;
+    ~GpuNoise();
+
+    GpuNoise& operator=(const GpuNoise &other) = delete;
+    GpuNoise& operator=(GpuNoise &&other) = delete;
+
+    // Upload the permutation table and spline from a noise graph.
+    // Returns false if the graph doesn't have the shape the shader
+    // implements.
+    bool set(const NoiseFunction &noise);
+
+    // The heights the noise can displace a sphere of the given radius
+    // to.
+    HeightRange heightRange(float radius) const;
+
+    static Locations locate(GLuint program);
+
+    // Set the uniforms of the program in use, and bind the buffers.
+    void bind(const Locations &locations) const;
+    void unbind() const;
+
+private:
+    GLuint m_perm_buffer, m_spline_buffer;
+
+    float m_scales[3];
+    int m_octaves;
+    float m_persistence;
+    int m_spline_points;
+    float m_value_range[2];
+};
+
+// Runs the terrain noise (a Curve over an Octave over a Perlin) in a
+// compute shader, displacing a buffer of PackedVertex in place: it
+// fills in their heights and normals from their directions.
+class TerrainCompute {
+public:
+    TerrainCompute();
+    TerrainCompute(const TerrainCompute &other) = delete;
+    TerrainCompute(TerrainCompute &&other) = delete;
+    ~TerrainCompute();
+
+    TerrainCompute& operator=(const TerrainCompute &other) = delete;
+    TerrainCompute& operator=(TerrainCompute &&other) = delete;
+
+    // Whether the context has compute shaders and the program built.
+    bool isAvailable() const;
+
+    // Upload the permutation table and spline from a noise graph.
+    // Returns false if the graph doesn't have the shape the shader
+    // implements.
+    bool setNoise(const NoiseFunction &noise);
+
+    // The heights the noise can displace a sphere of the given radius
+    // to, which displace() packs them into.
+    HeightRange heightRange(float radius) const;
+
+    // Displace vertex_count vertices of a sphere of the given radius,
+    // which must already be in vertex_buffer.
+    void displace(GLuint vertex_buffer, std::size_t vertex_count, float radius);
+
+private:
+    void initProgram();
+
+    GLuint m_compute_shader, m_program;
+    GLint m_vertex_count_loc, m_radius_loc, m_height_range_loc;
+    GpuNoise::Locations m_noise_locs;
+
+    GpuNoise m_noise;
+};
+
+// Build the same terrain on the CPU and with the compute shader and
+// compare them. Prints a report and returns whether every position and
+// normal agrees to within tolerance, beyond what the packing itself
+// loses.
+bool validateTerrainCompute(float radius, int refinements, const NoiseFunction &noise, double tolerance);
+
+#endif
@@ -0,0 +1,655 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/geometric.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/matrix.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#include "opengl.h"
+
+#include "Culling.h"
+#include "Models.h"
+#include "Noise.h"
+#include "OpenGLUtils.h"
+#include "PackedVertex.h"
+#include "RenderQueue.h"
+#include "Resource.h"
+#include "SharedBlocks.h"
+#include "Streaming.h"
+#include "TaskPool.h"
+#include "Terrain.h"
+#include "TerrainLod.h"
+
+// Every patch is this many triangles along each edge. Must be even,
+// so that every other vertex is on the patch one level up.
+const unsigned int PATCH_SUBDIVISIONS = 16;
+const unsigned int PATCH_VERTEX_COUNT = (PATCH_SUBDIVISIONS + 1) * (PATCH_SUBDIVISIONS + 2) / 2;
+const unsigned int PATCH_TRIANGLE_COUNT = PATCH_SUBDIVISIONS * PATCH_SUBDIVISIONS;
+
+// Patches the vertex pool has room for.
+const std::size_t POOL_SLOTS = 4096;
+
+// Patches asked for per update, and in all before they're uploaded.
+// The second keeps the background thread from falling so far behind
+// that what it builds is stale.
+const std::size_t PATCHES_PER_UPDATE = 64;
+const std::size_t MAX_REQUESTED_PATCHES = 256;
+
+// Updates a split is kept for after it was last needed, so that
+// patches aren't rebuilt as the camera wobbles about a split distance.
+const uint64_t KEEP_UPDATES = 120;
+
+// Vertices start morphing to their coarser positions at this fraction
+// of the distance their patch is merged at.
+const double MORPH_START = 0.7;
+
+// The least a patch is split at, in patch edge lengths, however much
+// error is allowed. The morphing relies on neighbouring patches being
+// at most one level apart and on patches next to finer ones not
+// morphing, which both hold when split distances are several times
+// the size of a patch.
+const double MIN_SPLIT_FACTOR = 8.0;
+
+// The edge of an icosahedron whose vertices are on the unit sphere,
+// and the angle it subtends at the centre.
+const double ICOSAHEDRON_EDGE = 1.0514622242382672;
+const double ICOSAHEDRON_EDGE_ANGLE = 1.1071487177940904;
+
+// Where vertex (i, j) of a patch is in its vertices: i runs along the
+// edge from the first corner to the second, j from the first to the
+// third, and row j has PATCH_SUBDIVISIONS + 1 - j vertices.
+unsigned int patchVertexIndex(unsigned int i, unsigned int j) {
+    return j * (PATCH_SUBDIVISIONS + 1) - j * (j - 1) / 2 + i;
+}
+
+// The direction of the point with barycentric coordinates bary on an
+// icosahedron face. The terms are summed in the order of the
+// icosahedron's vertex numbering, so a point on an edge comes out bit
+// for bit the same from either face it is on.
+glm::dvec3 faceDirection(unsigned int face, const glm::dvec3 &bary) {
+    const unsigned int *corners = &ICOSAHEDRON_ELEMS[3*face];
+    unsigned int order[3] = {0, 1, 2};
+    std::sort(order, order + 3, [&](unsigned int a, unsigned int b) {
+        return corners[a] < corners[b];
+    });
+
+    glm::dvec3 rv{0.0, 0.0, 0.0};
+    for (unsigned int k : order) {
+        rv += bary[k] * glm::make_vec3(ICOSAHEDRON_VERTICES[corners[k]]);
+    }
+    return glm::normalize(rv);
+}
+
+TerrainLod::Patch::Patch(unsigned int face, unsigned int level, const glm::dvec3 &a, const glm::dvec3 &b, const glm::dvec3 &c)
+    : face{face},
+      level{level},
+      corners{a, b, c},
+      bounds{},
+      slot{-1},
+      ready{false},
+      request{0},
+      last_used{0},
+      children{}
+{}
+
+TerrainLod::TerrainLod(float radius, const NoiseFunction &noise, unsigned int max_level, float pixel_error, const ShaderFeatures &lighting)
+    : m_radius{radius},
+      m_noise{noise},
+      m_max_level{max_level},
+      m_pixel_error{pixel_error},
+      m_roots{},
+      m_free_slots{},
+      m_draw_list{},
+      m_generate_list{},
+      m_requested{},
+      m_next_request{1},
+      m_built_mutex{},
+      m_built{},
+      m_cancelled{false},
+      m_uploads{},
+      m_upload_bytes{0},
+      m_camera{0.0f, 0.0f, 0.0f},
+      m_occluder_radius{0.0f},
+      m_cull_stats{},
+      m_frame{0},
+      m_split_factor{MIN_SPLIT_FACTOR},
+      m_indices{},
+      m_bound_elements{},
+      m_array_buffer{0},
+      m_elem_buffer{0},
+      m_vertex_shader{0},
+      m_fragment_shader{0},
+      m_program{0},
+      m_model_loc{-1},
+      m_camera_loc{-1},
+      m_morph_range_loc{-1},
+      m_array_object{0},
+      m_worker{}
+{
+    initIndices();
+    initBuffers();
+    initProgram(lighting);
+    initVAO();
+
+    // The terrain can't dip below its lowest height, less the sag of
+    // the longest triangle edge there can be.
+    double lowest = noise.range().first;
+    if (std::isfinite(lowest)) {
+        double sag = std::cos(0.5 * ICOSAHEDRON_EDGE_ANGLE / PATCH_SUBDIVISIONS);
+        m_occluder_radius = static_cast<float>(std::max(0.0, radius * (lowest/8.0 + 1.0) * sag));
+    }
+
+    // The slots are handed out from the back.
+    for (std::size_t i = 0; i < POOL_SLOTS; ++i) {
+        m_free_slots.push_back(static_cast<int>(POOL_SLOTS - 1 - i));
+    }
+
+    // The faces of the icosahedron are always there to fall back on,
+    // once they're built.
+    m_worker.reset(new BackgroundWorker{});
+    for (unsigned int f = 0; f < ICOSAHEDRON_ELEM_COUNT / 3; ++f) {
+        m_roots.emplace_back(new Patch{
+            f, 0,
+            glm::dvec3{1.0, 0.0, 0.0},
+            glm::dvec3{0.0, 1.0, 0.0},
+            glm::dvec3{0.0, 0.0, 1.0}});
+        m_generate_list.push_back(m_roots.back().get());
+    }
+    request(m_generate_list);
+    m_generate_list.clear();
+}
+
+TerrainLod::~TerrainLod() {
+    // Stop the background thread before anything it uses goes away.
+    m_cancelled = true;
+    m_worker.reset();
+
+    std::vector<GLuint> bufs{};
+
+    if (glIsBuffer(m_array_buffer)) {
+        bufs.push_back(m_array_buffer);
+    }
+
+    if (glIsBuffer(m_elem_buffer)) {
+        bufs.push_back(m_elem_buffer);
+    }
+
+    if (bufs.size() > 0) {
+        glDeleteBuffers(static_cast<GLsizei>(bufs.size()), bufs.data());
+    }
+
+    m_array_buffer = 0;
+    m_elem_buffer = 0;
+
+    if (glIsProgram(m_program)) {
+        if (glIsShader(m_vertex_shader)) {
+            glDetachShader(m_program, m_vertex_shader);
+            glDeleteShader(m_vertex_shader);
+        }
+        m_vertex_shader = 0;
+
+        // The ShaderCache owns the fragment shader.
+        if (glIsShader(m_fragment_shader)) {
+            glDetachShader(m_program, m_fragment_shader);
+        }
+        m_fragment_shader = 0;
+
+        GLState::current().forgetProgram(m_program);
+        glDeleteProgram(m_program);
+    }
+
+    m_program = 0;
+
+    if (glIsVertexArray(m_array_object)) {
+        GLState::current().forgetVertexArray(m_array_object);
+        glDeleteVertexArrays(1, &m_array_object);
+    }
+
+    m_array_object = 0;
+}
+
+void TerrainLod::update(const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model, int viewport_height, StagingBuffer &staging) {
+    ++m_frame;
+    upload(staging);
+
+    m_camera = modelCamera(vp_block.view(), model);
+    Culler culler{vp_block.projection() * vp_block.view() * model, m_camera, m_occluder_radius};
+
+    // A length of s at distance d covers about s * pixels_per_unit / d
+    // pixels, and the vertices of a patch are its edge length over
+    // PATCH_SUBDIVISIONS apart.
+    double pixels_per_unit = 0.5 * viewport_height * vp_block.projection()[1][1];
+    m_split_factor = std::max(MIN_SPLIT_FACTOR, pixels_per_unit / (PATCH_SUBDIVISIONS * m_pixel_error));
+
+    m_draw_list.clear();
+    m_cull_stats = CullStats{};
+    for (auto &root : m_roots) {
+        select(*root, culler);
+    }
+
+    for (auto &root : m_roots) {
+        prune(*root);
+    }
+
+    request(m_generate_list);
+    m_generate_list.clear();
+}
+
+void TerrainLod::submit(RenderQueue &queue, const glm::mat4x4 &model) {
+    // What all the patches share is set once, without binding the
+    // program, whatever order they're drawn in.
+    glProgramUniformMatrix4fv(m_program, m_model_loc, 1, GL_FALSE, glm::value_ptr(model));
+    glProgramUniform3fv(m_program, m_camera_loc, 1, glm::value_ptr(m_camera));
+
+    for (const Patch *patch : m_draw_list) {
+        // The faces of the icosahedron have nothing to morph to.
+        glm::vec2 morph_range{1e30f, 2e30f};
+        if (patch->level > 0) {
+            double end = splitDistance(patch->level - 1);
+            morph_range = glm::vec2{static_cast<float>(MORPH_START * end), static_cast<float>(end)};
+        }
+        GLint base_vertex = static_cast<GLint>(patch->slot * PATCH_VERTEX_COUNT);
+
+        queue.submit(DrawPacket{
+            SCENE_LAYER, m_program, m_array_object, true,
+            glm::vec3{model * glm::vec4{patch->bounds.center, 1.0f}}, patch->bounds.radius,
+            [this, morph_range, base_vertex]() {
+                glUniform2f(m_morph_range_loc, morph_range.x, morph_range.y);
+                glDrawElementsBaseVertex(
+                    GL_TRIANGLES,
+                    static_cast<GLsizei>(m_indices.size()),
+                    GL_UNSIGNED_SHORT, 0,
+                    base_vertex);
+            }});
+    }
+}
+
+std::size_t TerrainLod::patchCount() const {
+    return m_draw_list.size();
+}
+
+std::size_t TerrainLod::triangleCount() const {
+    return m_draw_list.size() * PATCH_TRIANGLE_COUNT;
+}
+
+std::size_t TerrainLod::residentPatchCount() const {
+    return POOL_SLOTS - m_free_slots.size();
+}
+
+std::size_t TerrainLod::pendingPatchCount() const {
+    return m_requested.size();
+}
+
+const CullStats& TerrainLod::cullStats() const {
+    return m_cull_stats;
+}
+
+double TerrainLod::splitDistance(unsigned int level) const {
+    return m_split_factor * ICOSAHEDRON_EDGE * m_radius / static_cast<double>(1u << level);
+}
+
+void TerrainLod::select(Patch &patch, const Culler &culler) {
+    patch.last_used = m_frame;
+
+    // Only the faces of the icosahedron are selected before they're
+    // ready, and there's nothing to draw for them yet.
+    if (!patch.ready) {
+        return;
+    }
+
+    // Hidden patches are neither drawn nor split.
+    CullResult result = culler.classify(patch.bounds);
+    if (result != CULL_VISIBLE) {
+        m_cull_stats.count(result);
+        return;
+    }
+
+    double distance = std::max(0.0, static_cast<double>(glm::distance(m_camera, patch.bounds.center) - patch.bounds.radius));
+    if (patch.level < m_max_level && distance < splitDistance(patch.level)) {
+        if (!patch.children[0]) {
+            split(patch);
+        }
+
+        bool ready = true;
+        for (auto &child : patch.children) {
+            child->last_used = m_frame;
+            if (!child->ready) {
+                ready = false;
+                if (child->slot < 0
+                    && m_generate_list.size() < std::min(PATCHES_PER_UPDATE, m_free_slots.size())
+                    && m_requested.size() + m_generate_list.size() < MAX_REQUESTED_PATCHES) {
+                    m_generate_list.push_back(child.get());
+                }
+            }
+        }
+
+        // Until all four children are built, the patch stands in for
+        // them.
+        if (ready) {
+            for (auto &child : patch.children) {
+                select(*child, culler);
+            }
+            return;
+        }
+    }
+
+    m_cull_stats.count(CULL_VISIBLE);
+    m_draw_list.push_back(&patch);
+}
+
+void TerrainLod::prune(Patch &patch) {
+    if (!patch.children[0]) {
+        return;
+    }
+
+    if (patch.children[0]->last_used + KEEP_UPDATES < m_frame) {
+        for (auto &child : patch.children) {
+            release(*child);
+            child.reset();
+        }
+        return;
+    }
+
+    for (auto &child : patch.children) {
+        prune(*child);
+    }
+}
+
+void TerrainLod::release(Patch &patch) {
+    for (auto &child : patch.children) {
+        if (child) {
+            release(*child);
+        }
+    }
+
+    if (patch.request != 0) {
+        m_requested.erase(patch.request);
+        patch.request = 0;
+    }
+
+    if (patch.slot >= 0) {
+        m_free_slots.push_back(patch.slot);
+        patch.slot = -1;
+    }
+    patch.ready = false;
+}
+
+void TerrainLod::split(Patch &patch) {
+    const glm::dvec3 &a = patch.corners[0];
+    const glm::dvec3 &b = patch.corners[1];
+    const glm::dvec3 &c = patch.corners[2];
+    glm::dvec3 ab = 0.5 * (a + b);
+    glm::dvec3 bc = 0.5 * (b + c);
+    glm::dvec3 ca = 0.5 * (c + a);
+
+    unsigned int level = patch.level + 1;
+    patch.children[0].reset(new Patch{patch.face, level, a, ab, ca});
+    patch.children[1].reset(new Patch{patch.face, level, ab, b, bc});
+    patch.children[2].reset(new Patch{patch.face, level, ca, bc, c});
+    patch.children[3].reset(new Patch{patch.face, level, ab, bc, ca});
+}
+
+void TerrainLod::request(std::vector<Patch*> &patches) {
+    if (patches.empty()) {
+        return;
+    }
+
+    std::vector<PatchRequest> requests;
+    for (Patch *patch : patches) {
+        patch->slot = m_free_slots.back();
+        m_free_slots.pop_back();
+        patch->request = m_next_request++;
+        m_requested[patch->request] = patch;
+        requests.push_back(PatchRequest{
+            patch->request, patch->face,
+            {patch->corners[0], patch->corners[1], patch->corners[2]}});
+    }
+
+    m_worker->push([this, requests]() {
+        build(requests);
+    });
+}
+
+void TerrainLod::build(const std::vector<PatchRequest> &requests) {
+    if (m_cancelled) {
+        return;
+    }
+
+    std::vector<BuiltPatch> built(requests.size());
+    TaskPool::shared().parallelFor(requests.size(), 1, [&](std::size_t begin, std::size_t end) {
+        std::vector<glm::dvec3> dirs(PATCH_VERTEX_COUNT);
+        std::vector<double> xs(PATCH_VERTEX_COUNT), ys(PATCH_VERTEX_COUNT), zs(PATCH_VERTEX_COUNT);
+        std::vector<NoiseSample> samples(PATCH_VERTEX_COUNT);
+        std::vector<glm::vec3> normals(PATCH_VERTEX_COUNT);
+        std::vector<glm::vec3> bound_positions(2 * PATCH_VERTEX_COUNT);
+
+        for (std::size_t p = begin; p < end; ++p) {
+            const PatchRequest &patch = requests[p];
+            built[p].id = patch.id;
+            built[p].vertices.resize(PATCH_VERTEX_COUNT);
+            LodVertex *out = built[p].vertices.data();
+
+            // The barycentric coordinates on the face are all
+            // multiples of powers of two, so they're exact, and every
+            // patch along an edge finds the same points on it.
+            const glm::dvec3 &a = patch.corners[0];
+            glm::dvec3 along_i = (patch.corners[1] - a) / static_cast<double>(PATCH_SUBDIVISIONS);
+            glm::dvec3 along_j = (patch.corners[2] - a) / static_cast<double>(PATCH_SUBDIVISIONS);
+            for (unsigned int j = 0; j <= PATCH_SUBDIVISIONS; ++j) {
+                for (unsigned int i = 0; i + j <= PATCH_SUBDIVISIONS; ++i) {
+                    unsigned int v = patchVertexIndex(i, j);
+                    dirs[v] = faceDirection(patch.face, a + along_i * static_cast<double>(i) + along_j * static_cast<double>(j));
+                    xs[v] = dirs[v].x * m_radius;
+                    ys[v] = dirs[v].y * m_radius;
+                    zs[v] = dirs[v].z * m_radius;
+                }
+            }
+
+            m_noise.evaluateWithGradient(PATCH_VERTEX_COUNT, xs.data(), ys.data(), zs.data(), samples.data());
+
+            for (unsigned int v = 0; v < PATCH_VERTEX_COUNT; ++v) {
+                out[v].position = glm::vec3{dirs[v] * (m_radius * (samples[v].value/8.0 + 1.0))};
+                normals[v] = displacedNormal(dirs[v], m_radius, samples[v]);
+                octQuantize(normals[v], out[v].normal);
+            }
+
+            // Vertices at even (i, j) are on the parent patch too. The
+            // others are halfway along one of its edges: across a row,
+            // up a column, or along a diagonal.
+            for (unsigned int j = 0; j <= PATCH_SUBDIVISIONS; ++j) {
+                for (unsigned int i = 0; i + j <= PATCH_SUBDIVISIONS; ++i) {
+                    unsigned int v = patchVertexIndex(i, j);
+                    unsigned int ends[2];
+                    if (i % 2 == 0 && j % 2 == 0) {
+                        ends[0] = ends[1] = v;
+                    } else if (j % 2 == 0) {
+                        ends[0] = patchVertexIndex(i - 1, j);
+                        ends[1] = patchVertexIndex(i + 1, j);
+                    } else if (i % 2 == 0) {
+                        ends[0] = patchVertexIndex(i, j - 1);
+                        ends[1] = patchVertexIndex(i, j + 1);
+                    } else {
+                        ends[0] = patchVertexIndex(i + 1, j - 1);
+                        ends[1] = patchVertexIndex(i - 1, j + 1);
+                    }
+
+                    out[v].coarse_position = 0.5f * (out[ends[0]].position + out[ends[1]].position);
+                    octQuantize(glm::normalize(normals[ends[0]] + normals[ends[1]]), out[v].coarse_normal);
+                }
+            }
+
+            for (unsigned int v = 0; v < PATCH_VERTEX_COUNT; ++v) {
+                bound_positions[v] = out[v].position;
+                bound_positions[PATCH_VERTEX_COUNT + v] = out[v].coarse_position;
+            }
+            built[p].bounds = boundTriangles(bound_positions.data(), m_bound_elements.data(), m_bound_elements.size());
+        }
+    });
+
+    std::lock_guard<std::mutex> lock{m_built_mutex};
+    for (BuiltPatch &patch : built) {
+        m_built.push_back(std::move(patch));
+    }
+}
+
+void TerrainLod::upload(StagingBuffer &staging) {
+    {
+        std::lock_guard<std::mutex> lock{m_built_mutex};
+        while (!m_built.empty()) {
+            m_uploads.push_back(std::move(m_built.front()));
+            m_built.pop_front();
+        }
+    }
+
+    const std::size_t patch_bytes = PATCH_VERTEX_COUNT * sizeof(LodVertex);
+    while (!m_uploads.empty()) {
+        BuiltPatch &built = m_uploads.front();
+        auto found = m_requested.find(built.id);
+        if (found == m_requested.end()) {
+            m_uploads.pop_front();
+            m_upload_bytes = 0;
+            continue;
+        }
+
+        Patch &patch = *found->second;
+        const char *vertices = reinterpret_cast<const char *>(built.vertices.data());
+        m_upload_bytes += staging.upload(
+            m_array_buffer, patch.slot * patch_bytes + m_upload_bytes,
+            vertices + m_upload_bytes, patch_bytes - m_upload_bytes);
+        if (m_upload_bytes < patch_bytes) {
+            return;
+        }
+
+        patch.bounds = built.bounds;
+        patch.ready = true;
+        m_requested.erase(found);
+        m_uploads.pop_front();
+        m_upload_bytes = 0;
+    }
+}
+
+void TerrainLod::initIndices() {
+    for (unsigned int j = 0; j < PATCH_SUBDIVISIONS; ++j) {
+        for (unsigned int i = 0; i + j < PATCH_SUBDIVISIONS; ++i) {
+            m_indices.push_back(static_cast<GLushort>(patchVertexIndex(i, j)));
+            m_indices.push_back(static_cast<GLushort>(patchVertexIndex(i + 1, j)));
+            m_indices.push_back(static_cast<GLushort>(patchVertexIndex(i, j + 1)));
+
+            if (i + j + 1 < PATCH_SUBDIVISIONS) {
+                m_indices.push_back(static_cast<GLushort>(patchVertexIndex(i + 1, j)));
+                m_indices.push_back(static_cast<GLushort>(patchVertexIndex(i + 1, j + 1)));
+                m_indices.push_back(static_cast<GLushort>(patchVertexIndex(i, j + 1)));
+            }
+        }
+    }
+
+    m_bound_elements.resize(2 * m_indices.size());
+    for (std::size_t i = 0; i < m_indices.size(); ++i) {
+        m_bound_elements[i] = m_indices[i];
+        m_bound_elements[m_indices.size() + i] = m_indices[i] + PATCH_VERTEX_COUNT;
+    }
+}
+
+void TerrainLod::initBuffers() {
+    GLuint buffers[2];
+    glGenBuffers(2, buffers);
+    m_array_buffer = buffers[0];
+    m_elem_buffer = buffers[1];
+
+    // Keep the index buffer out of whatever vertex array is bound.
+    GLState::current().bindVertexArray(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
+    glBufferData(
+        GL_ARRAY_BUFFER,
+        POOL_SLOTS*PATCH_VERTEX_COUNT*sizeof(LodVertex),
+        nullptr,
+        GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
+    glBufferData(
+        GL_ELEMENT_ARRAY_BUFFER,
+        m_indices.size()*sizeof(GLushort),
+        m_indices.data(),
+        GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void TerrainLod::initProgram(const ShaderFeatures &lighting) {
+    const std::vector<char> &vert_code = LOAD_RESOURCE(terrain_lod_vert);
+    const std::vector<char> &frag_code = LOAD_RESOURCE(terrain_frag);
+    const std::vector<char> &lighting_code = LOAD_RESOURCE(lighting_glsl);
+
+    m_vertex_shader = createAndCompileShader(GL_VERTEX_SHADER, vert_code.data());
+    m_fragment_shader = ShaderCache::current().shader(GL_FRAGMENT_SHADER, {frag_code.data(), lighting_code.data()}, lighting);
+    m_program = createProgramFromShaders(m_vertex_shader, m_fragment_shader);
+    ViewAndProjectionBlock::checkLayout(m_program, "ViewAndProjectionBlock");
+    LightListBlock::checkLayout(m_program, "LightListBlock");
+    m_model_loc = glGetUniformLocation(m_program, "model");
+    m_camera_loc = glGetUniformLocation(m_program, "camera_position");
+    m_morph_range_loc = glGetUniformLocation(m_program, "morph_range");
+
+    GLuint vp_block_idx = glGetUniformBlockIndex(m_program, "ViewAndProjectionBlock");
+    glUniformBlockBinding(m_program, vp_block_idx, ViewAndProjectionBlock::BINDING_INDEX);
+
+    GLuint light_block_idx = glGetUniformBlockIndex(m_program, "LightListBlock");
+    glUniformBlockBinding(m_program, light_block_idx, LightListBlock::BINDING_INDEX);
+}
+
+void TerrainLod::initVAO() {
+    glGenVertexArrays(1, &m_array_object);
+    GLState::current().useProgram(m_program);
+    GLState::current().bindVertexArray(m_array_object);
+    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(
+        0,
+        3, GL_FLOAT, GL_FALSE,
+        sizeof(LodVertex),
+        (const void *)(offsetof(LodVertex, position))
+    );
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(
+        1,
+        3, GL_FLOAT, GL_FALSE,
+        sizeof(LodVertex),
+        (const void *)(offsetof(LodVertex, coarse_position))
+    );
+
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(
+        2,
+        2, GL_BYTE, GL_TRUE,
+        sizeof(LodVertex),
+        (const void *)(offsetof(LodVertex, normal))
+    );
+
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(
+        3,
+        2, GL_BYTE, GL_TRUE,
+        sizeof(LodVertex),
+        (const void *)(offsetof(LodVertex, coarse_normal))
+    );
+
+    GLState::current().bindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    GLState::current().useProgram(0);
+}
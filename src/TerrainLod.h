@@ -0,0 +1,185 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_TERRAIN_LOD_H_
+#define _PLANET_TERRAIN_LOD_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "Culling.h"
+
+class BackgroundWorker;
+class NoiseFunction;
+class RenderQueue;
+class ShaderFeatures;
+class StagingBuffer;
+class ViewAndProjectionBlock;
+
+// A vertex of a terrain patch, along with where it sits on the patch
+// one level coarser, which it morphs to as the camera moves away.
+struct LodVertex {
+    glm::vec3 position;
+    glm::vec3 coarse_position;
+    int8_t normal[2];
+    int8_t coarse_normal[2];
+};
+
+// Terrain as a quadtree of triangular patches over each of the 20
+// faces of an icosahedron. Every patch is the same grid of triangles,
+// so a patch covers a quarter of the area of its parent at twice the
+// detail. Each frame, update() splits patches whose screen-space error
+// from the camera is too large and merges them back as it moves away,
+// so the triangle count depends on the error allowed, not on how close
+// the camera is. Vertices morph towards their coarser positions near
+// the distance their patch would be merged at, which hides the seams
+// between levels and the popping when they change. Patches are built
+// on a background thread and streamed in, so the render thread never
+// waits for them.
+class TerrainLod {
+public:
+    // Patches are split until their vertex spacing is within
+    // pixel_error pixels on screen, or they are max_level levels below
+    // the icosahedron. lighting is what the fragment shader is
+    // specialised on.
+    TerrainLod(float radius, const NoiseFunction &noise, unsigned int max_level, float pixel_error, const ShaderFeatures &lighting);
+    TerrainLod(const TerrainLod &other) = delete;
+    TerrainLod(TerrainLod &&other) = delete;
+    ~TerrainLod();
+
+    TerrainLod& operator=(const TerrainLod &other) = delete;
+    TerrainLod& operator=(TerrainLod &&other) = delete;
+
+    // Choose the patches to draw for the camera in vp_block, looking
+    // at the terrain placed by model, in a viewport viewport_height
+    // pixels high. Asks for a bounded number of new patches per call,
+    // and uploads the ones that are built through staging; until all
+    // four children of a patch are in, it is drawn instead of them.
+    void update(const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model, int viewport_height, StagingBuffer &staging);
+    // Queue each patch the last update() chose as a packet of its
+    // own, so that they're drawn nearest first.
+    void submit(RenderQueue &queue, const glm::mat4x4 &model);
+
+    // What the last update() chose to draw.
+    std::size_t patchCount() const;
+    std::size_t triangleCount() const;
+
+    // Patches with vertices in the vertex pool, or on their way there.
+    std::size_t residentPatchCount() const;
+    std::size_t pendingPatchCount() const;
+
+    // The patches the last update() drew, and those it culled rather
+    // than drawing or splitting.
+    const CullStats& cullStats() const;
+
+private:
+    struct Patch {
+        Patch(unsigned int face, unsigned int level, const glm::dvec3 &a, const glm::dvec3 &b, const glm::dvec3 &c);
+
+        unsigned int face;
+        unsigned int level;
+        // The corners, as barycentric coordinates on the face.
+        glm::dvec3 corners[3];
+
+        // Covers both the patch and its morph into its parent.
+        CullBounds bounds;
+
+        // Where its vertices go in the pool, or -1 if they haven't been
+        // asked for. It is only drawn once they're ready.
+        int slot;
+        bool ready;
+        // What it was built under, or 0 if it wasn't.
+        uint64_t request;
+        uint64_t last_used;
+
+        std::unique_ptr<Patch> children[4];
+    };
+
+    // A patch for the background thread to build, with what it needs
+    // to know copied, since the patch may be gone by the time it's
+    // done.
+    struct PatchRequest {
+        uint64_t id;
+        unsigned int face;
+        glm::dvec3 corners[3];
+    };
+
+    struct BuiltPatch {
+        uint64_t id;
+        CullBounds bounds;
+        std::vector<LodVertex> vertices;
+    };
+
+    void initIndices();
+    void initBuffers();
+    void initProgram(const ShaderFeatures &lighting);
+    void initVAO();
+
+    void select(Patch &patch, const Culler &culler);
+    void prune(Patch &patch);
+    void release(Patch &patch);
+    void split(Patch &patch);
+    void request(std::vector<Patch*> &patches);
+    void build(const std::vector<PatchRequest> &requests);
+    void upload(StagingBuffer &staging);
+
+    double splitDistance(unsigned int level) const;
+
+    float m_radius;
+    const NoiseFunction &m_noise;
+    unsigned int m_max_level;
+    float m_pixel_error;
+
+    std::vector<std::unique_ptr<Patch> > m_roots;
+    std::vector<int> m_free_slots;
+    std::vector<Patch*> m_draw_list;
+    std::vector<Patch*> m_generate_list;
+
+    // Requests that haven't been uploaded yet, and the patches they're
+    // for. Patches that are released are taken out, and whatever is
+    // built for them is thrown away.
+    std::unordered_map<uint64_t, Patch*> m_requested;
+    uint64_t m_next_request;
+
+    // Handed over from the background thread under m_built_mutex.
+    std::mutex m_built_mutex;
+    std::deque<BuiltPatch> m_built;
+    std::atomic<bool> m_cancelled;
+
+    std::deque<BuiltPatch> m_uploads;
+    std::size_t m_upload_bytes;
+
+    glm::vec3 m_camera;
+    float m_occluder_radius;
+    CullStats m_cull_stats;
+    uint64_t m_frame;
+    // Split distances are this many patch edge lengths.
+    double m_split_factor;
+
+    std::vector<GLushort> m_indices;
+    // A patch's triangles, then its morph's, as elements of its
+    // positions followed by its coarse positions.
+    std::vector<unsigned int> m_bound_elements;
+
+    GLuint m_array_buffer, m_elem_buffer;
+
+    GLuint m_vertex_shader, m_fragment_shader, m_program;
+    GLint m_model_loc, m_camera_loc, m_morph_range_loc;
+
+    GLuint m_array_object;
+
+    std::unique_ptr<BackgroundWorker> m_worker;
+};
+
+#endif
@@ -0,0 +1,222 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+#include "glm_defines.h"
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include "opengl.h"
+
+#include "Culling.h"
+#include "Models.h"
+#include "OpenGLUtils.h"
+#include "RenderQueue.h"
+#include "Resource.h"
+#include "SharedBlocks.h"
+#include "TerrainTessellation.h"
+
+// Where terrain_tess.vert takes a corner's direction.
+const GLuint TESS_DIRECTION_LOCATION = 0;
+
+// Levels past this make triangles far smaller than a pixel on any
+// reasonable screen, whatever the implementation allows.
+const GLint TESS_LEVEL_LIMIT = 64;
+
+TerrainTessellation::TerrainTessellation(float radius, int base_refinements, const NoiseFunction &noise, float pixels_per_edge, const ShaderFeatures &lighting)
+    : m_radius{radius},
+      m_pixels_per_edge{pixels_per_edge},
+      m_max_level{1.0f},
+      m_vertex_shader{0},
+      m_control_shader{0},
+      m_evaluation_shader{0},
+      m_fragment_shader{0},
+      m_program{0},
+      m_model_loc{-1},
+      m_camera_position_loc{-1},
+      m_radius_loc{-1},
+      m_height_range_loc{-1},
+      m_viewport_height_loc{-1},
+      m_pixels_per_edge_loc{-1},
+      m_max_level_loc{-1},
+      m_noise_locs{-1, -1, -1, -1},
+      m_noise{},
+      m_has_noise{false},
+      m_array_buffer{0},
+      m_elem_buffer{0},
+      m_array_object{0},
+      m_vertex_count{0},
+      m_index_count{0}
+{
+    if (!GLAD_GL_VERSION_4_3) {
+        return;
+    }
+
+    GLint max_level = 0;
+    glGetIntegerv(GL_MAX_TESS_GEN_LEVEL, &max_level);
+    m_max_level = static_cast<float>(std::max(1, std::min(max_level, TESS_LEVEL_LIMIT)));
+
+    setNoise(noise);
+    initProgram(lighting);
+    initGeometry(base_refinements);
+
+    std::cout << "Tessellated terrain: " << m_index_count / 3 << " patches, "
+              << bufferBytes() / 1024 << " KiB of buffers, up to level "
+              << m_max_level << std::endl;
+}
+
+TerrainTessellation::~TerrainTessellation() {
+    if (glIsVertexArray(m_array_object)) {
+        GLState::current().forgetVertexArray(m_array_object);
+        glDeleteVertexArrays(1, &m_array_object);
+    }
+    m_array_object = 0;
+
+    std::vector<GLuint> bufs{};
+
+    if (glIsBuffer(m_array_buffer)) {
+        bufs.push_back(m_array_buffer);
+    }
+
+    if (glIsBuffer(m_elem_buffer)) {
+        bufs.push_back(m_elem_buffer);
+    }
+
+    if (bufs.size() > 0) {
+        glDeleteBuffers(static_cast<GLsizei>(bufs.size()), bufs.data());
+    }
+
+    m_array_buffer = 0;
+    m_elem_buffer = 0;
+
+    if (glIsProgram(m_program)) {
+        GLuint *shaders[] = { &m_vertex_shader, &m_control_shader, &m_evaluation_shader };
+        for (GLuint *shader : shaders) {
+            if (glIsShader(*shader)) {
+                glDetachShader(m_program, *shader);
+                glDeleteShader(*shader);
+            }
+            *shader = 0;
+        }
+
+        // The ShaderCache owns the fragment shader.
+        if (glIsShader(m_fragment_shader)) {
+            glDetachShader(m_program, m_fragment_shader);
+        }
+        m_fragment_shader = 0;
+
+        GLState::current().forgetProgram(m_program);
+        glDeleteProgram(m_program);
+    }
+
+    m_program = 0;
+}
+
+bool TerrainTessellation::isAvailable() const {
+    return m_has_noise && isProgramLinked(m_program);
+}
+
+bool TerrainTessellation::setNoise(const NoiseFunction &noise) {
+    m_has_noise = m_noise.set(noise);
+    return m_has_noise;
+}
+
+void TerrainTessellation::submit(RenderQueue &queue, const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model, int viewport_height) {
+    if (!isAvailable()) {
+        return;
+    }
+
+    HeightRange height_range = m_noise.heightRange(m_radius);
+    glm::vec3 camera = modelCamera(vp_block.view(), model);
+    queue.submit(DrawPacket{
+        SCENE_LAYER, m_program, m_array_object, true,
+        glm::vec3{model[3]}, height_range.max,
+        [this, model, height_range, camera, viewport_height]() {
+            glUniformMatrix4fv(m_model_loc, 1, GL_FALSE, glm::value_ptr(model));
+            glUniform3fv(m_camera_position_loc, 1, glm::value_ptr(camera));
+            glUniform1f(m_radius_loc, m_radius);
+            glUniform2f(m_height_range_loc, height_range.min, height_range.max);
+            glUniform1f(m_viewport_height_loc, static_cast<float>(viewport_height));
+            glUniform1f(m_pixels_per_edge_loc, m_pixels_per_edge);
+            glUniform1f(m_max_level_loc, m_max_level);
+            m_noise.bind(m_noise_locs);
+
+            glPatchParameteri(GL_PATCH_VERTICES, 3);
+            glDrawElements(GL_PATCHES, static_cast<GLsizei>(m_index_count), GL_UNSIGNED_INT, 0);
+
+            m_noise.unbind();
+        }});
+}
+
+std::size_t TerrainTessellation::patchCount() const {
+    return m_index_count / 3;
+}
+
+std::size_t TerrainTessellation::bufferBytes() const {
+    return m_vertex_count*sizeof(glm::vec3) + m_index_count*sizeof(GLuint);
+}
+
+void TerrainTessellation::initProgram(const ShaderFeatures &lighting) {
+    const std::vector<char> &vert_code = LOAD_RESOURCE(terrain_tess_vert);
+    const std::vector<char> &tesc_code = LOAD_RESOURCE(terrain_tess_tesc);
+    const std::vector<char> &tese_code = LOAD_RESOURCE(terrain_tess_tese);
+    const std::vector<char> &frag_code = LOAD_RESOURCE(terrain_frag);
+    const std::vector<char> &lighting_code = LOAD_RESOURCE(lighting_glsl);
+    const std::vector<char> &noise_code = LOAD_RESOURCE(terrain_noise_glsl);
+
+    m_vertex_shader = createAndCompileShader(GL_VERTEX_SHADER, vert_code.data());
+    m_control_shader = createAndCompileShader(GL_TESS_CONTROL_SHADER, tesc_code.data());
+    m_evaluation_shader = createAndCompileShader(GL_TESS_EVALUATION_SHADER, std::vector<const char*>{tese_code.data(), noise_code.data()});
+    m_fragment_shader = ShaderCache::current().shader(GL_FRAGMENT_SHADER, {frag_code.data(), lighting_code.data()}, lighting);
+    m_program = createTessellationProgram(m_vertex_shader, m_control_shader, m_evaluation_shader, m_fragment_shader);
+    ViewAndProjectionBlock::checkLayout(m_program, "ViewAndProjectionBlock");
+    LightListBlock::checkLayout(m_program, "LightListBlock");
+
+    m_model_loc = glGetUniformLocation(m_program, "model");
+    m_camera_position_loc = glGetUniformLocation(m_program, "camera_position");
+    m_radius_loc = glGetUniformLocation(m_program, "radius");
+    m_height_range_loc = glGetUniformLocation(m_program, "height_range");
+    m_viewport_height_loc = glGetUniformLocation(m_program, "viewport_height");
+    m_pixels_per_edge_loc = glGetUniformLocation(m_program, "pixels_per_edge");
+    m_max_level_loc = glGetUniformLocation(m_program, "max_level");
+    m_noise_locs = GpuNoise::locate(m_program);
+
+    GLuint vp_block_idx = glGetUniformBlockIndex(m_program, "ViewAndProjectionBlock");
+    glUniformBlockBinding(m_program, vp_block_idx, ViewAndProjectionBlock::BINDING_INDEX);
+
+    GLuint light_block_idx = glGetUniformBlockIndex(m_program, "LightListBlock");
+    glUniformBlockBinding(m_program, light_block_idx, LightListBlock::BINDING_INDEX);
+}
+
+void TerrainTessellation::initGeometry(int base_refinements) {
+    // The directions are all the shaders need, so a unit sphere will
+    // do.
+    PositionsAndElements sphere = icosphere(1.0f, base_refinements);
+    m_vertex_count = sphere.positions.size();
+    m_index_count = sphere.elements.size();
+
+    GLuint buffers[2];
+    glGenBuffers(2, buffers);
+    m_array_buffer = buffers[0];
+    m_elem_buffer = buffers[1];
+
+    glGenVertexArrays(1, &m_array_object);
+    GLState::current().bindVertexArray(m_array_object);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_array_buffer);
+    glBufferData(GL_ARRAY_BUFFER, m_vertex_count*sizeof(glm::vec3), sphere.positions.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_elem_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_index_count*sizeof(GLuint), sphere.elements.data(), GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray(TESS_DIRECTION_LOCATION);
+    glVertexAttribPointer(TESS_DIRECTION_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (const void *)0);
+
+    GLState::current().bindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
@@ -0,0 +1,76 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef _PLANET_TERRAIN_TESSELLATION_H_
+#define _PLANET_TERRAIN_TESSELLATION_H_
+
+#include <cstddef>
+
+#include "glm_defines.h"
+#include <glm/mat4x4.hpp>
+
+#include "opengl.h"
+
+#include "TerrainCompute.h"
+
+class NoiseFunction;
+class RenderQueue;
+class ShaderFeatures;
+class ViewAndProjectionBlock;
+
+// Terrain drawn by the tessellation stages. A coarse sphere is drawn
+// as patches; the control shader splits each of their edges by how
+// long it is on screen, and the evaluation shader runs the terrain
+// noise (a Curve over an Octave over a Perlin) at every vertex that
+// makes. Only the coarse sphere is ever stored or uploaded, so the
+// detail near the camera costs GPU time rather than memory.
+class TerrainTessellation {
+public:
+    // The coarse sphere is an icosphere of base_refinements. Edges are
+    // split until they're about pixels_per_edge pixels long on screen.
+    // lighting is what the fragment shader is specialised on.
+    TerrainTessellation(float radius, int base_refinements, const NoiseFunction &noise, float pixels_per_edge, const ShaderFeatures &lighting);
+    TerrainTessellation(const TerrainTessellation &other) = delete;
+    TerrainTessellation(TerrainTessellation &&other) = delete;
+    ~TerrainTessellation();
+
+    TerrainTessellation& operator=(const TerrainTessellation &other) = delete;
+    TerrainTessellation& operator=(TerrainTessellation &&other) = delete;
+
+    // Whether the context has tessellation shaders, the program built,
+    // and the shaders can run the noise.
+    bool isAvailable() const;
+
+    // Upload the noise again, after its curve has changed. Returns
+    // false if the shaders can't run it.
+    bool setNoise(const NoiseFunction &noise);
+
+    // Queue the terrain placed by model to be drawn for the camera in
+    // vp_block, in a viewport viewport_height pixels high.
+    void submit(RenderQueue &queue, const ViewAndProjectionBlock &vp_block, const glm::mat4x4 &model, int viewport_height);
+
+    // Patches drawn, before the control shader culls any.
+    std::size_t patchCount() const;
+    // Bytes of vertices and indices in the buffers.
+    std::size_t bufferBytes() const;
+
+private:
+    void initProgram(const ShaderFeatures &lighting);
+    void initGeometry(int base_refinements);
+
+    float m_radius;
+    float m_pixels_per_edge;
+    float m_max_level;
+
+    GLuint m_vertex_shader, m_control_shader, m_evaluation_shader, m_fragment_shader, m_program;
+    GLint m_model_loc, m_camera_position_loc, m_radius_loc, m_height_range_loc;
+    GLint m_viewport_height_loc, m_pixels_per_edge_loc, m_max_level_loc;
+    GpuNoise::Locations m_noise_locs;
+
+    GpuNoise m_noise;
+    bool m_has_noise;
+
+    GLuint m_array_buffer, m_elem_buffer, m_array_object;
+    std::size_t m_vertex_count, m_index_count;
+};
+
+#endif
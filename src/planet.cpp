@@ -1,40 +1,209 @@
 // -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
 #include <string>
+#include <vector>
 
 #include "glm_defines.h"
+#include <glm/gtc/constants.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
 
 #include "opengl.h"
 
+#include "Benchmark.h"
+#include "Culling.h"
 #include "Curve.h"
+#include "LightClusters.h"
+#include "Models.h"
 #include "Noise.h"
 #include "Ocean.h"
 #include "OpenGLUtils.h"
+#include "PackedVertex.h"
+#include "PlanetInstances.h"
+#include "ProgressiveMesh.h"
+#include "RenderQueue.h"
 #include "SharedBlocks.h"
+#include "Streaming.h"
+#include "TaskPool.h"
 #include "Terrain.h"
+#include "TerrainBaked.h"
+#include "TerrainCompute.h"
+#include "TerrainLod.h"
+#include "TerrainTessellation.h"
 
 void bailout(const std::string &msg);
+bool parseInt(const char *arg, int &value);
 void handleGlfwError(int code, const char *desc);
 void initGlad();
-void initGlfw(int width, int height, const char *title, GLFWwindow **window);
+void initGlfw(int width, int height, const char *title, bool visible, GLFWwindow **window);
 void initOpenGL();
 void keypress(GLFWwindow *window, int key, int scancode, int action, int mods);
-void runMainLoop(GLFWwindow *window);
+void scroll(GLFWwindow *window, double x_offset, double y_offset);
+// The ways the terrain can be drawn, besides TerrainLod, which T
+// switches between.
+enum TerrainPath {
+    STATIC_TERRAIN,
+    TESSELLATED_TERRAIN,
+    BAKED_TERRAIN,
+    TERRAIN_PATH_COUNT
+};
+
+void runMainLoop(GLFWwindow *window, bool gpu_terrain, bool lod_terrain, TerrainPath terrain_path, int octaves, int detail_split, std::size_t bodies, std::size_t local_lights);
+glm::mat4x4 cameraView(double distance);
+glm::mat4x4 cameraProjection(double distance);
+void reportCulling(const char *name, const CullStats &stats);
+void reportLoadTimes(const char *name, const ProgressiveMesh &mesh);
+void reportBakedTerrain(const SphereGrid &grid, const TerrainBaked &baked);
+void addLocalLights(LightListBlock &lights, std::size_t count);
+CubicSpline terrainSpline();
 
 const int WINDOW_WIDTH = 1024, WINDOW_HEIGHT = 768;
 const char *WINDOW_TITLE = "Planet Demo";
+const int TERRAIN_OCTAVES = 3;
+const double TERRAIN_PERSISTENCE = 0.5;
+const float TERRAIN_RADIUS = 2.0f;
+const int TERRAIN_REFINEMENTS = 5;
+const int OCEAN_REFINEMENTS = 5;
+// The terrain and the ocean are first shown at this refinement, and
+// then at every REFINEMENT_STEP more up to their own.
+const int FIRST_REFINEMENTS = 3;
+const int REFINEMENT_STEP = 1;
+// The compute shader works in single precision.
+const double GPU_TERRAIN_TOLERANCE = 1e-3;
+const unsigned int TERRAIN_LOD_MAX_LEVEL = 14;
+const float TERRAIN_LOD_PIXEL_ERROR = 2.0f;
+// The tessellated terrain starts from a sphere this coarse, and splits
+// it into edges about this many pixels long.
+const int TERRAIN_TESS_BASE_REFINEMENTS = 3;
+const float TERRAIN_TESS_PIXELS_PER_EDGE = 8.0f;
+// The baked terrain's cube maps have this many texels across each
+// face, and the grid it displaces this many squares.
+const unsigned int TERRAIN_BAKED_TEXELS = 512;
+const unsigned int TERRAIN_BAKED_GRID_DIVISIONS = 64;
+// With --detail-split, the octaves past the split are baked into a
+// normal map with this many texels across each face.
+const unsigned int TERRAIN_DETAIL_TEXELS = 512;
+// Just clear of the highest terrain the spline allows.
+const double MIN_CAMERA_DISTANCE = 2.3;
+// Terrain uploads are spread out to this many bytes a frame. The
+// staging ring holds a few frames' worth, so that it doesn't fill up
+// while the GPU is behind.
+const std::size_t UPLOAD_BYTES_PER_FRAME = 256 * 1024;
+const std::size_t STAGING_BUFFER_BYTES = 3 * UPLOAD_BYTES_PER_FRAME;
+// The up and down arrows move the selected control point of the
+// terrain's spline this far, up to this limit.
+const double CURVE_EDIT_STEP = 0.05;
+const double CURVE_EDIT_LIMIT = 1.1;
+// The uniform blocks are written into a ring with a slice of this
+// many bytes for each of this many frames in flight.
+const std::size_t UNIFORM_RING_FRAME_BYTES = 16 * 1024;
+const unsigned int UNIFORM_RING_FRAMES = 3;
+// With --animate-camera, the camera swings between its distance and
+// this much further out, over this many frames.
+const double CAMERA_SWING = 0.5;
+const unsigned int CAMERA_SWING_FRAMES = 600;
+// With --bodies, that many small planets orbit between these
+// distances, as icospheres of up to this refinement with edges about
+// this many pixels long. The terrain never dips below 7/8 of its
+// radius, so bodies behind a sphere that size are hidden.
+const float BODY_MIN_DISTANCE = 3.0f, BODY_MAX_DISTANCE = 6.0f;
+const int BODY_MAX_REFINEMENTS = 5;
+const float BODY_PIXELS_PER_EDGE = 8.0f;
+const unsigned int BODY_ORBIT_SEED = 1;
+const float BODY_OCCLUDER_RADIUS = 0.875f * TERRAIN_RADIUS;
+// With --lights, that many point and spot lights hang between these
+// heights over the terrain, each reaching about this far.
+const float LOCAL_LIGHT_MIN_HEIGHT = 2.1f, LOCAL_LIGHT_MAX_HEIGHT = 2.4f;
+const float LOCAL_LIGHT_MIN_RANGE = 0.1f, LOCAL_LIGHT_MAX_RANGE = 0.3f;
+// Spot lights reach further, but fade out between these angles off
+// their axis, in radians.
+const float SPOT_LIGHT_RANGE_SCALE = 1.5f;
+const float SPOT_LIGHT_INNER_ANGLE = 0.3f, SPOT_LIGHT_OUTER_ANGLE = 0.6f;
+const unsigned int LOCAL_LIGHT_SEED = 1;
+
+double camera_distance = 5.0;
+// The spline's control point the left and right arrows have selected,
+// and how far the up and down arrows have asked to move it since the
+// last frame.
+int curve_edit_point = 0;
+double curve_edit_offset = 0.0;
+// Whether T has asked to switch to the next TerrainPath since the last
+// frame.
+bool switch_terrain = false;
+// Whether the camera moves by itself, so that its uniforms change
+// every frame.
+bool animate_camera = false;
 
-#ifdef _MSC_VER
-#pragma warning(push)
-#pragma warning(disable: 4100)
-#endif
 int main(int argc, char **argv) {
+    bool bench_noise = false;
+    bool bench_shaders = false;
+    bool gpu_terrain = false;
+    bool validate_gpu_terrain = false;
+    bool lod_terrain = false;
+    TerrainPath terrain_path = STATIC_TERRAIN;
+    int octaves = TERRAIN_OCTAVES;
+    int detail_split = -1;
+    std::size_t bodies = 0;
+    std::size_t local_lights = 0;
+    int number = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--bench-noise") == 0) {
+            bench_noise = true;
+        } else if (std::strcmp(argv[i], "--bench-shaders") == 0) {
+            bench_shaders = true;
+        } else if (std::strcmp(argv[i], "--gpu-terrain") == 0) {
+            gpu_terrain = true;
+        } else if (std::strcmp(argv[i], "--validate-gpu-terrain") == 0) {
+            validate_gpu_terrain = true;
+        } else if (std::strcmp(argv[i], "--lod-terrain") == 0) {
+            lod_terrain = true;
+        } else if (std::strcmp(argv[i], "--tess-terrain") == 0) {
+            terrain_path = TESSELLATED_TERRAIN;
+        } else if (std::strcmp(argv[i], "--baked-terrain") == 0) {
+            terrain_path = BAKED_TERRAIN;
+        } else if (std::strcmp(argv[i], "--animate-camera") == 0) {
+            animate_camera = true;
+        } else if (std::strcmp(argv[i], "--octaves") == 0 && i + 1 < argc && parseInt(argv[i + 1], number)) {
+            octaves = std::max(1, number);
+            ++i;
+        } else if (std::strcmp(argv[i], "--detail-split") == 0 && i + 1 < argc && parseInt(argv[i + 1], number)) {
+            detail_split = std::max(1, number);
+            ++i;
+        } else if (std::strcmp(argv[i], "--bodies") == 0 && i + 1 < argc && parseInt(argv[i + 1], number)) {
+            bodies = static_cast<std::size_t>(std::max(0, number));
+            ++i;
+        } else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc && parseInt(argv[i + 1], number)) {
+            local_lights = static_cast<std::size_t>(std::max(0, number));
+            ++i;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc && parseInt(argv[i + 1], number)) {
+            TaskPool::setSharedThreadCount(static_cast<unsigned int>(std::max(0, number)));
+            ++i;
+        } else {
+            std::cerr << "Unknown option or bad value: " << argv[i] << "\n"
+                      << "Usage: " << argv[0] << " [--threads N] [--octaves N] [--detail-split N] [--bodies N] [--lights N] [--bench-noise] [--bench-shaders] [--gpu-terrain] [--validate-gpu-terrain] [--lod-terrain] [--tess-terrain] [--baked-terrain] [--animate-camera]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (bench_noise) {
+        benchmarkNoise(terrainSpline(), TERRAIN_OCTAVES, TERRAIN_PERSISTENCE, 1 << 20);
+        return 0;
+    }
+
     GLFWwindow *window;
-    initGlfw(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, &window);
+    initGlfw(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, !validate_gpu_terrain && !bench_shaders, &window);
     initGlad();
     initOpenGL();
 
@@ -42,16 +211,50 @@ int main(int argc, char **argv) {
     std::cout << "GLSL version: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
     std::cout << "OpenGL renderer: " << glGetString(GL_RENDERER) << std::endl;
     std::cout << "OpenGL vendor: " << glGetString(GL_VENDOR) << std::endl;
+    std::cout << "Noise kernel: " << Perlin::batchKernelName() << std::endl;
+
+    if (validate_gpu_terrain) {
+        const Perlin base_noise{};
+        const Octave octave_noise{base_noise, TERRAIN_OCTAVES, TERRAIN_PERSISTENCE};
+        const CubicSpline spline = terrainSpline();
+        const Curve curved_noise{octave_noise, spline};
+        bool passed = validateTerrainCompute(TERRAIN_RADIUS, TERRAIN_REFINEMENTS, curved_noise, GPU_TERRAIN_TOLERANCE);
+
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return passed ? 0 : 1;
+    }
+
+    if (bench_shaders) {
+        benchmarkShaderVariants(WINDOW_WIDTH, WINDOW_HEIGHT);
+        ShaderCache::current().clear();
+
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return 0;
+    }
 
-    runMainLoop(window);
+    runMainLoop(window, gpu_terrain, lod_terrain, terrain_path, octaves, detail_split < 0 ? octaves : std::min(detail_split, octaves), bodies, local_lights);
+    ShaderCache::current().clear();
 
     glfwDestroyWindow(window);
     glfwTerminate();
     return 0;
 }
-#ifdef _MSC_VER
-#pragma warning(pop)
-#endif
+
+// Whether all of arg is a decimal integer that fits an int, which
+// goes in value.
+bool parseInt(const char *arg, int &value) {
+    char *end = nullptr;
+    errno = 0;
+    long parsed = std::strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno == ERANGE
+        || parsed < std::numeric_limits<int>::min() || parsed > std::numeric_limits<int>::max()) {
+        return false;
+    }
+    value = static_cast<int>(parsed);
+    return true;
+}
 
 void bailout(const std::string &msg) {
     std::cerr << msg << std::endl;
@@ -70,7 +273,7 @@ void initGlad() {
     }
 }
 
-void initGlfw(int width, int height, const char *title, GLFWwindow **window) {
+void initGlfw(int width, int height, const char *title, bool visible, GLFWwindow **window) {
     glfwSetErrorCallback(handleGlfwError);
     if (!glfwInit()) {
         bailout("Could not initialize GLFW");
@@ -81,6 +284,7 @@ void initGlfw(int width, int height, const char *title, GLFWwindow **window) {
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
 #if defined(_DEBUG) || !defined(NDEBUG)
     glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
 #endif
@@ -92,6 +296,7 @@ void initGlfw(int width, int height, const char *title, GLFWwindow **window) {
 
     glfwMakeContextCurrent(*window);
     glfwSetKeyCallback(*window, keypress);
+    glfwSetScrollCallback(*window, scroll);
 }
 
 void initOpenGL() {
@@ -101,10 +306,36 @@ void initOpenGL() {
 }
 
 void keypress(GLFWwindow *window, int key, int scancode, int action, int mode) {
+    bool pressed = action == GLFW_PRESS || action == GLFW_REPEAT;
     switch (key) {
     case GLFW_KEY_ESCAPE:
         glfwSetWindowShouldClose(window, GLFW_TRUE);
         break;
+    case GLFW_KEY_LEFT:
+        if (pressed) {
+            --curve_edit_point;
+        }
+        break;
+    case GLFW_KEY_RIGHT:
+        if (pressed) {
+            ++curve_edit_point;
+        }
+        break;
+    case GLFW_KEY_UP:
+        if (pressed) {
+            curve_edit_offset += CURVE_EDIT_STEP;
+        }
+        break;
+    case GLFW_KEY_DOWN:
+        if (pressed) {
+            curve_edit_offset -= CURVE_EDIT_STEP;
+        }
+        break;
+    case GLFW_KEY_T:
+        if (action == GLFW_PRESS) {
+            switch_terrain = true;
+        }
+        break;
     default:
         std::cout << "key: " << key
                   << " scancode: " << scancode
@@ -114,55 +345,236 @@ void keypress(GLFWwindow *window, int key, int scancode, int action, int mode) {
     }
 }
 
-void runMainLoop(GLFWwindow *window) {
+// Scrolling moves the camera towards or away from the terrain, by a
+// fraction of its height above it.
+void scroll(GLFWwindow *window, double x_offset, double y_offset) {
+    double altitude = (camera_distance - MIN_CAMERA_DISTANCE) * std::pow(0.9, y_offset);
+    camera_distance = MIN_CAMERA_DISTANCE + std::max(1e-5, altitude);
+}
+
+glm::mat4x4 cameraView(double distance) {
+    return glm::lookAt(
+        glm::vec3{ 0.0, 0.0, distance },
+        glm::vec3{ 0.0, 0.0, 0.0 },
+        glm::vec3{ 0.0, 1.0, 0.0 }
+    );
+}
+
+glm::mat4x4 cameraProjection(double distance) {
+    // The near plane comes in with the camera, so that the terrain
+    // isn't clipped when it's close.
+    float near_plane = static_cast<float>(std::max(1e-5, std::min(0.1, 0.5 * (distance - MIN_CAMERA_DISTANCE))));
+    return glm::perspectiveFov(
+        20.0f, (float)WINDOW_WIDTH, (float)WINDOW_HEIGHT, near_plane, 100.0f
+    );
+}
+
+// The static terrain's geometry is displaced by the first detail_split
+// of the octaves; if that isn't all of them, the rest are baked into a
+// normal map. The other ways of drawing the terrain use them all.
+void runMainLoop(GLFWwindow *window, bool gpu_terrain, bool lod_terrain, TerrainPath terrain_path, int octaves, int detail_split, std::size_t bodies, std::size_t local_lights) {
     const Perlin base_noise{};
-    const Octave octave_noise{base_noise, 3, 0.5};
-    CubicSpline spline;
-    spline
-        .addControlPoint(-1.0, -1.0)
-        .addControlPoint(-0.5, -0.5)
-        .addControlPoint(0.0, -0.1)
-        .addControlPoint(0.6, 0.6)
-        .addControlPoint(0.9, 1.1)
-        .addControlPoint(1.0, 1.1);
+    const Octave octave_noise{base_noise, octaves, TERRAIN_PERSISTENCE};
+    const Octave geometry_octave_noise{base_noise, detail_split, TERRAIN_PERSISTENCE};
+    CubicSpline spline = terrainSpline();
     const Curve curved_noise{octave_noise, spline};
+    const Curve geometry_noise{geometry_octave_noise, spline};
 
     CurveDisplay curve_disp{spline, -1.0, 1.0, -1.0, 1.0, 1000};
-    Terrain terrain{2.0, 5, curved_noise};
-    Ocean ocean;
+    StagingBuffer staging{STAGING_BUFFER_BYTES, UPLOAD_BYTES_PER_FRAME};
+
+    // The lights come first, so that the lit shaders can be built for
+    // them.
+    LightListBlock light_block{};
+    light_block.enableLight(0, glm::normalize(glm::vec3(-1.0, -1.0, -1.0)));
+    std::unique_ptr<LightClusters> light_clusters;
+    if (local_lights > 0) {
+        light_clusters.reset(new LightClusters{});
+        if (light_clusters->isAvailable()) {
+            addLocalLights(light_block, local_lights);
+        } else {
+            std::cerr << "Clustered lights are unavailable" << std::endl;
+            light_clusters.reset();
+        }
+    }
+    const ShaderFeatures lighting = light_block.shaderFeatures(light_clusters != nullptr);
+
+    std::unique_ptr<Terrain> terrain;
+    std::unique_ptr<TerrainLod> terrain_lod;
+    std::unique_ptr<TerrainTessellation> terrain_tess;
+    std::unique_ptr<SphereGrid> sphere_grid;
+    std::unique_ptr<TerrainBaked> terrain_baked;
+    if (lod_terrain) {
+        terrain_lod.reset(new TerrainLod{TERRAIN_RADIUS, curved_noise, TERRAIN_LOD_MAX_LEVEL, TERRAIN_LOD_PIXEL_ERROR, lighting});
+    } else {
+        terrain.reset(new Terrain{
+            TERRAIN_RADIUS,
+            refinementSchedule(FIRST_REFINEMENTS, TERRAIN_REFINEMENTS, REFINEMENT_STEP),
+            geometry_noise, gpu_terrain, lighting});
+        if (detail_split < octaves) {
+            terrain->setDetail(curved_noise, TERRAIN_DETAIL_TEXELS);
+        }
+    }
+
+    // The tessellated and baked terrains are drawn on the same scene
+    // as the static one, but only built the first time they're chosen,
+    // by --tess-terrain, --baked-terrain or T, so that nothing waits on
+    // them otherwise. The baked one bakes in the background, and the
+    // static one stands in for it until it's ready. Whether path can
+    // be drawn, once it's been built if it can be.
+    bool tess_unavailable = false;
+    bool baked_dirty = false, baked_reported = false;
+    auto build_path = [&](TerrainPath path) {
+        if (path == TESSELLATED_TERRAIN && !terrain_tess && !tess_unavailable) {
+            terrain_tess.reset(new TerrainTessellation{TERRAIN_RADIUS, TERRAIN_TESS_BASE_REFINEMENTS, curved_noise, TERRAIN_TESS_PIXELS_PER_EDGE, lighting});
+            if (!terrain_tess->isAvailable()) {
+                std::cerr << "Tessellated terrain is unavailable" << std::endl;
+                terrain_tess.reset();
+                tess_unavailable = true;
+            }
+        } else if (path == BAKED_TERRAIN && !terrain_baked) {
+            sphere_grid.reset(new SphereGrid{TERRAIN_BAKED_GRID_DIVISIONS});
+            terrain_baked.reset(new TerrainBaked{TERRAIN_RADIUS, curved_noise, TERRAIN_BAKED_TEXELS, lighting});
+        }
+        return (path != TESSELLATED_TERRAIN || terrain_tess) && (path != BAKED_TERRAIN || terrain_baked);
+    };
+    if (!terrain || !build_path(terrain_path)) {
+        terrain_path = STATIC_TERRAIN;
+    }
+    Ocean ocean{refinementSchedule(FIRST_REFINEMENTS, OCEAN_REFINEMENTS, REFINEMENT_STEP), lighting};
+
+    std::unique_ptr<PlanetInstances> planets;
+    std::vector<PlanetOrbit> orbits;
+    std::vector<PlanetInstance> body_instances;
+    if (bodies > 0) {
+        planets.reset(new PlanetInstances{TERRAIN_RADIUS, curved_noise, BODY_MAX_REFINEMENTS, BODY_PIXELS_PER_EDGE, lighting});
+        if (planets->isAvailable()) {
+            orbits = randomOrbits(bodies, BODY_MIN_DISTANCE, BODY_MAX_DISTANCE, BODY_ORBIT_SEED);
+        } else {
+            std::cerr << "Instanced bodies are unavailable" << std::endl;
+            planets.reset();
+        }
+    }
+    unsigned int body_frame = 0;
+    bool load_times_reported = false;
+    std::cout << "Shader cache: " << ShaderCache::current().compiledCount() << " compiled, "
+              << ShaderCache::current().reusedCount() << " reused" << std::endl;
 
     ViewAndProjectionBlock vp_block{};
     static float angle = 0.0;
     glm::mat4x4 model{1.0};
-    glm::mat4x4 view = glm::lookAt(
-        glm::vec3{ 0.0, 0.0, 5.0 },
-        glm::vec3{ 0.0, 0.0, 0.0 },
-        glm::vec3{ 0.0, 1.0, 0.0 }
-    );
-    glm::mat4x4 projection = glm::perspectiveFov(
-        20.0f, (float)WINDOW_WIDTH, (float)WINDOW_HEIGHT, 0.1f, 100.0f
-    );
-    vp_block.setProjection(projection);
-    vp_block.setView(view);
-    vp_block.writeToBuffer();
+    double view_distance = 0.0;
 
-    LightListBlock light_block{};
-    light_block.enableLight(0, glm::normalize(glm::vec3(-1.0, -1.0, -1.0)));
-    light_block.writeToBuffer();
+    UniformRing uniform_ring{UNIFORM_RING_FRAME_BYTES, UNIFORM_RING_FRAMES};
+    unsigned int camera_frame = 0;
+
+    RenderQueue render_queue{};
+
+    auto report_start = std::chrono::steady_clock::now();
+    unsigned int report_frames = 0;
 
     while (!glfwWindowShouldClose(window)) {
         glm::mat4x4 model2 = glm::rotate(model, glm::radians(angle), glm::vec3(0.0, 1.0, 0.0));
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        double distance = camera_distance;
+        if (animate_camera) {
+            double phase = 2.0 * glm::pi<double>() * (camera_frame++ % CAMERA_SWING_FRAMES) / CAMERA_SWING_FRAMES;
+            distance += CAMERA_SWING * 0.5 * (1.0 - std::cos(phase));
+        }
+        if (view_distance != distance) {
+            view_distance = distance;
+            vp_block.setView(cameraView(view_distance));
+            vp_block.setProjection(cameraProjection(view_distance));
+        }
 
-        vp_block.bind();
-        light_block.bind();
-        terrain.render(model2);
-        ocean.render(model2);
-        vp_block.unbind();
-        light_block.unbind();
+        // Move the selected control point, and the terrain and the
+        // curve with it, before they're drawn.
+        if (curve_edit_offset != 0.0) {
+            // The baked terrain's bake reads the curve, like the
+            // static terrain's detail.
+            if (terrain && terrain->canRefreshCurve() && (!terrain_baked || !terrain_baked->isBaking())) {
+                int count = static_cast<int>(spline.controlPoints().size());
+                curve_edit_point = std::max(0, std::min(count - 1, curve_edit_point));
+                double y = spline.controlPoints()[curve_edit_point].second + curve_edit_offset;
+                spline.setControlPoint(curve_edit_point, std::max(-CURVE_EDIT_LIMIT, std::min(CURVE_EDIT_LIMIT, y)));
+                terrain->refreshCurve();
+                if (terrain_tess) {
+                    terrain_tess->setNoise(curved_noise);
+                }
+                if (planets) {
+                    planets->setNoise(curved_noise);
+                }
+                // Baked again once it's drawn, however many edits
+                // there are until then.
+                baked_dirty = terrain_baked != nullptr;
+                curve_disp.update(spline);
+            } else {
+                std::cout << "The terrain's curve can't be edited "
+                          << (terrain_lod || gpu_terrain ? "in this mode" : "until it has loaded") << std::endl;
+            }
+            curve_edit_offset = 0.0;
+        }
 
-        curve_disp.render();
+        if (switch_terrain) {
+            if (terrain) {
+                do {
+                    terrain_path = static_cast<TerrainPath>((terrain_path + 1) % TERRAIN_PATH_COUNT);
+                } while (!build_path(terrain_path));
+                std::cout << "Drawing the "
+                          << (terrain_path == TESSELLATED_TERRAIN ? "tessellated" : terrain_path == BAKED_TERRAIN ? "baked" : "static")
+                          << " terrain" << std::endl;
+            }
+            switch_terrain = false;
+        }
+
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        uniform_ring.beginFrame();
+        vp_block.writeToBuffer(uniform_ring);
+        if (light_clusters) {
+            light_clusters->update(light_block, vp_block, WINDOW_WIDTH, WINDOW_HEIGHT);
+        }
+        light_block.writeToBuffer(uniform_ring);
+        staging.beginFrame();
+        if (terrain_lod) {
+            terrain_lod->update(vp_block, model2, WINDOW_HEIGHT, staging);
+            terrain_lod->submit(render_queue, model2);
+        } else {
+            // The static terrain keeps loading while the others are
+            // drawn.
+            terrain->update(staging);
+            if (terrain_baked) {
+                if (baked_dirty && terrain_path == BAKED_TERRAIN && !terrain_baked->isBaking()) {
+                    terrain_baked->rebake();
+                    baked_dirty = false;
+                }
+                terrain_baked->update();
+                if (!baked_reported && terrain_baked->isReady()) {
+                    reportBakedTerrain(*sphere_grid, *terrain_baked);
+                    baked_reported = true;
+                }
+            }
+            if (terrain_path == TESSELLATED_TERRAIN) {
+                terrain_tess->submit(render_queue, vp_block, model2, WINDOW_HEIGHT);
+            } else if (terrain_path == BAKED_TERRAIN && terrain_baked->isReady()) {
+                terrain_baked->submit(render_queue, *sphere_grid, model2);
+            } else {
+                terrain->cull(vp_block, model2);
+                terrain->submit(render_queue, model2);
+            }
+        }
+        if (planets) {
+            placeBodies(orbits, static_cast<float>(body_frame++), body_instances);
+            planets->update(body_instances, vp_block, WINDOW_HEIGHT, BODY_OCCLUDER_RADIUS);
+            planets->submit(render_queue);
+        }
+        ocean.update(staging);
+        ocean.cull(vp_block, model2);
+        ocean.submit(render_queue, model2);
+        curve_disp.submit(render_queue);
+        render_queue.execute(vp_block);
+        staging.endFrame();
+        uniform_ring.endFrame();
 
         glfwSwapBuffers(window);
 
@@ -172,5 +584,118 @@ void runMainLoop(GLFWwindow *window) {
         if (angle > 360.0) {
             angle = 0.0;
         }
+
+        ++report_frames;
+        auto now = std::chrono::steady_clock::now();
+        double report_ms = std::chrono::duration<double, std::milli>(now - report_start).count();
+        if (report_ms >= 1000.0) {
+            GLCallCounts gl_calls = GLState::current().takeCallCounts();
+            std::cout << "Frame: " << report_ms / report_frames << " ms, "
+                      << staging.takeUploadedBytes() / 1024 << " KiB uploaded, "
+                      << gl_calls.issued / report_frames << " GL state calls made and "
+                      << gl_calls.skipped / report_frames << " skipped per frame, "
+                      << render_queue.stats().packets << " draw packets, "
+                      << render_queue.stats().programs << " program and "
+                      << render_queue.stats().array_objects << " vertex array changes";
+            double stall_ms = 0.0;
+            unsigned int stalls = uniform_ring.takeStalls(stall_ms);
+            if (stalls > 0) {
+                std::cout << ", uniform ring waited " << stalls << " times for " << stall_ms << " ms";
+            }
+            if (terrain_lod) {
+                std::cout << ", " << terrain_lod->patchCount() << " patches, "
+                          << terrain_lod->triangleCount() << " triangles, "
+                          << terrain_lod->residentPatchCount() << " resident, "
+                          << terrain_lod->pendingPatchCount() << " pending";
+                reportCulling("patches", terrain_lod->cullStats());
+            } else if (terrain_path == TESSELLATED_TERRAIN) {
+                std::cout << ", tessellated terrain: " << terrain_tess->patchCount() << " patches";
+            } else if (terrain_path == BAKED_TERRAIN && terrain_baked->isReady()) {
+                std::cout << ", baked terrain: " << sphere_grid->triangleCount() << " triangles";
+            } else {
+                reportCulling("terrain clusters", terrain->cullStats());
+            }
+            reportCulling("ocean clusters", ocean.cullStats());
+            if (planets) {
+                std::cout << "; " << planets->commandCount() << " draw commands, "
+                          << planets->triangleCount() << " triangles";
+                reportCulling("bodies", planets->cullStats());
+            }
+            std::cout << std::endl;
+
+            report_start = now;
+            report_frames = 0;
+        }
+
+        // Once everything is at its final quality, say how long that
+        // took.
+        if (!load_times_reported && ocean.mesh().isComplete() && (!terrain || terrain->mesh().isComplete())) {
+            if (terrain) {
+                reportLoadTimes("Terrain", terrain->mesh());
+            }
+            reportLoadTimes("Ocean", ocean.mesh());
+            load_times_reported = true;
+        }
+    }
+}
+
+void reportCulling(const char *name, const CullStats &stats) {
+    std::cout << "; " << name << ": " << stats.drawn << " drawn, "
+              << stats.frustum << " outside the frustum, "
+              << stats.horizon << " over the horizon, "
+              << stats.backface << " facing away";
+}
+
+void reportLoadTimes(const char *name, const ProgressiveMesh &mesh) {
+    std::cout << name << " load times: "
+              << mesh.timeToFirstFrame() << " ms to first frame, "
+              << mesh.timeToFinalQuality() << " ms to final quality, at refinement "
+              << mesh.refinements() << std::endl;
+}
+
+// What each planet costs with its terrain baked, against a mesh of its
+// own at the static terrain's final refinement.
+void reportBakedTerrain(const SphereGrid &grid, const TerrainBaked &baked) {
+    unsigned int subdivisions = 1u << TERRAIN_REFINEMENTS;
+    std::size_t mesh_bytes = geodesicVertexCount(subdivisions)*sizeof(PackedVertex)
+        + 3*geodesicFaceCount(subdivisions)*sizeof(GLuint);
+    std::cout << "Baked terrain vs mesh: " << baked.textureBytes() / 1024 << " KiB of textures per planet, plus "
+              << grid.bufferBytes() / 1024 << " KiB of grid ("
+              << grid.triangleCount() << " triangles) shared by every planet; the mesh takes "
+              << mesh_bytes / 1024 << " KiB per planet (" << geodesicFaceCount(subdivisions)
+              << " triangles) at refinement " << TERRAIN_REFINEMENTS << std::endl;
+}
+
+// Point and spot lights, alternately, scattered over the terrain in
+// random colours. The spot lights shine straight down.
+void addLocalLights(LightListBlock &lights, std::size_t count) {
+    std::mt19937 rng{LOCAL_LIGHT_SEED};
+    std::normal_distribution<float> direction{0.0f, 1.0f};
+    std::uniform_real_distribution<float> height{LOCAL_LIGHT_MIN_HEIGHT, LOCAL_LIGHT_MAX_HEIGHT};
+    std::uniform_real_distribution<float> range{LOCAL_LIGHT_MIN_RANGE, LOCAL_LIGHT_MAX_RANGE};
+    std::uniform_real_distribution<float> channel{0.2f, 1.0f};
+
+    for (std::size_t i = 0; i < count; ++i) {
+        glm::vec3 dir = glm::normalize(glm::vec3{direction(rng), direction(rng), direction(rng)});
+        glm::vec3 position = dir * height(rng);
+        glm::vec3 color{channel(rng), channel(rng), channel(rng)};
+        if (i % 2 == 0) {
+            lights.addPointLight(position, color, range(rng));
+        } else {
+            lights.addSpotLight(position, -dir, color, SPOT_LIGHT_RANGE_SCALE * range(rng), SPOT_LIGHT_INNER_ANGLE, SPOT_LIGHT_OUTER_ANGLE);
+        }
     }
+    std::cout << "Local lights: " << count << std::endl;
+}
+
+CubicSpline terrainSpline() {
+    CubicSpline spline;
+    spline
+        .addControlPoint(-1.0, -1.0)
+        .addControlPoint(-0.5, -0.5)
+        .addControlPoint(0.0, -0.1)
+        .addControlPoint(0.6, 0.6)
+        .addControlPoint(0.9, 1.1)
+        .addControlPoint(1.0, 1.1);
+    return spline;
 }
@@ -0,0 +1,130 @@
+// The directional lights, and the local lights LightClusters binned
+// into clusters, as the fragment shaders use them. Linked after a
+// shader's own source, which declares what it uses from here.
+//
+// It can be specialised (see LightListBlock::shaderFeatures) on
+// LIGHT_COUNT, the number of directional lights, which are then all
+// taken to be enabled, so that the loops over them have a fixed
+// length and no checks; and on LOCAL_LIGHTS, which, if 0, leaves the
+// local lights out altogether.
+
+#ifdef LIGHT_COUNT
+#define DIRECTIONAL_LIGHTS LIGHT_COUNT
+#define IS_ENABLED(i) true
+#else
+#define DIRECTIONAL_LIGHTS int(light_count)
+#define IS_ENABLED(i) lights[i].enabled
+#endif
+
+#ifndef LOCAL_LIGHTS
+#define LOCAL_LIGHTS 1
+#endif
+
+// As LightListData in SharedBlocks.h.
+const int MAX_LIGHTS = 10;
+struct LightInfo {
+    bool enabled;
+    vec3 direction;
+    // vec4 color;
+    // uint specular_exp;
+};
+
+layout(std140) uniform LightListBlock {
+    LightInfo lights[MAX_LIGHTS];
+    uint light_count;
+    uint local_light_count;
+    uvec4 cluster_grid;
+    vec4 cluster_scale;
+    vec4 depth_range;
+};
+
+// As LocalLight in SharedBlocks.h.
+struct LocalLight {
+    vec3 position;
+    float range;
+    vec3 color;
+    float spot_outer;
+    vec3 direction;
+    float spot_inner;
+};
+
+layout(std430, binding = 4) readonly buffer LocalLightBuffer {
+    LocalLight local_lights[];
+};
+
+// How many lights each cluster has, and their indices, in a run of
+// cluster_grid.w for each cluster.
+layout(std430, binding = 5) readonly buffer ClusterCountBuffer {
+    uint cluster_counts[];
+};
+
+layout(std430, binding = 6) readonly buffer ClusterLightBuffer {
+    uint cluster_lights[];
+};
+
+// The enabled directional lights' diffuse light on color, averaged.
+vec3 directionalDiffuse(vec3 normal, vec3 color) {
+    int enabled_lights = 0;
+    vec3 diffuse_color = vec3(0.0, 0.0, 0.0);
+    for (int i = 0; i < DIRECTIONAL_LIGHTS; ++i) {
+        if (IS_ENABLED(i)) {
+            enabled_lights += 1;
+            diffuse_color += color * dot(normal, -1 * lights[i].direction);
+        }
+    }
+
+    if (enabled_lights == 0) {
+        return diffuse_color;
+    }
+    return clamp(diffuse_color / float(enabled_lights), 0.0, 1.0);
+}
+
+// The enabled directional lights' specular highlights, added up.
+float directionalSpecular(vec3 normal, vec3 eye_dir, float specular_pow) {
+    float specular = 0.0;
+    for (int i = 0; i < DIRECTIONAL_LIGHTS; ++i) {
+        if (IS_ENABLED(i)) {
+            vec3 reflected = normalize(reflect(lights[i].direction, normal));
+            specular += pow(dot(reflected, eye_dir), specular_pow);
+        }
+    }
+    return specular;
+}
+
+// The diffuse light on color from the local lights in this fragment's
+// cluster. position is in world coordinates.
+vec3 localDiffuse(vec3 position, vec3 normal, vec3 color) {
+#if LOCAL_LIGHTS
+    if (local_light_count == 0u) {
+        return vec3(0.0, 0.0, 0.0);
+    }
+
+    // Back from the depth buffer's value to a distance in front of the
+    // camera, and from there to a slice.
+    float near = depth_range.x, far = depth_range.y;
+    float view_depth = near * far / (far - gl_FragCoord.z * (far - near));
+    uvec2 tile = min(uvec2(gl_FragCoord.xy * cluster_scale.xy), cluster_grid.xy - 1u);
+    float slice = clamp(floor(log(view_depth) * cluster_scale.z + cluster_scale.w), 0.0, float(cluster_grid.z - 1u));
+    uint cluster = (uint(slice) * cluster_grid.y + tile.y) * cluster_grid.x + tile.x;
+
+    vec3 diffuse = vec3(0.0, 0.0, 0.0);
+    uint count = cluster_counts[cluster];
+    for (uint i = 0; i < count; ++i) {
+        LocalLight light = local_lights[cluster_lights[cluster * cluster_grid.w + i]];
+        vec3 to_light = light.position - position;
+        float distance = length(to_light);
+        vec3 light_dir = to_light / max(distance, 1e-6);
+
+        // Smoothly down to nothing at the light's range.
+        float falloff = clamp(1.0 - (distance * distance) / (light.range * light.range), 0.0, 1.0);
+        float spot = 1.0;
+        if (light.spot_outer > -1.0) {
+            spot = smoothstep(light.spot_outer, light.spot_inner, dot(-light_dir, light.direction));
+        }
+        diffuse += light.color * (falloff * falloff * spot * max(dot(normal, light_dir), 0.0));
+    }
+    return color * diffuse;
+#else
+    return vec3(0.0, 0.0, 0.0);
+#endif
+}
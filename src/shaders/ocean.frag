@@ -1,55 +1,24 @@
 #version 430 core
 
-const int MAX_LIGHTS = 10;
-struct LightInfo {
-    bool enabled;
-    vec3 direction;
-    // vec4 color;
-    // uint specular_exp;
-};
-
 layout(location = 0) in vec4 inColor;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec3 inEyeDir;
-
-layout(shared) uniform LightListBlock {
-    LightInfo lights[MAX_LIGHTS];
-};
+layout(location = 3) in vec3 inPosition;
 
 uniform float specular_pow;
 
 layout(location = 0) out vec4 outColor;
 
-void main(void) {
-    int enabled_lights = 0;
-    vec3 diffuse_colors[MAX_LIGHTS];
-    for (int i = 0; i < MAX_LIGHTS; ++i) {
-        if (lights[i].enabled) {
-            enabled_lights += 1;
-            diffuse_colors[i] = inColor.rgb * dot(inNormal, -1 * lights[i].direction);
-        }
-    }
+// From lighting.glsl.
+vec3 directionalDiffuse(vec3 normal, vec3 color);
+float directionalSpecular(vec3 normal, vec3 eye_dir, float specular_pow);
+vec3 localDiffuse(vec3 position, vec3 normal, vec3 color);
 
+void main(void) {
     vec3 ambient_color = inColor.rgb;
+    vec3 diffuse_color = directionalDiffuse(inNormal, inColor.rgb);
+    vec3 specular_color = clamp(directionalSpecular(inNormal, inEyeDir, specular_pow) * vec3(0.5, 0.5, 1.0), 0.0, 1.0);
+    vec3 local_color = localDiffuse(inPosition, inNormal, inColor.rgb);
 
-    vec3 diffuse_color = vec3(0.0, 0.0, 0.0);
-    for (int i = 0; i < MAX_LIGHTS; ++i) {
-        if (lights[i].enabled) {
-            diffuse_color += (1.0 / enabled_lights) * diffuse_colors[i];
-        }
-    }
-    diffuse_color = clamp(diffuse_color, 0.0, 1.0);
-
-    vec3 specular_color = vec3(0.0, 0.0, 0.0);
-    for (int i = 0; i < MAX_LIGHTS; ++i) {
-        if (lights[i].enabled) {
-            vec3 reflected = normalize(reflect(lights[i].direction, inNormal));
-
-            float specular = pow(dot(reflected, inEyeDir), specular_pow);
-            specular_color += specular * vec3(0.5, 0.5, 1.0);
-        }
-    }
-    specular_color = clamp(specular_color, 0.0, 1.0);
-
-    outColor = vec4(0.1*ambient_color + 0.9*diffuse_color + 0.5*specular_color, 1.0);
+    outColor = vec4(0.1*ambient_color + 0.9*diffuse_color + 0.5*specular_color + local_color, 1.0);
 }
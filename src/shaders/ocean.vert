@@ -1,29 +1,47 @@
 #version 430 core
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec4 inColor;
-layout(location = 2) in vec3 inNormal;
+// A PackedVertex: octahedrally encoded direction and normal, and the
+// height as a fraction of height_range.
+layout(location = 0) in vec2 inDirection;
+layout(location = 1) in float inHeight;
+layout(location = 2) in vec2 inNormal;
 
-layout(shared) uniform ViewAndProjectionBlock {
+layout(std140) uniform ViewAndProjectionBlock {
     mat4x4 view;
     mat4x4 view_inv;
     mat4x4 projection;
 };
 
 uniform mat4x4 model;
+uniform vec2 height_range;
+uniform vec4 color;
 
 layout(location = 0) out vec4 outColor;
 layout(location = 1) out vec3 outNormal;
 layout(location = 2) out vec3 outEyeDir;
+// In world coordinates, for the local lights.
+layout(location = 3) out vec3 outPosition;
+
+vec3 octDecode(vec2 e) {
+    vec3 v = vec3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y));
+    if (v.z < 0.0) {
+        vec2 signs = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+        v.xy = (1.0 - abs(e.yx)) * signs;
+    }
+    return normalize(v);
+}
 
 void main(void) {
-    vec4 wld_vert_pos4 = view * model * vec4(inPosition, 1.0);
+    vec3 position = octDecode(inDirection) * mix(height_range.x, height_range.y, inHeight);
+
+    vec4 wld_vert_pos4 = view * model * vec4(position, 1.0);
     vec3 wld_vert_pos = wld_vert_pos4.xyz / wld_vert_pos4.w;
     vec4 wld_eye_pos4 = view_inv * vec4(0.0, 0.0, 0.0, 1.0);
     vec3 wld_eye_pos = wld_eye_pos4.xyz / wld_eye_pos4.w;
 
     gl_Position = projection * wld_vert_pos4;
-    outNormal = normalize(mat3x3(model) * inNormal);
-    outColor = inColor;
+    outNormal = normalize(mat3x3(model) * octDecode(inNormal));
+    outColor = color;
     outEyeDir = normalize(wld_eye_pos - wld_vert_pos);
+    outPosition = (model * vec4(position, 1.0)).xyz;
 }
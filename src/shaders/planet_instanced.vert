@@ -0,0 +1,63 @@
+#version 430 core
+
+// One vertex of one of PlanetInstances' bodies. The noise is linked in
+// from terrain_noise.glsl, and the vertex displaced the same way
+// terrain_tess.tese does, but for the body it belongs to.
+
+layout(location = 0) in vec3 inDirection;
+// Which body this is. It's an instanced attribute counting up from 0,
+// so that it starts from each draw command's base instance, which
+// gl_InstanceID doesn't.
+layout(location = 1) in uint inInstance;
+
+layout(std140) uniform ViewAndProjectionBlock {
+    mat4x4 view;
+    mat4x4 view_inv;
+    mat4x4 projection;
+};
+
+// As PlanetInstance in PlanetInstances.h.
+struct PlanetInstance {
+    mat4x4 model;
+    vec3 noise_offset;
+    float height_shift;
+};
+
+layout(std430, binding = 3) readonly buffer InstanceBuffer {
+    PlanetInstance instances[];
+};
+
+uniform float radius;
+
+layout(location = 0) out float outHeight;
+layout(location = 1) out vec3 outNormal;
+layout(location = 2) out vec3 outDirection;
+// In world coordinates, for the local lights.
+layout(location = 3) out vec3 outPosition;
+
+// From terrain_noise.glsl.
+vec4 octave(vec3 pos);
+vec2 curve(float x);
+
+void main(void) {
+    PlanetInstance body = instances[inInstance];
+    vec3 dir = normalize(inDirection);
+
+    vec4 n = octave(dir * radius + body.noise_offset);
+    vec2 c = curve(n.w);
+    float value = c.x;
+    vec3 gradient = n.xyz * c.y;
+
+    // See displacedNormal in Terrain.cpp.
+    float height = radius * (value/8.0 + 1.0);
+    vec3 height_grad = gradient * (radius * radius / 8.0);
+    vec3 tangential = height_grad - dot(height_grad, dir) * dir;
+    vec3 normal = normalize(dir - tangential / height);
+
+    vec4 wld_position4 = body.model * vec4(dir * height, 1.0);
+    gl_Position = projection * view * wld_position4;
+    outHeight = height + body.height_shift;
+    outNormal = normalize(mat3(body.model) * normal);
+    outDirection = dir;
+    outPosition = wld_position4.xyz;
+}
@@ -0,0 +1,20 @@
+#version 430 core
+
+// One triangle that covers the screen, made from gl_VertexID alone,
+// with ocean.frag's inputs varying across it, so that timing it times
+// the fragment shader.
+layout(location = 0) out vec4 outColor;
+layout(location = 1) out vec3 outNormal;
+layout(location = 2) out vec3 outEyeDir;
+layout(location = 3) out vec3 outPosition;
+
+void main(void) {
+    // (-1, -1), (3, -1) and (-1, 3).
+    vec2 corner = vec2(float((gl_VertexID & 1) << 2) - 1.0, float((gl_VertexID & 2) << 1) - 1.0);
+
+    outColor = vec4(0.0, 0.2, 0.5 + 0.25 * corner.y, 1.0);
+    outNormal = normalize(vec3(0.5 * corner, 1.0));
+    outEyeDir = vec3(0.0, 0.0, 1.0);
+    outPosition = vec3(corner, 0.0);
+    gl_Position = vec4(corner, 0.0, 1.0);
+}
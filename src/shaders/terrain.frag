@@ -1,23 +1,43 @@
 #version 430 core
 
-const int MAX_LIGHTS = 10;
-struct LightInfo {
-    bool enabled;
-    vec3 direction;
-    // vec4 color;
-    // uint specular_exp;
-};
-
 layout(location = 0) in float inHeight;
 layout(location = 1) in vec3 inNormal;
+// The direction from the centre, in model coordinates.
+layout(location = 2) in vec3 inDirection;
+// In world coordinates.
+layout(location = 3) in vec3 inPosition;
+
+uniform mat4x4 model;
 
-layout(shared) uniform LightListBlock {
-    LightInfo lights[MAX_LIGHTS];
-};
+// The octaves left out of the geometry, as the normals of the plain
+// sphere they would tilt: see DetailNormalMap.
+uniform bool has_detail;
+uniform samplerCube detail_map;
 
 layout(location = 0) out vec4 outColor;
 
+// From lighting.glsl.
+vec3 directionalDiffuse(vec3 normal, vec3 color);
+vec3 localDiffuse(vec3 position, vec3 normal, vec3 color);
+
+// The geometry's normal, with the detail's slope added to it. Both
+// are scaled to meet the plane touching the sphere a unit out, where
+// slopes add.
+vec3 detailedNormal(vec3 normal) {
+    if (!has_detail) {
+        return normal;
+    }
+
+    vec3 dir = normalize(inDirection);
+    vec3 detail = normalize(texture(detail_map, dir).xyz);
+    vec3 slope = mat3(model) * (detail / max(dot(detail, dir), 1e-3) - dir);
+    vec3 wld_dir = mat3(model) * dir;
+    return normalize(normal / max(dot(normal, wld_dir), 1e-3) + slope);
+}
+
 void main(void) {
+    vec3 normal = detailedNormal(normalize(inNormal));
+
     // Specify a color based on the "altitude" of the vertex.
     vec3 color = vec3(0.0, 0.0, 0.0);
     if (inHeight < 2.00) {
@@ -31,25 +51,10 @@ void main(void) {
     }
 
     // No specular highlight for the terrain. Just an ambient and a diffuse
-    // term.
-    int enabled_lights = 0;
-    vec3 diffuse_colors[MAX_LIGHTS];
-    for (int i = 0; i < MAX_LIGHTS; ++i) {
-        if (lights[i].enabled) {
-            enabled_lights += 1;
-            diffuse_colors[i] = color * dot(inNormal, -1 * lights[i].direction);
-        }
-    }
-
+    // term, and whatever the local lights add.
     vec3 ambient_color = color;
+    vec3 diffuse_color = directionalDiffuse(normal, color);
+    vec3 local_color = localDiffuse(inPosition, normal, color);
 
-    vec3 diffuse_color = vec3(0.0, 0.0, 0.0);
-    for (int i = 0; i < MAX_LIGHTS; ++i) {
-        if (lights[i].enabled) {
-            diffuse_color += (1.0 / enabled_lights) * diffuse_colors[i];
-        }
-    }
-    diffuse_color = clamp(diffuse_color, 0.0, 1.0);
-
-    outColor = vec4(0.1*ambient_color + 0.9*diffuse_color, 1.0);
+    outColor = vec4(0.1*ambient_color + 0.9*diffuse_color + local_color, 1.0);
 }
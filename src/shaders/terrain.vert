@@ -1,22 +1,41 @@
 #version 430 core
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
+// A PackedVertex: octahedrally encoded direction and normal, and the
+// height as a fraction of height_range.
+layout(location = 0) in vec2 inDirection;
+layout(location = 1) in float inHeight;
+layout(location = 2) in vec2 inNormal;
 
-layout(shared) uniform ViewAndProjectionBlock {
+layout(std140) uniform ViewAndProjectionBlock {
     mat4x4 view;
     mat4x4 view_inv;
     mat4x4 projection;
 };
 
 uniform mat4x4 model;
+uniform vec2 height_range;
 
 layout(location = 0) out float outHeight;
 layout(location = 1) out vec3 outNormal;
+layout(location = 2) out vec3 outDirection;
+// In world coordinates, for the local lights.
+layout(location = 3) out vec3 outPosition;
+
+vec3 octDecode(vec2 e) {
+    vec3 v = vec3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y));
+    if (v.z < 0.0) {
+        vec2 signs = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+        v.xy = (1.0 - abs(e.yx)) * signs;
+    }
+    return normalize(v);
+}
 
 void main(void) {
+    float height = mix(height_range.x, height_range.y, inHeight);
+    vec3 position = octDecode(inDirection) * height;
+
     // Position, in "world" coordinates, of the vertex.
-    vec4 wld_position4 = model * vec4(inPosition, 1.0);
+    vec4 wld_position4 = model * vec4(position, 1.0);
     vec3 wld_position = wld_position4.xyz / wld_position4.w;
 
     // Position, in "world" coordinates, of the eye (i.e,
@@ -27,10 +46,12 @@ void main(void) {
     // Direction, in "world" cordinates, of the normal at this vertex. This
     // should use the inverse transpose of the upper-left 3x3 of model, but we'e
     // not doing any nonuniform scaling (right?)
-    vec3 wld_normal = normalize(mat3(model) * inNormal);
+    vec3 wld_normal = normalize(mat3(model) * octDecode(inNormal));
 
     // Set output variables.
     gl_Position = projection * view * wld_position4;
-    outHeight = length(inPosition);
+    outHeight = height;
     outNormal = wld_normal;
+    outDirection = octDecode(inDirection);
+    outPosition = wld_position;
 }
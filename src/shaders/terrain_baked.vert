@@ -0,0 +1,48 @@
+#version 430 core
+
+// A vertex of the shared sphere grid: just its octahedrally encoded
+// direction. Its height and normal come from the cube maps the
+// terrain was baked into.
+layout(location = 0) in vec2 inDirection;
+
+layout(std140) uniform ViewAndProjectionBlock {
+    mat4x4 view;
+    mat4x4 view_inv;
+    mat4x4 projection;
+};
+
+uniform mat4x4 model;
+uniform vec2 height_range;
+
+// The height as a fraction of height_range, and the octahedrally
+// encoded normal.
+uniform samplerCube height_map;
+uniform samplerCube normal_map;
+
+layout(location = 0) out float outHeight;
+layout(location = 1) out vec3 outNormal;
+layout(location = 2) out vec3 outDirection;
+// In world coordinates, for the local lights.
+layout(location = 3) out vec3 outPosition;
+
+vec3 octDecode(vec2 e) {
+    vec3 v = vec3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y));
+    if (v.z < 0.0) {
+        vec2 signs = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+        v.xy = (1.0 - abs(e.yx)) * signs;
+    }
+    return normalize(v);
+}
+
+void main(void) {
+    vec3 dir = octDecode(inDirection);
+    float height = mix(height_range.x, height_range.y, textureLod(height_map, dir, 0.0).r);
+    vec3 normal = octDecode(textureLod(normal_map, dir, 0.0).rg);
+
+    vec4 wld_position4 = model * vec4(dir * height, 1.0);
+    gl_Position = projection * view * wld_position4;
+    outHeight = height;
+    outNormal = normalize(mat3(model) * normal);
+    outDirection = dir;
+    outPosition = wld_position4.xyz;
+}
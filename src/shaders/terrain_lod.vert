@@ -0,0 +1,53 @@
+#version 430 core
+
+// A LodVertex: its position and normal, and where it would be on the
+// patch one level coarser.
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inCoarsePosition;
+layout(location = 2) in vec2 inNormal;
+layout(location = 3) in vec2 inCoarseNormal;
+
+layout(std140) uniform ViewAndProjectionBlock {
+    mat4x4 view;
+    mat4x4 view_inv;
+    mat4x4 projection;
+};
+
+uniform mat4x4 model;
+
+// The camera, in model coordinates, and the distances from it over
+// which the patch morphs into its parent.
+uniform vec3 camera_position;
+uniform vec2 morph_range;
+
+layout(location = 0) out float outHeight;
+layout(location = 1) out vec3 outNormal;
+layout(location = 2) out vec3 outDirection;
+// In world coordinates, for the local lights.
+layout(location = 3) out vec3 outPosition;
+
+vec3 octDecode(vec2 e) {
+    vec3 v = vec3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y));
+    if (v.z < 0.0) {
+        vec2 signs = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+        v.xy = (1.0 - abs(e.yx)) * signs;
+    }
+    return normalize(v);
+}
+
+void main(void) {
+    // Measured from the coarse position, which a coarser neighbour
+    // shares, so that vertices on its edge morph all the way to it.
+    float camera_distance = length(inCoarsePosition - camera_position);
+    float morph = clamp((camera_distance - morph_range.x) / (morph_range.y - morph_range.x), 0.0, 1.0);
+
+    vec3 position = mix(inPosition, inCoarsePosition, morph);
+    vec3 normal = normalize(mix(octDecode(inNormal), octDecode(inCoarseNormal), morph));
+
+    vec4 wld_position4 = model * vec4(position, 1.0);
+    gl_Position = projection * view * wld_position4;
+    outHeight = length(position);
+    outNormal = normalize(mat3(model) * normal);
+    outDirection = normalize(position);
+    outPosition = wld_position4.xyz;
+}
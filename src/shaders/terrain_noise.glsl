@@ -0,0 +1,141 @@
+// The Perlin -> Octave -> Curve terrain noise, as TerrainCompute and
+// TerrainTessellation run it. Linked after a shader's own source, which
+// declares what it uses from here: GpuNoise fills in the buffers and
+// uniforms.
+
+layout(std430, binding = 1) readonly buffer PermutationBuffer {
+    int perm[512];
+};
+
+// One entry per spline control point: x, y, second derivative, unused.
+layout(std430, binding = 2) readonly buffer SplineBuffer {
+    vec4 spline[];
+};
+
+uniform vec3 scales;
+uniform int octaves;
+uniform float persistence;
+uniform int spline_points;
+
+float reduceToRange(float x) {
+    return x - 256.0 * floor(x / 256.0);
+}
+
+float fade(float t) {
+    return t * t * t * (t * (t * 6.0 - 15.0) + 10.0);
+}
+
+float fadeDerivative(float t) {
+    return 30.0 * t * t * (t - 1.0) * (t - 1.0);
+}
+
+// The gradient vector behind Perlin::grad for this hash.
+vec3 gradVector(int hash) {
+    int h = hash & 0xF;
+    vec3 a = ((0xCF00 >> h) & 1) != 0 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+    vec3 b = ((0xCFF0 >> h) & 1) != 0 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+    float sa = ((0xEAAA >> h) & 1) != 0 ? -1.0 : 1.0;
+    float sb = ((0x8CCC >> h) & 1) != 0 ? -1.0 : 1.0;
+    return sa * a + sb * b;
+}
+
+// Perlin noise and its gradient, as in Perlin::sample. Returns the
+// value in w and the gradient in xyz.
+vec4 perlin(vec3 pos) {
+    vec3 p = vec3(reduceToRange(pos.x), reduceToRange(pos.y), reduceToRange(pos.z));
+    ivec3 a = ivec3(floor(p));
+    ivec3 b = (a + 1) & 0xFF;
+    vec3 f = p - vec3(a);
+    vec3 s = vec3(fade(f.x), fade(f.y), fade(f.z));
+    vec3 ds = vec3(fadeDerivative(f.x), fadeDerivative(f.y), fadeDerivative(f.z));
+
+    int hashes[8];
+    hashes[0] = perm[perm[perm[a.x] + a.y] + a.z];
+    hashes[1] = perm[perm[perm[b.x] + a.y] + a.z];
+    hashes[2] = perm[perm[perm[a.x] + b.y] + a.z];
+    hashes[3] = perm[perm[perm[b.x] + b.y] + a.z];
+    hashes[4] = perm[perm[perm[a.x] + a.y] + b.z];
+    hashes[5] = perm[perm[perm[b.x] + a.y] + b.z];
+    hashes[6] = perm[perm[perm[a.x] + b.y] + b.z];
+    hashes[7] = perm[perm[perm[b.x] + b.y] + b.z];
+
+    float n[8];
+    vec3 gradient = vec3(0.0);
+    for (int i = 0; i < 8; ++i) {
+        vec3 corner = vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+        vec3 g = gradVector(hashes[i]);
+        n[i] = dot(g, f - corner);
+
+        vec3 weights = mix(1.0 - s, s, corner);
+        gradient += weights.x * weights.y * weights.z * g;
+    }
+
+    float x1 = mix(n[0], n[1], s.x);
+    float x2 = mix(n[2], n[3], s.x);
+    float y1 = mix(x1, x2, s.y);
+    x1 = mix(n[4], n[5], s.x);
+    x2 = mix(n[6], n[7], s.x);
+    float y2 = mix(x1, x2, s.y);
+    float value = mix(y1, y2, s.z);
+
+    float k1 = n[1] - n[0];
+    float k2 = n[2] - n[0];
+    float k3 = n[4] - n[0];
+    float k4 = n[0] - n[1] - n[2] + n[3];
+    float k5 = n[0] - n[2] - n[4] + n[6];
+    float k6 = n[0] - n[1] - n[4] + n[5];
+    float k7 = -n[0] + n[1] + n[2] - n[3] + n[4] - n[5] - n[6] + n[7];
+    gradient += ds * vec3(
+        k1 + k4*s.y + k6*s.z + k7*s.y*s.z,
+        k2 + k4*s.x + k5*s.z + k7*s.x*s.z,
+        k3 + k5*s.y + k6*s.x + k7*s.x*s.y);
+
+    return vec4(gradient, value);
+}
+
+vec4 octave(vec3 pos) {
+    vec4 total = vec4(0.0);
+    float amplitude = 1.0;
+    float frequency = 1.0;
+
+    for (int i = 0; i < octaves; ++i) {
+        vec4 n = perlin(pos * frequency * scales);
+        total.w += n.w * amplitude;
+        total.xyz += n.xyz * scales * amplitude * frequency;
+        amplitude *= persistence;
+        frequency /= persistence;
+    }
+
+    return total;
+}
+
+// CubicSpline's value and slope at x, in x and y.
+vec2 curve(float x) {
+    if (x < spline[0].x) {
+        return vec2(spline[0].y, 0.0);
+    }
+
+    if (x > spline[spline_points - 1].x) {
+        return vec2(spline[spline_points - 1].y, 0.0);
+    }
+
+    int i;
+    for (i = spline_points - 2; i >= 0; --i) {
+        if (x - spline[i].x >= 0.0) {
+            break;
+        }
+    }
+
+    vec4 p0 = spline[i], p1 = spline[i+1];
+    float alpha = x - p0.x;
+    float h = p1.x - p0.x;
+    float slope0 = -1.0*(h/6.0)*(p1.z + 2.0*p0.z) + (p1.y - p0.y)/h;
+
+    float value = 0.5*p0.z + alpha*(p1.z - p0.z)/(6.0*h);
+    value = p0.y + alpha*(slope0 + alpha*value);
+
+    float slope = p0.z + alpha*(p1.z - p0.z)/(2.0*h);
+    slope = slope0 + alpha*slope;
+
+    return vec2(value, slope);
+}
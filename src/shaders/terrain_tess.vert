@@ -0,0 +1,11 @@
+#version 430 core
+
+// A corner of one of the base sphere's triangles, which are drawn as
+// patches for the tessellation stages to fill in.
+layout(location = 0) in vec3 inDirection;
+
+layout(location = 0) out vec3 outDirection;
+
+void main(void) {
+    outDirection = normalize(inDirection);
+}